@@ -5,33 +5,133 @@ using System.Runtime.InteropServices;
 public class HapMovieTexture : MonoBehaviour
 {
 	public string path;
+	public string mipmapPath;
 	public Material movieMaterial;
+	public bool pin;
+	public int prerollFrames = 3;
+	public int levelOfDetail;
+	public int streamPort;
+	public bool streamUDP;
+	public int streamWidth = 1920;
+	public int streamHeight = 1080;
+	public int streamLatency = 50;
+	public int decodeBudget;
+	public bool decodeAhead;
+	public bool uploadThread;
 
 	private float deltaTimeAfterLastFrame;
 
 #if UNITY_STANDALONE_OSX || UNITY_EDITOR_OSX
 	[DllImport ("HapMovieTexturePlugin")]
 	private static extern IntPtr CreateContext (string path);
+
+	[DllImport ("HapMovieTexturePlugin")]
+	private static extern IntPtr CreateStreamContext (int port, [MarshalAs(UnmanagedType.I1)] bool udp, int width, int height, int latency);
 	
+	[DllImport ("HapMovieTexturePlugin")]
+	private static extern void Preroll (IntPtr context, int textureHandle, int frames);
+
 	[DllImport ("HapMovieTexturePlugin")]
 	private static extern void UpdateTexture (IntPtr context, int textureHandle);
 
 	[DllImport ("HapMovieTexturePlugin")]
 	public static extern void DestroyContext (IntPtr context);
+
+	[DllImport ("HapMovieTexturePlugin")]
+	public static extern double CreateContexts (string[] paths, int count, [Out] IntPtr[] contexts, [Out] int[] statuses);
+
+	[DllImport ("HapMovieTexturePlugin")]
+	private static extern int SetContextPinned (IntPtr context, [MarshalAs(UnmanagedType.I1)] bool pinned);
+
+	[DllImport ("HapMovieTexturePlugin")]
+	private static extern int SetLevelOfDetail (IntPtr context, int level);
+
+	[DllImport ("HapMovieTexturePlugin")]
+	private static extern int SetContextMipmaps (IntPtr context, string path);
+
+	[DllImport ("HapMovieTexturePlugin")]
+	private static extern void SetDecodeBudget (IntPtr context, int budget);
+
+	[DllImport ("HapMovieTexturePlugin")]
+	private static extern int SetDecodeAhead (IntPtr context, [MarshalAs(UnmanagedType.I1)] bool enabled);
+
+	[DllImport ("HapMovieTexturePlugin")]
+	private static extern void SeekToFrame (IntPtr context, int frame);
+
+	[DllImport ("HapMovieTexturePlugin")]
+	private static extern int SetUploadThread (IntPtr context, [MarshalAs(UnmanagedType.I1)] bool enabled);
+
+	[DllImport ("HapMovieTexturePlugin")]
+	private static extern int UpdateUploadedTexture (IntPtr context);
+
+	[DllImport ("HapMovieTexturePlugin")]
+	private static extern int GetUploadedTextureFormat (IntPtr context);
+
+	// GL_COMPRESSED_RGB_S3TC_DXT1_EXT, which Hap movies decode to; the others decode to DXT5
+	private const int kTextureFormatDXT1 = 0x83F0;
 	
 	private IntPtr context;
+	private Texture2D texture;
+	private Texture2D uploadedTexture;
 
 	void Start()
 	{
-		context = CreateContext (System.IO.Path.Combine(Application.streamingAssetsPath, path));	
+		if (streamPort > 0) {
+			context = CreateStreamContext (streamPort, streamUDP, streamWidth, streamHeight, streamLatency);
+		} else {
+			context = CreateContext (System.IO.Path.Combine(Application.streamingAssetsPath, path));	
+		}
+
+		if (pin) {
+			int error = SetContextPinned (context, true);
+			if (error != 0) {
+				Debug.LogWarning ("Could not pin " + path + " in memory (errno " + error + ")");
+			}
+		}
+
+		if (!string.IsNullOrEmpty (mipmapPath)) {
+			int error = SetContextMipmaps (context, System.IO.Path.Combine(Application.streamingAssetsPath, mipmapPath));
+			if (error != 0) {
+				Debug.LogWarning ("Could not use mipmaps " + mipmapPath + " (errno " + error + ")");
+			}
+		}
+
+		SetDecodeBudget (context, decodeBudget);
+		if (decodeAhead) {
+			SetDecodeAhead (context, true);
+		}
+
+		if (uploadThread && SetUploadThread (context, true) != 0) {
+			Debug.LogWarning ("Could not start an upload thread for " + path);
+			uploadThread = false;
+		}
+
+		texture = new Texture2D(1, 1);
+		SetLevelOfDetail (context, levelOfDetail);
+		Preroll (context, texture.GetNativeTextureID(), prerollFrames);
 	}
 
 	void Update ()
 	{
 		if (movieMaterial != null) {
 			/*if ((deltaTimeAfterLastFrame += Time.deltaTime) >= 1.0f / 30.0f) */{
-				movieMaterial.mainTexture = new Texture2D(1, 1);
-				UpdateTexture(context, movieMaterial.mainTexture.GetNativeTextureID());
+				SetLevelOfDetail (context, levelOfDetail);
+				if (uploadThread) {
+					// The plugin uploads into textures of its own, handing back the one to draw with
+					int name = UpdateUploadedTexture (context);
+					if (name != 0) {
+						if (uploadedTexture == null) {
+							TextureFormat format = GetUploadedTextureFormat (context) == kTextureFormatDXT1 ? TextureFormat.DXT1 : TextureFormat.DXT5;
+							uploadedTexture = Texture2D.CreateExternalTexture (1, 1, format, false, false, (IntPtr)name);
+						} else {
+							uploadedTexture.UpdateExternalTexture ((IntPtr)name);
+						}
+						movieMaterial.mainTexture = uploadedTexture;
+					}
+				} else {
+					movieMaterial.mainTexture = texture;
+					UpdateTexture(context, texture.GetNativeTextureID());
+				}
 
 				deltaTimeAfterLastFrame = 0;
 			}
@@ -40,6 +140,11 @@ public class HapMovieTexture : MonoBehaviour
 		}
 	}
 
+	public void Seek (int frame)
+	{
+		SeekToFrame (context, frame);
+	}
+
 	void OnDestroy()
 	{
 		DestroyContext (context);
@@ -0,0 +1,479 @@
+//
+//  main.c
+//  HapBenchmark
+//
+//  Measures the plugin's decode and upload paths against a movie without Unity.
+//
+//  usage: HapBenchmark movie.mov [iterations]
+//
+//  Built with HAP_VULKAN defined, also measures the Vulkan upload backend. Elsewhere than macOS the context
+//  comes from a surfaceless EGL display.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+
+#if defined(__APPLE__)
+#include <OpenGL/OpenGL.h>
+#else
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#include <OpenGL/gl.h>
+
+#include <mach/mach_time.h>
+
+#include "hap.h"
+#include "MovieIndex.h"
+#include "Parallel.h"
+#include "ETC.h"
+#include "VulkanUploader.h"
+
+// The time available to prepare each frame at 60 frames per second
+#define kFrameBudgetNanoseconds (1000000000ULL / 60)
+
+typedef struct {
+    int width, height;
+    int frameCount;
+    uint8_t **frames;
+    uint32_t *frameSizes;
+    size_t decodedSize;
+} BenchmarkMovie;
+
+static uint64_t Nanoseconds(void)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+
+static void SerialDecodeCallback(HapDecodeWorkFunction function, void *p, unsigned int count, void *info)
+{
+    unsigned int i;
+    for (i = 0; i < count; i++) {
+        function(p, i);
+    }
+}
+
+// Reads every frame of the movie's first track into memory so that I/O is not measured
+static int LoadMovie(const char *path, BenchmarkMovie *movie)
+{
+    FILE *file = fopen(path, "r");
+    MovieIndex index;
+    
+    if (file == NULL || MovieIndexRead(file, &index) != 0) {
+        return -1;
+    }
+    
+    MovieTrackIndex *track = &index.tracks[0];
+    
+    movie->width = track->width;
+    movie->height = track->height;
+    movie->frameCount = track->frameCount;
+    movie->frames = calloc(track->frameCount, sizeof(uint8_t *));
+    movie->frameSizes = calloc(track->frameCount, sizeof(uint32_t));
+    movie->decodedSize = MovieTrackDecodedSize(track);
+    
+    int i;
+    for (i = 0; i < track->frameCount; i++) {
+        movie->frames[i] = malloc(track->frameSizes[i]);
+        movie->frameSizes[i] = track->frameSizes[i];
+        pread(fileno(file), movie->frames[i], track->frameSizes[i], track->frameOffsets[i]);
+    }
+    
+    printf("%s: %dx%d, %d frames, %.1f MB decoded per frame\n", path, track->width, track->height, track->frameCount, movie->decodedSize / 1e6);
+    
+    MovieIndexFree(&index);
+    fclose(file);
+    
+    return 0;
+}
+
+static bool CreateHeadlessContext(void)
+{
+#if defined(__APPLE__)
+    CGLPixelFormatAttribute attributes[] = { kCGLPFAAccelerated, kCGLPFAAllowOfflineRenderers, 0 };
+    CGLPixelFormatObj pixelFormat;
+    CGLContextObj context = NULL;
+    GLint count;
+    
+    if (CGLChoosePixelFormat(attributes, &pixelFormat, &count) != kCGLNoError || pixelFormat == NULL) {
+        return false;
+    }
+    
+    CGLCreateContext(pixelFormat, NULL, &context);
+    CGLDestroyPixelFormat(pixelFormat);
+    
+    return context != NULL && CGLSetCurrentContext(context) == kCGLNoError;
+#else
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay == NULL) {
+        return false;
+    }
+    
+    EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) || !eglBindAPI(EGL_OPENGL_API)) {
+        return false;
+    }
+    
+    EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config = NULL;
+    EGLint count = 0;
+    eglChooseConfig(display, configAttributes, &config, 1, &count);
+    
+    EGLContext context = eglCreateContext(display, count > 0 ? config : NULL, EGL_NO_CONTEXT, NULL);
+    
+    return context != EGL_NO_CONTEXT && eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+#endif
+}
+
+static void ReportDecode(const char *name, const BenchmarkMovie *movie, int iterations, uint64_t elapsed)
+{
+    double frames = (double)movie->frameCount * iterations;
+    
+    printf("  %-28s %8.3f ms/frame %10.1f MB/s\n", name, elapsed / 1e6 / frames, movie->decodedSize * frames * 1e3 / elapsed);
+}
+
+static uint64_t RunDecode(const BenchmarkMovie *movie, int iterations, void *destination, int staged)
+{
+    uint64_t start = Nanoseconds();
+    
+    int iteration, i;
+    for (iteration = 0; iteration < iterations; iteration++) {
+        for (i = 0; i < movie->frameCount; i++) {
+            unsigned long outsz;
+            unsigned int textureFormat;
+            
+            if (staged) {
+                HapDecodeStaged(movie->frames[i], movie->frameSizes[i], SerialDecodeCallback, NULL, destination, movie->decodedSize, &outsz, &textureFormat);
+            } else {
+                HapDecode(movie->frames[i], movie->frameSizes[i], SerialDecodeCallback, NULL, destination, movie->decodedSize, &outsz, &textureFormat);
+            }
+        }
+    }
+    
+    return Nanoseconds() - start;
+}
+
+/*
+ Compares decoding straight into the destination with staged decoding, into both ordinary cached memory and
+ a mapped pixel buffer object, which drivers usually place in write-combined memory
+ */
+static void BenchmarkDecode(const BenchmarkMovie *movie, int iterations)
+{
+    printf("Decode\n");
+    
+    void *cached = malloc(movie->decodedSize);
+    memset(cached, 0, movie->decodedSize);
+    
+    ReportDecode("cached, direct", movie, iterations, RunDecode(movie, iterations, cached, 0));
+    ReportDecode("cached, staged", movie, iterations, RunDecode(movie, iterations, cached, 1));
+    
+    free(cached);
+    
+    GLuint pixelBuffer;
+    glGenBuffers(1, &pixelBuffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, movie->decodedSize, NULL, GL_STREAM_DRAW);
+    
+    void *mapped = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (mapped != NULL) {
+        ReportDecode("pixel buffer, direct", movie, iterations, RunDecode(movie, iterations, mapped, 0));
+        ReportDecode("pixel buffer, staged", movie, iterations, RunDecode(movie, iterations, mapped, 1));
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    } else {
+        printf("  pixel buffer could not be mapped\n");
+    }
+    
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(1, &pixelBuffer);
+}
+
+static void ReportTranscode(const char *name, const BenchmarkMovie *movie, int iterations, uint64_t elapsed)
+{
+    double frames = (double)movie->frameCount * iterations;
+    double perFrame = elapsed / frames;
+    
+    printf("  %-28s %8.3f ms/frame %9.0f%% of a 60 fps frame\n", name, perFrame / 1e6, perFrame * 100.0 / kFrameBudgetNanoseconds);
+}
+
+static uint64_t RunTranscode(const BenchmarkMovie *movie, int iterations, uint8_t **decoded, bool dxt5, void *destination, HapDecodeCallback callback)
+{
+    uint64_t start = Nanoseconds();
+    
+    int iteration, i;
+    for (iteration = 0; iteration < iterations; iteration++) {
+        for (i = 0; i < movie->frameCount; i++) {
+            ETCTranscode(decoded[i], movie->width, movie->height, dxt5, destination, callback, NULL);
+        }
+    }
+    
+    return Nanoseconds() - start;
+}
+
+/*
+ Times transcoding decoded frames to ETC2 on one thread and across every core, against the frame budget
+ */
+static void BenchmarkTranscode(const BenchmarkMovie *movie, int iterations)
+{
+    printf("Transcode to ETC2\n");
+    
+    uint8_t **decoded = calloc(movie->frameCount, sizeof(uint8_t *));
+    void *destination = malloc(movie->decodedSize);
+    unsigned int textureFormat = 0;
+    
+    int i;
+    for (i = 0; i < movie->frameCount; i++) {
+        unsigned long outsz;
+        decoded[i] = malloc(movie->decodedSize);
+        HapDecode(movie->frames[i], movie->frameSizes[i], SerialDecodeCallback, NULL, decoded[i], movie->decodedSize, &outsz, &textureFormat);
+    }
+    
+    if (textureFormat == HapTextureFormat_YCoCg_DXT5) {
+        printf("  Hap Q frames can not be transcoded\n");
+    } else {
+        bool dxt5 = textureFormat == HapTextureFormat_RGBA_DXT5;
+        ReportTranscode("one thread", movie, iterations, RunTranscode(movie, iterations, decoded, dxt5, destination, SerialDecodeCallback));
+        ReportTranscode("all cores", movie, iterations, RunTranscode(movie, iterations, decoded, dxt5, destination, ParallelHapCallback));
+    }
+    
+    for (i = 0; i < movie->frameCount; i++) {
+        free(decoded[i]);
+    }
+    free(decoded);
+    free(destination);
+}
+
+#if defined(HAP_VULKAN)
+/*
+ Creates a device on the first physical device with a queue for the uploader, preferring a family with
+ transfer but not graphics, as a host with a dedicated transfer queue would use
+ */
+static VkDevice CreateVulkanDevice(VkInstance instance, VulkanUploaderDevice *uploaderDevice)
+{
+    uint32_t count = 1;
+    VkPhysicalDevice physicalDevice;
+    VkQueueFamilyProperties families[16];
+    
+    if (vkEnumeratePhysicalDevices(instance, &count, &physicalDevice) < 0 || count == 0) {
+        return NULL;
+    }
+    
+    count = 16;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &count, families);
+    
+    int family = -1;
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        if ((families[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_TRANSFER_BIT)) == 0) {
+            continue;
+        }
+        if (family < 0 || (families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) == 0) {
+            family = (int)i;
+        }
+    }
+    if (family < 0) {
+        return NULL;
+    }
+    
+    float priority = 1.0f;
+    VkDeviceQueueCreateInfo queueInfo = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = (uint32_t)family,
+        .queueCount = 1,
+        .pQueuePriorities = &priority
+    };
+    VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+        .timelineSemaphore = VK_TRUE
+    };
+    VkDeviceCreateInfo deviceInfo = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .pNext = &timelineFeatures,
+        .queueCreateInfoCount = 1,
+        .pQueueCreateInfos = &queueInfo
+    };
+    
+    VkDevice device;
+    if (vkCreateDevice(physicalDevice, &deviceInfo, NULL, &device) != VK_SUCCESS) {
+        return NULL;
+    }
+    
+    // Nothing samples the image here, so it stays with the transfer family
+    uploaderDevice->physicalDevice = physicalDevice;
+    uploaderDevice->device = device;
+    uploaderDevice->transferQueueFamily = (uint32_t)family;
+    uploaderDevice->graphicsQueueFamily = (uint32_t)family;
+    vkGetDeviceQueue(device, (uint32_t)family, 0, &uploaderDevice->transferQueue);
+    
+    return device;
+}
+
+static VkImage CreateVulkanImage(const VulkanUploaderDevice *uploaderDevice, VkFormat format, int width, int height, VkDeviceMemory *outMemory)
+{
+    VkDevice device = uploaderDevice->device;
+    VkImageCreateInfo imageInfo = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .imageType = VK_IMAGE_TYPE_2D,
+        .format = format,
+        .extent = { (uint32_t)width, (uint32_t)height, 1 },
+        .mipLevels = 1,
+        .arrayLayers = 1,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .tiling = VK_IMAGE_TILING_OPTIMAL,
+        .usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
+    };
+    
+    VkImage image;
+    if (vkCreateImage(device, &imageInfo, NULL, &image) != VK_SUCCESS) {
+        return VK_NULL_HANDLE;
+    }
+    
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device, image, &requirements);
+    
+    VkPhysicalDeviceMemoryProperties properties;
+    vkGetPhysicalDeviceMemoryProperties(uploaderDevice->physicalDevice, &properties);
+    
+    uint32_t memoryType = 0;
+    while (memoryType < properties.memoryTypeCount && (requirements.memoryTypeBits & (1u << memoryType)) == 0) {
+        memoryType++;
+    }
+    
+    VkMemoryAllocateInfo allocateInfo = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = requirements.size,
+        .memoryTypeIndex = memoryType
+    };
+    if (vkAllocateMemory(device, &allocateInfo, NULL, outMemory) != VK_SUCCESS
+        || vkBindImageMemory(device, image, *outMemory, 0) != VK_SUCCESS) {
+        vkDestroyImage(device, image, NULL);
+        return VK_NULL_HANDLE;
+    }
+    
+    return image;
+}
+
+/*
+ Decodes every frame into the Vulkan uploader's staging ring and copies it to an image on the transfer queue,
+ timed until the last copy has finished
+ */
+static void BenchmarkVulkanUpload(const BenchmarkMovie *movie, int iterations)
+{
+    printf("Vulkan transfer queue upload\n");
+    
+    VkApplicationInfo applicationInfo = {
+        .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+        .pApplicationName = "HapBenchmark",
+        .apiVersion = VK_API_VERSION_1_2
+    };
+    VkInstanceCreateInfo instanceInfo = {
+        .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+        .pApplicationInfo = &applicationInfo
+    };
+    
+    VkInstance instance;
+    if (vkCreateInstance(&instanceInfo, NULL, &instance) != VK_SUCCESS) {
+        printf("  no Vulkan instance\n");
+        return;
+    }
+    
+    VulkanUploaderDevice uploaderDevice;
+    VkDevice device = CreateVulkanDevice(instance, &uploaderDevice);
+    if (device == NULL) {
+        printf("  no Vulkan device with timeline semaphores\n");
+        vkDestroyInstance(instance, NULL);
+        return;
+    }
+    
+    unsigned int textureFormat;
+    HapGetFrameTextureFormat(movie->frames[0], movie->frameSizes[0], &textureFormat);
+    
+    VkDeviceMemory imageMemory = VK_NULL_HANDLE;
+    VkImage image = CreateVulkanImage(&uploaderDevice, VulkanUploaderFormat(textureFormat), movie->width, movie->height, &imageMemory);
+    VulkanUploader *uploader = VulkanUploaderCreate(&uploaderDevice, movie->decodedSize * 3);
+    
+    if (image != VK_NULL_HANDLE && uploader != NULL) {
+        uint64_t start = Nanoseconds();
+        uint64_t value = 0;
+        int dropped = 0;
+        
+        int iteration, i;
+        for (iteration = 0; iteration < iterations; iteration++) {
+            for (i = 0; i < movie->frameCount; i++) {
+                unsigned long outsz;
+                void *staging = VulkanUploaderReserve(uploader, movie->decodedSize);
+                
+                if (staging == NULL) {
+                    dropped++;
+                    continue;
+                }
+                
+                HapDecodeStaged(movie->frames[i], movie->frameSizes[i], ParallelHapCallback, NULL, staging, movie->decodedSize, &outsz, &textureFormat);
+                value = VulkanUploaderSubmit(uploader, image, movie->width, movie->height);
+            }
+        }
+        
+        VkSemaphore semaphore = VulkanUploaderSemaphore(uploader);
+        VkSemaphoreWaitInfo waitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+            .semaphoreCount = 1,
+            .pSemaphores = &semaphore,
+            .pValues = &value
+        };
+        vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+        
+        ReportDecode("decode and copy", movie, iterations, Nanoseconds() - start);
+        if (dropped > 0) {
+            printf("  %d frames dropped waiting for staging memory\n", dropped);
+        }
+    } else {
+        printf("  the uploader or a %dx%d image could not be created\n", movie->width, movie->height);
+    }
+    
+    VulkanUploaderDestroy(uploader);
+    vkDestroyImage(device, image, NULL);
+    vkFreeMemory(device, imageMemory, NULL);
+    vkDestroyDevice(device, NULL);
+    vkDestroyInstance(instance, NULL);
+}
+#endif
+
+int main(int argc, const char *argv[])
+{
+    BenchmarkMovie movie;
+    
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s movie.mov [iterations]\n", argv[0]);
+        return 1;
+    }
+    
+    int iterations = argc > 2 ? atoi(argv[2]) : 10;
+    
+    if (LoadMovie(argv[1], &movie) != 0) {
+        fprintf(stderr, "%s: not a Hap movie\n", argv[1]);
+        return 1;
+    }
+    
+    if (!CreateHeadlessContext()) {
+        fprintf(stderr, "Could not create an OpenGL context\n");
+        return 1;
+    }
+    
+    BenchmarkDecode(&movie, iterations);
+    BenchmarkTranscode(&movie, iterations);
+#if defined(HAP_VULKAN)
+    BenchmarkVulkanUpload(&movie, iterations);
+#endif
+    
+    return 0;
+}
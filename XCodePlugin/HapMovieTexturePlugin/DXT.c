@@ -0,0 +1,376 @@
+//
+//  DXT.c
+//  HapMovieTexturePlugin
+//
+
+#include "DXT.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool DXT5AlphaBlockIsOpaque(const uint8_t *block)
+{
+    unsigned int alpha0 = block[0];
+    unsigned int alpha1 = block[1];
+    bool opaque[8];
+    
+    // Which of the eight palette entries are certain to be 255
+    int i;
+    for (i = 0; i < 8; i++) {
+        opaque[i] = alpha0 == 255 && alpha1 == 255;
+    }
+    opaque[0] = alpha0 == 255;
+    opaque[1] = alpha1 == 255;
+    if (alpha0 <= alpha1) {
+        // Six-value mode, where the last two entries are 0 and 255
+        opaque[6] = false;
+        opaque[7] = true;
+    }
+    
+    // Sixteen 3-bit indices, little-endian across six bytes
+    uint64_t indices = 0;
+    for (i = 0; i < 6; i++) {
+        indices |= (uint64_t)block[2 + i] << (8 * i);
+    }
+    
+    for (i = 0; i < 16; i++) {
+        if (!opaque[(indices >> (3 * i)) & 7]) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+bool DXT5IsOpaque(const void *data, size_t length)
+{
+    const uint8_t *block = data;
+    const uint8_t *end = block + length / kDXT5BlockBytes * kDXT5BlockBytes;
+    
+    for (; block < end; block += kDXT5BlockBytes) {
+        if (!DXT5AlphaBlockIsOpaque(block)) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+void DXT5ToDXT1(const void *source, size_t length, void *destination)
+{
+    const uint8_t *in = source;
+    uint8_t *out = destination;
+    size_t blockCount = length / kDXT5BlockBytes;
+    size_t i;
+    
+    for (i = 0; i < blockCount; i++, in += kDXT5BlockBytes, out += kDXT1BlockBytes) {
+        const uint8_t *colour = in + 8;
+        unsigned int colour0 = colour[0] | (colour[1] << 8);
+        unsigned int colour1 = colour[2] | (colour[3] << 8);
+        
+        if (colour0 > colour1) {
+            // Already in four-colour mode, which is all DXT5 colour blocks use
+            memcpy(out, colour, kDXT1BlockBytes);
+        } else if (colour0 < colour1) {
+            // Swapping the endpoints selects four-colour mode, which swaps palette entries 0 with 1 and 2 with 3
+            out[0] = colour[2];
+            out[1] = colour[3];
+            out[2] = colour[0];
+            out[3] = colour[1];
+            out[4] = colour[4] ^ 0x55;
+            out[5] = colour[5] ^ 0x55;
+            out[6] = colour[6] ^ 0x55;
+            out[7] = colour[7] ^ 0x55;
+        } else {
+            // Equal endpoints make every four-colour entry the same, but DXT1 would make entry 3 transparent
+            memcpy(out, colour, 4);
+            memset(out + 4, 0, 4);
+        }
+    }
+}
+
+static void ExpandColour(unsigned int colour, int rgb[3])
+{
+    int r = (colour >> 11) & 31, g = (colour >> 5) & 63, b = colour & 31;
+    
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+static unsigned int PackColour(const int rgb[3])
+{
+    return ((rgb[0] * 31 + 127) / 255) << 11 | ((rgb[1] * 63 + 127) / 255) << 5 | ((rgb[2] * 31 + 127) / 255);
+}
+
+static void ColourPalette(unsigned int colour0, unsigned int colour1, bool fourColour, int palette[4][4])
+{
+    int k;
+    
+    ExpandColour(colour0, palette[0]);
+    ExpandColour(colour1, palette[1]);
+    palette[0][3] = palette[1][3] = palette[2][3] = palette[3][3] = 255;
+    
+    for (k = 0; k < 3; k++) {
+        if (fourColour) {
+            palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+            palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+        } else {
+            palette[2][k] = (palette[0][k] + palette[1][k]) / 2;
+            palette[3][k] = 0;
+        }
+    }
+    if (!fourColour) {
+        palette[3][3] = 0;
+    }
+}
+
+static void AlphaPalette(unsigned int alpha0, unsigned int alpha1, int palette[8])
+{
+    int i;
+    
+    palette[0] = alpha0;
+    palette[1] = alpha1;
+    if (alpha0 > alpha1) {
+        for (i = 2; i < 8; i++) {
+            palette[i] = ((8 - i) * alpha0 + (i - 1) * alpha1) / 7;
+        }
+    } else {
+        for (i = 2; i < 6; i++) {
+            palette[i] = ((6 - i) * alpha0 + (i - 1) * alpha1) / 5;
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+void DXTDecodeBlock(const void *block, bool dxt5, uint8_t rgba[16][4])
+{
+    const uint8_t *in = block;
+    const uint8_t *colour = dxt5 ? in + 8 : in;
+    unsigned int colour0 = colour[0] | (colour[1] << 8);
+    unsigned int colour1 = colour[2] | (colour[3] << 8);
+    uint32_t indices = colour[4] | (colour[5] << 8) | (colour[6] << 16) | ((uint32_t)colour[7] << 24);
+    int palette[4][4];
+    int i;
+    
+    // DXT5 colour blocks are always four-colour
+    ColourPalette(colour0, colour1, dxt5 || colour0 > colour1, palette);
+    
+    for (i = 0; i < 16; i++) {
+        const int *entry = palette[(indices >> (2 * i)) & 3];
+        rgba[i][0] = entry[0];
+        rgba[i][1] = entry[1];
+        rgba[i][2] = entry[2];
+        rgba[i][3] = entry[3];
+    }
+    
+    if (dxt5) {
+        int alphaPalette[8];
+        uint64_t alphaIndices = 0;
+        
+        AlphaPalette(in[0], in[1], alphaPalette);
+        for (i = 0; i < 6; i++) {
+            alphaIndices |= (uint64_t)in[2 + i] << (8 * i);
+        }
+        for (i = 0; i < 16; i++) {
+            rgba[i][3] = alphaPalette[(alphaIndices >> (3 * i)) & 7];
+        }
+    }
+}
+
+static void EncodeAlphaBlock(const uint8_t rgba[16][4], uint8_t *out)
+{
+    int minimum = 255, maximum = 0;
+    int i, j;
+    
+    for (i = 0; i < 16; i++) {
+        if (rgba[i][3] < minimum) minimum = rgba[i][3];
+        if (rgba[i][3] > maximum) maximum = rgba[i][3];
+    }
+    
+    memset(out, 0, 8);
+    out[0] = maximum;
+    out[1] = minimum;
+    if (maximum == minimum) {
+        return;
+    }
+    
+    int palette[8];
+    uint64_t indices = 0;
+    AlphaPalette(maximum, minimum, palette);
+    
+    for (i = 0; i < 16; i++) {
+        int best = 0, bestError = 256;
+        for (j = 0; j < 8; j++) {
+            int error = abs(palette[j] - rgba[i][3]);
+            if (error < bestError) {
+                best = j;
+                bestError = error;
+            }
+        }
+        indices |= (uint64_t)best << (3 * i);
+    }
+    
+    for (i = 0; i < 6; i++) {
+        out[2 + i] = (uint8_t)(indices >> (8 * i));
+    }
+}
+
+static void EncodeColourBlock(const uint8_t rgba[16][4], uint8_t *out)
+{
+    int minimum[3] = { 255, 255, 255 }, maximum[3] = { 0, 0, 0 };
+    int i, j, k;
+    
+    for (i = 0; i < 16; i++) {
+        for (k = 0; k < 3; k++) {
+            if (rgba[i][k] < minimum[k]) minimum[k] = rgba[i][k];
+            if (rgba[i][k] > maximum[k]) maximum[k] = rgba[i][k];
+        }
+    }
+    
+    // Inset the box by a sixteenth of its size on each side, which lowers the error of the interpolated entries
+    for (k = 0; k < 3; k++) {
+        int inset = (maximum[k] - minimum[k]) >> 4;
+        minimum[k] += inset;
+        maximum[k] -= inset;
+    }
+    
+    /*
+     The endpoints are opposite corners of the box. Use the diagonal which follows the colours, by flipping any
+     channel which falls as the widest channel rises.
+     */
+    int widest = 0, mean[3] = { 0, 0, 0 };
+    for (k = 0; k < 3; k++) {
+        if (maximum[k] - minimum[k] > maximum[widest] - minimum[widest]) widest = k;
+        for (i = 0; i < 16; i++) mean[k] += rgba[i][k];
+        mean[k] /= 16;
+    }
+    for (k = 0; k < 3; k++) {
+        int covariance = 0;
+        for (i = 0; i < 16; i++) {
+            covariance += (rgba[i][widest] - mean[widest]) * (rgba[i][k] - mean[k]);
+        }
+        if (covariance < 0) {
+            int swap = minimum[k];
+            minimum[k] = maximum[k];
+            maximum[k] = swap;
+        }
+    }
+    
+    unsigned int colour0 = PackColour(maximum);
+    unsigned int colour1 = PackColour(minimum);
+    
+    if (colour0 == colour1) {
+        out[0] = colour0 & 0xFF;
+        out[1] = colour0 >> 8;
+        out[2] = colour1 & 0xFF;
+        out[3] = colour1 >> 8;
+        memset(out + 4, 0, 4);
+        return;
+    }
+    
+    // Four-colour mode needs the larger endpoint first
+    if (colour0 < colour1) {
+        unsigned int swap = colour0;
+        colour0 = colour1;
+        colour1 = swap;
+    }
+    
+    int palette[4][4];
+    uint32_t indices = 0;
+    ColourPalette(colour0, colour1, true, palette);
+    
+    for (i = 0; i < 16; i++) {
+        int best = 0, bestError = 0x7FFFFFFF;
+        for (j = 0; j < 4; j++) {
+            int error = 0;
+            for (k = 0; k < 3; k++) {
+                int difference = palette[j][k] - rgba[i][k];
+                error += difference * difference;
+            }
+            if (error < bestError) {
+                best = j;
+                bestError = error;
+            }
+        }
+        indices |= (uint32_t)best << (2 * i);
+    }
+    
+    out[0] = colour0 & 0xFF;
+    out[1] = colour0 >> 8;
+    out[2] = colour1 & 0xFF;
+    out[3] = colour1 >> 8;
+    out[4] = indices & 0xFF;
+    out[5] = (indices >> 8) & 0xFF;
+    out[6] = (indices >> 16) & 0xFF;
+    out[7] = indices >> 24;
+}
+
+void DXTEncodeBlock(const uint8_t rgba[16][4], bool dxt5, void *block)
+{
+    uint8_t *out = block;
+    
+    if (dxt5) {
+        EncodeAlphaBlock(rgba, out);
+        out += 8;
+    }
+    EncodeColourBlock(rgba, out);
+}
+
+void DXTEncode(const uint8_t *rgba, int width, int height, size_t rowBytes, bool dxt5, void *destination)
+{
+    uint8_t *out = destination;
+    size_t blockBytes = dxt5 ? kDXT5BlockBytes : kDXT1BlockBytes;
+    int x, y, i;
+    
+    for (y = 0; y < height; y += 4) {
+        for (x = 0; x < width; x += 4, out += blockBytes) {
+            uint8_t texels[16][4];
+            for (i = 0; i < 16; i++) {
+                int tx = x + (i & 3), ty = y + (i >> 2);
+                if (tx >= width) tx = width - 1;
+                if (ty >= height) ty = height - 1;
+                memcpy(texels[i], rgba + ty * rowBytes + tx * 4, 4);
+            }
+            DXTEncodeBlock(texels, dxt5, out);
+        }
+    }
+}
+
+void DXTDownsample(const void *source, int width, int height, bool dxt5, void *destination, int destinationWidth, int destinationHeight)
+{
+    const uint8_t *in = source;
+    uint8_t *out = destination;
+    size_t blockBytes = dxt5 ? kDXT5BlockBytes : kDXT1BlockBytes;
+    int sourceColumns = (width + 3) / 4, sourceRows = (height + 3) / 4;
+    int columns = (destinationWidth + 3) / 4, rows = (destinationHeight + 3) / 4;
+    int x, y, i, k;
+    
+    for (y = 0; y < rows; y++) {
+        for (x = 0; x < columns; x++) {
+            // The four source blocks, clamped to the edge where the source has an odd number of blocks
+            uint8_t quad[4][16][4];
+            for (i = 0; i < 4; i++) {
+                int sourceX = 2 * x + (i & 1), sourceY = 2 * y + (i >> 1);
+                if (sourceX >= sourceColumns) sourceX = sourceColumns - 1;
+                if (sourceY >= sourceRows) sourceY = sourceRows - 1;
+                DXTDecodeBlock(in + ((size_t)sourceY * sourceColumns + sourceX) * blockBytes, dxt5, quad[i]);
+            }
+            
+            // Each destination texel is the mean of a 2x2 square of the 8x8 source texels
+            uint8_t texels[16][4];
+            for (i = 0; i < 16; i++) {
+                int tx = (i & 3) * 2, ty = (i >> 2) * 2;
+                const uint8_t (*block)[4] = quad[(tx >> 2) + ((ty >> 2) << 1)];
+                int index = (ty & 3) * 4 + (tx & 3);
+                for (k = 0; k < 4; k++) {
+                    texels[i][k] = (block[index][k] + block[index + 1][k] + block[index + 4][k] + block[index + 5][k] + 2) / 4;
+                }
+            }
+            
+            DXTEncodeBlock(texels, dxt5, out + ((size_t)y * columns + x) * blockBytes);
+        }
+    }
+}
@@ -0,0 +1,57 @@
+//
+//  DXT.h
+//  HapMovieTexturePlugin
+//
+//  Operations on S3TC blocks. The transcoding functions never decode to pixels, so they introduce no loss of
+//  their own; the block codec is a fast bounding-box encoder for derived textures such as proxies.
+//
+
+#ifndef HapMovieTexturePlugin_DXT_h
+#define HapMovieTexturePlugin_DXT_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define kDXT1BlockBytes 8
+#define kDXT5BlockBytes 16
+
+/*
+ Returns true if every texel of the DXT5 blocks in data is certain to decode with an alpha of 255 on any
+ hardware. Interpolated alpha values only count when both endpoints are 255, since decoders round differently.
+ */
+bool DXT5IsOpaque(const void *data, size_t length);
+
+/*
+ Writes the colour halves of the DXT5 blocks in source to destination as DXT1 blocks which decode to the same
+ colours. destination must hold length / 2 bytes. Only meaningful if DXT5IsOpaque() is true for source.
+ */
+void DXT5ToDXT1(const void *source, size_t length, void *destination);
+
+/*
+ Decodes one DXT1 or DXT5 block to sixteen RGBA texels in row order. DXT1 blocks decode with an alpha of 255,
+ or 0 for transparent texels.
+ */
+void DXTDecodeBlock(const void *block, bool dxt5, uint8_t rgba[16][4]);
+
+/*
+ Encodes sixteen RGBA texels in row order as one DXT1 or DXT5 block. Endpoints are the corners of the texels'
+ bounding box, inset slightly, and colour blocks are always in four-colour mode, so DXT1 blocks are opaque.
+ */
+void DXTEncodeBlock(const uint8_t rgba[16][4], bool dxt5, void *block);
+
+/*
+ Compresses an RGBA image of width by height texels, whose rows are rowBytes apart, to DXT1 or DXT5 with
+ DXTEncodeBlock(). Blocks past the right or bottom edge repeat the edge texels.
+ */
+void DXTEncode(const uint8_t *rgba, int width, int height, size_t rowBytes, bool dxt5, void *destination);
+
+/*
+ Writes a texture of half the width and height of the DXT1 or DXT5 texture in source to destination. Each
+ group of 2x2 source blocks is decoded, box filtered and encoded as one block, so no more than four blocks are
+ ever held decoded. destinationWidth and destinationHeight may be half the source size rounded either way,
+ to suit proxies or mipmap levels.
+ */
+void DXTDownsample(const void *source, int width, int height, bool dxt5, void *destination, int destinationWidth, int destinationHeight);
+
+#endif
@@ -0,0 +1,238 @@
+//
+//  DecodedFrame.c
+//  HapMovieTexturePlugin
+//
+
+#include "DecodedFrame.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+ frames holds every frame allocated so far. A destroyed pool is freed when outstanding, the number of frames
+ still referenced, reaches zero.
+ */
+struct DecodedFramePool {
+    pthread_mutex_t lock;
+    size_t bufferSize;
+    int maxFrames;
+    int frameCount;
+    int outstanding;
+    bool destroyed;
+    DecodedFrame **frames;
+};
+
+struct FrameSink {
+    pthread_mutex_t lock;
+    DecodedFrame *pending;
+    DecodedFrame *acquired;
+    FrameSinkStatistics statistics;
+};
+
+static void FreeFrame(DecodedFrame *frame)
+{
+    free(frame->data);
+    free(frame);
+}
+
+static void FreePool(DecodedFramePool *pool)
+{
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->frames);
+    free(pool);
+}
+
+DecodedFramePool *DecodedFramePoolCreate(size_t bufferSize, int maxFrames)
+{
+    DecodedFramePool *pool = calloc(1, sizeof(DecodedFramePool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    
+    pool->frames = calloc(maxFrames, sizeof(DecodedFrame *));
+    if (pool->frames == NULL) {
+        free(pool);
+        return NULL;
+    }
+    
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->bufferSize = bufferSize;
+    pool->maxFrames = maxFrames;
+    
+    return pool;
+}
+
+DecodedFrame *DecodedFramePoolTake(DecodedFramePool *pool)
+{
+    DecodedFrame *frame = NULL;
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    int i;
+    for (i = 0; i < pool->frameCount && frame == NULL; i++) {
+        if (pool->frames[i]->references == 0) {
+            frame = pool->frames[i];
+        }
+    }
+    
+    if (frame == NULL && pool->frameCount < pool->maxFrames) {
+        frame = calloc(1, sizeof(DecodedFrame));
+        if (frame != NULL) {
+            frame->data = malloc(pool->bufferSize);
+            if (frame->data == NULL) {
+                free(frame);
+                frame = NULL;
+            } else {
+                frame->pool = pool;
+                pool->frames[pool->frameCount++] = frame;
+            }
+        }
+    }
+    
+    if (frame != NULL) {
+        frame->references = 1;
+        pool->outstanding++;
+    }
+    
+    pthread_mutex_unlock(&pool->lock);
+    
+    return frame;
+}
+
+void DecodedFrameRetain(DecodedFrame *frame)
+{
+    __sync_add_and_fetch(&frame->references, 1);
+}
+
+/*
+ The last reference is only dropped with the pool locked, so that a frame seen unreferenced by
+ DecodedFramePoolTake or DecodedFramePoolDestroy is never still being released
+ */
+void DecodedFrameRelease(DecodedFrame *frame)
+{
+    DecodedFramePool *pool = frame->pool;
+    bool freePool = false;
+    
+    pthread_mutex_lock(&pool->lock);
+    if (__sync_sub_and_fetch(&frame->references, 1) == 0) {
+        freePool = --pool->outstanding == 0 && pool->destroyed;
+        if (pool->destroyed) {
+            FreeFrame(frame);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    if (freePool) {
+        FreePool(pool);
+    }
+}
+
+void DecodedFramePoolDestroy(DecodedFramePool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    pool->destroyed = true;
+    
+    int i;
+    for (i = 0; i < pool->frameCount; i++) {
+        if (pool->frames[i]->references == 0) {
+            FreeFrame(pool->frames[i]);
+        }
+    }
+    
+    bool freePool = pool->outstanding == 0;
+    
+    pthread_mutex_unlock(&pool->lock);
+    
+    if (freePool) {
+        FreePool(pool);
+    }
+}
+
+FrameSink *FrameSinkCreate(void)
+{
+    FrameSink *sink = calloc(1, sizeof(FrameSink));
+    if (sink == NULL) {
+        return NULL;
+    }
+    
+    pthread_mutex_init(&sink->lock, NULL);
+    sink->statistics.completedFrame = -1;
+    
+    return sink;
+}
+
+void FrameSinkDeliver(FrameSink *sink, DecodedFrame *frame)
+{
+    DecodedFrameRetain(frame);
+    
+    pthread_mutex_lock(&sink->lock);
+    DecodedFrame *skipped = sink->pending;
+    sink->pending = frame;
+    sink->statistics.delivered++;
+    if (skipped != NULL) {
+        sink->statistics.skipped++;
+    }
+    pthread_mutex_unlock(&sink->lock);
+    
+    if (skipped != NULL) {
+        DecodedFrameRelease(skipped);
+    }
+}
+
+DecodedFrame *FrameSinkAcquire(FrameSink *sink)
+{
+    FrameSinkComplete(sink);
+    
+    pthread_mutex_lock(&sink->lock);
+    DecodedFrame *frame = sink->pending;
+    sink->pending = NULL;
+    sink->acquired = frame;
+    pthread_mutex_unlock(&sink->lock);
+    
+    return frame;
+}
+
+void FrameSinkComplete(FrameSink *sink)
+{
+    pthread_mutex_lock(&sink->lock);
+    DecodedFrame *frame = sink->acquired;
+    sink->acquired = NULL;
+    if (frame != NULL) {
+        sink->statistics.completedFrame = frame->frame;
+        sink->statistics.completed++;
+    }
+    pthread_mutex_unlock(&sink->lock);
+    
+    if (frame != NULL) {
+        DecodedFrameRelease(frame);
+    }
+}
+
+void FrameSinkGetStatistics(FrameSink *sink, FrameSinkStatistics *statistics)
+{
+    pthread_mutex_lock(&sink->lock);
+    *statistics = sink->statistics;
+    pthread_mutex_unlock(&sink->lock);
+}
+
+void FrameSinkDestroy(FrameSink *sink)
+{
+    if (sink == NULL) {
+        return;
+    }
+    
+    if (sink->pending != NULL) {
+        DecodedFrameRelease(sink->pending);
+    }
+    if (sink->acquired != NULL) {
+        DecodedFrameRelease(sink->acquired);
+    }
+    
+    pthread_mutex_destroy(&sink->lock);
+    free(sink);
+}
@@ -0,0 +1,87 @@
+//
+//  DecodedFrame.h
+//  HapMovieTexturePlugin
+//
+//  Shares one decoded frame between several consumers.
+//
+
+#ifndef HapMovieTexturePlugin_DecodedFrame_h
+#define HapMovieTexturePlugin_DecodedFrame_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ A decoded frame, counted by reference, whose buffer goes back to the pool it came from once the last
+ reference is released. Its fields must not be changed once it has been delivered to a sink.
+ */
+typedef struct DecodedFramePool DecodedFramePool;
+
+typedef struct {
+    DecodedFramePool *pool;
+    volatile int32_t references;
+    void *data;
+    unsigned long size;
+    unsigned int textureFormat;
+    int width, height;
+    int frame;
+} DecodedFrame;
+
+/*
+ Creates a pool of up to maxFrames buffers of bufferSize bytes, which are allocated as they are first needed.
+ Returns NULL on failure.
+ */
+DecodedFramePool *DecodedFramePoolCreate(size_t bufferSize, int maxFrames);
+
+/*
+ Returns a free frame holding one reference, or NULL if every frame is still referenced
+ */
+DecodedFrame *DecodedFramePoolTake(DecodedFramePool *pool);
+
+void DecodedFrameRetain(DecodedFrame *frame);
+void DecodedFrameRelease(DecodedFrame *frame);
+
+/*
+ Frees the pool's buffers, deferring any still referenced until they are released
+ */
+void DecodedFramePoolDestroy(DecodedFramePool *pool);
+
+/*
+ One consumer of decoded frames, such as a texture in another GL context, a Vulkan image or a CPU preview.
+ Frames are delivered from the decoding thread and taken by the consumer from its own thread. Only the newest
+ frame is kept waiting: one delivered before the consumer took the last is skipped and released. A frame the
+ consumer has taken stays referenced until it calls FrameSinkComplete, which records how far it has got.
+ */
+typedef struct FrameSink FrameSink;
+
+typedef struct {
+    int completedFrame;
+    uint64_t delivered;
+    uint64_t completed;
+    uint64_t skipped;
+} FrameSinkStatistics;
+
+FrameSink *FrameSinkCreate(void);
+
+void FrameSinkDeliver(FrameSink *sink, DecodedFrame *frame);
+
+/*
+ Takes the newest frame delivered, or returns NULL if there is none since the last was taken. Any frame taken
+ before is completed first.
+ */
+DecodedFrame *FrameSinkAcquire(FrameSink *sink);
+
+/*
+ Completes and releases the frame last taken, if it has not been already
+ */
+void FrameSinkComplete(FrameSink *sink);
+
+void FrameSinkGetStatistics(FrameSink *sink, FrameSinkStatistics *statistics);
+
+/*
+ Releases any frames the sink holds. The consumer must have stopped using it.
+ */
+void FrameSinkDestroy(FrameSink *sink);
+
+#endif
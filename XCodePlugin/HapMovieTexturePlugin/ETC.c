@@ -0,0 +1,576 @@
+//
+//  ETC.c
+//  HapMovieTexturePlugin
+//
+
+#include "ETC.h"
+#include "DXT.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// The number of bands of block rows handed to the callback, enough to balance work across cores
+#define kETCBandCount 32
+
+static const int ETCModifierTables[8][2] = {
+    { 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 }, { 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 }
+};
+
+static const int ETCDistances[8] = { 3, 6, 11, 16, 23, 32, 41, 64 };
+
+static const int EACModifierTables[16][8] = {
+    { -3, -6, -9, -15, 2, 5, 8, 14 },
+    { -3, -7, -10, -13, 2, 6, 9, 12 },
+    { -2, -5, -8, -13, 1, 4, 7, 12 },
+    { -2, -4, -6, -13, 1, 3, 5, 12 },
+    { -3, -6, -8, -12, 2, 5, 7, 11 },
+    { -3, -7, -9, -11, 2, 6, 8, 10 },
+    { -4, -7, -8, -11, 3, 6, 7, 10 },
+    { -3, -5, -8, -11, 2, 4, 7, 10 },
+    { -2, -6, -8, -10, 1, 5, 7, 9 },
+    { -2, -5, -8, -10, 1, 4, 7, 9 },
+    { -2, -4, -8, -10, 1, 3, 7, 9 },
+    { -2, -5, -7, -10, 1, 4, 6, 9 },
+    { -3, -4, -7, -10, 2, 3, 6, 9 },
+    { -1, -2, -3, -10, 0, 1, 2, 9 },
+    { -4, -6, -8, -9, 3, 5, 7, 8 },
+    { -3, -5, -7, -9, 2, 4, 6, 8 }
+};
+
+static inline int Clamp255(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+/*
+ A DXT block reduced to its palette: the distinct values its indices can select, and the index of every texel
+ */
+typedef struct {
+    int colours[4][3];
+    uint8_t colourIndices[16];
+    int alphas[8];
+    uint8_t alphaIndices[16];
+} BlockPalette;
+
+static void ReadBlockPalette(const uint8_t *block, bool dxt5, BlockPalette *palette)
+{
+    const uint8_t *colour = dxt5 ? block + 8 : block;
+    int i, k;
+    
+    // Decoding a block made of the four index values gives the palette in texels 0 to 3
+    uint8_t paletteBlock[16], texels[16][4];
+    memcpy(paletteBlock, block, 16);
+    uint8_t *paletteColour = dxt5 ? paletteBlock + 8 : paletteBlock;
+    paletteColour[4] = 0xE4;
+    paletteColour[5] = paletteColour[6] = paletteColour[7] = 0;
+    if (dxt5) {
+        // Alpha indices 0 to 7 in texels 0 to 7
+        uint64_t alphaIndices = 0;
+        for (i = 0; i < 8; i++) alphaIndices |= (uint64_t)i << (3 * i);
+        for (i = 0; i < 6; i++) paletteBlock[2 + i] = (uint8_t)(alphaIndices >> (8 * i));
+    }
+    DXTDecodeBlock(paletteBlock, dxt5, texels);
+    
+    for (i = 0; i < 4; i++) {
+        for (k = 0; k < 3; k++) {
+            palette->colours[i][k] = texels[i][k];
+        }
+    }
+    for (i = 0; i < 8; i++) {
+        palette->alphas[i] = dxt5 ? texels[i][3] : 255;
+    }
+    
+    uint32_t indices = colour[4] | (colour[5] << 8) | (colour[6] << 16) | ((uint32_t)colour[7] << 24);
+    for (i = 0; i < 16; i++) {
+        palette->colourIndices[i] = (indices >> (2 * i)) & 3;
+    }
+    
+    uint64_t alphaIndices = 0;
+    if (dxt5) {
+        for (i = 0; i < 6; i++) alphaIndices |= (uint64_t)block[2 + i] << (8 * i);
+    }
+    for (i = 0; i < 16; i++) {
+        palette->alphaIndices[i] = (alphaIndices >> (3 * i)) & 7;
+    }
+}
+
+/*
+ The fit of one ETC subblock: its expanded base colour, modifier table, and the ETC pixel index chosen for each
+ of the four DXT palette entries
+ */
+typedef struct {
+    int base[3];
+    int table;
+    int entryIndices[4];
+    int error;
+} SubblockFit;
+
+/*
+ Fits the palette entries used by a subblock, count[j] times each, to base. Pixel index values 0 to 3 select
+ modifiers +a, +b, -a and -b.
+ */
+static void FitSubblock(const BlockPalette *palette, const int counts[4], const int base[3], SubblockFit *fit)
+{
+    int table, j, m, k;
+    
+    memcpy(fit->base, base, sizeof(fit->base));
+    fit->error = 0x7FFFFFFF;
+    
+    for (table = 0; table < 8; table++) {
+        int modifiers[4] = { ETCModifierTables[table][0], ETCModifierTables[table][1], -ETCModifierTables[table][0], -ETCModifierTables[table][1] };
+        int entryIndices[4] = { 0, 0, 0, 0 };
+        int error = 0;
+        
+        for (j = 0; j < 4; j++) {
+            if (counts[j] == 0) {
+                continue;
+            }
+            int best = 0x7FFFFFFF;
+            for (m = 0; m < 4; m++) {
+                int entryError = 0;
+                for (k = 0; k < 3; k++) {
+                    int difference = Clamp255(base[k] + modifiers[m]) - palette->colours[j][k];
+                    entryError += difference * difference;
+                }
+                if (entryError < best) {
+                    best = entryError;
+                    entryIndices[j] = m;
+                }
+            }
+            error += best * counts[j];
+        }
+        
+        if (error < fit->error) {
+            fit->error = error;
+            fit->table = table;
+            memcpy(fit->entryIndices, entryIndices, sizeof(entryIndices));
+        }
+    }
+}
+
+/*
+ The two subblocks of a 4x4 block, as 2x4 halves side by side or, flipped, 4x2 halves one above the other,
+ and the bits of both base colours as stored
+ */
+typedef struct {
+    bool flip;
+    bool differential;
+    int quantized[2][3];
+    SubblockFit fits[2];
+    int error;
+} BlockFit;
+
+static int Subblock(int x, int y, bool flip)
+{
+    return flip ? y >= 2 : x >= 2;
+}
+
+static void FitBlock(const BlockPalette *palette, bool flip, BlockFit *fit)
+{
+    int counts[2][4] = { { 0 } }, sums[2][3] = { { 0 } }, texels[2] = { 0, 0 };
+    int s, k, x, y;
+    
+    for (y = 0; y < 4; y++) {
+        for (x = 0; x < 4; x++) {
+            s = Subblock(x, y, flip);
+            int entry = palette->colourIndices[y * 4 + x];
+            counts[s][entry]++;
+            for (k = 0; k < 3; k++) {
+                sums[s][k] += palette->colours[entry][k];
+            }
+            texels[s]++;
+        }
+    }
+    
+    // Each subblock is based on the mean of its colours, stored as 5-bit bases 3-bit apart if possible
+    int mean[2][3];
+    fit->flip = flip;
+    fit->differential = true;
+    for (s = 0; s < 2; s++) {
+        for (k = 0; k < 3; k++) {
+            mean[s][k] = (sums[s][k] + texels[s] / 2) / texels[s];
+            fit->quantized[s][k] = (mean[s][k] * 31 + 127) / 255;
+        }
+    }
+    for (k = 0; k < 3; k++) {
+        int difference = fit->quantized[1][k] - fit->quantized[0][k];
+        if (difference < -4 || difference > 3) {
+            fit->differential = false;
+        }
+    }
+    
+    fit->error = 0;
+    for (s = 0; s < 2; s++) {
+        int base[3];
+        for (k = 0; k < 3; k++) {
+            if (fit->differential) {
+                base[k] = (fit->quantized[s][k] << 3) | (fit->quantized[s][k] >> 2);
+            } else {
+                fit->quantized[s][k] = (mean[s][k] * 15 + 127) / 255;
+                base[k] = fit->quantized[s][k] * 17;
+            }
+        }
+        FitSubblock(palette, counts[s], base, &fit->fits[s]);
+        fit->error += fit->fits[s].error;
+    }
+}
+
+static void WriteETCBlock(const BlockPalette *palette, const BlockFit *fit, uint8_t *out)
+{
+    uint32_t high = 0, low = 0;
+    int x, y, k;
+    
+    for (k = 0; k < 3; k++) {
+        int shift = 24 - 8 * k;
+        if (fit->differential) {
+            int difference = fit->quantized[1][k] - fit->quantized[0][k];
+            high |= (uint32_t)((fit->quantized[0][k] << 3) | (difference & 7)) << shift;
+        } else {
+            high |= (uint32_t)((fit->quantized[0][k] << 4) | fit->quantized[1][k]) << shift;
+        }
+    }
+    high |= (uint32_t)fit->fits[0].table << 5;
+    high |= (uint32_t)fit->fits[1].table << 2;
+    high |= (uint32_t)fit->differential << 1;
+    high |= (uint32_t)fit->flip;
+    
+    // Pixels are numbered down each column; the low bit of each index is in the low half
+    for (x = 0; x < 4; x++) {
+        for (y = 0; y < 4; y++) {
+            int pixel = x * 4 + y;
+            int index = fit->fits[Subblock(x, y, fit->flip)].entryIndices[palette->colourIndices[y * 4 + x]];
+            low |= (uint32_t)(index >> 1) << (16 + pixel);
+            low |= (uint32_t)(index & 1) << pixel;
+        }
+    }
+    
+    out[0] = high >> 24; out[1] = high >> 16; out[2] = high >> 8; out[3] = high;
+    out[4] = low >> 24; out[5] = low >> 16; out[6] = low >> 8; out[7] = low;
+}
+
+/*
+ A fit in ETC2's T or H mode: two 4-bit base colours, a distance, and the paint colour chosen for each DXT
+ palette entry. T mode paints the first base alone and the second plus, minus and exactly the distance; H mode
+ paints each base plus and minus the distance.
+ */
+typedef struct {
+    bool hMode;
+    int bases[2][3];
+    int distance;
+    int entryIndices[4];
+    int error;
+} PaintFit;
+
+static int PaintEntries(const BlockPalette *palette, const int counts[4], int paints[4][3], int entryIndices[4])
+{
+    int error = 0;
+    int j, m, k;
+    
+    for (j = 0; j < 4; j++) {
+        if (counts[j] == 0) {
+            continue;
+        }
+        int best = 0x7FFFFFFF;
+        for (m = 0; m < 4; m++) {
+            int entryError = 0;
+            for (k = 0; k < 3; k++) {
+                int difference = paints[m][k] - palette->colours[j][k];
+                entryError += difference * difference;
+            }
+            if (entryError < best) {
+                best = entryError;
+                entryIndices[j] = m;
+            }
+        }
+        error += best * counts[j];
+    }
+    
+    return error;
+}
+
+static int Base12(const int base[3])
+{
+    return (base[0] << 8) | (base[1] << 4) | base[2];
+}
+
+/*
+ Tries every distance for a pair of 4-bit bases. In H mode the lowest bit of the distance index is implied by
+ the order of the bases, so the bases are swapped where needed.
+ */
+static void FitPaintBases(const BlockPalette *palette, const int counts[4], bool hMode, const int bases[2][3], PaintFit *fit)
+{
+    int distance, k;
+    
+    for (distance = 0; distance < 8; distance++) {
+        int ordered[2][3];
+        memcpy(ordered, bases, sizeof(ordered));
+        
+        if (hMode) {
+            bool firstGreater = Base12(bases[0]) >= Base12(bases[1]);
+            if (firstGreater != (distance & 1)) {
+                if (Base12(bases[0]) == Base12(bases[1])) {
+                    continue;
+                }
+                memcpy(ordered[0], bases[1], sizeof(ordered[0]));
+                memcpy(ordered[1], bases[0], sizeof(ordered[1]));
+            }
+        }
+        
+        int paints[4][3];
+        int d = ETCDistances[distance];
+        for (k = 0; k < 3; k++) {
+            int base0 = ordered[0][k] * 17, base1 = ordered[1][k] * 17;
+            if (hMode) {
+                paints[0][k] = Clamp255(base0 + d);
+                paints[1][k] = Clamp255(base0 - d);
+                paints[2][k] = Clamp255(base1 + d);
+                paints[3][k] = Clamp255(base1 - d);
+            } else {
+                paints[0][k] = base0;
+                paints[1][k] = Clamp255(base1 + d);
+                paints[2][k] = base1;
+                paints[3][k] = Clamp255(base1 - d);
+            }
+        }
+        
+        int entryIndices[4] = { 0, 0, 0, 0 };
+        int error = PaintEntries(palette, counts, paints, entryIndices);
+        if (error < fit->error) {
+            fit->hMode = hMode;
+            memcpy(fit->bases, ordered, sizeof(fit->bases));
+            fit->distance = distance;
+            memcpy(fit->entryIndices, entryIndices, sizeof(entryIndices));
+            fit->error = error;
+        }
+    }
+}
+
+/*
+ Fits T and H modes by splitting the palette entries the block uses into two groups in every possible way and
+ basing each group on its mean. With at most four entries there are only seven splits.
+ */
+static void FitPaintBlock(const BlockPalette *palette, PaintFit *fit)
+{
+    int counts[4] = { 0, 0, 0, 0 };
+    int i, j, k, split;
+    
+    for (i = 0; i < 16; i++) {
+        counts[palette->colourIndices[i]]++;
+    }
+    
+    fit->error = 0x7FFFFFFF;
+    
+    for (split = 1; split < 16; split += 2) {
+        int sums[2][3] = { { 0 } }, totals[2] = { 0, 0 }, used[2] = { 0, 0 };
+        for (j = 0; j < 4; j++) {
+            int group = (split >> j) & 1;
+            totals[group] += counts[j];
+            used[group] += counts[j] > 0;
+            for (k = 0; k < 3; k++) {
+                sums[group][k] += palette->colours[j][k] * counts[j];
+            }
+        }
+        // Each split and its complement give the same groups, so entry 0 is always in the second group
+        if (totals[0] == 0 || totals[1] == 0) {
+            continue;
+        }
+        
+        int bases[2][3];
+        for (i = 0; i < 2; i++) {
+            for (k = 0; k < 3; k++) {
+                int mean = (sums[i][k] + totals[i] / 2) / totals[i];
+                bases[i][k] = (mean * 15 + 127) / 255;
+            }
+        }
+        FitPaintBases(palette, counts, true, bases, fit);
+        
+        // T mode paints its first base alone, so it is only tried with a single entry in that group
+        if (used[0] == 1) {
+            FitPaintBases(palette, counts, false, bases, fit);
+        }
+        if (used[1] == 1) {
+            int swapped[2][3];
+            memcpy(swapped[0], bases[1], sizeof(swapped[0]));
+            memcpy(swapped[1], bases[0], sizeof(swapped[1]));
+            FitPaintBases(palette, counts, false, swapped, fit);
+        }
+    }
+}
+
+static void WritePaintBlock(const BlockPalette *palette, const PaintFit *fit, uint8_t *out)
+{
+    const int *base0 = fit->bases[0], *base1 = fit->bases[1];
+    uint32_t high = 0, low = 0;
+    int x, y;
+    
+    /*
+     T and H modes are signalled by the red or green differential overflowing, using bits the mode leaves free.
+     A low two-bit value plus a high two-bit value overflows upwards from 28 if their sum is at least 4, and
+     downwards from 0 otherwise.
+     */
+    if (!fit->hMode) {
+        int high2 = base0[0] >> 2, low2 = base0[0] & 3;
+        high |= (uint32_t)high2 << 27 | (uint32_t)low2 << 24;
+        high |= high2 + low2 >= 4 ? 7U << 29 : 1U << 26;
+        high |= (uint32_t)base0[1] << 20 | (uint32_t)base0[2] << 16;
+        high |= (uint32_t)base1[0] << 12 | (uint32_t)base1[1] << 8 | (uint32_t)base1[2] << 4;
+        high |= (uint32_t)(fit->distance >> 1) << 2 | 1U << 1 | (uint32_t)(fit->distance & 1);
+    } else {
+        int greenHigh = base0[1] >> 1, greenLow = base0[1] & 1, blueHigh = base0[2] >> 3, blueLow = base0[2] & 7;
+        high |= (uint32_t)base0[0] << 27 | (uint32_t)greenHigh << 24 | (uint32_t)greenLow << 20;
+        high |= (uint32_t)blueHigh << 19 | (uint32_t)blueLow << 15;
+        high |= (uint32_t)base1[0] << 11 | (uint32_t)base1[1] << 7 | (uint32_t)base1[2] << 3;
+        high |= (uint32_t)(fit->distance >> 2) << 2 | 1U << 1 | (uint32_t)((fit->distance >> 1) & 1);
+        
+        // Red must not overflow, or the block would be read as T mode
+        int redDifference = greenHigh >= 4 ? greenHigh - 8 : greenHigh;
+        if (base0[0] + redDifference < 0) {
+            high |= 1U << 31;
+        }
+        int green2 = (greenLow << 1) | blueHigh, difference2 = blueLow >> 1;
+        high |= green2 + difference2 >= 4 ? 7U << 21 : 1U << 18;
+    }
+    
+    for (x = 0; x < 4; x++) {
+        for (y = 0; y < 4; y++) {
+            int pixel = x * 4 + y;
+            int index = fit->entryIndices[palette->colourIndices[y * 4 + x]];
+            low |= (uint32_t)(index >> 1) << (16 + pixel);
+            low |= (uint32_t)(index & 1) << pixel;
+        }
+    }
+    
+    out[0] = high >> 24; out[1] = high >> 16; out[2] = high >> 8; out[3] = high;
+    out[4] = low >> 24; out[5] = low >> 16; out[6] = low >> 8; out[7] = low;
+}
+
+static void WriteEACBlock(const BlockPalette *palette, uint8_t *out)
+{
+    int used[8] = { 0 };
+    int minimum = 255, maximum = 0;
+    int i, j, m;
+    
+    for (i = 0; i < 16; i++) {
+        int alpha = palette->alphas[palette->alphaIndices[i]];
+        used[palette->alphaIndices[i]]++;
+        if (alpha < minimum) minimum = alpha;
+        if (alpha > maximum) maximum = alpha;
+    }
+    
+    int bestBase = minimum, bestMultiplier = 1, bestTable = 13, bestError = 0x7FFFFFFF;
+    int bestIndices[8] = { 4, 4, 4, 4, 4, 4, 4, 4 };
+    
+    // A constant block is exact with table 13, whose fifth modifier is 0
+    if (minimum != maximum) {
+        int base = (minimum + maximum + 1) / 2;
+        int table;
+        for (table = 0; table < 16; table++) {
+            const int *modifiers = EACModifierTables[table];
+            int span = modifiers[7] - modifiers[3];
+            int multiplier = (maximum - minimum + span / 2) / span;
+            int candidate;
+            
+            for (candidate = multiplier - 1; candidate <= multiplier + 1; candidate++) {
+                if (candidate < 1 || candidate > 15) {
+                    continue;
+                }
+                int indices[8] = { 0 };
+                int error = 0;
+                for (j = 0; j < 8 && error < bestError; j++) {
+                    if (used[j] == 0) {
+                        continue;
+                    }
+                    int best = 0x7FFFFFFF;
+                    for (m = 0; m < 8; m++) {
+                        int difference = Clamp255(base + modifiers[m] * candidate) - palette->alphas[j];
+                        if (difference * difference < best) {
+                            best = difference * difference;
+                            indices[j] = m;
+                        }
+                    }
+                    error += best * used[j];
+                }
+                if (error < bestError) {
+                    bestError = error;
+                    bestBase = base;
+                    bestMultiplier = candidate;
+                    bestTable = table;
+                    memcpy(bestIndices, indices, sizeof(indices));
+                }
+            }
+        }
+    }
+    
+    uint64_t bits = (uint64_t)bestBase << 56 | (uint64_t)bestMultiplier << 52 | (uint64_t)bestTable << 48;
+    int x, y;
+    for (x = 0; x < 4; x++) {
+        for (y = 0; y < 4; y++) {
+            int pixel = x * 4 + y;
+            bits |= (uint64_t)bestIndices[palette->alphaIndices[y * 4 + x]] << (45 - 3 * pixel);
+        }
+    }
+    
+    for (i = 0; i < 8; i++) {
+        out[i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+}
+
+static void TranscodeBlock(const uint8_t *block, bool dxt5, uint8_t *out)
+{
+    BlockPalette palette;
+    BlockFit fits[2];
+    
+    ReadBlockPalette(block, dxt5, &palette);
+    
+    if (dxt5) {
+        WriteEACBlock(&palette, out);
+        out += 8;
+    }
+    
+    FitBlock(&palette, false, &fits[0]);
+    FitBlock(&palette, true, &fits[1]);
+    BlockFit *best = fits[1].error < fits[0].error ? &fits[1] : &fits[0];
+    
+    // Blocks whose colours do not lie along the grey axis usually fit T or H mode better
+    if (best->error > 0) {
+        PaintFit paintFit;
+        FitPaintBlock(&palette, &paintFit);
+        if (paintFit.error < best->error) {
+            WritePaintBlock(&palette, &paintFit, out);
+            return;
+        }
+    }
+    
+    WriteETCBlock(&palette, best, out);
+}
+
+typedef struct {
+    const uint8_t *source;
+    uint8_t *destination;
+    int columns, rows;
+    int bandCount;
+    bool dxt5;
+} ETCTranscodeJob;
+
+static void TranscodeBand(void *p, unsigned int band)
+{
+    ETCTranscodeJob *job = p;
+    size_t blockBytes = job->dxt5 ? kDXT5BlockBytes : kDXT1BlockBytes;
+    int first = job->rows * band / job->bandCount, last = job->rows * (band + 1) / job->bandCount;
+    size_t offset = (size_t)first * job->columns * blockBytes;
+    size_t end = (size_t)last * job->columns * blockBytes;
+    
+    for (; offset < end; offset += blockBytes) {
+        TranscodeBlock(job->source + offset, job->dxt5, job->destination + offset);
+    }
+}
+
+void ETCTranscode(const void *source, int width, int height, bool dxt5, void *destination, HapDecodeCallback callback, void *info)
+{
+    ETCTranscodeJob job = { source, destination, (width + 3) / 4, (height + 3) / 4, 0, dxt5 };
+    
+    job.bandCount = job.rows < kETCBandCount ? job.rows : kETCBandCount;
+    if (job.bandCount > 0) {
+        callback(TranscodeBand, &job, job.bandCount, info);
+    }
+}
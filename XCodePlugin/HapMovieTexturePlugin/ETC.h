@@ -0,0 +1,31 @@
+//
+//  ETC.h
+//  HapMovieTexturePlugin
+//
+//  Transcodes decoded Hap frames to ETC2 for GPUs without S3TC.
+//
+
+#ifndef HapMovieTexturePlugin_ETC_h
+#define HapMovieTexturePlugin_ETC_h
+
+#include <stdbool.h>
+
+#include "hap.h"
+
+/*
+ These match the constants defined by OpenGL ES 3.0 and ARB_ES3_compatibility
+ */
+#define kETCTextureFormatRGB8 0x9274
+#define kETCTextureFormatRGBA8 0x9278
+
+/*
+ Transcodes a DXT1 or DXT5 texture to ETC2 RGB8 or ETC2 RGBA8 (EAC alpha) respectively. Both formats use
+ blocks of the same size, so destination must hold as many bytes as source and may not be source.
+ Each block is transcoded from its palette rather than its texels: the colours a block's indices select are
+ fitted once with ETC1-compatible base colours and modifier tables, then every texel takes the modifier of its
+ palette entry. Alpha is fitted the same way to EAC. Rows of blocks are split into bands which are run through
+ callback and info as for HapDecode, so callback may spread them across threads.
+ */
+void ETCTranscode(const void *source, int width, int height, bool dxt5, void *destination, HapDecodeCallback callback, void *info);
+
+#endif
@@ -0,0 +1,657 @@
+//
+//  FrameStream.c
+//  HapMovieTexturePlugin
+//
+
+#include "FrameStream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <libkern/OSByteOrder.h>
+#include <mach/mach_time.h>
+
+#define FourCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+#define kFrameStreamMagic FourCC('H', 'a', 'p', 'S')
+#define kFrameStreamHeaderBytes 32
+
+// Kept within a typical Ethernet MTU so that fragments are not themselves fragmented
+#define kFrameStreamDatagramBytes 1400
+#define kFrameStreamFragmentBytes (kFrameStreamDatagramBytes - kFrameStreamHeaderBytes)
+#define kFrameStreamMaxDatagramBytes 65536
+#define kFrameStreamReceiveBufferBytes (4 * 1024 * 1024)
+
+// Frames being reassembled from UDP fragments at once, and frames waiting to be shown
+#define kFrameStreamAssemblies 4
+#define kFrameStreamJitterSlots 16
+
+// Reordering never spans more than the frames buffered, so a sequence further back than this is a new sender
+#define kFrameStreamRestartFrames (4 * kFrameStreamJitterSlots)
+
+// Darwin suppresses SIGPIPE with a socket option instead
+#if defined(MSG_NOSIGNAL)
+#define kFrameStreamSendFlags MSG_NOSIGNAL
+#else
+#define kFrameStreamSendFlags 0
+#endif
+
+// How often the receiving thread checks whether it should stop
+#define kFrameStreamPollMilliseconds 100
+
+typedef struct {
+    uint32_t sequence;
+    uint64_t timestamp;
+    int width, height;
+    uint32_t frameSize;
+    uint32_t fragmentOffset;
+    uint32_t fragmentSize;
+} FrameStreamHeader;
+
+typedef struct {
+    bool used;
+    uint64_t sequence;
+    uint64_t timestamp;
+    int width, height;
+    uint32_t size;
+    uint8_t *buffer;
+} FrameStreamFrame;
+
+/*
+ A frame being reassembled from UDP fragments. Every fragment but the last is kFrameStreamFragmentBytes, so a
+ fragment's offset gives its index, and received has a bit set for each index seen, so that a duplicated
+ fragment is only counted once.
+ */
+typedef struct {
+    FrameStreamFrame frame;
+    uint32_t fragmentCount;
+    uint32_t receivedCount;
+    uint8_t *received;
+} FrameStreamAssembly;
+
+struct FrameSender {
+    FrameStreamTransport transport;
+    int socket;
+    uint32_t sequence;
+};
+
+struct FrameReceiver {
+    FrameStreamTransport transport;
+    int socket;
+    int connection;
+    uint16_t port;
+    uint32_t maxFrameSize;
+    uint64_t latency;
+    
+    volatile bool stopping;
+    pthread_t thread;
+    
+    FrameStreamAssembly assemblies[kFrameStreamAssemblies];
+    uint8_t *datagram;
+    
+    // The jitter buffer, protected by lock
+    pthread_mutex_t lock;
+    FrameStreamFrame slots[kFrameStreamJitterSlots];
+    bool transitKnown;
+    int64_t minimumTransit;
+    bool displayedAny;
+    uint64_t lastDisplayed;
+    uint64_t skippedSinceDisplay;
+    FrameReceiverStatistics statistics;
+};
+
+static uint64_t Nanoseconds(void)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+
+static void WriteHeader(uint8_t *bytes, const FrameStreamHeader *header)
+{
+    OSWriteBigInt32(bytes, 0, kFrameStreamMagic);
+    OSWriteBigInt32(bytes, 4, header->sequence);
+    OSWriteBigInt64(bytes, 8, header->timestamp);
+    OSWriteBigInt16(bytes, 16, (uint16_t)header->width);
+    OSWriteBigInt16(bytes, 18, (uint16_t)header->height);
+    OSWriteBigInt32(bytes, 20, header->frameSize);
+    OSWriteBigInt32(bytes, 24, header->fragmentOffset);
+    OSWriteBigInt32(bytes, 28, header->fragmentSize);
+}
+
+static bool ReadHeader(const uint8_t *bytes, uint32_t maxFrameSize, FrameStreamHeader *header)
+{
+    if (OSReadBigInt32(bytes, 0) != kFrameStreamMagic) {
+        return false;
+    }
+    
+    header->sequence = OSReadBigInt32(bytes, 4);
+    header->timestamp = OSReadBigInt64(bytes, 8);
+    header->width = OSReadBigInt16(bytes, 16);
+    header->height = OSReadBigInt16(bytes, 18);
+    header->frameSize = OSReadBigInt32(bytes, 20);
+    header->fragmentOffset = OSReadBigInt32(bytes, 24);
+    header->fragmentSize = OSReadBigInt32(bytes, 28);
+    
+    return header->frameSize <= maxFrameSize && header->fragmentOffset <= header->frameSize
+        && header->fragmentSize <= header->frameSize - header->fragmentOffset;
+}
+
+static void DisableSigPipe(int fd)
+{
+#if defined(SO_NOSIGPIPE)
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+FrameSender *FrameSenderCreate(FrameStreamTransport transport, const char *host, uint16_t port)
+{
+    struct addrinfo hints, *addresses, *address;
+    char service[8];
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = transport == FrameStreamTCP ? SOCK_STREAM : SOCK_DGRAM;
+    snprintf(service, sizeof(service), "%u", port);
+    
+    if (getaddrinfo(host, service, &hints, &addresses) != 0) {
+        return NULL;
+    }
+    
+    int fd = -1;
+    for (address = addresses; address != NULL && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    FrameSender *sender = calloc(1, sizeof(FrameSender));
+    if (sender == NULL) {
+        close(fd);
+        return NULL;
+    }
+    
+    DisableSigPipe(fd);
+    if (transport == FrameStreamTCP) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    
+    sender->transport = transport;
+    sender->socket = fd;
+    
+    return sender;
+}
+
+static int SendFully(int fd, const void *bytes, size_t length)
+{
+    while (length > 0) {
+        ssize_t sent = send(fd, bytes, length, kFrameStreamSendFlags);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        bytes = (const uint8_t *)bytes + sent;
+        length -= sent;
+    }
+    
+    return 0;
+}
+
+int FrameSenderSend(FrameSender *sender, const void *frame, uint32_t size, int width, int height, uint64_t timestamp)
+{
+    if (sender == NULL || frame == NULL || width <= 0 || height <= 0 || width > UINT16_MAX || height > UINT16_MAX) {
+        return EINVAL;
+    }
+    
+    FrameStreamHeader header = { sender->sequence++, timestamp, width, height, size, 0, size };
+    uint8_t datagram[kFrameStreamDatagramBytes];
+    
+    if (sender->transport == FrameStreamTCP) {
+        WriteHeader(datagram, &header);
+        int error = SendFully(sender->socket, datagram, kFrameStreamHeaderBytes);
+        return error != 0 ? error : SendFully(sender->socket, frame, size);
+    }
+    
+    do {
+        header.fragmentSize = size - header.fragmentOffset;
+        if (header.fragmentSize > kFrameStreamFragmentBytes) {
+            header.fragmentSize = kFrameStreamFragmentBytes;
+        }
+        
+        WriteHeader(datagram, &header);
+        memcpy(datagram + kFrameStreamHeaderBytes, (const uint8_t *)frame + header.fragmentOffset, header.fragmentSize);
+        
+        // A datagram the receiver has no room for is lost like any other, so only local failures are errors
+        if (send(sender->socket, datagram, kFrameStreamHeaderBytes + header.fragmentSize, kFrameStreamSendFlags) < 0 && errno != ENOBUFS && errno != ECONNREFUSED) {
+            return errno;
+        }
+        
+        header.fragmentOffset += header.fragmentSize;
+    } while (header.fragmentOffset < size);
+    
+    return 0;
+}
+
+void FrameSenderDestroy(FrameSender *sender)
+{
+    if (sender != NULL) {
+        close(sender->socket);
+        free(sender);
+    }
+}
+
+/*
+ Forgets the sequence and clock of the last sender, whose frames still waiting are dropped, so that a new
+ sender starting again from sequence 0 on a clock of its own is shown. Must be called on the receiving thread
+ with lock held; any frame of the receiver's being reassembled is abandoned.
+ */
+static void ResetReceiver(FrameReceiver *receiver)
+{
+    int i;
+    for (i = 0; i < kFrameStreamAssemblies; i++) {
+        receiver->assemblies[i].frame.used = false;
+    }
+    for (i = 0; i < kFrameStreamJitterSlots; i++) {
+        receiver->slots[i].used = false;
+    }
+    
+    receiver->transitKnown = false;
+    receiver->minimumTransit = 0;
+    receiver->displayedAny = false;
+    receiver->lastDisplayed = 0;
+    receiver->skippedSinceDisplay = 0;
+}
+
+/*
+ Moves a complete frame into the jitter buffer, swapping buffers with the slot it takes. If every slot is full
+ the oldest frame is pushed out. A frame from far before the last one shown means the sender has restarted.
+ */
+static void InsertFrame(FrameReceiver *receiver, FrameStreamFrame *frame)
+{
+    int64_t transit = (int64_t)(Nanoseconds() - frame->timestamp * 1000);
+    
+    pthread_mutex_lock(&receiver->lock);
+    
+    receiver->statistics.received++;
+    
+    if (receiver->displayedAny && frame->sequence + kFrameStreamRestartFrames < receiver->lastDisplayed) {
+        ResetReceiver(receiver);
+    }
+    
+    if (receiver->displayedAny && frame->sequence <= receiver->lastDisplayed) {
+        receiver->statistics.late++;
+        pthread_mutex_unlock(&receiver->lock);
+        return;
+    }
+    
+    FrameStreamFrame *slot = NULL;
+    int i;
+    for (i = 0; i < kFrameStreamJitterSlots; i++) {
+        if (!receiver->slots[i].used) {
+            slot = &receiver->slots[i];
+            break;
+        }
+        if (slot == NULL || receiver->slots[i].sequence < slot->sequence) {
+            slot = &receiver->slots[i];
+        }
+    }
+    if (slot->used) {
+        receiver->statistics.skipped++;
+        receiver->skippedSinceDisplay++;
+    }
+    
+    uint8_t *buffer = slot->buffer;
+    *slot = *frame;
+    slot->used = true;
+    frame->buffer = buffer;
+    
+    // The least delayed frame shows the sender's clock relative to ours, plus the fastest delivery
+    if (!receiver->transitKnown || transit < receiver->minimumTransit) {
+        receiver->minimumTransit = transit;
+        receiver->transitKnown = true;
+    }
+    
+    pthread_mutex_unlock(&receiver->lock);
+}
+
+static bool ReceiveFully(FrameReceiver *receiver, int fd, void *bytes, size_t length)
+{
+    while (length > 0) {
+        struct pollfd pollfd = { fd, POLLIN, 0 };
+        if (receiver->stopping) {
+            return false;
+        }
+        if (poll(&pollfd, 1, kFrameStreamPollMilliseconds) <= 0) {
+            continue;
+        }
+        
+        ssize_t received = recv(fd, bytes, length, 0);
+        if (received <= 0) {
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes = (uint8_t *)bytes + received;
+        length -= received;
+    }
+    
+    return true;
+}
+
+/*
+ Accepts one sender at a time. A sender which breaks the framing is disconnected.
+ */
+static void ReceiveTCP(FrameReceiver *receiver)
+{
+    FrameStreamFrame *frame = &receiver->assemblies[0].frame;
+    uint8_t bytes[kFrameStreamHeaderBytes];
+    FrameStreamHeader header;
+    
+    while (!receiver->stopping) {
+        if (receiver->connection < 0) {
+            struct pollfd pollfd = { receiver->socket, POLLIN, 0 };
+            if (poll(&pollfd, 1, kFrameStreamPollMilliseconds) > 0) {
+                receiver->connection = accept(receiver->socket, NULL, NULL);
+            }
+            
+            // Each connection is a new sender, counting its frames from 0 on its own clock
+            if (receiver->connection >= 0) {
+                pthread_mutex_lock(&receiver->lock);
+                ResetReceiver(receiver);
+                pthread_mutex_unlock(&receiver->lock);
+            }
+            continue;
+        }
+        
+        if (!ReceiveFully(receiver, receiver->connection, bytes, kFrameStreamHeaderBytes)
+            || !ReadHeader(bytes, receiver->maxFrameSize, &header) || header.fragmentSize != header.frameSize
+            || !ReceiveFully(receiver, receiver->connection, frame->buffer, header.frameSize)) {
+            close(receiver->connection);
+            receiver->connection = -1;
+            continue;
+        }
+        
+        frame->sequence = header.sequence;
+        frame->timestamp = header.timestamp;
+        frame->width = header.width;
+        frame->height = header.height;
+        frame->size = header.frameSize;
+        InsertFrame(receiver, frame);
+    }
+}
+
+static uint32_t FragmentCount(uint32_t frameSize)
+{
+    // An empty frame is still sent as one fragment
+    return frameSize == 0 ? 1 : (frameSize + kFrameStreamFragmentBytes - 1) / kFrameStreamFragmentBytes;
+}
+
+/*
+ Reassembles fragments into frames, which are complete once every fragment has arrived at least once. When a
+ fragment of a new frame arrives with every assembly in use, the oldest incomplete frame is abandoned.
+ */
+static void ReceiveUDP(FrameReceiver *receiver)
+{
+    FrameStreamHeader header;
+    
+    while (!receiver->stopping) {
+        struct pollfd pollfd = { receiver->socket, POLLIN, 0 };
+        if (poll(&pollfd, 1, kFrameStreamPollMilliseconds) <= 0) {
+            continue;
+        }
+        
+        ssize_t length = recv(receiver->socket, receiver->datagram, kFrameStreamMaxDatagramBytes, 0);
+        if (length < kFrameStreamHeaderBytes || !ReadHeader(receiver->datagram, receiver->maxFrameSize, &header)
+            || length != kFrameStreamHeaderBytes + header.fragmentSize) {
+            continue;
+        }
+        
+        // Fragments which don't fall on the sender's boundaries can't be told apart from overlapping ones
+        uint32_t index = header.fragmentOffset / kFrameStreamFragmentBytes;
+        uint32_t expectedSize = header.frameSize - header.fragmentOffset;
+        if (expectedSize > kFrameStreamFragmentBytes) {
+            expectedSize = kFrameStreamFragmentBytes;
+        }
+        if (header.fragmentOffset % kFrameStreamFragmentBytes != 0 || header.fragmentSize != expectedSize
+            || index >= FragmentCount(header.frameSize)) {
+            continue;
+        }
+        
+        FrameStreamAssembly *assembly = NULL, *oldest = NULL;
+        int i;
+        for (i = 0; i < kFrameStreamAssemblies && assembly == NULL; i++) {
+            FrameStreamAssembly *candidate = &receiver->assemblies[i];
+            if (candidate->frame.used && candidate->frame.sequence == header.sequence) {
+                assembly = candidate;
+            } else if (oldest == NULL || !candidate->frame.used || (oldest->frame.used && candidate->frame.sequence < oldest->frame.sequence)) {
+                oldest = candidate;
+            }
+        }
+        if (assembly == NULL) {
+            assembly = oldest;
+        }
+        
+        FrameStreamFrame *frame = &assembly->frame;
+        if (!frame->used || frame->sequence != header.sequence || frame->size != header.frameSize) {
+            frame->used = true;
+            frame->sequence = header.sequence;
+            frame->timestamp = header.timestamp;
+            frame->width = header.width;
+            frame->height = header.height;
+            frame->size = header.frameSize;
+            assembly->fragmentCount = FragmentCount(header.frameSize);
+            assembly->receivedCount = 0;
+            memset(assembly->received, 0, (assembly->fragmentCount + 7) / 8);
+        }
+        
+        uint8_t bit = (uint8_t)(1 << (index % 8));
+        if (assembly->received[index / 8] & bit) {
+            continue;
+        }
+        assembly->received[index / 8] |= bit;
+        assembly->receivedCount++;
+        
+        memcpy(frame->buffer + header.fragmentOffset, receiver->datagram + kFrameStreamHeaderBytes, header.fragmentSize);
+        
+        if (assembly->receivedCount == assembly->fragmentCount) {
+            frame->used = false;
+            InsertFrame(receiver, frame);
+        }
+    }
+}
+
+static void *ReceiveThread(void *p)
+{
+    FrameReceiver *receiver = p;
+    
+    if (receiver->transport == FrameStreamTCP) {
+        ReceiveTCP(receiver);
+    } else {
+        ReceiveUDP(receiver);
+    }
+    
+    return NULL;
+}
+
+static void FreeReceiver(FrameReceiver *receiver)
+{
+    int i;
+    for (i = 0; i < kFrameStreamAssemblies; i++) {
+        free(receiver->assemblies[i].frame.buffer);
+        free(receiver->assemblies[i].received);
+    }
+    for (i = 0; i < kFrameStreamJitterSlots; i++) {
+        free(receiver->slots[i].buffer);
+    }
+    free(receiver->datagram);
+    
+    if (receiver->connection >= 0) {
+        close(receiver->connection);
+    }
+    if (receiver->socket >= 0) {
+        close(receiver->socket);
+    }
+    pthread_mutex_destroy(&receiver->lock);
+    free(receiver);
+}
+
+FrameReceiver *FrameReceiverCreate(FrameStreamTransport transport, uint16_t port, uint32_t maxFrameSize, uint32_t latency)
+{
+    FrameReceiver *receiver = calloc(1, sizeof(FrameReceiver));
+    if (receiver == NULL) {
+        return NULL;
+    }
+    
+    receiver->transport = transport;
+    receiver->connection = -1;
+    receiver->maxFrameSize = maxFrameSize;
+    receiver->latency = (uint64_t)latency * 1000;
+    pthread_mutex_init(&receiver->lock, NULL);
+    
+    bool ok = true;
+    int i;
+    for (i = 0; i < kFrameStreamAssemblies; i++) {
+        ok = ok && (receiver->assemblies[i].frame.buffer = malloc(maxFrameSize)) != NULL;
+        if (transport == FrameStreamUDP) {
+            ok = ok && (receiver->assemblies[i].received = calloc((FragmentCount(maxFrameSize) + 7) / 8, 1)) != NULL;
+        }
+    }
+    for (i = 0; i < kFrameStreamJitterSlots; i++) {
+        ok = ok && (receiver->slots[i].buffer = malloc(maxFrameSize)) != NULL;
+    }
+    if (transport == FrameStreamUDP) {
+        ok = ok && (receiver->datagram = malloc(kFrameStreamMaxDatagramBytes)) != NULL;
+    }
+    
+    receiver->socket = socket(AF_INET6, transport == FrameStreamTCP ? SOCK_STREAM : SOCK_DGRAM, 0);
+    ok = ok && receiver->socket >= 0;
+    
+    if (ok) {
+        int on = 1, off = 0, bufferBytes = kFrameStreamReceiveBufferBytes;
+        setsockopt(receiver->socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(receiver->socket, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        setsockopt(receiver->socket, SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes));
+        
+        struct sockaddr_in6 address;
+        socklen_t addressLength = sizeof(address);
+        memset(&address, 0, sizeof(address));
+        address.sin6_family = AF_INET6;
+        address.sin6_addr = in6addr_any;
+        address.sin6_port = htons(port);
+        
+        ok = bind(receiver->socket, (struct sockaddr *)&address, sizeof(address)) == 0
+            && (transport == FrameStreamUDP || listen(receiver->socket, 1) == 0)
+            && getsockname(receiver->socket, (struct sockaddr *)&address, &addressLength) == 0;
+        receiver->port = ntohs(address.sin6_port);
+    }
+    
+    if (!ok || pthread_create(&receiver->thread, NULL, ReceiveThread, receiver) != 0) {
+        FreeReceiver(receiver);
+        return NULL;
+    }
+    
+    return receiver;
+}
+
+uint16_t FrameReceiverPort(FrameReceiver *receiver)
+{
+    return receiver != NULL ? receiver->port : 0;
+}
+
+int FrameReceiverNextFrame(FrameReceiver *receiver, void *destination, size_t destinationBytes, uint32_t *size, int *width, int *height)
+{
+    if (receiver == NULL) {
+        return EINVAL;
+    }
+    
+    int64_t now = (int64_t)Nanoseconds();
+    int result = EAGAIN;
+    
+    pthread_mutex_lock(&receiver->lock);
+    
+    FrameStreamFrame *newest = NULL;
+    int i;
+    for (i = 0; i < kFrameStreamJitterSlots; i++) {
+        FrameStreamFrame *slot = &receiver->slots[i];
+        if (slot->used && (int64_t)(slot->timestamp * 1000) + receiver->minimumTransit + (int64_t)receiver->latency <= now
+            && (newest == NULL || slot->sequence > newest->sequence)) {
+            newest = slot;
+        }
+    }
+    
+    if (newest != NULL) {
+        *size = newest->size;
+        *width = newest->width;
+        *height = newest->height;
+        
+        if (newest->size > destinationBytes) {
+            result = ENOBUFS;
+        } else {
+            memcpy(destination, newest->buffer, newest->size);
+            result = 0;
+            
+            uint64_t skipped = receiver->skippedSinceDisplay;
+            for (i = 0; i < kFrameStreamJitterSlots; i++) {
+                FrameStreamFrame *slot = &receiver->slots[i];
+                if (slot->used && slot->sequence < newest->sequence) {
+                    slot->used = false;
+                    skipped++;
+                }
+            }
+            
+            if (receiver->displayedAny && newest->sequence - receiver->lastDisplayed - 1 > skipped) {
+                receiver->statistics.missing += newest->sequence - receiver->lastDisplayed - 1 - skipped;
+            }
+            receiver->statistics.skipped += skipped - receiver->skippedSinceDisplay;
+            receiver->statistics.displayed++;
+            receiver->skippedSinceDisplay = 0;
+            receiver->displayedAny = true;
+            receiver->lastDisplayed = newest->sequence;
+            newest->used = false;
+        }
+    }
+    
+    pthread_mutex_unlock(&receiver->lock);
+    
+    return result;
+}
+
+void FrameReceiverGetStatistics(FrameReceiver *receiver, FrameReceiverStatistics *statistics)
+{
+    pthread_mutex_lock(&receiver->lock);
+    *statistics = receiver->statistics;
+    pthread_mutex_unlock(&receiver->lock);
+}
+
+void FrameReceiverDestroy(FrameReceiver *receiver)
+{
+    if (receiver != NULL) {
+        receiver->stopping = true;
+        pthread_join(receiver->thread, NULL);
+        FreeReceiver(receiver);
+    }
+}
@@ -0,0 +1,70 @@
+//
+//  FrameStream.h
+//  HapMovieTexturePlugin
+//
+//  Sends and receives Hap frames over local sockets.
+//
+
+#ifndef HapMovieTexturePlugin_FrameStream_h
+#define HapMovieTexturePlugin_FrameStream_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ Each frame is preceded by a header giving its sequence number, the sender's timestamp for it, its dimensions
+ and its size. Over TCP a frame follows its header whole; over UDP it is split into fragments which each carry
+ the header with their offset in the frame, and a frame missing any fragment is lost.
+ */
+typedef enum {
+    FrameStreamTCP,
+    FrameStreamUDP
+} FrameStreamTransport;
+
+typedef struct FrameSender FrameSender;
+
+typedef struct FrameReceiver FrameReceiver;
+
+typedef struct {
+    uint64_t received;
+    uint64_t displayed;
+    uint64_t skipped;   // Received but superseded by a later frame, or pushed out of a full buffer
+    uint64_t late;      // Arrived after a later frame had been displayed
+    uint64_t missing;   // Never arrived whole
+} FrameReceiverStatistics;
+
+/*
+ Connects to a receiver on host and port. Returns NULL on failure.
+ */
+FrameSender *FrameSenderCreate(FrameStreamTransport transport, const char *host, uint16_t port);
+
+/*
+ Sends a Hap frame of width by height texels. timestamp is when it should be shown, in microseconds on any
+ clock of the sender's which advances in real time. Returns 0 or an errno value.
+ */
+int FrameSenderSend(FrameSender *sender, const void *frame, uint32_t size, int width, int height, uint64_t timestamp);
+
+void FrameSenderDestroy(FrameSender *sender);
+
+/*
+ Listens on port, or on a port chosen by the system if port is 0, and receives frames of up to maxFrameSize
+ bytes on a background thread. Each frame is held until latency microseconds after the least delayed frame
+ would have been due, so that variation in delivery up to latency is absorbed. A sender which reconnects over
+ TCP, or restarts its sequence over UDP, is shown from its first frame. Returns NULL on failure.
+ */
+FrameReceiver *FrameReceiverCreate(FrameStreamTransport transport, uint16_t port, uint32_t maxFrameSize, uint32_t latency);
+
+uint16_t FrameReceiverPort(FrameReceiver *receiver);
+
+/*
+ Copies the newest frame which is due into destination, skipping any older ones, and sets size, width and
+ height. Returns 0, EAGAIN if no new frame is due, or ENOBUFS if destinationBytes is too small.
+ */
+int FrameReceiverNextFrame(FrameReceiver *receiver, void *destination, size_t destinationBytes, uint32_t *size, int *width, int *height);
+
+void FrameReceiverGetStatistics(FrameReceiver *receiver, FrameReceiverStatistics *statistics);
+
+void FrameReceiverDestroy(FrameReceiver *receiver);
+
+#endif
@@ -0,0 +1,540 @@
+//
+//  MovieIndex.c
+//  HapMovieTexturePlugin
+//
+
+#include "MovieIndex.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include <libkern/OSByteOrder.h>
+
+#define kMovieIndexCacheMagic 0x48617049 // 'HapI'
+#define kMovieIndexCacheVersion 1
+
+#define FourCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+/*
+ The parts of a trak atom we need, gathered while walking it and then flattened into a MovieTrackIndex
+ */
+typedef struct {
+    uint32_t handler;
+    uint32_t timescale;
+    uint8_t *stsd, *stts, *stsc, *stsz, *stco, *co64;
+    uint32_t stsdSize, sttsSize, stscSize, stszSize, stcoSize, co64Size;
+} TrackAtoms;
+
+static int ReadAtomHeader(int fd, off_t offset, off_t end, off_t *outSize, uint32_t *outType, off_t *outHeaderSize)
+{
+    uint8_t buf[16];
+    
+    if (end - offset < 8 || pread(fd, buf, 8, offset) != 8) {
+        return -1;
+    }
+    
+    *outSize = OSReadBigInt32(buf, 0);
+    *outType = OSReadBigInt32(buf, 4);
+    *outHeaderSize = 8;
+    
+    if (*outSize == 1) {
+        // 64-bit size follows the type
+        if (end - offset < 16 || pread(fd, buf + 8, 8, offset + 8) != 8) {
+            return -1;
+        }
+        *outSize = (off_t)OSReadBigInt64(buf, 8);
+        *outHeaderSize = 16;
+    } else if (*outSize == 0) {
+        // Atom extends to the end of its container
+        *outSize = end - offset;
+    }
+    
+    if (*outSize < *outHeaderSize || offset + *outSize > end) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+static uint8_t *ReadAtomBody(int fd, off_t offset, off_t size, uint32_t *outSize)
+{
+    if (size > UINT32_MAX) {
+        return NULL;
+    }
+    
+    uint8_t *body = malloc(size > 0 ? size : 1);
+    if (body != NULL && pread(fd, body, size, offset) != size) {
+        free(body);
+        return NULL;
+    }
+    
+    *outSize = (uint32_t)size;
+    return body;
+}
+
+static void WalkTrack(int fd, off_t offset, off_t end, TrackAtoms *atoms)
+{
+    while (offset < end) {
+        off_t size, headerSize;
+        uint32_t type;
+        
+        if (ReadAtomHeader(fd, offset, end, &size, &type, &headerSize) != 0) {
+            return;
+        }
+        
+        off_t body = offset + headerSize;
+        uint8_t buf[24];
+        
+        switch (type) {
+            case FourCC('m', 'd', 'i', 'a'):
+            case FourCC('m', 'i', 'n', 'f'):
+            case FourCC('s', 't', 'b', 'l'):
+                WalkTrack(fd, body, offset + size, atoms);
+                break;
+            case FourCC('m', 'd', 'h', 'd'):
+                if (pread(fd, buf, 24, body) == 24) {
+                    // Version 1 media headers use 64-bit times ahead of the timescale
+                    atoms->timescale = buf[0] == 1 ? OSReadBigInt32(buf, 20) : OSReadBigInt32(buf, 12);
+                }
+                break;
+            case FourCC('h', 'd', 'l', 'r'):
+                // Only the media handler says what the track is; QuickTime also has a data handler in minf
+                if (pread(fd, buf, 12, body) == 12 && OSReadBigInt32(buf, 4) != FourCC('d', 'h', 'l', 'r')) {
+                    atoms->handler = OSReadBigInt32(buf, 8);
+                }
+                break;
+            case FourCC('s', 't', 's', 'd'):
+                atoms->stsd = ReadAtomBody(fd, body, size - headerSize, &atoms->stsdSize);
+                break;
+            case FourCC('s', 't', 't', 's'):
+                atoms->stts = ReadAtomBody(fd, body, size - headerSize, &atoms->sttsSize);
+                break;
+            case FourCC('s', 't', 's', 'c'):
+                atoms->stsc = ReadAtomBody(fd, body, size - headerSize, &atoms->stscSize);
+                break;
+            case FourCC('s', 't', 's', 'z'):
+                atoms->stsz = ReadAtomBody(fd, body, size - headerSize, &atoms->stszSize);
+                break;
+            case FourCC('s', 't', 'c', 'o'):
+                atoms->stco = ReadAtomBody(fd, body, size - headerSize, &atoms->stcoSize);
+                break;
+            case FourCC('c', 'o', '6', '4'):
+                atoms->co64 = ReadAtomBody(fd, body, size - headerSize, &atoms->co64Size);
+                break;
+            default:
+                break;
+        }
+        
+        offset += size;
+    }
+}
+
+static void FreeTrackAtoms(TrackAtoms *atoms)
+{
+    free(atoms->stsd);
+    free(atoms->stts);
+    free(atoms->stsc);
+    free(atoms->stsz);
+    free(atoms->stco);
+    free(atoms->co64);
+}
+
+/*
+ Resolves the sample-to-chunk, chunk offset and sample size tables into a per-frame offset and size
+ */
+static int BuildTrackIndex(const TrackAtoms *atoms, MovieTrackIndex *track)
+{
+    if (atoms->handler != FourCC('v', 'i', 'd', 'e') || atoms->stsd == NULL || atoms->stsz == NULL || atoms->stsc == NULL
+        || (atoms->stco == NULL && atoms->co64 == NULL)) {
+        return -1;
+    }
+    
+    // The first sample description carries the codec and the frame dimensions
+    if (atoms->stsdSize < 8 + 36 || OSReadBigInt32(atoms->stsd, 4) < 1) {
+        return -1;
+    }
+    track->codec = OSReadBigInt32(atoms->stsd, 12);
+    track->width = OSReadBigInt16(atoms->stsd, 8 + 32);
+    track->height = OSReadBigInt16(atoms->stsd, 8 + 34);
+    
+    if (track->codec != FourCC('H', 'a', 'p', '1') && track->codec != FourCC('H', 'a', 'p', '5') && track->codec != FourCC('H', 'a', 'p', 'Y')) {
+        return -1;
+    }
+    
+    track->timescale = atoms->timescale;
+    if (atoms->stts != NULL && atoms->sttsSize >= 16 && OSReadBigInt32(atoms->stts, 4) > 0) {
+        track->frameDuration = OSReadBigInt32(atoms->stts, 12);
+    }
+    
+    if (atoms->stszSize < 12) {
+        return -1;
+    }
+    uint32_t uniformSize = OSReadBigInt32(atoms->stsz, 4);
+    uint32_t sampleCount = OSReadBigInt32(atoms->stsz, 8);
+    if (uniformSize == 0 && atoms->stszSize < 12 + (uint64_t)sampleCount * 4) {
+        return -1;
+    }
+    
+    const uint8_t *offsets = atoms->co64 ? atoms->co64 : atoms->stco;
+    uint32_t offsetsSize = atoms->co64 ? atoms->co64Size : atoms->stcoSize;
+    int offsetWidth = atoms->co64 ? 8 : 4;
+    if (offsetsSize < 8) {
+        return -1;
+    }
+    uint32_t chunkCount = OSReadBigInt32(offsets, 4);
+    if (offsetsSize < 8 + (uint64_t)chunkCount * offsetWidth) {
+        return -1;
+    }
+    
+    if (atoms->stscSize < 8) {
+        return -1;
+    }
+    uint32_t stscCount = OSReadBigInt32(atoms->stsc, 4);
+    if (atoms->stscSize < 8 + (uint64_t)stscCount * 12) {
+        return -1;
+    }
+    
+    track->frameOffsets = malloc(sizeof(off_t) * (sampleCount > 0 ? sampleCount : 1));
+    track->frameSizes = malloc(sizeof(uint32_t) * (sampleCount > 0 ? sampleCount : 1));
+    if (track->frameOffsets == NULL || track->frameSizes == NULL) {
+        return -1;
+    }
+    
+    uint32_t sample = 0, entry = 0, chunk;
+    for (chunk = 1; chunk <= chunkCount && sample < sampleCount; chunk++) {
+        while (entry + 1 < stscCount && OSReadBigInt32(atoms->stsc, 8 + (entry + 1) * 12) <= chunk) {
+            entry++;
+        }
+        uint32_t samplesPerChunk = stscCount > 0 ? OSReadBigInt32(atoms->stsc, 8 + entry * 12 + 4) : 1;
+        
+        off_t offset = offsetWidth == 8 ? (off_t)OSReadBigInt64(offsets, 8 + (chunk - 1) * 8) : OSReadBigInt32(offsets, 8 + (chunk - 1) * 4);
+        
+        uint32_t i;
+        for (i = 0; i < samplesPerChunk && sample < sampleCount; i++, sample++) {
+            uint32_t size = uniformSize ? uniformSize : OSReadBigInt32(atoms->stsz, 12 + sample * 4);
+            
+            track->frameOffsets[sample] = offset;
+            track->frameSizes[sample] = size;
+            if (size > track->maxFrameSize) {
+                track->maxFrameSize = size;
+            }
+            
+            offset += size;
+        }
+    }
+    
+    track->frameCount = sample;
+    
+    return track->frameCount > 0 ? 0 : -1;
+}
+
+static void FreeTrackIndex(MovieTrackIndex *track)
+{
+    free(track->frameOffsets);
+    free(track->frameSizes);
+    memset(track, 0, sizeof(MovieTrackIndex));
+}
+
+static int CompareTracksBySize(const void *a, const void *b)
+{
+    const MovieTrackIndex *x = a, *y = b;
+    return y->width * y->height - x->width * x->height;
+}
+
+int MovieIndexRead(FILE *file, MovieIndex *index)
+{
+    int fd = fileno(file);
+    off_t end = lseek(fd, 0, SEEK_END);
+    off_t offset = 0;
+    
+    memset(index, 0, sizeof(MovieIndex));
+    
+    // Find the moov atom at the top level
+    while (offset < end) {
+        off_t size, headerSize;
+        uint32_t type;
+        
+        if (ReadAtomHeader(fd, offset, end, &size, &type, &headerSize) != 0) {
+            break;
+        }
+        
+        if (type == FourCC('m', 'o', 'o', 'v')) {
+            off_t trakOffset = offset + headerSize;
+            off_t moovEnd = offset + size;
+            
+            while (trakOffset < moovEnd && index->trackCount < kMovieIndexMaxTracks) {
+                if (ReadAtomHeader(fd, trakOffset, moovEnd, &size, &type, &headerSize) != 0) {
+                    break;
+                }
+                
+                if (type == FourCC('t', 'r', 'a', 'k')) {
+                    TrackAtoms atoms;
+                    memset(&atoms, 0, sizeof(TrackAtoms));
+                    
+                    WalkTrack(fd, trakOffset + headerSize, trakOffset + size, &atoms);
+                    
+                    if (BuildTrackIndex(&atoms, &index->tracks[index->trackCount]) == 0) {
+                        index->trackCount++;
+                    } else {
+                        FreeTrackIndex(&index->tracks[index->trackCount]);
+                    }
+                    
+                    FreeTrackAtoms(&atoms);
+                }
+                
+                trakOffset += size;
+            }
+            break;
+        }
+        
+        offset += size;
+    }
+    
+    qsort(index->tracks, index->trackCount, sizeof(MovieTrackIndex), CompareTracksBySize);
+    
+    return index->trackCount > 0 ? 0 : -1;
+}
+
+void MovieIndexFree(MovieIndex *index)
+{
+    int i;
+    for (i = 0; i < index->trackCount; i++) {
+        FreeTrackIndex(&index->tracks[i]);
+    }
+    index->trackCount = 0;
+}
+
+size_t MovieTrackDecodedSize(const MovieTrackIndex *track)
+{
+    size_t blocks = (size_t)((track->width + 3) / 4) * ((track->height + 3) / 4);
+    
+    return blocks * (track->codec == FourCC('H', 'a', 'p', '1') ? 8 : 16);
+}
+
+/*
+ Cache files are named after a hash of the movie's path and identity, and start with enough about the movie
+ to tell whether it has changed since the index was written
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fileSize;
+    int64_t modificationSeconds;
+    int64_t modificationNanoseconds;
+    uint32_t pathHash;
+    int32_t trackCount;
+} MovieIndexCacheHeader;
+
+typedef struct {
+    uint32_t codec;
+    int32_t width, height;
+    uint32_t timescale;
+    uint32_t frameDuration;
+    int32_t frameCount;
+    uint32_t maxFrameSize;
+} MovieIndexCacheTrack;
+
+static uint32_t HashPath(const char *path)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    while (*path) {
+        hash = (hash ^ (uint8_t)*path++) * 16777619U;
+    }
+    return hash;
+}
+
+static int CachePath(const char *path, const struct stat *st, char *outPath, size_t outPathSize)
+{
+    char directory[PATH_MAX];
+    
+#if defined(_CS_DARWIN_USER_CACHE_DIR)
+    if (confstr(_CS_DARWIN_USER_CACHE_DIR, directory, sizeof(directory)) == 0) {
+        return -1;
+    }
+#else
+    const char *tmp = getenv("TMPDIR");
+    snprintf(directory, sizeof(directory), "%s/", tmp ? tmp : "/tmp");
+#endif
+    
+    strlcat(directory, "HapMovieTexture", sizeof(directory));
+    mkdir(directory, 0755);
+    
+    int length = snprintf(outPath, outPathSize, "%s/%08x-%llx.index", directory, HashPath(path), (unsigned long long)st->st_ino);
+    
+    return length > 0 && (size_t)length < outPathSize ? 0 : -1;
+}
+
+static void FillCacheHeader(const char *path, const struct stat *st, MovieIndexCacheHeader *header)
+{
+    memset(header, 0, sizeof(MovieIndexCacheHeader));
+    header->magic = kMovieIndexCacheMagic;
+    header->version = kMovieIndexCacheVersion;
+    header->fileSize = st->st_size;
+#if defined(__APPLE__)
+    header->modificationSeconds = st->st_mtimespec.tv_sec;
+    header->modificationNanoseconds = st->st_mtimespec.tv_nsec;
+#else
+    header->modificationSeconds = st->st_mtim.tv_sec;
+    header->modificationNanoseconds = st->st_mtim.tv_nsec;
+#endif
+    header->pathHash = HashPath(path);
+}
+
+static int LoadCachedIndex(const char *cachePath, const MovieIndexCacheHeader *expected, MovieIndex *index)
+{
+    FILE *cache = fopen(cachePath, "rb");
+    if (cache == NULL) {
+        return -1;
+    }
+    
+    MovieIndexCacheHeader header;
+    int result = -1;
+    
+    memset(index, 0, sizeof(MovieIndex));
+    
+    if (fread(&header, sizeof(header), 1, cache) == 1
+        && header.magic == expected->magic
+        && header.version == expected->version
+        && header.fileSize == expected->fileSize
+        && header.modificationSeconds == expected->modificationSeconds
+        && header.modificationNanoseconds == expected->modificationNanoseconds
+        && header.pathHash == expected->pathHash
+        && header.trackCount > 0 && header.trackCount <= kMovieIndexMaxTracks) {
+        result = 0;
+        
+        int i;
+        for (i = 0; i < header.trackCount && result == 0; i++) {
+            MovieIndexCacheTrack cached;
+            MovieTrackIndex *track = &index->tracks[i];
+            
+            if (fread(&cached, sizeof(cached), 1, cache) != 1 || cached.frameCount <= 0) {
+                result = -1;
+                break;
+            }
+            
+            track->codec = cached.codec;
+            track->width = cached.width;
+            track->height = cached.height;
+            track->timescale = cached.timescale;
+            track->frameDuration = cached.frameDuration;
+            track->frameCount = cached.frameCount;
+            track->frameOffsets = malloc(sizeof(off_t) * cached.frameCount);
+            track->frameSizes = malloc(sizeof(uint32_t) * cached.frameCount);
+            index->trackCount = i + 1;
+            
+            if (track->frameOffsets == NULL || track->frameSizes == NULL
+                || fread(track->frameOffsets, sizeof(off_t), cached.frameCount, cache) != (size_t)cached.frameCount
+                || fread(track->frameSizes, sizeof(uint32_t), cached.frameCount, cache) != (size_t)cached.frameCount) {
+                result = -1;
+                break;
+            }
+            
+            /*
+             Frames are read straight from these offsets and into buffers of maxFrameSize, so a damaged cache must
+             not be able to point outside the file or understate the largest frame
+             */
+            track->maxFrameSize = 0;
+            int frame;
+            for (frame = 0; frame < cached.frameCount; frame++) {
+                off_t offset = track->frameOffsets[frame];
+                uint32_t size = track->frameSizes[frame];
+                
+                if (offset < 0 || (uint64_t)offset > header.fileSize || size > header.fileSize - (uint64_t)offset) {
+                    result = -1;
+                    break;
+                }
+                if (size > track->maxFrameSize) {
+                    track->maxFrameSize = size;
+                }
+            }
+        }
+    }
+    
+    fclose(cache);
+    
+    if (result != 0) {
+        MovieIndexFree(index);
+    }
+    
+    return result;
+}
+
+static void StoreCachedIndex(const char *cachePath, const MovieIndexCacheHeader *header, const MovieIndex *index)
+{
+    // Write to a temporary file and rename it into place so a reader never sees a partial index
+    // The name is unique, as movies may be opened in parallel by several threads of one process
+    char temporaryPath[PATH_MAX];
+    int length = snprintf(temporaryPath, sizeof(temporaryPath), "%s.XXXXXX", cachePath);
+    if (length < 0 || (size_t)length >= sizeof(temporaryPath)) {
+        return;
+    }
+    
+    int descriptor = mkstemp(temporaryPath);
+    if (descriptor < 0) {
+        return;
+    }
+    
+    FILE *cache = fdopen(descriptor, "wb");
+    if (cache == NULL) {
+        close(descriptor);
+        unlink(temporaryPath);
+        return;
+    }
+    
+    MovieIndexCacheHeader stored = *header;
+    stored.trackCount = index->trackCount;
+    
+    int ok = fwrite(&stored, sizeof(stored), 1, cache) == 1;
+    
+    int i;
+    for (i = 0; i < index->trackCount && ok; i++) {
+        const MovieTrackIndex *track = &index->tracks[i];
+        MovieIndexCacheTrack cached;
+        
+        memset(&cached, 0, sizeof(cached));
+        cached.codec = track->codec;
+        cached.width = track->width;
+        cached.height = track->height;
+        cached.timescale = track->timescale;
+        cached.frameDuration = track->frameDuration;
+        cached.frameCount = track->frameCount;
+        cached.maxFrameSize = track->maxFrameSize;
+        
+        ok = fwrite(&cached, sizeof(cached), 1, cache) == 1
+            && fwrite(track->frameOffsets, sizeof(off_t), track->frameCount, cache) == (size_t)track->frameCount
+            && fwrite(track->frameSizes, sizeof(uint32_t), track->frameCount, cache) == (size_t)track->frameCount;
+    }
+    
+    if (fclose(cache) != 0 || !ok || rename(temporaryPath, cachePath) != 0) {
+        unlink(temporaryPath);
+    }
+}
+
+int MovieIndexReadCached(FILE *file, const char *path, MovieIndex *index)
+{
+    struct stat st;
+    char cachePath[PATH_MAX];
+    MovieIndexCacheHeader header;
+    
+    if (fstat(fileno(file), &st) != 0 || CachePath(path, &st, cachePath, sizeof(cachePath)) != 0) {
+        return MovieIndexRead(file, index);
+    }
+    
+    FillCacheHeader(path, &st, &header);
+    
+    if (LoadCachedIndex(cachePath, &header, index) == 0) {
+        return 0;
+    }
+    
+    if (MovieIndexRead(file, index) != 0) {
+        return -1;
+    }
+    
+    StoreCachedIndex(cachePath, &header, index);
+    
+    return 0;
+}
@@ -0,0 +1,57 @@
+//
+//  MovieIndex.h
+//  HapMovieTexturePlugin
+//
+
+#ifndef HapMovieTexturePlugin_MovieIndex_h
+#define HapMovieTexturePlugin_MovieIndex_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define kMovieIndexMaxTracks 4
+
+/*
+ The sample table of one Hap video track, flattened so that the file offset and size of any frame can be
+ found without touching the file.
+ */
+typedef struct {
+    uint32_t codec;
+    int width, height;
+    
+    uint32_t timescale;
+    uint32_t frameDuration;
+    
+    int frameCount;
+    off_t *frameOffsets;
+    uint32_t *frameSizes;
+    uint32_t maxFrameSize;
+} MovieTrackIndex;
+
+typedef struct {
+    int trackCount;
+    MovieTrackIndex tracks[kMovieIndexMaxTracks];
+} MovieIndex;
+
+/*
+ Reads the moov atom of the QuickTime movie open as file and fills index with every Hap video track it finds,
+ largest first. Returns 0 on success or -1 if the file is not a movie or has no Hap track.
+ */
+int MovieIndexRead(FILE *file, MovieIndex *index);
+
+void MovieIndexFree(MovieIndex *index);
+
+/*
+ As MovieIndexRead, but first tries an index persisted in the user's cache directory for the movie at path,
+ which is only used if the movie's size and modification date still match. Indexes read from the movie are
+ written back to the cache.
+ */
+int MovieIndexReadCached(FILE *file, const char *path, MovieIndex *index);
+
+/*
+ Returns the size of a decoded frame of track, which depends on the codec and dimensions.
+ */
+size_t MovieTrackDecodedSize(const MovieTrackIndex *track);
+
+#endif
@@ -0,0 +1,679 @@
+//
+//  MovieTools.c
+//  HapMovieTexturePlugin
+//
+//  Offline tools which rewrite Hap movies. These are plain C entry points so that editor scripts can call
+//  them through the plugin as well as the player.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/sysctl.h>
+
+#include <libkern/OSByteOrder.h>
+
+#include "hap.h"
+#include "MovieIndex.h"
+#include "MovieWriter.h"
+#include "Parallel.h"
+#include "DXT.h"
+#include "MovieTools.h"
+
+#define FourCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+// Snappy compresses in independent 64KB blocks, so chunks at least this large lose almost nothing in ratio
+#define kChunkMinimumBytes (64 * 1024)
+#define kChunkMaximumCount 64
+#define kChunkDefaultCacheBytes (256 * 1024)
+
+// Rough per-core rates for Snappy decompression and memcpy, used to model decoding time
+#define kSnappyDecompressBytesPerSecond 1.5e9
+#define kCopyBytesPerSecond 6.0e9
+
+/*
+ A movie opened for reading by a tool, with buffers for one compressed and one decoded frame
+ */
+typedef struct {
+    FILE *file;
+    MovieIndex index;
+    MovieTrackIndex *track;
+    
+    uint8_t *frameBuffer;
+    uint8_t *decodedBuffer;
+    size_t decodedSize;
+} ToolMovie;
+
+static int OpenToolMovie(const char *path, ToolMovie *movie)
+{
+    memset(movie, 0, sizeof(ToolMovie));
+    
+    movie->file = fopen(path, "r");
+    if (movie->file == NULL) {
+        return errno;
+    }
+    
+    if (MovieIndexRead(movie->file, &movie->index) != 0) {
+        fclose(movie->file);
+        movie->file = NULL;
+        return EFTYPE;
+    }
+    
+    movie->track = &movie->index.tracks[0];
+    movie->decodedSize = MovieTrackDecodedSize(movie->track);
+    movie->frameBuffer = malloc(movie->track->maxFrameSize);
+    movie->decodedBuffer = malloc(movie->decodedSize);
+    
+    if (movie->frameBuffer == NULL || movie->decodedBuffer == NULL) {
+        return ENOMEM;
+    }
+    
+    return 0;
+}
+
+static void CloseToolMovie(ToolMovie *movie)
+{
+    if (movie->file != NULL) {
+        fclose(movie->file);
+    }
+    MovieIndexFree(&movie->index);
+    
+    free(movie->frameBuffer);
+    free(movie->decodedBuffer);
+}
+
+/*
+ Decodes frame of the movie into decodedBuffer, setting the frame's texture format and decoded length
+ */
+static int DecodeToolFrame(ToolMovie *movie, int frame, unsigned int *outTextureFormat, unsigned long *outSize)
+{
+    uint32_t size = movie->track->frameSizes[frame];
+    
+    if (pread(fileno(movie->file), movie->frameBuffer, size, movie->track->frameOffsets[frame]) != size) {
+        return EIO;
+    }
+    
+    if (HapDecode(movie->frameBuffer, size, ParallelHapCallback, NULL, movie->decodedBuffer, movie->decodedSize, outSize, outTextureFormat) != HapResult_No_Error) {
+        return EFTYPE;
+    }
+    
+    return 0;
+}
+
+// The length in bytes of one row of S3TC blocks
+static unsigned long BlockRowBytes(const MovieTrackIndex *track)
+{
+    return (unsigned long)((track->width + 3) / 4) * (track->codec == FourCC('H', 'a', 'p', '1') ? 8 : 16);
+}
+
+/*
+ The inputs to the chunk count model and the count it chose, kept so that AnalyzeMovie can report them
+ */
+typedef struct {
+    unsigned int threads;
+    unsigned long cacheBytes;
+    unsigned long targetChunkBytes;
+    unsigned long blockRows;
+    unsigned int chunkCount;
+} ChunkPlan;
+
+/*
+ Chooses a chunk count for frames height texels high decoding to decodedSize bytes. Each chunk aims to fit in half
+ of a core's L2 cache, leaving the other half for its compressed input, so a decoding thread never spills
+ the chunk it is writing. There are at least as many chunks as decoding threads, rounded up to a multiple of
+ them so every thread gets the same share, but never so many that chunks fall below kChunkMinimumBytes
+ or split a row of blocks.
+ */
+static void PlanChunks(int height, unsigned long decodedSize, ChunkPlan *plan)
+{
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    plan->threads = online > 0 ? (unsigned int)online : 1;
+    
+    uint64_t cacheBytes = 0;
+    size_t length = sizeof(cacheBytes);
+    if (sysctlbyname("hw.l2cachesize", &cacheBytes, &length, NULL, 0) != 0 || cacheBytes == 0) {
+        cacheBytes = kChunkDefaultCacheBytes;
+    }
+    plan->cacheBytes = (unsigned long)cacheBytes;
+    plan->targetChunkBytes = plan->cacheBytes / 2;
+    plan->blockRows = (unsigned long)(height + 3) / 4;
+    
+    unsigned long count = (decodedSize + plan->targetChunkBytes - 1) / plan->targetChunkBytes;
+    if (count < plan->threads) {
+        count = plan->threads;
+    }
+    count = (count + plan->threads - 1) / plan->threads * plan->threads;
+    
+    unsigned long limit = decodedSize / kChunkMinimumBytes;
+    if (limit > plan->blockRows) {
+        limit = plan->blockRows;
+    }
+    if (limit > kChunkMaximumCount) {
+        limit = kChunkMaximumCount;
+    }
+    if (count > limit) {
+        count = limit;
+    }
+    
+    plan->chunkCount = count > 0 ? (unsigned int)count : 1;
+}
+
+unsigned int PlanChunkCount(int height, unsigned long decodedSize)
+{
+    ChunkPlan plan;
+    PlanChunks(height, decodedSize, &plan);
+    
+    return plan.chunkCount;
+}
+
+/*
+ Writes the open movie to destinationPath, re-encoding every frame as chunkCount row-aligned chunks, or a
+ number chosen by PlanChunks if chunkCount is 0. If toDXT1 is true, DXT5 frames are written as DXT1 with
+ DXT5ToDXT1(). model is passed to HapEncodeChunks if storageBytesPerSecond is greater than 0.
+ */
+static int WriteToolMovie(ToolMovie *movie, const char *destinationPath, int chunkCount, double storageBytesPerSecond, bool toDXT1)
+{
+    MovieTrackIndex *track = movie->track;
+    ChunkPlan plan;
+    unsigned long outputSize = toDXT1 ? movie->decodedSize / 2 : movie->decodedSize;
+    unsigned long rowBytes = toDXT1 ? BlockRowBytes(track) / 2 : BlockRowBytes(track);
+    
+    PlanChunks(track->height, outputSize, &plan);
+    if (chunkCount == 0) {
+        chunkCount = plan.chunkCount;
+    } else if (chunkCount < 1) {
+        chunkCount = 1;
+    }
+    
+    HapCompressionModel model = {
+        storageBytesPerSecond,
+        kSnappyDecompressBytesPerSecond * plan.threads,
+        kCopyBytesPerSecond * plan.threads
+    };
+    
+    int result = 0;
+    unsigned long encodedCapacity = HapMaxEncodedLengthForChunks(outputSize, chunkCount);
+    uint8_t *encoded = malloc(encodedCapacity);
+    uint8_t *transcoded = toDXT1 ? malloc(outputSize) : NULL;
+    MovieWriter *writer = MovieWriterCreate(destinationPath);
+    
+    if (encoded == NULL || (toDXT1 && transcoded == NULL)) {
+        result = ENOMEM;
+    } else if (writer == NULL) {
+        result = errno;
+    } else if (MovieWriterAddTrack(writer, toDXT1 ? FourCC('H', 'a', 'p', '1') : track->codec,
+                                   track->width, track->height, track->timescale, track->frameDuration) != 0) {
+        result = EINVAL;
+    }
+    
+    int frame;
+    for (frame = 0; frame < track->frameCount && result == 0; frame++) {
+        unsigned int textureFormat;
+        unsigned long decodedSize, encodedSize;
+        const uint8_t *texture = movie->decodedBuffer;
+        
+        result = DecodeToolFrame(movie, frame, &textureFormat, &decodedSize);
+        if (result != 0) {
+            break;
+        }
+        
+        if (toDXT1) {
+            DXT5ToDXT1(movie->decodedBuffer, decodedSize, transcoded);
+            texture = transcoded;
+            decodedSize /= 2;
+            textureFormat = HapTextureFormat_RGB_DXT1;
+        }
+        
+        if (HapEncodeChunks(texture, decodedSize, textureFormat, HapCompressorSnappy, chunkCount, rowBytes,
+                            storageBytesPerSecond > 0.0 ? &model : NULL, ParallelHapCallback, NULL, encoded, encodedCapacity, &encodedSize) != HapResult_No_Error) {
+            result = EINVAL;
+            break;
+        }
+        
+        if (MovieWriterAppendFrame(writer, 0, encoded, (uint32_t)encodedSize) != 0) {
+            result = EIO;
+        }
+    }
+    
+    if (writer != NULL) {
+        if (result == 0) {
+            result = MovieWriterFinish(writer) == 0 ? 0 : EIO;
+        } else {
+            MovieWriterCancel(writer);
+        }
+    }
+    
+    free(encoded);
+    free(transcoded);
+    
+    return result;
+}
+
+/*
+ Rewrites the movie at sourcePath to destinationPath with every frame split into chunkCount row-aligned
+ chunks, so that it can be decoded on several cores. The S3TC data is only re-split and recompressed with
+ Snappy, never re-encoded, so the result is identical in quality. Only the first Hap track is written.
+ If chunkCount is 0 the count is chosen by PlanChunks.
+ If storageBytesPerSecond is greater than 0 each chunk is only compressed if reading and decompressing it
+ from storage of that bandwidth is predicted to be quicker than reading it uncompressed, using decoding rates
+ for this machine's cores. Otherwise chunks are compressed whenever that makes them smaller.
+ Returns 0 or an errno value.
+ */
+int RechunkMovieForStorage(const char *sourcePath, const char *destinationPath, int chunkCount, double storageBytesPerSecond)
+{
+    ToolMovie movie;
+    int result = OpenToolMovie(sourcePath, &movie);
+    if (result == 0) {
+        result = WriteToolMovie(&movie, destinationPath, chunkCount, storageBytesPerSecond, false);
+    }
+    
+    CloseToolMovie(&movie);
+    
+    return result;
+}
+
+int RechunkMovie(const char *sourcePath, const char *destinationPath, int chunkCount)
+{
+    return RechunkMovieForStorage(sourcePath, destinationPath, chunkCount, 0.0);
+}
+
+/*
+ Checks whether every frame of a Hap Alpha track is fully opaque, setting the first frame which is not, or -1
+ */
+static int FindTranslucentFrame(ToolMovie *movie, int *outFrame)
+{
+    *outFrame = -1;
+    
+    int frame;
+    for (frame = 0; frame < movie->track->frameCount; frame++) {
+        unsigned int textureFormat;
+        unsigned long decodedSize;
+        
+        int result = DecodeToolFrame(movie, frame, &textureFormat, &decodedSize);
+        if (result != 0) {
+            return result;
+        }
+        
+        if (textureFormat != HapTextureFormat_RGBA_DXT5 || !DXT5IsOpaque(movie->decodedBuffer, decodedSize)) {
+            *outFrame = frame;
+            break;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ Rewrites a Hap Alpha movie whose alpha is opaque in every frame as Hap, halving its decoded size. Colour
+ blocks are carried over exactly, so the result decodes to the same pixels. Returns EFTYPE if the movie is
+ not Hap Alpha, EINVAL if any texel of any frame may not be opaque, or another errno value on failure.
+ */
+int TranscodeMovieToDXT1(const char *sourcePath, const char *destinationPath, int chunkCount)
+{
+    ToolMovie movie;
+    int result = OpenToolMovie(sourcePath, &movie);
+    
+    if (result == 0 && movie.track->codec != FourCC('H', 'a', 'p', '5')) {
+        result = EFTYPE;
+    }
+    
+    int translucentFrame;
+    if (result == 0) {
+        result = FindTranslucentFrame(&movie, &translucentFrame);
+    }
+    if (result == 0 && translucentFrame != -1) {
+        result = EINVAL;
+    }
+    
+    if (result == 0) {
+        result = WriteToolMovie(&movie, destinationPath, chunkCount, 0.0, true);
+    }
+    
+    CloseToolMovie(&movie);
+    
+    return result;
+}
+
+/*
+ Writes the movie at sourcePath to destinationPath with its frames copied unchanged, followed by a second
+ track at half the width and height made by DXTDownsample(). MovieIndexRead sorts the larger track first, so
+ players see the original as the first track and the proxy as the second. Hap Q movies are not supported
+ because their scaled colour can not be filtered in the block domain. Returns 0 or an errno value.
+ */
+int AddProxyTrack(const char *sourcePath, const char *destinationPath)
+{
+    ToolMovie movie;
+    int result = OpenToolMovie(sourcePath, &movie);
+    if (result != 0) {
+        CloseToolMovie(&movie);
+        return result;
+    }
+    
+    MovieTrackIndex *track = movie.track;
+    bool dxt5 = track->codec == FourCC('H', 'a', 'p', '5');
+    if (!dxt5 && track->codec != FourCC('H', 'a', 'p', '1')) {
+        CloseToolMovie(&movie);
+        return EFTYPE;
+    }
+    
+    int proxyWidth = (track->width + 1) / 2, proxyHeight = (track->height + 1) / 2;
+    unsigned long proxyRowBytes = (unsigned long)((proxyWidth + 3) / 4) * (dxt5 ? kDXT5BlockBytes : kDXT1BlockBytes);
+    unsigned long proxySize = proxyRowBytes * ((proxyHeight + 3) / 4);
+    
+    ChunkPlan plan;
+    PlanChunks(proxyHeight, proxySize, &plan);
+    
+    unsigned long encodedCapacity = HapMaxEncodedLengthForChunks(proxySize, plan.chunkCount);
+    uint8_t *encoded = malloc(encodedCapacity);
+    uint8_t *proxy = malloc(proxySize);
+    MovieWriter *writer = MovieWriterCreate(destinationPath);
+    
+    if (encoded == NULL || proxy == NULL) {
+        result = ENOMEM;
+    } else if (writer == NULL) {
+        result = errno;
+    } else if (MovieWriterAddTrack(writer, track->codec, track->width, track->height, track->timescale, track->frameDuration) != 0
+               || MovieWriterAddTrack(writer, track->codec, proxyWidth, proxyHeight, track->timescale, track->frameDuration) != 1) {
+        result = EINVAL;
+    }
+    
+    int frame;
+    for (frame = 0; frame < track->frameCount && result == 0; frame++) {
+        unsigned int textureFormat;
+        unsigned long decodedSize, encodedSize;
+        
+        // DecodeToolFrame leaves the compressed frame in frameBuffer, which is copied as it is
+        result = DecodeToolFrame(&movie, frame, &textureFormat, &decodedSize);
+        if (result != 0) {
+            break;
+        }
+        if (MovieWriterAppendFrame(writer, 0, movie.frameBuffer, track->frameSizes[frame]) != 0) {
+            result = EIO;
+            break;
+        }
+        
+        DXTDownsample(movie.decodedBuffer, track->width, track->height, dxt5, proxy, proxyWidth, proxyHeight);
+        
+        if (HapEncodeChunks(proxy, proxySize, textureFormat, HapCompressorSnappy, plan.chunkCount, proxyRowBytes,
+                            NULL, ParallelHapCallback, NULL, encoded, encodedCapacity, &encodedSize) != HapResult_No_Error) {
+            result = EINVAL;
+            break;
+        }
+        if (MovieWriterAppendFrame(writer, 1, encoded, (uint32_t)encodedSize) != 0) {
+            result = EIO;
+        }
+    }
+    
+    if (writer != NULL) {
+        if (result == 0) {
+            result = MovieWriterFinish(writer) == 0 ? 0 : EIO;
+        } else {
+            MovieWriterCancel(writer);
+        }
+    }
+    
+    free(encoded);
+    free(proxy);
+    CloseToolMovie(&movie);
+    
+    return result;
+}
+
+/*
+ Writes a sidecar movie to sidecarPath holding the mipmap levels of every frame of the movie at sourcePath.
+ Each sample of its single track holds levels 1 to n in order, down to 1x1, each as a four-byte big-endian
+ length followed by a Hap frame. Each level is made from the one above by DXTDownsample(), so the sidecar adds
+ about a third to the movie's size and bandwidth. The track has the codec of the source and the dimensions
+ of level 1. Hap Q movies are not supported. Returns 0 or an errno value.
+ */
+int WriteMipmapSidecar(const char *sourcePath, const char *sidecarPath)
+{
+    ToolMovie movie;
+    int result = OpenToolMovie(sourcePath, &movie);
+    if (result != 0) {
+        CloseToolMovie(&movie);
+        return result;
+    }
+    
+    MovieTrackIndex *track = movie.track;
+    bool dxt5 = track->codec == FourCC('H', 'a', 'p', '5');
+    if ((!dxt5 && track->codec != FourCC('H', 'a', 'p', '1')) || (track->width < 2 && track->height < 2)) {
+        CloseToolMovie(&movie);
+        return EFTYPE;
+    }
+    
+    size_t blockBytes = dxt5 ? kDXT5BlockBytes : kDXT1BlockBytes;
+    int level1Width = track->width > 1 ? track->width / 2 : 1, level1Height = track->height > 1 ? track->height / 2 : 1;
+    unsigned long level1Size = (unsigned long)((level1Width + 3) / 4) * ((level1Height + 3) / 4) * blockBytes;
+    
+    // Every level's worst-case encoded length, with the chunk counts PlanChunks gives at each size
+    unsigned long sampleCapacity = 0;
+    int width = level1Width, height = level1Height;
+    while (true) {
+        unsigned long size = (unsigned long)((width + 3) / 4) * ((height + 3) / 4) * blockBytes;
+        ChunkPlan plan;
+        PlanChunks(height, size, &plan);
+        sampleCapacity += 4 + HapMaxEncodedLengthForChunks(size, plan.chunkCount);
+        
+        if (width == 1 && height == 1) {
+            break;
+        }
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    
+    uint8_t *levels[2] = { malloc(level1Size), malloc(level1Size) };
+    uint8_t *sample = malloc(sampleCapacity);
+    MovieWriter *writer = MovieWriterCreate(sidecarPath);
+    
+    if (levels[0] == NULL || levels[1] == NULL || sample == NULL) {
+        result = ENOMEM;
+    } else if (writer == NULL) {
+        result = errno;
+    } else if (MovieWriterAddTrack(writer, track->codec, level1Width, level1Height, track->timescale, track->frameDuration) != 0) {
+        result = EINVAL;
+    }
+    
+    int frame;
+    for (frame = 0; frame < track->frameCount && result == 0; frame++) {
+        unsigned int textureFormat;
+        unsigned long decodedSize;
+        
+        result = DecodeToolFrame(&movie, frame, &textureFormat, &decodedSize);
+        if (result != 0) {
+            break;
+        }
+        
+        const uint8_t *above = movie.decodedBuffer;
+        int aboveWidth = track->width, aboveHeight = track->height;
+        unsigned long sampleSize = 0;
+        int level = 0;
+        
+        width = level1Width;
+        height = level1Height;
+        while (result == 0) {
+            uint8_t *texture = levels[level++ % 2];
+            unsigned long rowBytes = (unsigned long)((width + 3) / 4) * blockBytes;
+            unsigned long size = rowBytes * ((height + 3) / 4);
+            unsigned long encodedSize;
+            ChunkPlan plan;
+            
+            DXTDownsample(above, aboveWidth, aboveHeight, dxt5, texture, width, height);
+            
+            PlanChunks(height, size, &plan);
+            if (HapEncodeChunks(texture, size, textureFormat, HapCompressorSnappy, plan.chunkCount, rowBytes, NULL, ParallelHapCallback, NULL,
+                                sample + sampleSize + 4, sampleCapacity - sampleSize - 4, &encodedSize) != HapResult_No_Error) {
+                result = EINVAL;
+                break;
+            }
+            OSWriteBigInt32(sample, sampleSize, (uint32_t)encodedSize);
+            sampleSize += 4 + encodedSize;
+            
+            if (width == 1 && height == 1) {
+                break;
+            }
+            above = texture;
+            aboveWidth = width;
+            aboveHeight = height;
+            width = width > 1 ? width / 2 : 1;
+            height = height > 1 ? height / 2 : 1;
+        }
+        
+        if (result == 0 && MovieWriterAppendFrame(writer, 0, sample, (uint32_t)sampleSize) != 0) {
+            result = EIO;
+        }
+    }
+    
+    if (writer != NULL) {
+        if (result == 0) {
+            result = MovieWriterFinish(writer) == 0 ? 0 : EIO;
+        } else {
+            MovieWriterCancel(writer);
+        }
+    }
+    
+    free(levels[0]);
+    free(levels[1]);
+    free(sample);
+    CloseToolMovie(&movie);
+    
+    return result;
+}
+
+// A HapDecodeCallback which runs the work serially and remembers how many chunks the frame had
+static void CountingHapCallback(HapDecodeWorkFunction function, void *p, unsigned int count, void *info)
+{
+    *(unsigned int *)info = count;
+    
+    unsigned int i;
+    for (i = 0; i < count; i++) {
+        function(p, i);
+    }
+}
+
+/*
+ Reports whether a Hap Alpha movie could be transcoded by TranscodeMovieToDXT1, and if so estimates the size of
+ the result by transcoding its first frame
+ */
+static int ReportDXT1Savings(ToolMovie *movie, uint64_t totalBytes, FILE *report)
+{
+    int translucentFrame;
+    int result = FindTranslucentFrame(movie, &translucentFrame);
+    if (result != 0) {
+        return result;
+    }
+    
+    if (translucentFrame != -1) {
+        fprintf(report, "DXT1 transcode: not possible, frame %d is not opaque\n", translucentFrame);
+        return 0;
+    }
+    
+    unsigned int textureFormat;
+    unsigned long decodedSize, encodedSize;
+    result = DecodeToolFrame(movie, 0, &textureFormat, &decodedSize);
+    if (result != 0) {
+        return result;
+    }
+    
+    ChunkPlan plan;
+    PlanChunks(movie->track->height, decodedSize / 2, &plan);
+    unsigned long encodedCapacity = HapMaxEncodedLengthForChunks(decodedSize / 2, plan.chunkCount);
+    uint8_t *transcoded = malloc(decodedSize / 2);
+    uint8_t *encoded = malloc(encodedCapacity);
+    
+    if (transcoded == NULL || encoded == NULL) {
+        result = ENOMEM;
+    } else {
+        DXT5ToDXT1(movie->decodedBuffer, decodedSize, transcoded);
+        if (HapEncodeChunks(transcoded, decodedSize / 2, HapTextureFormat_RGB_DXT1, HapCompressorSnappy, plan.chunkCount, BlockRowBytes(movie->track) / 2,
+                            NULL, ParallelHapCallback, NULL, encoded, encodedCapacity, &encodedSize) != HapResult_No_Error) {
+            result = EINVAL;
+        }
+    }
+    
+    if (result == 0) {
+        uint64_t estimatedBytes = totalBytes * encodedSize / movie->track->frameSizes[0];
+        fprintf(report, "DXT1 transcode: possible, every frame is opaque\n");
+        fprintf(report, "  decoded bytes per frame: %lu -> %lu\n", decodedSize, decodedSize / 2);
+        fprintf(report, "  file bytes: %llu -> about %llu (%.0f%% saved, estimated from the first frame)\n",
+                (unsigned long long)totalBytes, (unsigned long long)estimatedBytes,
+                totalBytes > 0 ? 100.0 * (1.0 - (double)estimatedBytes / totalBytes) : 0.0);
+    }
+    
+    free(transcoded);
+    free(encoded);
+    
+    return result;
+}
+
+/*
+ Writes a plain text report on the first Hap track of the movie at sourcePath to reportPath, with the
+ chunk count RechunkMovie would choose on this machine and how it was chosen, and for Hap Alpha movies whether
+ TranscodeMovieToDXT1 could be used and what it would save. Returns 0 or an errno value.
+ */
+int AnalyzeMovie(const char *sourcePath, const char *reportPath)
+{
+    ToolMovie movie;
+    int result = OpenToolMovie(sourcePath, &movie);
+    if (result != 0) {
+        CloseToolMovie(&movie);
+        return result;
+    }
+    
+    MovieTrackIndex *track = movie.track;
+    uint64_t totalBytes = 0;
+    int frame;
+    for (frame = 0; frame < track->frameCount; frame++) {
+        totalBytes += track->frameSizes[frame];
+    }
+    
+    unsigned int chunks = 1;
+    uint32_t size = track->frameCount > 0 ? track->frameSizes[0] : 0;
+    unsigned long decodedSize;
+    unsigned int textureFormat;
+    if (size == 0
+        || pread(fileno(movie.file), movie.frameBuffer, size, track->frameOffsets[0]) != size
+        || HapDecode(movie.frameBuffer, size, CountingHapCallback, &chunks, movie.decodedBuffer, movie.decodedSize, &decodedSize, &textureFormat) != HapResult_No_Error) {
+        CloseToolMovie(&movie);
+        return EFTYPE;
+    }
+    
+    ChunkPlan plan;
+    PlanChunks(track->height, movie.decodedSize, &plan);
+    
+    FILE *report = fopen(reportPath, "w");
+    if (report == NULL) {
+        result = errno;
+        CloseToolMovie(&movie);
+        return result;
+    }
+    
+    fprintf(report, "Movie: %s\n", sourcePath);
+    fprintf(report, "Codec: %c%c%c%c\n", (char)(track->codec >> 24), (char)(track->codec >> 16), (char)(track->codec >> 8), (char)track->codec);
+    fprintf(report, "Dimensions: %d x %d\n", track->width, track->height);
+    fprintf(report, "Frames: %d at %d/%d\n", track->frameCount, track->timescale, track->frameDuration);
+    fprintf(report, "Frame bytes: %llu mean, %u max, %lu decoded\n",
+            track->frameCount > 0 ? (unsigned long long)(totalBytes / track->frameCount) : 0ULL, track->maxFrameSize, movie.decodedSize);
+    fprintf(report, "Chunks in first frame: %u\n", chunks);
+    fprintf(report, "\n");
+    fprintf(report, "Chunking: %u chunks of about %lu KB\n", plan.chunkCount, movie.decodedSize / plan.chunkCount / 1024);
+    fprintf(report, "  decoder threads: %u\n", plan.threads);
+    fprintf(report, "  L2 cache: %lu KB, target chunk %lu KB\n", plan.cacheBytes / 1024, plan.targetChunkBytes / 1024);
+    fprintf(report, "  limits: %lu block rows, %d KB minimum chunk, %d chunks maximum\n", plan.blockRows, kChunkMinimumBytes / 1024, kChunkMaximumCount);
+    
+    if (track->codec == FourCC('H', 'a', 'p', '5')) {
+        fprintf(report, "\n");
+        result = ReportDXT1Savings(&movie, totalBytes, report);
+    }
+    
+    if (fclose(report) != 0 && result == 0) {
+        result = errno;
+    }
+    
+    CloseToolMovie(&movie);
+    
+    return result;
+}
@@ -0,0 +1,24 @@
+//
+//  MovieTools.h
+//  HapMovieTexturePlugin
+//
+//  Offline tools which rewrite Hap movies. Each returns 0 or an errno value; see MovieTools.c for details.
+//
+
+#ifndef HapMovieTexturePlugin_MovieTools_h
+#define HapMovieTexturePlugin_MovieTools_h
+
+/*
+ The number of chunks to encode frames of height texels high and decodedSize bytes with, so that every core
+ can decode a chunk which stays in its cache
+ */
+unsigned int PlanChunkCount(int height, unsigned long decodedSize);
+
+int RechunkMovie(const char *sourcePath, const char *destinationPath, int chunkCount);
+int RechunkMovieForStorage(const char *sourcePath, const char *destinationPath, int chunkCount, double storageBytesPerSecond);
+int TranscodeMovieToDXT1(const char *sourcePath, const char *destinationPath, int chunkCount);
+int AddProxyTrack(const char *sourcePath, const char *destinationPath);
+int WriteMipmapSidecar(const char *sourcePath, const char *sidecarPath);
+int AnalyzeMovie(const char *sourcePath, const char *reportPath);
+
+#endif
@@ -0,0 +1,453 @@
+//
+//  MovieWriter.c
+//  HapMovieTexturePlugin
+//
+
+#include "MovieWriter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <libkern/OSByteOrder.h>
+
+#include "MovieIndex.h"
+
+#define FourCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+typedef struct {
+    uint32_t codec;
+    int width, height;
+    uint32_t timescale;
+    uint32_t frameDuration;
+    
+    int frameCount, frameCapacity;
+    uint64_t *frameOffsets;
+    uint32_t *frameSizes;
+} MovieWriterTrack;
+
+struct MovieWriter {
+    FILE *file;
+    char *path;
+    
+    off_t mdatOffset;
+    off_t position;
+    bool failed;
+    
+    int trackCount;
+    MovieWriterTrack tracks[kMovieIndexMaxTracks];
+};
+
+/*
+ The moov atom is built in memory, with each atom's size patched in when it is closed
+ */
+typedef struct {
+    uint8_t *data;
+    size_t length, capacity;
+    size_t open[16];
+    int depth;
+    bool failed;
+} AtomBuffer;
+
+static uint8_t *AtomReserve(AtomBuffer *buffer, size_t length)
+{
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (capacity < buffer->length + length) {
+            capacity *= 2;
+        }
+        
+        uint8_t *data = realloc(buffer->data, capacity);
+        if (data == NULL) {
+            buffer->failed = true;
+            return NULL;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    
+    uint8_t *p = buffer->data + buffer->length;
+    buffer->length += length;
+    memset(p, 0, length);
+    
+    return p;
+}
+
+static void Put16(AtomBuffer *buffer, uint16_t value)
+{
+    uint8_t *p = AtomReserve(buffer, 2);
+    if (p) OSWriteBigInt16(p, 0, value);
+}
+
+static void Put32(AtomBuffer *buffer, uint32_t value)
+{
+    uint8_t *p = AtomReserve(buffer, 4);
+    if (p) OSWriteBigInt32(p, 0, value);
+}
+
+static void Put64(AtomBuffer *buffer, uint64_t value)
+{
+    uint8_t *p = AtomReserve(buffer, 8);
+    if (p) OSWriteBigInt64(p, 0, value);
+}
+
+static void PutZeros(AtomBuffer *buffer, size_t length)
+{
+    AtomReserve(buffer, length);
+}
+
+// The unity matrix used by mvhd and tkhd
+static void PutMatrix(AtomBuffer *buffer)
+{
+    Put32(buffer, 0x00010000); Put32(buffer, 0); Put32(buffer, 0);
+    Put32(buffer, 0); Put32(buffer, 0x00010000); Put32(buffer, 0);
+    Put32(buffer, 0); Put32(buffer, 0); Put32(buffer, 0x40000000);
+}
+
+static void BeginAtom(AtomBuffer *buffer, uint32_t type)
+{
+    buffer->open[buffer->depth++] = buffer->length;
+    Put32(buffer, 0);
+    Put32(buffer, type);
+}
+
+static void EndAtom(AtomBuffer *buffer)
+{
+    size_t start = buffer->open[--buffer->depth];
+    if (!buffer->failed) {
+        OSWriteBigInt32(buffer->data, start, (uint32_t)(buffer->length - start));
+    }
+}
+
+static uint64_t TrackDuration(const MovieWriterTrack *track)
+{
+    return (uint64_t)track->frameCount * track->frameDuration;
+}
+
+static void PutTrack(AtomBuffer *moov, const MovieWriterTrack *track, int trackID, uint32_t movieTimescale)
+{
+    bool largeOffsets = false;
+    int i;
+    for (i = 0; i < track->frameCount; i++) {
+        if (track->frameOffsets[i] > UINT32_MAX) {
+            largeOffsets = true;
+        }
+    }
+    
+    BeginAtom(moov, FourCC('t', 'r', 'a', 'k'));
+    
+    BeginAtom(moov, FourCC('t', 'k', 'h', 'd'));
+    Put32(moov, 0x0000000F); // Enabled, in movie, in preview, in poster
+    Put32(moov, 0); Put32(moov, 0);
+    Put32(moov, trackID);
+    Put32(moov, 0);
+    Put32(moov, (uint32_t)(TrackDuration(track) * movieTimescale / track->timescale));
+    PutZeros(moov, 8);
+    Put16(moov, 0); Put16(moov, 0); Put16(moov, 0); Put16(moov, 0);
+    PutMatrix(moov);
+    Put32(moov, (uint32_t)track->width << 16);
+    Put32(moov, (uint32_t)track->height << 16);
+    EndAtom(moov);
+    
+    BeginAtom(moov, FourCC('m', 'd', 'i', 'a'));
+    
+    BeginAtom(moov, FourCC('m', 'd', 'h', 'd'));
+    Put32(moov, 0);
+    Put32(moov, 0); Put32(moov, 0);
+    Put32(moov, track->timescale);
+    Put32(moov, (uint32_t)TrackDuration(track));
+    Put16(moov, 0); Put16(moov, 0);
+    EndAtom(moov);
+    
+    BeginAtom(moov, FourCC('h', 'd', 'l', 'r'));
+    Put32(moov, 0);
+    Put32(moov, FourCC('m', 'h', 'l', 'r'));
+    Put32(moov, FourCC('v', 'i', 'd', 'e'));
+    PutZeros(moov, 12);
+    PutZeros(moov, 1);
+    EndAtom(moov);
+    
+    BeginAtom(moov, FourCC('m', 'i', 'n', 'f'));
+    
+    BeginAtom(moov, FourCC('v', 'm', 'h', 'd'));
+    Put32(moov, 0x00000001);
+    Put16(moov, 0x0040); // Copy graphics mode
+    PutZeros(moov, 6);
+    EndAtom(moov);
+    
+    BeginAtom(moov, FourCC('h', 'd', 'l', 'r'));
+    Put32(moov, 0);
+    Put32(moov, FourCC('d', 'h', 'l', 'r'));
+    Put32(moov, FourCC('a', 'l', 'i', 's'));
+    PutZeros(moov, 12);
+    PutZeros(moov, 1);
+    EndAtom(moov);
+    
+    BeginAtom(moov, FourCC('d', 'i', 'n', 'f'));
+    BeginAtom(moov, FourCC('d', 'r', 'e', 'f'));
+    Put32(moov, 0);
+    Put32(moov, 1);
+    BeginAtom(moov, FourCC('a', 'l', 'i', 's'));
+    Put32(moov, 0x00000001); // Media data is in this file
+    EndAtom(moov);
+    EndAtom(moov);
+    EndAtom(moov);
+    
+    BeginAtom(moov, FourCC('s', 't', 'b', 'l'));
+    
+    BeginAtom(moov, FourCC('s', 't', 's', 'd'));
+    Put32(moov, 0);
+    Put32(moov, 1);
+    BeginAtom(moov, track->codec);
+    PutZeros(moov, 6);
+    Put16(moov, 1); // Data reference index
+    Put16(moov, 0); Put16(moov, 0);
+    Put32(moov, 0);
+    Put32(moov, 0); Put32(moov, 512); // Temporal and spatial quality
+    Put16(moov, track->width);
+    Put16(moov, track->height);
+    Put32(moov, 0x00480000); Put32(moov, 0x00480000); // 72 dpi
+    Put32(moov, 0);
+    Put16(moov, 1); // Frames per sample
+    uint8_t *name = AtomReserve(moov, 32);
+    if (name) {
+        const char *codecName = "Hap";
+        name[0] = (uint8_t)strlen(codecName);
+        memcpy(name + 1, codecName, name[0]);
+    }
+    Put16(moov, track->codec == FourCC('H', 'a', 'p', '1') ? 24 : 32);
+    Put16(moov, 0xFFFF); // No color table
+    EndAtom(moov);
+    EndAtom(moov);
+    
+    BeginAtom(moov, FourCC('s', 't', 't', 's'));
+    Put32(moov, 0);
+    Put32(moov, 1);
+    Put32(moov, track->frameCount);
+    Put32(moov, track->frameDuration);
+    EndAtom(moov);
+    
+    // Every frame is its own chunk
+    BeginAtom(moov, FourCC('s', 't', 's', 'c'));
+    Put32(moov, 0);
+    Put32(moov, 1);
+    Put32(moov, 1); Put32(moov, 1); Put32(moov, 1);
+    EndAtom(moov);
+    
+    BeginAtom(moov, FourCC('s', 't', 's', 'z'));
+    Put32(moov, 0);
+    Put32(moov, 0);
+    Put32(moov, track->frameCount);
+    for (i = 0; i < track->frameCount; i++) {
+        Put32(moov, track->frameSizes[i]);
+    }
+    EndAtom(moov);
+    
+    BeginAtom(moov, largeOffsets ? FourCC('c', 'o', '6', '4') : FourCC('s', 't', 'c', 'o'));
+    Put32(moov, 0);
+    Put32(moov, track->frameCount);
+    for (i = 0; i < track->frameCount; i++) {
+        if (largeOffsets) {
+            Put64(moov, track->frameOffsets[i]);
+        } else {
+            Put32(moov, (uint32_t)track->frameOffsets[i]);
+        }
+    }
+    EndAtom(moov);
+    
+    EndAtom(moov); // stbl
+    EndAtom(moov); // minf
+    EndAtom(moov); // mdia
+    EndAtom(moov); // trak
+}
+
+static bool WriteAll(MovieWriter *writer, const void *data, size_t size)
+{
+    if (!writer->failed && fwrite(data, 1, size, writer->file) != size) {
+        writer->failed = true;
+    }
+    writer->position += size;
+    
+    return !writer->failed;
+}
+
+static void FreeWriter(MovieWriter *writer)
+{
+    int i;
+    for (i = 0; i < writer->trackCount; i++) {
+        free(writer->tracks[i].frameOffsets);
+        free(writer->tracks[i].frameSizes);
+    }
+    
+    free(writer->path);
+    free(writer);
+}
+
+MovieWriter *MovieWriterCreate(const char *path)
+{
+    MovieWriter *writer = calloc(1, sizeof(MovieWriter));
+    if (writer == NULL) {
+        return NULL;
+    }
+    
+    writer->path = strdup(path);
+    writer->file = fopen(path, "wb");
+    if (writer->file == NULL || writer->path == NULL) {
+        if (writer->file) fclose(writer->file);
+        FreeWriter(writer);
+        return NULL;
+    }
+    
+    uint8_t header[20 + 16];
+    
+    // ftyp
+    OSWriteBigInt32(header, 0, 20);
+    OSWriteBigInt32(header, 4, FourCC('f', 't', 'y', 'p'));
+    OSWriteBigInt32(header, 8, FourCC('q', 't', ' ', ' '));
+    OSWriteBigInt32(header, 12, 0x00000200);
+    OSWriteBigInt32(header, 16, FourCC('q', 't', ' ', ' '));
+    
+    // mdat with a 64-bit size, filled in when the movie is finished
+    OSWriteBigInt32(header, 20, 1);
+    OSWriteBigInt32(header, 24, FourCC('m', 'd', 'a', 't'));
+    OSWriteBigInt64(header, 28, 0);
+    
+    writer->mdatOffset = 20;
+    WriteAll(writer, header, sizeof(header));
+    
+    return writer;
+}
+
+int MovieWriterAddTrack(MovieWriter *writer, uint32_t codec, int width, int height, uint32_t timescale, uint32_t frameDuration)
+{
+    if (writer == NULL || writer->trackCount == kMovieIndexMaxTracks || timescale == 0 || frameDuration == 0) {
+        return -1;
+    }
+    
+    MovieWriterTrack *track = &writer->tracks[writer->trackCount];
+    memset(track, 0, sizeof(MovieWriterTrack));
+    track->codec = codec;
+    track->width = width;
+    track->height = height;
+    track->timescale = timescale;
+    track->frameDuration = frameDuration;
+    
+    return writer->trackCount++;
+}
+
+int MovieWriterAppendFrame(MovieWriter *writer, int trackNumber, const void *data, uint32_t size)
+{
+    if (writer == NULL || trackNumber < 0 || trackNumber >= writer->trackCount) {
+        return -1;
+    }
+    
+    MovieWriterTrack *track = &writer->tracks[trackNumber];
+    
+    if (track->frameCount == track->frameCapacity) {
+        int capacity = track->frameCapacity ? track->frameCapacity * 2 : 256;
+        uint64_t *offsets = realloc(track->frameOffsets, sizeof(uint64_t) * capacity);
+        if (offsets != NULL) {
+            track->frameOffsets = offsets;
+        }
+        uint32_t *sizes = realloc(track->frameSizes, sizeof(uint32_t) * capacity);
+        if (sizes != NULL) {
+            track->frameSizes = sizes;
+        }
+        if (offsets == NULL || sizes == NULL) {
+            writer->failed = true;
+            return -1;
+        }
+        track->frameCapacity = capacity;
+    }
+    
+    track->frameOffsets[track->frameCount] = writer->position;
+    track->frameSizes[track->frameCount] = size;
+    track->frameCount++;
+    
+    return WriteAll(writer, data, size) ? 0 : -1;
+}
+
+int MovieWriterFinish(MovieWriter *writer)
+{
+    if (writer == NULL) {
+        return -1;
+    }
+    
+    off_t mdatEnd = writer->position;
+    
+    /*
+     The movie's timescale is that of its first track; every track is as long as the longest
+     */
+    uint32_t movieTimescale = writer->trackCount > 0 ? writer->tracks[0].timescale : 600;
+    uint64_t movieDuration = 0;
+    int i;
+    for (i = 0; i < writer->trackCount; i++) {
+        uint64_t duration = TrackDuration(&writer->tracks[i]) * movieTimescale / writer->tracks[i].timescale;
+        if (duration > movieDuration) {
+            movieDuration = duration;
+        }
+    }
+    
+    AtomBuffer moov;
+    memset(&moov, 0, sizeof(AtomBuffer));
+    
+    BeginAtom(&moov, FourCC('m', 'o', 'o', 'v'));
+    
+    BeginAtom(&moov, FourCC('m', 'v', 'h', 'd'));
+    Put32(&moov, 0);
+    Put32(&moov, 0); Put32(&moov, 0);
+    Put32(&moov, movieTimescale);
+    Put32(&moov, (uint32_t)movieDuration);
+    Put32(&moov, 0x00010000); // Rate
+    Put16(&moov, 0x0100); // Volume
+    PutZeros(&moov, 10);
+    PutMatrix(&moov);
+    PutZeros(&moov, 24); // Preview, poster, selection and current times
+    Put32(&moov, writer->trackCount + 1);
+    EndAtom(&moov);
+    
+    for (i = 0; i < writer->trackCount; i++) {
+        PutTrack(&moov, &writer->tracks[i], i + 1, movieTimescale);
+    }
+    
+    EndAtom(&moov);
+    
+    if (moov.failed) {
+        writer->failed = true;
+    }
+    WriteAll(writer, moov.data, moov.length);
+    free(moov.data);
+    
+    uint8_t size[8];
+    OSWriteBigInt64(size, 0, (uint64_t)(mdatEnd - writer->mdatOffset));
+    if (!writer->failed && (fseeko(writer->file, writer->mdatOffset + 8, SEEK_SET) != 0 || fwrite(size, 8, 1, writer->file) != 1)) {
+        writer->failed = true;
+    }
+    
+    if (fclose(writer->file) != 0) {
+        writer->failed = true;
+    }
+    
+    int result = writer->failed ? -1 : 0;
+    if (result != 0) {
+        unlink(writer->path);
+    }
+    
+    FreeWriter(writer);
+    
+    return result;
+}
+
+void MovieWriterCancel(MovieWriter *writer)
+{
+    if (writer == NULL) {
+        return;
+    }
+    
+    fclose(writer->file);
+    unlink(writer->path);
+    FreeWriter(writer);
+}
@@ -0,0 +1,39 @@
+//
+//  MovieWriter.h
+//  HapMovieTexturePlugin
+//
+
+#ifndef HapMovieTexturePlugin_MovieWriter_h
+#define HapMovieTexturePlugin_MovieWriter_h
+
+#include <stdint.h>
+
+/*
+ Writes QuickTime movies of Hap video tracks that MovieIndexRead can read back. Frames are appended to the
+ mdat as they arrive and the moov atom is written when the movie is finished.
+ */
+typedef struct MovieWriter MovieWriter;
+
+MovieWriter *MovieWriterCreate(const char *path);
+
+/*
+ Adds a video track whose frames are of the given Hap codec ('Hap1', 'Hap5' or 'HapY') and dimensions, each
+ lasting frameDuration units of timescale. Returns the track's number or -1. Tracks must all be added before
+ the first frame is appended.
+ */
+int MovieWriterAddTrack(MovieWriter *writer, uint32_t codec, int width, int height, uint32_t timescale, uint32_t frameDuration);
+
+int MovieWriterAppendFrame(MovieWriter *writer, int track, const void *data, uint32_t size);
+
+/*
+ Writes the moov atom, closes the file and frees writer. Returns 0 on success; on failure the partial file
+ is removed.
+ */
+int MovieWriterFinish(MovieWriter *writer);
+
+/*
+ Abandons the movie, removing the partial file, and frees writer.
+ */
+void MovieWriterCancel(MovieWriter *writer);
+
+#endif
@@ -0,0 +1,168 @@
+//
+//  Parallel.c
+//  HapMovieTexturePlugin
+//
+
+#include "Parallel.h"
+
+#include <stdlib.h>
+#include <dispatch/dispatch.h>
+
+/*
+ Set on a thread while it runs work given to a host's executor, whose pool may not be able to run a batch
+ started from inside one of its own jobs
+ */
+static __thread bool inExecutorWork;
+
+static void DispatchBatch(void *info, ExecutorFunction function, void *p, size_t count)
+{
+    dispatch_apply_f(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), p, function);
+}
+
+typedef struct {
+    ExecutorFunction function;
+    void *p;
+} DispatchTask;
+
+static void DispatchTaskRun(void *context)
+{
+    DispatchTask *task = context;
+    task->function(task->p, 0);
+    free(task);
+}
+
+// A task is its own dispatch group, which wait releases
+static void *DispatchSubmit(void *info, ExecutorFunction function, void *p)
+{
+    DispatchTask *task = malloc(sizeof(DispatchTask));
+    dispatch_group_t group = dispatch_group_create();
+    if (task == NULL || group == NULL) {
+        free(task);
+        if (group != NULL) {
+            dispatch_release(group);
+        }
+        return NULL;
+    }
+    
+    task->function = function;
+    task->p = p;
+    dispatch_group_async_f(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), task, DispatchTaskRun);
+    
+    return group;
+}
+
+static void DispatchWait(void *info, void *task)
+{
+    dispatch_group_wait((dispatch_group_t)task, DISPATCH_TIME_FOREVER);
+    dispatch_release((dispatch_group_t)task);
+}
+
+static const Executor DispatchExecutor = { NULL, DispatchBatch, DispatchSubmit, DispatchWait };
+
+static Executor currentExecutor = { NULL, DispatchBatch, DispatchSubmit, DispatchWait };
+static bool customExecutor;
+
+void SetExecutor(const Executor *executor)
+{
+    customExecutor = executor != NULL && executor->batch != NULL && executor->submit != NULL && executor->wait != NULL;
+    currentExecutor = customExecutor ? *executor : DispatchExecutor;
+}
+
+typedef struct {
+    ExecutorFunction function;
+    void *p;
+} ExecutorWork;
+
+static void ExecutorWorkRun(void *context, size_t index)
+{
+    ExecutorWork *work = context;
+    bool nested = inExecutorWork;
+    
+    inExecutorWork = true;
+    work->function(work->p, index);
+    inExecutorWork = nested;
+}
+
+static void ExecutorTaskRun(void *context, size_t index)
+{
+    ExecutorWorkRun(context, index);
+    free(context);
+}
+
+/*
+ GCD runs batches started from its own work itself, but a host's executor is only given batches from outside
+ it; from inside, the work is run on the calling thread
+ */
+void ExecutorBatch(ExecutorFunction function, void *p, size_t count)
+{
+    size_t i;
+    
+    if (count == 1) {
+        function(p, 0);
+    } else if (count > 1 && !customExecutor) {
+        currentExecutor.batch(currentExecutor.info, function, p, count);
+    } else if (count > 1 && inExecutorWork) {
+        for (i = 0; i < count; i++) {
+            function(p, i);
+        }
+    } else if (count > 1) {
+        ExecutorWork work = { function, p };
+        currentExecutor.batch(currentExecutor.info, ExecutorWorkRun, &work, count);
+    }
+}
+
+/*
+ A task the executor could not accept is run before returning, with a NULL handle which waiting ignores
+ */
+void *ExecutorSubmit(ExecutorFunction function, void *p)
+{
+    void *task = NULL;
+    
+    if (!customExecutor) {
+        task = currentExecutor.submit(currentExecutor.info, function, p);
+    } else {
+        ExecutorWork *work = malloc(sizeof(ExecutorWork));
+        if (work != NULL) {
+            work->function = function;
+            work->p = p;
+            task = currentExecutor.submit(currentExecutor.info, ExecutorTaskRun, work);
+            if (task == NULL) {
+                free(work);
+            }
+        }
+    }
+    
+    if (task == NULL) {
+        function(p, 0);
+    }
+    
+    return task;
+}
+
+void ExecutorWait(void *task)
+{
+    if (task != NULL) {
+        currentExecutor.wait(currentExecutor.info, task);
+    }
+}
+
+typedef struct {
+    HapDecodeWorkFunction function;
+    void *p;
+    ParallelCancellation *cancellation;
+} ParallelWork;
+
+static void ParallelWorkApply(void *context, size_t index)
+{
+    ParallelWork *work = context;
+    if (work->cancellation == NULL || !work->cancellation->cancelled) {
+        work->function(work->p, (unsigned int)index);
+    }
+}
+
+void ParallelHapCallback(HapDecodeWorkFunction function, void *p, unsigned int count, void *info)
+{
+    ParallelWork work = { function, p, info };
+    
+    ExecutorBatch(ParallelWorkApply, &work, count);
+}
@@ -0,0 +1,64 @@
+//
+//  Parallel.h
+//  HapMovieTexturePlugin
+//
+
+#ifndef HapMovieTexturePlugin_Parallel_h
+#define HapMovieTexturePlugin_Parallel_h
+
+#include "hap.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ All of the plugin's background work, whether decoding or encoding the chunks of a frame, opening movies or
+ reading and decoding frames ahead, runs on an executor. By default this is GCD's global concurrent queues;
+ a host with its own job system can supply one instead so that the plugin does not compete with it for cores.
+ */
+typedef void (*ExecutorFunction)(void *p, size_t index);
+
+typedef struct {
+    void *info;
+    
+    // Calls function(p, index) for every index below count, spread across threads, and returns when all are done
+    void (*batch)(void *info, ExecutorFunction function, void *p, size_t count);
+    
+    // Starts a call of function(p, 0) on another thread, returning a handle for wait, or NULL if it cannot
+    void *(*submit)(void *info, ExecutorFunction function, void *p);
+    
+    // Returns once the task submit returned has finished, after which the handle is no longer used
+    void (*wait)(void *info, void *task);
+} Executor;
+
+/*
+ Replaces the executor, or restores the default if executor is NULL or incomplete. executor is copied. Must
+ be called before any work is started, normally before the first context is created.
+ 
+ Work often starts more work, as when a frame decoded ahead or for an atlas decodes its chunks. A host's
+ batch need not be reentrant: it is never called from work the executor is running, which instead runs
+ such a batch itself on its own thread, so a fixed pool cannot deadlock with every thread waiting on itself.
+ */
+void SetExecutor(const Executor *executor);
+
+void ExecutorBatch(ExecutorFunction function, void *p, size_t count);
+
+void *ExecutorSubmit(ExecutorFunction function, void *p);
+
+void ExecutorWait(void *task);
+
+/*
+ Lets a decode be abandoned once its frame is no longer wanted. Setting cancelled stops any chunk which has
+ not yet started from running, so the decode returns an error as soon as the chunks in progress finish.
+ */
+typedef struct {
+    volatile bool cancelled;
+} ParallelCancellation;
+
+/*
+ A HapDecodeCallback which runs the work as a batch on the executor and returns when it is all done. Used for
+ both decoding and encoding chunked frames. info may be NULL or a ParallelCancellation.
+ */
+void ParallelHapCallback(HapDecodeWorkFunction function, void *p, unsigned int count, void *info);
+
+#endif
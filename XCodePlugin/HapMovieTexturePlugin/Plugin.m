@@ -8,91 +8,2047 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include <OpenGL/gl.h>
+#include <OpenGL/glext.h>
 
 #include <libkern/OSByteOrder.h>
+#include <mach/mach_time.h>
 
 #include "hap.h"
+#include "MovieIndex.h"
+#include "Parallel.h"
+#include "FrameStream.h"
+#include "Uploader.h"
+#include "VulkanUploader.h"
+#include "DecodedFrame.h"
+
+/*
+ Read-ahead is tuned per stream from the latency of the reads we issue, but the total amount of
+ advised data across all open streams never exceeds kReadAheadBudgetBytes.
+ */
+#define kReadAheadLatencySamples 128
+#define kReadAheadMaxFrames 120
+#define kReadAheadShrinkInterval 30
+#define kReadAheadBudgetBytes (256LL * 1024 * 1024)
+
+static int64_t readAheadBytesReserved = 0;
+
+/*
+ Frames are decoded straight into a ring of pixel buffer objects and uploaded from there. A buffer is only
+ reused once the fence placed after its upload has passed, or is given new storage if the wait times out.
+ */
+#define kPixelBufferCount 3
+#define kPixelBufferFenceTimeout (100 * 1000 * 1000ULL)
+
+#define FourCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+// Streamed frames may be split into as many chunks as the offline tools write
+#define kStreamMaxChunkCount 64
+
+/*
+ Each sink holds at most a frame waiting for it and one it has taken, so the pool never needs more than two
+ frames a sink and the one being decoded
+ */
+#define kMaxFrameSinks 8
+#define kDecodedFrameCount (kMaxFrameSinks * 2 + 1)
+
+#define kMaxAtlasContexts 64
+
+/*
+ A flipbook holds every decoded frame of its clip at once, so only clips which fit within this are loaded
+ */
+#define kFlipbookMaxBytes (256 * 1024 * 1024)
+
+struct HapMovieTextureContext;
+
+/*
+ A frame being decoded in the background ahead of being shown, into buffers of its own
+ */
+typedef struct {
+    struct HapMovieTextureContext *context;
+    ParallelCancellation cancellation;
+    MovieTrackIndex *track;
+    int sample;
+    uint8_t *frameBuffer;
+    void *textureBuffer;
+    unsigned long size;
+    unsigned int textureFormat;
+    unsigned int result;
+} DecodeAheadJob;
+
+/*
+ A consumer of the frames PublishFrame decodes, with the storage of the texture it last uploaded to
+ */
+typedef struct {
+    FrameSink *sink;
+    GLuint allocatedTexture;
+    GLenum allocatedTextureFormat;
+    int allocatedWidth, allocatedHeight;
+} ContextFrameSink;
+
+/*
+ Several contexts sharing one texture, each playing into its own rectangle of it. Every rectangle is decoded
+ into place in buffer, which holds the whole atlas as S3TC blocks, so the atlas is uploaded with a single call.
+ */
+typedef struct {
+    struct HapMovieTextureContext *context;
+    unsigned int blockX, blockY;
+    unsigned int result;
+} AtlasEntry;
 
 typedef struct {
+    int width, height;
+    GLenum textureFormat;
+    void *buffer;
+    size_t bufferSize;
+    size_t rowBytes;
+    AtlasEntry entries[kMaxAtlasContexts];
+    int entryCount;
+    GLuint allocatedTexture;
+} HapMovieTextureAtlas;
+
+typedef struct HapMovieTextureContext {
     FILE *file;
+    FrameReceiver *stream;
     
-    int width, height;
+    MovieIndex index;
+    MovieTrackIndex *track;
+    MovieTrackIndex *proxyTrack;
+    int levelOfDetail;
     
-    off_t mdatStartOffset;
-    off_t mdatEndOffset;
-
-    uint8_t hapFrameBuffer[16 * 1024 * 1024];
+    int currentFrame;
+    
+    uint64_t readLatencies[kReadAheadLatencySamples];
+    int readLatencyCount, readLatencyNext;
+    double meanFrameBytes;
+    double readBytesPerSecond;
+    double frameInterval;
+    uint64_t lastUpdateTime;
+    int readAheadFrames;
+    int64_t readAheadBytes;
+    int64_t trackBytes;
+    int updatesSinceGrowth;
+    int advisedFrames;
+    int readAheadBusy;
+    
+    void *pinnedData;
+    size_t pinnedLength;
+    off_t pinnedOffset;
+    
+    uint8_t *hapFrameBuffer;
     void *textureBuffer;
+    size_t textureBufferSize;
+    
+    unsigned long decodeBudget;
+    HapDecodeProgress *decodeProgress;
+    MovieTrackIndex *decodeTrack;
+    int decodeFrame;
+    unsigned int decodeTextureFormat;
+    
+    bool decodeAheadEnabled;
+    DecodeAheadJob decodeAhead;
+    void *decodeAheadTask;
+    bool decodeAheadPending;
+    
+    UploadStream *uploadStream;
+    GLenum uploadedTextureFormat;
+    
+    DecodedFramePool *framePool;
+    ContextFrameSink *frameSinks[kMaxFrameSinks];
+    int frameSinkCount;
+    
+    GLuint allocatedTexture;
+    GLenum allocatedTextureFormat;
+    int allocatedWidth, allocatedHeight;
+    
+    GLuint flipbookTexture;
+    int *flipbookLayers;
+    
+    FILE *mipmapFile;
+    MovieIndex mipmapIndex;
+    uint8_t *mipmapFrameBuffer;
+    bool mipmapsAllocated;
+    
+    bool pixelBuffersUnavailable;
+    GLuint pixelBuffers[kPixelBufferCount];
+    GLsync pixelBufferFences[kPixelBufferCount];
+    int pixelBufferIndex;
 } HapMovieTextureContext;
 
-static void MyHapDecodeCallback(HapDecodeWorkFunction function, void *p, unsigned int count, void *info)
+static uint64_t Nanoseconds(void)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+
+static int CompareLatencies(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t ReadLatencyPercentile(HapMovieTextureContext *context, int percentile)
+{
+    uint64_t sorted[kReadAheadLatencySamples];
+    
+    if (context->readLatencyCount == 0) {
+        return 0;
+    }
+    
+    memcpy(sorted, context->readLatencies, context->readLatencyCount * sizeof(uint64_t));
+    qsort(sorted, context->readLatencyCount, sizeof(uint64_t), CompareLatencies);
+    
+    return sorted[(context->readLatencyCount - 1) * percentile / 100];
+}
+
+static int NextFrame(HapMovieTextureContext *context, int frame)
+{
+    return (frame + 1) % context->track->frameCount;
+}
+
+/*
+ Tells the kernel about the exact byte range of a frame we are about to read, or have finished with. There is
+ no way to drop pages from the cache on Darwin, so finished frames are only released where posix_fadvise exists.
+ */
+static void AdviseFrame(HapMovieTextureContext *context, int frame, bool willNeed)
+{
+    off_t offset = context->track->frameOffsets[frame];
+    off_t length = context->track->frameSizes[frame];
+
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fileno(context->file), offset, length, willNeed ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED);
+#else
+    if (willNeed) {
+        struct radvisory advisory;
+        advisory.ra_offset = offset;
+        advisory.ra_count = (int)length;
+        
+        fcntl(fileno(context->file), F_RDADVISE, &advisory);
+    }
+#endif
+}
+
+/*
+ Records a read of frame, of bytes which took latency nanoseconds, resizes this stream's read-ahead window so
+ it covers the p99 read latency at the current playback rate, and advises the kernel of any data in the window
+ after frame not yet requested.
+ */
+static void UpdateReadAhead(HapMovieTextureContext *context, int frame, size_t bytes, uint64_t latency)
 {
+    uint64_t now = Nanoseconds();
+    
+    context->readLatencies[context->readLatencyNext] = latency;
+    context->readLatencyNext = (context->readLatencyNext + 1) % kReadAheadLatencySamples;
+    if (context->readLatencyCount < kReadAheadLatencySamples) {
+        context->readLatencyCount++;
+    }
+    
+    if (context->meanFrameBytes == 0) {
+        context->meanFrameBytes = bytes;
+    }
+    context->meanFrameBytes += (bytes - context->meanFrameBytes) / 16.0;
+    
+    if (latency > 0) {
+        double bytesPerSecond = bytes * 1e9 / latency;
+        context->readBytesPerSecond += (bytesPerSecond - context->readBytesPerSecond) / 16.0;
+    }
+    
+    if (context->lastUpdateTime != 0) {
+        double interval = (now - context->lastUpdateTime) / 1e9;
+        context->frameInterval = context->frameInterval == 0 ? interval : context->frameInterval + (interval - context->frameInterval) / 16.0;
+    }
+    context->lastUpdateTime = now;
+    
+    if (context->frameInterval <= 0 || context->readBytesPerSecond <= 0) {
+        return;
+    }
+    
+    /*
+     The window must hold enough frames to play through a p99 read stall, plus the time to transfer a frame
+     at the throughput we have been seeing
+     */
+    double cover = ReadLatencyPercentile(context, 99) / 1e9 + context->meanFrameBytes / context->readBytesPerSecond;
+    int frames = (int)(cover / context->frameInterval) + 2;
+    if (frames > kReadAheadMaxFrames) {
+        frames = kReadAheadMaxFrames;
+    }
+    
+    /*
+     Grow immediately but only shrink after a run of updates that didn't need the larger window, so that reads
+     served from the cache don't collapse the window as soon as it starts working
+     */
+    if (frames >= context->readAheadFrames) {
+        context->readAheadFrames = frames;
+        context->updatesSinceGrowth = 0;
+    } else if (++context->updatesSinceGrowth >= kReadAheadShrinkInterval) {
+        context->readAheadFrames--;
+        context->updatesSinceGrowth = 0;
+    }
+    
+    /*
+     Other streams reserve concurrently, so the share we take is only committed if the total hasn't changed
+     since we read it
+     */
+    int64_t target = (int64_t)(context->readAheadFrames * context->meanFrameBytes);
+    int64_t wanted;
+    int64_t reserved;
+    do {
+        reserved = __sync_add_and_fetch(&readAheadBytesReserved, 0);
+        int64_t available = kReadAheadBudgetBytes - (reserved - context->readAheadBytes);
+        wanted = target;
+        if (wanted > available) {
+            wanted = available > 0 ? available : 0;
+        }
+    } while (!__sync_bool_compare_and_swap(&readAheadBytesReserved, reserved, reserved + wanted - context->readAheadBytes));
+    context->readAheadBytes = wanted;
+    
+    /*
+     The frame just read has been consumed from the window; advise the frames after it, in playback order,
+     until the window is full
+     */
+    if (context->advisedFrames > 0) {
+        context->advisedFrames--;
+    }
+    
+    int64_t advisedBytes = 0;
     int i;
-    for (i = 0; i < count; i++) {
-        function(p, i);
+    for (i = 0; i < context->readAheadFrames && i < context->track->frameCount - 1; i++) {
+        frame = NextFrame(context, frame);
+        advisedBytes += context->track->frameSizes[frame];
+        if (advisedBytes > wanted) {
+            break;
+        }
+        
+        if (i >= context->advisedFrames) {
+            AdviseFrame(context, frame, true);
+        }
     }
+    context->advisedFrames = i;
 }
 
-HapMovieTextureContext* CreateContext(const char *path)
+/*
+ Opens the movie at path and builds or loads its index. Returns 0 or an errno value.
+ */
+static int OpenContext(const char *path, HapMovieTextureContext **outContext)
 {
     HapMovieTextureContext *context = calloc(1, sizeof(HapMovieTextureContext));
+    if (context == NULL) {
+        return ENOMEM;
+    }
     
     context->file = fopen(path, "r");
- 
-    context->width = 2048;
-    context->height = 1024;
-
-    fseeko(context->file, 0, SEEK_END);
-    off_t end = ftello(context->file);
-    fseeko(context->file, 0, SEEK_SET);
-    
-    while (end > ftello(context->file)) {
-        uint8_t buf[16];
-        fread(buf, 8, 1, context->file);
-        
-        uint32_t size = OSReadBigInt32(buf, 0);
-        char type[5] = { buf[4], buf[5], buf[6], buf[7], 0 };
-        
-        if (strcmp("mdat", type) == 0) {
-            fread(buf, 16, 1, context->file);
-            
-            context->mdatStartOffset = ftello(context->file);
-            context->mdatEndOffset = context->mdatStartOffset + size - 128;
-            
-            break;
+    if (context->file == NULL) {
+        int error = errno;
+        free(context);
+        return error;
+    }
+    
+    if (MovieIndexReadCached(context->file, path, &context->index) != 0) {
+        fclose(context->file);
+        free(context);
+        return EFTYPE;
+    }
+    
+    context->track = &context->index.tracks[0];
+    
+    // A smaller second track is a proxy, as written by AddProxyTrack
+    if (context->index.trackCount > 1 && context->index.tracks[1].width < context->track->width) {
+        context->proxyTrack = &context->index.tracks[1];
+    }
+    
+    int frame;
+    for (frame = 0; frame < context->track->frameCount; frame++) {
+        context->trackBytes += context->track->frameSizes[frame];
+    }
+    
+    uint32_t maxFrameSize = context->track->maxFrameSize;
+    if (context->proxyTrack != NULL && context->proxyTrack->maxFrameSize > maxFrameSize) {
+        maxFrameSize = context->proxyTrack->maxFrameSize;
+    }
+    
+    context->hapFrameBuffer = malloc(maxFrameSize);
+    context->textureBufferSize = MovieTrackDecodedSize(context->track);
+    context->textureBuffer = malloc(context->textureBufferSize);
+    
+    if (context->hapFrameBuffer == NULL || context->textureBuffer == NULL) {
+        MovieIndexFree(&context->index);
+        fclose(context->file);
+        free(context->hapFrameBuffer);
+        free(context->textureBuffer);
+        free(context);
+        return ENOMEM;
+    }
+    
+    *outContext = context;
+    
+    return 0;
+}
+
+HapMovieTextureContext* CreateContext(const char *path)
+{
+    HapMovieTextureContext *context = NULL;
+    
+    OpenContext(path, &context);
+    
+    return context;
+}
+
+/*
+ Creates a context which shows Hap frames of width by height texels received on port, as sent by a
+ FrameSender, rather than a movie. Frames are held for latency milliseconds to absorb uneven delivery, and
+ each update shows the newest frame due, or leaves the texture unchanged if none is. The stream is presented
+ as a movie with a single sample which each received frame replaces.
+ */
+HapMovieTextureContext* CreateStreamContext(int port, bool udp, int width, int height, int latency)
+{
+    if (port < 0 || port > UINT16_MAX || width <= 0 || height <= 0 || latency < 0) {
+        return NULL;
+    }
+    
+    HapMovieTextureContext *context = calloc(1, sizeof(HapMovieTextureContext));
+    if (context == NULL) {
+        return NULL;
+    }
+    
+    context->index.trackCount = 1;
+    context->track = &context->index.tracks[0];
+    context->track->codec = FourCC('H', 'a', 'p', '5');
+    context->track->width = width;
+    context->track->height = height;
+    context->track->timescale = 1;
+    context->track->frameDuration = 1;
+    context->track->frameCount = 1;
+    context->track->frameOffsets = calloc(1, sizeof(off_t));
+    context->track->frameSizes = calloc(1, sizeof(uint32_t));
+    
+    // Sized for DXT5, the larger of the formats a stream may carry
+    context->textureBufferSize = MovieTrackDecodedSize(context->track);
+    context->track->maxFrameSize = (uint32_t)HapMaxEncodedLengthForChunks(context->textureBufferSize, kStreamMaxChunkCount);
+    context->textureBuffer = malloc(context->textureBufferSize);
+    context->hapFrameBuffer = malloc(context->track->maxFrameSize);
+    
+    context->stream = FrameReceiverCreate(udp ? FrameStreamUDP : FrameStreamTCP, (uint16_t)port, context->track->maxFrameSize, (uint32_t)latency * 1000);
+    
+    if (context->stream == NULL || context->textureBuffer == NULL || context->hapFrameBuffer == NULL
+        || context->track->frameOffsets == NULL || context->track->frameSizes == NULL) {
+        FrameReceiverDestroy(context->stream);
+        MovieIndexFree(&context->index);
+        free(context->hapFrameBuffer);
+        free(context->textureBuffer);
+        free(context);
+        return NULL;
+    }
+    
+    return context;
+}
+
+/*
+ Takes the newest due frame of a stream context into hapFrameBuffer as its only sample. Returns false if there
+ is no new frame, or it does not have the context's dimensions.
+ */
+static bool ReceiveStreamFrame(HapMovieTextureContext *context)
+{
+    uint32_t size;
+    int width, height;
+    
+    if (FrameReceiverNextFrame(context->stream, context->hapFrameBuffer, context->track->maxFrameSize, &size, &width, &height) != 0
+        || width != context->track->width || height != context->track->height) {
+        return false;
+    }
+    
+    context->track->frameSizes[0] = size;
+    
+    return true;
+}
+
+/*
+ Sets the counts of frames a stream context has received, shown, skipped, received too late and never
+ received whole, in that order. Returns 0, or EINVAL if the context is not a stream.
+ */
+int GetStreamStatistics(HapMovieTextureContext *context, uint64_t *statistics) {
+    if (context == NULL || context->stream == NULL || statistics == NULL) {
+        return EINVAL;
+    }
+    
+    FrameReceiverStatistics received;
+    FrameReceiverGetStatistics(context->stream, &received);
+    
+    statistics[0] = received.received;
+    statistics[1] = received.displayed;
+    statistics[2] = received.skipped;
+    statistics[3] = received.late;
+    statistics[4] = received.missing;
+    
+    return 0;
+}
+
+typedef struct {
+    const char *path;
+    dev_t device;
+    ino_t inode;
+    int position;
+} BulkOpenEntry;
+
+typedef struct {
+    BulkOpenEntry *entries;
+    HapMovieTextureContext **contexts;
+    int *statuses;
+} BulkOpenJob;
+
+static int CompareBulkOpenEntries(const void *a, const void *b)
+{
+    const BulkOpenEntry *x = a, *y = b;
+    
+    if (x->device != y->device) {
+        return x->device < y->device ? -1 : 1;
+    }
+    if (x->inode != y->inode) {
+        return x->inode < y->inode ? -1 : 1;
+    }
+    return x->position - y->position;
+}
+
+static void BulkOpenWork(void *p, size_t index)
+{
+    BulkOpenJob *job = p;
+    BulkOpenEntry *entry = &job->entries[index];
+    
+    job->contexts[entry->position] = NULL;
+    job->statuses[entry->position] = OpenContext(entry->path, &job->contexts[entry->position]);
+}
+
+/*
+ Opens count movies across a pool of workers, storing each context (or NULL) in contexts and its open status
+ (0 or an errno value) in statuses, in the order of paths. Files are opened in device and inode order, which
+ approximates their order on disk. Indexes are persisted to the index cache as they are built. Returns the
+ number of files opened per second.
+ */
+double CreateContexts(const char **paths, int count, HapMovieTextureContext **contexts, int *statuses)
+{
+    if (paths == NULL || contexts == NULL || statuses == NULL || count <= 0) {
+        return 0;
+    }
+    
+    uint64_t start = Nanoseconds();
+    
+    BulkOpenEntry *entries = calloc(count, sizeof(BulkOpenEntry));
+    if (entries == NULL) {
+        return 0;
+    }
+    
+    int i;
+    for (i = 0; i < count; i++) {
+        struct stat st;
+        
+        entries[i].path = paths[i];
+        entries[i].position = i;
+        if (stat(paths[i], &st) == 0) {
+            entries[i].device = st.st_dev;
+            entries[i].inode = st.st_ino;
         }
+    }
+    
+    qsort(entries, count, sizeof(BulkOpenEntry), CompareBulkOpenEntries);
+    
+    BulkOpenJob job = { entries, contexts, statuses };
+    ExecutorBatch(BulkOpenWork, &job, count);
+    
+    free(entries);
+    
+    uint64_t elapsed = Nanoseconds() - start;
+    
+    return elapsed > 0 ? count * 1e9 / elapsed : 0;
+}
+
+static void UnpinSampleData(HapMovieTextureContext *context)
+{
+    if (context->pinnedData != NULL) {
+        munlock(context->pinnedData, context->pinnedLength);
+        munmap(context->pinnedData, context->pinnedLength);
         
-        fseeko(context->file, size - 8, SEEK_CUR);
+        context->pinnedData = NULL;
+        context->pinnedLength = 0;
+    }
+}
+
+/*
+ Maps the range of the file holding every frame of the track and locks it into memory, so playback never
+ faults on compressed data. Returns 0 or an errno value describing why the data could not be pinned.
+ */
+static int PinSampleData(HapMovieTextureContext *context)
+{
+    off_t start = context->track->frameOffsets[0], end = start;
+    int i;
+    for (i = 0; i < context->track->frameCount; i++) {
+        off_t offset = context->track->frameOffsets[i];
+        if (offset < start) {
+            start = offset;
+        }
+        if (offset + context->track->frameSizes[i] > end) {
+            end = offset + context->track->frameSizes[i];
+        }
     }
     
-    context->textureBuffer = malloc(context->width * context->height / 2);
+    // mmap needs a page-aligned file offset
+    off_t pageSize = getpagesize();
+    off_t alignedStart = start - start % pageSize;
+    size_t length = end - alignedStart;
     
-    return context;
+    /*
+     The span runs from the first frame to the end of the last, so any audio or other tracks interleaved with
+     the video are locked too and count against the limit
+     */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && length > limit.rlim_cur) {
+        return ENOMEM;
+    }
+    
+    void *data = mmap(NULL, length, PROT_READ, MAP_SHARED, fileno(context->file), alignedStart);
+    if (data == MAP_FAILED) {
+        return errno;
+    }
+    
+    if (mlock(data, length) != 0) {
+        int error = errno;
+        munmap(data, length);
+        return error;
+    }
+    
+    context->pinnedData = data;
+    context->pinnedLength = length;
+    context->pinnedOffset = alignedStart;
+    
+    // Pinned frames are never read, so the read-ahead budget this stream held can go to the others
+    __sync_add_and_fetch(&readAheadBytesReserved, -context->readAheadBytes);
+    context->readAheadBytes = 0;
+    context->advisedFrames = 0;
+    
+    return 0;
 }
 
-void UpdateTexture(HapMovieTextureContext *context, GLuint textureHandle) {
-    fread(context->hapFrameBuffer, 4, 1, context->file);
+/*
+ Returns the track shown at the context's level of detail, setting the sample of it which shows at frame of
+ the main track. Samples are matched by time, so the proxy need not have the same frame rate.
+ */
+static MovieTrackIndex *LevelTrack(HapMovieTextureContext *context, int frame, int *outSample)
+{
+    MovieTrackIndex *track = context->track;
+    MovieTrackIndex *proxy = context->proxyTrack;
     
-    uint32_t insz = (*(uint8_t *)context->hapFrameBuffer) + ((*(((uint8_t *)context->hapFrameBuffer) + 1)) << 8) + ((*(((uint8_t *)context->hapFrameBuffer) + 2)) << 16);
-    fread(&context->hapFrameBuffer[4], insz, 1, context->file);
+    if (context->levelOfDetail == 0 || proxy == NULL) {
+        *outSample = frame;
+        return track;
+    }
+    
+    int64_t sample = (int64_t)frame * track->frameDuration * proxy->timescale / ((int64_t)track->timescale * proxy->frameDuration);
+    *outSample = sample < proxy->frameCount ? (int)sample : proxy->frameCount - 1;
+    
+    return proxy;
+}
+
+/*
+ Returns the compressed data for sample of track, either straight from pinned memory or read into buffer,
+ or NULL if it could not be read. Only the main track is pinned, and only playback reads from it drive
+ read-ahead. A background decode may read at the same time as the calling thread, so whichever finds the
+ read-ahead state in use skips updating it; the window is only a hint.
+ */
+static const uint8_t *ReadFrame(HapMovieTextureContext *context, MovieTrackIndex *track, int frame, bool playback, uint8_t *buffer)
+{
+    off_t offset = track->frameOffsets[frame];
+    uint32_t size = track->frameSizes[frame];
     
-    if (ftello(context->file) >= context->mdatEndOffset) {
-        fseeko(context->file, context->mdatStartOffset, SEEK_SET);
+    if (context->stream != NULL) {
+        return context->hapFrameBuffer;
     }
     
-    GLenum textureFormat; unsigned long outsz;
-    HapDecode(&context->hapFrameBuffer, insz + 4, MyHapDecodeCallback, NULL, context->textureBuffer, context->width * context->height / 2, &outsz, &textureFormat);
+    if (track != context->track) {
+        return pread(fileno(context->file), buffer, size, offset) == size ? buffer : NULL;
+    }
     
-    glBindTexture(GL_TEXTURE_2D, 1);
-    glCompressedTexImage2D(GL_TEXTURE_2D, 0, textureFormat, 2048, 1024, 0, outsz, context->textureBuffer);
+    if (context->pinnedData != NULL) {
+        return (const uint8_t *)context->pinnedData + (offset - context->pinnedOffset);
+    }
+    
+    uint64_t readStart = Nanoseconds();
+    
+    ssize_t bytesRead = pread(fileno(context->file), buffer, size, offset);
+    
+    if (playback && __sync_bool_compare_and_swap(&context->readAheadBusy, 0, 1)) {
+        UpdateReadAhead(context, frame, size, Nanoseconds() - readStart);
+        
+        // A clip which fits in the budget will loop back to this frame; dropping it would read it again each pass
+        if (context->trackBytes > kReadAheadBudgetBytes) {
+            AdviseFrame(context, frame, false);
+        }
+        __sync_bool_compare_and_swap(&context->readAheadBusy, 1, 0);
+    }
+    
+    return bytesRead == size ? buffer : NULL;
 }
 
-void DestroyContext(HapMovieTextureContext *context) {
-    fclose(context->file);
+/*
+ Abandons any frame being decoded across updates, whose compressed data may be about to go away
+ */
+static void AbandonDecode(HapMovieTextureContext *context)
+{
+    if (context->decodeProgress != NULL) {
+        HapDecodeEnd(context->decodeProgress, NULL);
+        context->decodeProgress = NULL;
+    }
+}
+
+/*
+ Cancels any background decode, and waits for the chunks it has in progress if wait is true. Without waiting,
+ the job's buffers stay in use until the next wait.
+ */
+static void CancelDecodeAhead(HapMovieTextureContext *context, bool wait)
+{
+    if (context->decodeAheadPending) {
+        context->decodeAhead.cancellation.cancelled = true;
+        if (wait) {
+            ExecutorWait(context->decodeAheadTask);
+            context->decodeAheadPending = false;
+        }
+    }
+}
+
+/*
+ Locks the compressed data of the main track into memory if pinned is true, or releases it. The locked span
+ is the whole range of the file from the first frame to the end of the last, including any audio or other
+ data interleaved with the frames, so it can be noticeably larger than the video alone. Returns 0 or an
+ errno value; ENOMEM if the span is over RLIMIT_MEMLOCK.
+ */
+int SetContextPinned(HapMovieTextureContext *context, bool pinned) {
+    if (context == NULL) {
+        return EINVAL;
+    }
+    if (context->stream != NULL) {
+        return ENOTSUP;
+    }
+    
+    // Decoding under way may be reading the pinned data, or reading into read-ahead state pinning resets
+    AbandonDecode(context);
+    CancelDecodeAhead(context, true);
+    
+    if (!pinned) {
+        UnpinSampleData(context);
+        return 0;
+    }
+    
+    return context->pinnedData != NULL ? 0 : PinSampleData(context);
+}
+
+/*
+ Reads and decodes sample frame of track into destination, returning the texture format to upload it with.
+ Staged decoding is used for destinations in write-combined memory.
+ */
+static unsigned int DecodeFrame(HapMovieTextureContext *context, MovieTrackIndex *track, int frame, bool playback, void *destination, bool staged, GLenum *outTextureFormat, unsigned long *outSize)
+{
+    const uint8_t *frameData = ReadFrame(context, track, frame, playback, context->hapFrameBuffer);
+    if (frameData == NULL) {
+        return HapResult_Internal_Error;
+    }
+    
+    unsigned int result;
+    if (staged) {
+        result = HapDecodeStaged(frameData, track->frameSizes[frame], ParallelHapCallback, NULL, destination, context->textureBufferSize, outSize, outTextureFormat);
+    } else {
+        result = HapDecode(frameData, track->frameSizes[frame], ParallelHapCallback, NULL, destination, context->textureBufferSize, outSize, outTextureFormat);
+    }
+    
+    // Scaled YCoCg is stored as DXT5 and converted back to RGB by the material's shader. The format is only set if decoding succeeded.
+    if (result == HapResult_No_Error && *outTextureFormat == HapTextureFormat_YCoCg_DXT5) {
+        *outTextureFormat = HapTextureFormat_RGBA_DXT5;
+    }
+    
+    return result;
+}
+
+/*
+ Uploads a decoded frame of track, only specifying the texture's storage when it is first used or the level of
+ detail changes its size. data is an offset into the bound pixel buffer if there is one.
+ */
+static void UploadFrame(HapMovieTextureContext *context, MovieTrackIndex *track, GLuint textureHandle, GLenum textureFormat, unsigned long size, const void *data)
+{
+    glBindTexture(GL_TEXTURE_2D, textureHandle);
+    
+    if (context->allocatedTexture == textureHandle && context->allocatedTextureFormat == textureFormat
+        && context->allocatedWidth == track->width && context->allocatedHeight == track->height) {
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, track->width, track->height, textureFormat, (GLsizei)size, data);
+    } else {
+        glCompressedTexImage2D(GL_TEXTURE_2D, 0, textureFormat, track->width, track->height, 0, (GLsizei)size, data);
+        
+        context->allocatedTexture = textureHandle;
+        context->allocatedTextureFormat = textureFormat;
+        context->allocatedWidth = track->width;
+        context->allocatedHeight = track->height;
+        
+        // Any mipmap levels are now the wrong size, so limit sampling to level 0 until they are replaced
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        context->mipmapsAllocated = false;
+    }
+}
+
+static void CloseMipmaps(HapMovieTextureContext *context)
+{
+    if (context->mipmapFile == NULL) {
+        return;
+    }
+    
+    fclose(context->mipmapFile);
+    MovieIndexFree(&context->mipmapIndex);
+    free(context->mipmapFrameBuffer);
+    
+    context->mipmapFile = NULL;
+    context->mipmapFrameBuffer = NULL;
+    context->mipmapsAllocated = false;
+}
+
+/*
+ Uses the mipmap sidecar at path, as written by WriteMipmapSidecar, to upload levels 1 and below with every
+ frame, or stops using one if path is NULL. Mipmaps are only uploaded at level of detail 0. Returns 0 or an
+ errno value.
+ */
+int SetContextMipmaps(HapMovieTextureContext *context, const char *path) {
+    if (context == NULL) {
+        return EINVAL;
+    }
+    if (context->stream != NULL) {
+        return ENOTSUP;
+    }
+    
+    CloseMipmaps(context);
+    if (path == NULL) {
+        return 0;
+    }
+    
+    context->mipmapFile = fopen(path, "r");
+    if (context->mipmapFile == NULL) {
+        return errno;
+    }
+    
+    if (MovieIndexReadCached(context->mipmapFile, path, &context->mipmapIndex) != 0) {
+        fclose(context->mipmapFile);
+        context->mipmapFile = NULL;
+        return EFTYPE;
+    }
+    
+    // The sidecar's track has the dimensions of level 1
+    MovieTrackIndex *mipmapTrack = &context->mipmapIndex.tracks[0];
+    if (mipmapTrack->codec != context->track->codec
+        || mipmapTrack->width != (context->track->width > 1 ? context->track->width / 2 : 1)
+        || mipmapTrack->height != (context->track->height > 1 ? context->track->height / 2 : 1)) {
+        CloseMipmaps(context);
+        return EFTYPE;
+    }
+    
+    context->mipmapFrameBuffer = malloc(mipmapTrack->maxFrameSize);
+    if (context->mipmapFrameBuffer == NULL) {
+        CloseMipmaps(context);
+        return ENOMEM;
+    }
+    
+    return 0;
+}
+
+/*
+ Reads the mipmap levels for frame from the sidecar and uploads them below the level 0 just uploaded. Levels
+ are decoded one at a time through textureBuffer, which level 0 has finished with.
+ */
+static void UploadMipmaps(HapMovieTextureContext *context, int frame, GLuint textureHandle)
+{
+    if (context->mipmapFile == NULL || context->levelOfDetail != 0) {
+        return;
+    }
+    
+    MovieTrackIndex *mipmapTrack = &context->mipmapIndex.tracks[0];
+    if (frame >= mipmapTrack->frameCount) {
+        frame = mipmapTrack->frameCount - 1;
+    }
+    
+    uint32_t size = mipmapTrack->frameSizes[frame];
+    if (pread(fileno(context->mipmapFile), context->mipmapFrameBuffer, size, mipmapTrack->frameOffsets[frame]) != size) {
+        return;
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, textureHandle);
+    
+    int level = 0;
+    int width = context->track->width, height = context->track->height;
+    uint32_t offset = 0;
+    while (offset + 4 <= size && (width > 1 || height > 1)) {
+        uint32_t length = OSReadBigInt32(context->mipmapFrameBuffer, offset);
+        offset += 4;
+        if (length > size - offset) {
+            break;
+        }
+        
+        GLenum textureFormat;
+        unsigned long decodedSize;
+        if (HapDecode(context->mipmapFrameBuffer + offset, length, ParallelHapCallback, NULL, context->textureBuffer, context->textureBufferSize, &decodedSize, &textureFormat) != HapResult_No_Error
+            || textureFormat != context->allocatedTextureFormat) {
+            break;
+        }
+        offset += length;
+        
+        level++;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+        
+        if (context->mipmapsAllocated) {
+            glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height, textureFormat, (GLsizei)decodedSize, context->textureBuffer);
+        } else {
+            glCompressedTexImage2D(GL_TEXTURE_2D, level, textureFormat, width, height, 0, (GLsizei)decodedSize, context->textureBuffer);
+        }
+    }
+    
+    // Only sample the levels which have been specified, so a short sample never leaves the texture incomplete
+    if (!context->mipmapsAllocated) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level);
+        context->mipmapsAllocated = true;
+    }
+}
+
+static void CreatePixelBuffers(HapMovieTextureContext *context)
+{
+    if (context->pixelBuffers[0] != 0 || context->pixelBuffersUnavailable) {
+        return;
+    }
+    
+    glGenBuffers(kPixelBufferCount, context->pixelBuffers);
+    if (context->pixelBuffers[0] == 0) {
+        context->pixelBuffersUnavailable = true;
+        return;
+    }
+    
+    int i;
+    for (i = 0; i < kPixelBufferCount; i++) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, context->pixelBuffers[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, context->textureBufferSize, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+static void DestroyPixelBuffers(HapMovieTextureContext *context)
+{
+    int i;
+    for (i = 0; i < kPixelBufferCount; i++) {
+        if (context->pixelBufferFences[i] != NULL) {
+            glDeleteSync(context->pixelBufferFences[i]);
+            context->pixelBufferFences[i] = NULL;
+        }
+    }
+    
+    if (context->pixelBuffers[0] != 0) {
+        glDeleteBuffers(kPixelBufferCount, context->pixelBuffers);
+        memset(context->pixelBuffers, 0, sizeof(context->pixelBuffers));
+    }
+}
+
+/*
+ Decodes frame into the next pixel buffer in the ring and uploads it from there. Returns false if the pixel
+ buffer could not be used, in which case the caller should fall back to textureBuffer.
+ */
+static bool UpdateTextureFromPixelBuffer(HapMovieTextureContext *context, MovieTrackIndex *track, int frame, GLuint textureHandle)
+{
+    int i = context->pixelBufferIndex;
+    
+    GLenum waitResult = GL_ALREADY_SIGNALED;
+    if (context->pixelBufferFences[i] != NULL) {
+        waitResult = glClientWaitSync(context->pixelBufferFences[i], GL_SYNC_FLUSH_COMMANDS_BIT, kPixelBufferFenceTimeout);
+        glDeleteSync(context->pixelBufferFences[i]);
+        context->pixelBufferFences[i] = NULL;
+    }
+    
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, context->pixelBuffers[i]);
+    
+    /*
+     If the GPU may still be reading the buffer, orphan its storage rather than write over a frame in flight;
+     the driver frees the old storage once the upload from it completes
+     */
+    if (waitResult != GL_ALREADY_SIGNALED && waitResult != GL_CONDITION_SATISFIED) {
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, context->textureBufferSize, NULL, GL_STREAM_DRAW);
+    }
+    
+    void *mapped = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (mapped == NULL) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        DestroyPixelBuffers(context);
+        context->pixelBuffersUnavailable = true;
+        return false;
+    }
+    
+    GLenum textureFormat; unsigned long outsz;
+    unsigned int result = DecodeFrame(context, track, frame, true, mapped, true, &textureFormat, &outsz);
+    
+    if (glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) && result == HapResult_No_Error) {
+        UploadFrame(context, track, textureHandle, textureFormat, outsz, NULL);
+        
+        context->pixelBufferFences[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        context->pixelBufferIndex = (i + 1) % kPixelBufferCount;
+    }
+    
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    
+    return true;
+}
+
+/*
+ Pays the first-frame costs up front: touches every page of the frame buffers, reads and decodes the first
+ frames so their data and the decoder are warm, and allocates the texture's storage with the first frame
+ along with the pixel buffers used to upload later frames. Playback then starts from the first frame.
+ */
+void Preroll(HapMovieTextureContext *context, GLuint textureHandle, int frames) {
+    if (context == NULL) {
+        return;
+    }
+    
+    AbandonDecode(context);
+    CancelDecodeAhead(context, true);
+    
+    memset(context->textureBuffer, 0, context->textureBufferSize);
+    if (context->pinnedData == NULL) {
+        memset(context->hapFrameBuffer, 0, context->track->maxFrameSize);
+    }
+    
+    // A stream has no frames to decode ahead of time
+    if (context->stream != NULL) {
+        CreatePixelBuffers(context);
+        return;
+    }
+    
+    if (frames < 1) {
+        frames = 1;
+    }
+    if (frames > context->track->frameCount) {
+        frames = context->track->frameCount;
+    }
+    
+    // Decode backwards so the first frame is the one left in textureBuffer to upload
+    int frame, sample = 0;
+    MovieTrackIndex *track = context->track;
+    GLenum textureFormat = 0; unsigned long outsz = 0;
+    unsigned int result = HapResult_No_Error;
+    for (frame = frames - 1; frame >= 0; frame--) {
+        track = LevelTrack(context, frame, &sample);
+        result = DecodeFrame(context, track, sample, false, context->textureBuffer, false, &textureFormat, &outsz);
+    }
+    
+    if (result == HapResult_No_Error) {
+        UploadFrame(context, track, textureHandle, textureFormat, outsz, context->textureBuffer);
+        UploadMipmaps(context, 0, textureHandle);
+    }
+    
+    CreatePixelBuffers(context);
+    
+    context->currentFrame = 0;
+}
+
+/*
+ Decodes a frame a budgeted slice at a time on the calling thread, uploading it once it is complete. The
+ texture keeps showing the previous frame until then, and playback advances a frame per completed decode.
+ */
+static void UpdateTextureIncrementally(HapMovieTextureContext *context, GLuint textureHandle)
+{
+    if (context->decodeProgress == NULL) {
+        if (context->stream != NULL && !ReceiveStreamFrame(context)) {
+            return;
+        }
+        
+        int sample;
+        context->decodeFrame = context->currentFrame;
+        context->currentFrame = NextFrame(context, context->decodeFrame);
+        context->decodeTrack = LevelTrack(context, context->decodeFrame, &sample);
+        
+        const uint8_t *frameData = ReadFrame(context, context->decodeTrack, sample, true, context->hapFrameBuffer);
+        if (frameData == NULL
+            || HapDecodeBegin(frameData, context->decodeTrack->frameSizes[sample], context->textureBuffer, context->textureBufferSize,
+                              &context->decodeTextureFormat, &context->decodeProgress) != HapResult_No_Error) {
+            return;
+        }
+    }
+    
+    if (!HapDecodeContinue(context->decodeProgress, context->decodeBudget)) {
+        return;
+    }
+    
+    unsigned long size;
+    unsigned int result = HapDecodeEnd(context->decodeProgress, &size);
+    context->decodeProgress = NULL;
+    if (result != HapResult_No_Error) {
+        return;
+    }
+    
+    GLenum textureFormat = context->decodeTextureFormat == HapTextureFormat_YCoCg_DXT5 ? HapTextureFormat_RGBA_DXT5 : context->decodeTextureFormat;
+    UploadFrame(context, context->decodeTrack, textureHandle, textureFormat, size, context->textureBuffer);
+    UploadMipmaps(context, context->decodeFrame, textureHandle);
+}
+
+static void DecodeAheadWork(void *p, size_t index)
+{
+    DecodeAheadJob *job = p;
+    HapMovieTextureContext *context = job->context;
+    
+    job->result = HapResult_Internal_Error;
+    if (job->cancellation.cancelled) {
+        return;
+    }
+    
+    const uint8_t *frameData = ReadFrame(context, job->track, job->sample, true, job->frameBuffer);
+    if (frameData == NULL || job->cancellation.cancelled) {
+        return;
+    }
+    
+    job->result = HapDecode(frameData, job->track->frameSizes[job->sample], ParallelHapCallback, &job->cancellation, job->textureBuffer, context->textureBufferSize, &job->size, &job->textureFormat);
+    
+    if (job->result == HapResult_No_Error && job->textureFormat == HapTextureFormat_YCoCg_DXT5) {
+        job->textureFormat = HapTextureFormat_RGBA_DXT5;
+    }
+}
+
+/*
+ Starts decoding frame of the main track in the background. Any previous job must have been waited for.
+ */
+static void StartDecodeAhead(HapMovieTextureContext *context, int frame)
+{
+    DecodeAheadJob *job = &context->decodeAhead;
+    
+    job->track = LevelTrack(context, frame, &job->sample);
+    job->cancellation.cancelled = false;
+    
+    context->decodeAheadPending = true;
+    context->decodeAheadTask = ExecutorSubmit(DecodeAheadWork, job);
+}
+
+/*
+ Uploads the current frame, taking it from the background decode started by the previous update when that
+ was for the same frame, and then starts decoding the next frame in the background. A background decode
+ for any other frame, left by a seek or a change of level of detail, is cancelled and drains while the
+ wanted frame is decoded here.
+ */
+static void UpdateTextureAhead(HapMovieTextureContext *context, GLuint textureHandle)
+{
+    DecodeAheadJob *job = &context->decodeAhead;
+    int frame = context->currentFrame, sample;
+    context->currentFrame = NextFrame(context, frame);
+    
+    MovieTrackIndex *track = LevelTrack(context, frame, &sample);
+    
+    if (context->decodeAheadPending && (job->track != track || job->sample != sample)) {
+        CancelDecodeAhead(context, false);
+    }
+    
+    if (context->decodeAheadPending && !job->cancellation.cancelled) {
+        ExecutorWait(context->decodeAheadTask);
+        context->decodeAheadPending = false;
+        
+        if (job->result == HapResult_No_Error) {
+            UploadFrame(context, track, textureHandle, job->textureFormat, job->size, job->textureBuffer);
+        }
+    } else {
+        GLenum textureFormat; unsigned long outsz;
+        if (DecodeFrame(context, track, sample, true, context->textureBuffer, false, &textureFormat, &outsz) == HapResult_No_Error) {
+            UploadFrame(context, track, textureHandle, textureFormat, outsz, context->textureBuffer);
+        }
+        
+        CancelDecodeAhead(context, true);
+    }
+    
+    UploadMipmaps(context, frame, textureHandle);
+    
+    StartDecodeAhead(context, context->currentFrame);
+}
+
+void UpdateTexture(HapMovieTextureContext *context, GLuint textureHandle) {
+    if (context == NULL) {
+        return;
+    }
+    
+    if (context->decodeBudget > 0) {
+        UpdateTextureIncrementally(context, textureHandle);
+        return;
+    }
+    
+    if (context->decodeAheadEnabled) {
+        UpdateTextureAhead(context, textureHandle);
+        return;
+    }
+    
+    if (context->stream != NULL && !ReceiveStreamFrame(context)) {
+        return;
+    }
+    
+    int frame = context->currentFrame;
+    context->currentFrame = NextFrame(context, frame);
+    
+    int sample;
+    MovieTrackIndex *track = LevelTrack(context, frame, &sample);
+    
+    CreatePixelBuffers(context);
+    
+    if (context->pixelBuffersUnavailable || !UpdateTextureFromPixelBuffer(context, track, sample, textureHandle)) {
+        GLenum textureFormat; unsigned long outsz;
+        if (DecodeFrame(context, track, sample, true, context->textureBuffer, false, &textureFormat, &outsz) != HapResult_No_Error) {
+            return;
+        }
+        
+        UploadFrame(context, track, textureHandle, textureFormat, outsz, context->textureBuffer);
+    }
+    
+    UploadMipmaps(context, frame, textureHandle);
+}
+
+/*
+ Selects the full resolution track at level 0 or the proxy track at any higher level, from the next frame
+ on. Playback position is kept in frames of the full track, so switching never skips or repeats a frame.
+ Returns the level in effect, which is 0 if the movie has no proxy.
+ */
+int SetLevelOfDetail(HapMovieTextureContext *context, int level) {
+    if (context == NULL) {
+        return 0;
+    }
+    
+    context->levelOfDetail = level > 0 && context->proxyTrack != NULL ? 1 : 0;
+    
+    return context->levelOfDetail;
+}
+
+/*
+ Moves uploads to a thread with its own GL context, which saves the render thread the driver's time in them.
+ Frames are then shown with UpdateUploadedTexture rather than UpdateTexture. Must be called on the render
+ thread. Returns 0 or an errno value.
+ */
+int SetUploadThread(HapMovieTextureContext *context, bool enabled) {
+    if (context == NULL) {
+        return EINVAL;
+    }
+    
+    if (enabled && context->uploadStream == NULL) {
+        context->uploadStream = UploadStreamCreate(context->textureBufferSize);
+        if (context->uploadStream == NULL) {
+            return ENOTSUP;
+        }
+    } else if (!enabled && context->uploadStream != NULL) {
+        UploadStreamDestroy(context->uploadStream);
+        context->uploadStream = NULL;
+    }
+    
+    return 0;
+}
+
+/*
+ Decodes the next frame and queues it on the upload thread, then returns the texture holding the newest frame
+ uploaded, which the caller samples in place of a texture of its own, or 0 until the first frame is uploaded.
+ The frame is dropped if uploads are falling behind. Must be called on the render thread before drawing.
+ */
+GLuint UpdateUploadedTexture(HapMovieTextureContext *context) {
+    if (context == NULL || context->uploadStream == NULL) {
+        return 0;
+    }
+    
+    GLuint texture = UploadStreamTexture(context->uploadStream);
+    
+    if (context->stream != NULL && !ReceiveStreamFrame(context)) {
+        return texture;
+    }
+    
+    int frame = context->currentFrame, sample;
+    context->currentFrame = NextFrame(context, frame);
+    
+    void *buffer = UploadStreamBuffer(context->uploadStream);
+    if (buffer == NULL) {
+        return texture;
+    }
+    
+    MovieTrackIndex *track = LevelTrack(context, frame, &sample);
+    GLenum textureFormat; unsigned long outsz;
+    if (DecodeFrame(context, track, sample, true, buffer, false, &textureFormat, &outsz) == HapResult_No_Error) {
+        UploadStreamSubmit(context->uploadStream, textureFormat, track->width, track->height, outsz);
+        context->uploadedTextureFormat = textureFormat;
+    } else {
+        UploadStreamCancel(context->uploadStream);
+    }
+    
+    return texture;
+}
+
+/*
+ Returns the format of the textures UpdateUploadedTexture returns, so the host can wrap them with the
+ matching compressed format: HapTextureFormat_RGB_DXT1 for Hap movies or HapTextureFormat_RGBA_DXT5 for
+ Hap Alpha and Hap Q. Returns 0 until a frame has been queued.
+ */
+GLenum GetUploadedTextureFormat(HapMovieTextureContext *context) {
+    return context != NULL ? context->uploadedTextureFormat : 0;
+}
+
+#if defined(HAP_VULKAN)
+/*
+ For Vulkan hosts, decodes the next frame of the full resolution track straight into uploader's staging memory
+ and copies it into image on the uploader's transfer queue. Returns the value of the uploader's timeline
+ semaphore for the host's graphics queue to wait on before sampling image, or 0 if no frame was uploaded.
+ See VulkanUploaderSubmit for the image required.
+ */
+uint64_t UpdateVulkanImage(HapMovieTextureContext *context, VulkanUploader *uploader, VkImage image) {
+    if (context == NULL || uploader == NULL) {
+        return 0;
+    }
+    
+    if (context->stream != NULL && !ReceiveStreamFrame(context)) {
+        return 0;
+    }
+    
+    int frame = context->currentFrame;
+    context->currentFrame = NextFrame(context, frame);
+    
+    void *buffer = VulkanUploaderReserve(uploader, context->textureBufferSize);
+    if (buffer == NULL) {
+        return 0;
+    }
+    
+    MovieTrackIndex *track = context->track;
+    GLenum textureFormat; unsigned long outsz;
+    if (DecodeFrame(context, track, frame, true, buffer, true, &textureFormat, &outsz) != HapResult_No_Error) {
+        VulkanUploaderCancel(uploader);
+        return 0;
+    }
+    
+    return VulkanUploaderSubmit(uploader, image, track->width, track->height);
+}
+#endif
+
+/*
+ Adds a consumer of the frames PublishFrame decodes, so that several outputs can show a movie for the cost of
+ decoding it once. Returns NULL if the context already has kMaxFrameSinks sinks. Sinks are added, removed and
+ published to from one thread, but each is read from the thread of its own consumer.
+ */
+ContextFrameSink *AddFrameSink(HapMovieTextureContext *context) {
+    if (context == NULL || context->frameSinkCount == kMaxFrameSinks) {
+        return NULL;
+    }
+    
+    if (context->framePool == NULL) {
+        context->framePool = DecodedFramePoolCreate(context->textureBufferSize, kDecodedFrameCount);
+        if (context->framePool == NULL) {
+            return NULL;
+        }
+    }
+    
+    ContextFrameSink *sink = calloc(1, sizeof(ContextFrameSink));
+    if (sink == NULL || (sink->sink = FrameSinkCreate()) == NULL) {
+        free(sink);
+        return NULL;
+    }
+    
+    context->frameSinks[context->frameSinkCount++] = sink;
+    
+    return sink;
+}
+
+/*
+ Removes a sink, whose consumer must have stopped reading from it
+ */
+void RemoveFrameSink(HapMovieTextureContext *context, ContextFrameSink *sink) {
+    if (context == NULL || sink == NULL) {
+        return;
+    }
+    
+    int i;
+    for (i = 0; i < context->frameSinkCount; i++) {
+        if (context->frameSinks[i] == sink) {
+            context->frameSinks[i] = context->frameSinks[--context->frameSinkCount];
+            FrameSinkDestroy(sink->sink);
+            free(sink);
+            return;
+        }
+    }
+}
+
+/*
+ Decodes the next frame once and delivers it to every sink, returning its number, or -1 if no frame was
+ published because there are no sinks, the frame could not be decoded, or the sinks still hold every buffer
+ */
+int PublishFrame(HapMovieTextureContext *context) {
+    if (context == NULL || context->frameSinkCount == 0) {
+        return -1;
+    }
+    
+    if (context->stream != NULL && !ReceiveStreamFrame(context)) {
+        return -1;
+    }
+    
+    int frame = context->currentFrame, sample;
+    context->currentFrame = NextFrame(context, frame);
+    
+    DecodedFrame *decoded = DecodedFramePoolTake(context->framePool);
+    if (decoded == NULL) {
+        return -1;
+    }
+    
+    MovieTrackIndex *track = LevelTrack(context, frame, &sample);
+    GLenum textureFormat;
+    if (DecodeFrame(context, track, sample, true, decoded->data, false, &textureFormat, &decoded->size) != HapResult_No_Error) {
+        DecodedFrameRelease(decoded);
+        return -1;
+    }
+    
+    decoded->textureFormat = textureFormat;
+    decoded->width = track->width;
+    decoded->height = track->height;
+    decoded->frame = frame;
+    
+    int i;
+    for (i = 0; i < context->frameSinkCount; i++) {
+        FrameSinkDeliver(context->frameSinks[i]->sink, decoded);
+    }
+    
+    DecodedFrameRelease(decoded);
+    
+    return frame;
+}
+
+/*
+ Uploads the newest frame published to sink, if there is one it has not shown, to a texture of the GL context
+ current on the calling thread. Returns true if the texture was updated.
+ */
+bool UpdateSinkTexture(ContextFrameSink *sink, GLuint textureHandle) {
+    if (sink == NULL) {
+        return false;
+    }
+    
+    DecodedFrame *frame = FrameSinkAcquire(sink->sink);
+    if (frame == NULL) {
+        return false;
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, textureHandle);
+    
+    if (sink->allocatedTexture == textureHandle && sink->allocatedTextureFormat == frame->textureFormat
+        && sink->allocatedWidth == frame->width && sink->allocatedHeight == frame->height) {
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame->width, frame->height, frame->textureFormat, (GLsizei)frame->size, frame->data);
+    } else {
+        glCompressedTexImage2D(GL_TEXTURE_2D, 0, frame->textureFormat, frame->width, frame->height, 0, (GLsizei)frame->size, frame->data);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        
+        sink->allocatedTexture = textureHandle;
+        sink->allocatedTextureFormat = frame->textureFormat;
+        sink->allocatedWidth = frame->width;
+        sink->allocatedHeight = frame->height;
+    }
+    
+    // GL has copied the data by the time the call returns, so the frame can go back at once
+    FrameSinkComplete(sink->sink);
+    
+    return true;
+}
+
+/*
+ For a CPU consumer such as a preview, returns the newest frame published to sink as S3TC blocks, or NULL if
+ there is none it has not seen. The data stays valid until ReleaseSinkFrame or the next call.
+ */
+const void *AcquireSinkFrame(ContextFrameSink *sink, int *outFrame, int *outWidth, int *outHeight, GLenum *outTextureFormat, unsigned long *outSize) {
+    if (sink == NULL) {
+        return NULL;
+    }
+    
+    DecodedFrame *frame = FrameSinkAcquire(sink->sink);
+    if (frame == NULL) {
+        return NULL;
+    }
+    
+    *outFrame = frame->frame;
+    *outWidth = frame->width;
+    *outHeight = frame->height;
+    *outTextureFormat = frame->textureFormat;
+    *outSize = frame->size;
+    
+    return frame->data;
+}
+
+void ReleaseSinkFrame(ContextFrameSink *sink) {
+    if (sink != NULL) {
+        FrameSinkComplete(sink->sink);
+    }
+}
+
+#if defined(HAP_VULKAN)
+/*
+ Copies the newest frame published to sink into image through uploader, as UpdateVulkanImage does. Returns the
+ timeline value to wait on, or 0 if there was no new frame or it could not be uploaded.
+ */
+uint64_t UpdateSinkVulkanImage(ContextFrameSink *sink, VulkanUploader *uploader, VkImage image) {
+    if (sink == NULL || uploader == NULL) {
+        return 0;
+    }
+    
+    DecodedFrame *frame = FrameSinkAcquire(sink->sink);
+    if (frame == NULL) {
+        return 0;
+    }
+    
+    uint64_t value = 0;
+    void *staging = VulkanUploaderReserve(uploader, frame->size);
+    if (staging != NULL) {
+        memcpy(staging, frame->data, frame->size);
+        value = VulkanUploaderSubmit(uploader, image, frame->width, frame->height);
+    }
+    
+    FrameSinkComplete(sink->sink);
+    
+    return value;
+}
+#endif
+
+/*
+ Sets the number of the last frame the sink's consumer finished with, or -1, followed by the counts of frames
+ delivered to it, completed and skipped because a newer frame arrived first
+ */
+void GetSinkStatistics(ContextFrameSink *sink, int64_t *statistics) {
+    if (sink == NULL || statistics == NULL) {
+        return;
+    }
+    
+    FrameSinkStatistics sinkStatistics;
+    FrameSinkGetStatistics(sink->sink, &sinkStatistics);
+    
+    statistics[0] = sinkStatistics.completedFrame;
+    statistics[1] = (int64_t)sinkStatistics.delivered;
+    statistics[2] = (int64_t)sinkStatistics.completed;
+    statistics[3] = (int64_t)sinkStatistics.skipped;
+}
+
+/*
+ Creates an empty atlas of width by height pixels. Its texture format is that of the first context added.
+ */
+HapMovieTextureAtlas *CreateAtlas(int width, int height) {
+    if (width <= 0 || height <= 0) {
+        return NULL;
+    }
+    
+    HapMovieTextureAtlas *atlas = calloc(1, sizeof(HapMovieTextureAtlas));
+    if (atlas == NULL) {
+        return NULL;
+    }
+    
+    atlas->width = width;
+    atlas->height = height;
+    
+    return atlas;
+}
+
+/*
+ Places context's movie in the atlas with its top left corner at x, y, which must be multiples of 4 so that it
+ starts on a block. Only the full resolution track is shown, whatever the context's level of detail, and every
+ movie in an atlas must have the same texture format. Rectangles must not overlap. A context in an atlas is
+ played by UpdateAtlasTexture and should not also be updated by itself. Returns 0 or an errno value; EEXIST if
+ the context is already in the atlas.
+ */
+int AddAtlasContext(HapMovieTextureAtlas *atlas, HapMovieTextureContext *context, int x, int y) {
+    if (atlas == NULL || context == NULL || x < 0 || y < 0 || x % 4 != 0 || y % 4 != 0) {
+        return EINVAL;
+    }
+    if (context->stream != NULL) {
+        return ENOTSUP;
+    }
+    
+    // Each entry advances its context's frame, so a context added twice would skip every other frame
+    int i;
+    for (i = 0; i < atlas->entryCount; i++) {
+        if (atlas->entries[i].context == context) {
+            return EEXIST;
+        }
+    }
+    
+    if (atlas->entryCount == kMaxAtlasContexts) {
+        return ENOSPC;
+    }
+    
+    MovieTrackIndex *track = context->track;
+    if ((x + track->width + 3) / 4 > (atlas->width + 3) / 4 || (y + track->height + 3) / 4 > (atlas->height + 3) / 4) {
+        return ERANGE;
+    }
+    
+    const uint8_t *frameData = ReadFrame(context, track, 0, false, context->hapFrameBuffer);
+    unsigned int textureFormat;
+    if (frameData == NULL || HapGetFrameTextureFormat(frameData, track->frameSizes[0], &textureFormat) != HapResult_No_Error) {
+        return EIO;
+    }
+    if (textureFormat == HapTextureFormat_YCoCg_DXT5) {
+        textureFormat = HapTextureFormat_RGBA_DXT5;
+    }
+    
+    if (atlas->buffer == NULL) {
+        size_t blockBytes = textureFormat == HapTextureFormat_RGB_DXT1 ? 8 : 16;
+        atlas->rowBytes = (size_t)((atlas->width + 3) / 4) * blockBytes;
+        atlas->bufferSize = atlas->rowBytes * ((atlas->height + 3) / 4);
+        atlas->buffer = calloc(1, atlas->bufferSize);
+        if (atlas->buffer == NULL) {
+            return ENOMEM;
+        }
+        atlas->textureFormat = textureFormat;
+    } else if (textureFormat != atlas->textureFormat) {
+        return EINVAL;
+    }
+    
+    AbandonDecode(context);
+    CancelDecodeAhead(context, true);
+    
+    AtlasEntry *entry = &atlas->entries[atlas->entryCount++];
+    entry->context = context;
+    entry->blockX = x / 4;
+    entry->blockY = y / 4;
+    entry->result = HapResult_No_Error;
+    
+    return 0;
+}
+
+/*
+ Takes context out of the atlas. Its rectangle keeps showing its last frame.
+ */
+void RemoveAtlasContext(HapMovieTextureAtlas *atlas, HapMovieTextureContext *context) {
+    if (atlas == NULL) {
+        return;
+    }
+    
+    int i;
+    for (i = 0; i < atlas->entryCount; i++) {
+        if (atlas->entries[i].context == context) {
+            atlas->entries[i] = atlas->entries[--atlas->entryCount];
+            return;
+        }
+    }
+}
+
+static void AtlasDecodeWork(void *p, size_t index)
+{
+    HapMovieTextureAtlas *atlas = p;
+    AtlasEntry *entry = &atlas->entries[index];
+    HapMovieTextureContext *context = entry->context;
+    MovieTrackIndex *track = context->track;
+    
+    int frame = context->currentFrame;
+    context->currentFrame = NextFrame(context, frame);
+    
+    const uint8_t *frameData = ReadFrame(context, track, frame, true, context->hapFrameBuffer);
+    if (frameData == NULL) {
+        entry->result = HapResult_Internal_Error;
+        return;
+    }
+    
+    // A frame in another format than the atlas would be written with the wrong block size, so is never started
+    unsigned int textureFormat;
+    entry->result = HapGetFrameTextureFormat(frameData, track->frameSizes[frame], &textureFormat);
+    if (entry->result != HapResult_No_Error) {
+        return;
+    }
+    if ((textureFormat == HapTextureFormat_YCoCg_DXT5 ? HapTextureFormat_RGBA_DXT5 : textureFormat) != atlas->textureFormat) {
+        entry->result = HapResult_Bad_Frame;
+        return;
+    }
+    
+    entry->result = HapDecodeRegion(frameData, track->frameSizes[frame], ParallelHapCallback, NULL, track->width, track->height,
+                                    atlas->buffer, atlas->bufferSize, atlas->rowBytes, entry->blockX, entry->blockY, &textureFormat);
+}
+
+/*
+ Decodes the next frame of every context in the atlas straight into its rectangle, the contexts in parallel,
+ and uploads the whole atlas to textureHandle at once. A rectangle whose frame cannot be read, or is not in
+ the atlas's format, keeps its last frame; one whose frame fails part way through decoding may show the chunks
+ that were decoded over the last frame. Returns the number of rectangles updated.
+ */
+int UpdateAtlasTexture(HapMovieTextureAtlas *atlas, GLuint textureHandle) {
+    if (atlas == NULL || atlas->entryCount == 0) {
+        return 0;
+    }
+    
+    ExecutorBatch(AtlasDecodeWork, atlas, atlas->entryCount);
+    
+    int i, updated = 0;
+    for (i = 0; i < atlas->entryCount; i++) {
+        if (atlas->entries[i].result == HapResult_No_Error) {
+            updated++;
+        }
+    }
+    
+    if (updated == 0) {
+        return 0;
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, textureHandle);
+    
+    if (atlas->allocatedTexture == textureHandle) {
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, atlas->width, atlas->height, atlas->textureFormat, (GLsizei)atlas->bufferSize, atlas->buffer);
+    } else {
+        glCompressedTexImage2D(GL_TEXTURE_2D, 0, atlas->textureFormat, atlas->width, atlas->height, 0, (GLsizei)atlas->bufferSize, atlas->buffer);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        
+        atlas->allocatedTexture = textureHandle;
+    }
+    
+    return updated;
+}
+
+/*
+ Destroys the atlas but not its contexts
+ */
+void DestroyAtlas(HapMovieTextureAtlas *atlas) {
+    if (atlas == NULL) {
+        return;
+    }
+    
+    free(atlas->buffer);
+    free(atlas);
+}
+
+/*
+ Every frame of a flipbook's clip decoded side by side, with a hash of each to find repeated frames quickly
+ */
+typedef struct {
+    HapMovieTextureContext *context;
+    uint8_t *frames;
+    size_t frameSize;
+    uint64_t *hashes;
+    unsigned int *results;
+    unsigned int *textureFormats;
+} FlipbookLoadJob;
+
+static uint64_t HashFrame(const uint8_t *data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    
+    size_t i;
+    for (i = 0; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    }
+    
+    return hash;
+}
+
+static void FlipbookLoadWork(void *p, size_t index)
+{
+    FlipbookLoadJob *job = p;
+    HapMovieTextureContext *context = job->context;
+    MovieTrackIndex *track = context->track;
+    off_t offset = track->frameOffsets[index];
+    uint32_t size = track->frameSizes[index];
+    uint8_t *frameBuffer = NULL;
+    const uint8_t *frameData;
+    
+    job->results[index] = HapResult_Internal_Error;
+    
+    if (context->pinnedData != NULL) {
+        frameData = (const uint8_t *)context->pinnedData + (offset - context->pinnedOffset);
+    } else {
+        frameBuffer = malloc(size);
+        if (frameBuffer == NULL || pread(fileno(context->file), frameBuffer, size, offset) != size) {
+            free(frameBuffer);
+            return;
+        }
+        frameData = frameBuffer;
+    }
+    
+    uint8_t *destination = job->frames + index * job->frameSize;
+    unsigned long used;
+    job->results[index] = HapDecode(frameData, size, ParallelHapCallback, NULL, destination, job->frameSize, &used, &job->textureFormats[index]);
+    if (job->results[index] == HapResult_No_Error) {
+        job->hashes[index] = HashFrame(destination, job->frameSize);
+    }
+    
+    free(frameBuffer);
+}
+
+/*
+ Gives each distinct frame the next layer, moving it down to follow the last so that the layers end up packed
+ in order at the start of frames. A frame is only ever moved down over frames already placed. Returns 0, or
+ EIO if any frame could not be decoded or its format differs from the first.
+ */
+static int PackFlipbookLayers(FlipbookLoadJob *job, int frameCount, int *layers, int *outLayerCount)
+{
+    size_t frameSize = job->frameSize;
+    int frame, layerCount = 0;
+    
+    for (frame = 0; frame < frameCount; frame++) {
+        if (job->results[frame] != HapResult_No_Error || job->textureFormats[frame] != job->textureFormats[0]) {
+            return EIO;
+        }
+        
+        const uint8_t *data = job->frames + frame * frameSize;
+        
+        int earlier;
+        for (earlier = 0; earlier < frame; earlier++) {
+            if (job->hashes[earlier] == job->hashes[frame]
+                && memcmp(job->frames + layers[earlier] * frameSize, data, frameSize) == 0) {
+                break;
+            }
+        }
+        
+        if (earlier < frame) {
+            layers[frame] = layers[earlier];
+        } else {
+            if (layerCount != frame) {
+                memmove(job->frames + layerCount * frameSize, data, frameSize);
+            }
+            layers[frame] = layerCount++;
+        }
+    }
+    
+    *outLayerCount = layerCount;
+    
+    return 0;
+}
+
+/*
+ Frees a context's flipbook, returning it to ordinary playback
+ */
+void UnloadFlipbook(HapMovieTextureContext *context) {
+    if (context == NULL) {
+        return;
+    }
+    
+    if (context->flipbookTexture != 0) {
+        glDeleteTextures(1, &context->flipbookTexture);
+        context->flipbookTexture = 0;
+    }
+    free(context->flipbookLayers);
+    context->flipbookLayers = NULL;
+}
+
+/*
+ Turns a short clip into a flipbook: decodes all of its frames at once across the executor and uploads them
+ to a compressed 2D texture array with one layer per distinct frame, so frames which repeat, such as holds in
+ an animation, are stored once. Playback then costs no decoding or uploading; UpdateFlipbook gives the layer
+ to show. Only the full resolution track is used. Returns 0, EFBIG if the clip is too long to hold decoded or
+ has more distinct frames than the array can have layers, ENOMEM if the GL has no room for the array, or
+ another errno value.
+ */
+int LoadFlipbook(HapMovieTextureContext *context) {
+    if (context == NULL) {
+        return EINVAL;
+    }
+    if (context->stream != NULL) {
+        return ENOTSUP;
+    }
+    
+    MovieTrackIndex *track = context->track;
+    size_t frameSize = MovieTrackDecodedSize(track);
+    int frameCount = track->frameCount;
+    
+    if (frameCount <= 0 || frameSize * frameCount > kFlipbookMaxBytes) {
+        return EFBIG;
+    }
+    
+    UnloadFlipbook(context);
+    AbandonDecode(context);
+    CancelDecodeAhead(context, true);
+    
+    FlipbookLoadJob job = { context, malloc(frameSize * frameCount), frameSize,
+                            calloc(frameCount, sizeof(uint64_t)), calloc(frameCount, sizeof(unsigned int)), calloc(frameCount, sizeof(unsigned int)) };
+    int *layers = calloc(frameCount, sizeof(int));
+    int layerCount = 0;
+    int result = ENOMEM;
+    
+    if (job.frames != NULL && job.hashes != NULL && job.results != NULL && job.textureFormats != NULL && layers != NULL) {
+        ExecutorBatch(FlipbookLoadWork, &job, frameCount);
+        result = PackFlipbookLayers(&job, frameCount, layers, &layerCount);
+    }
+    
+    GLint maxLayers = 0;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+    if (result == 0 && layerCount > maxLayers) {
+        result = EFBIG;
+    }
+    
+    if (result == 0) {
+        // Scaled YCoCg is stored as DXT5 and converted back to RGB by the material's shader
+        GLenum textureFormat = job.textureFormats[0] == HapTextureFormat_YCoCg_DXT5 ? HapTextureFormat_RGBA_DXT5 : job.textureFormats[0];
+        
+        // Errors left by the host would otherwise be taken for the upload's
+        while (glGetError() != GL_NO_ERROR) {
+        }
+        
+        glGenTextures(1, &context->flipbookTexture);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, context->flipbookTexture);
+        glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, 0, textureFormat, track->width, track->height, layerCount, 0, (GLsizei)(frameSize * layerCount), job.frames);
+        GLenum error = glGetError();
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        
+        if (error == GL_NO_ERROR) {
+            context->flipbookLayers = layers;
+            layers = NULL;
+        } else {
+            glDeleteTextures(1, &context->flipbookTexture);
+            context->flipbookTexture = 0;
+            result = error == GL_OUT_OF_MEMORY ? ENOMEM : error == GL_INVALID_VALUE ? EFBIG : EIO;
+        }
+    }
+    
+    free(job.frames);
+    free(job.hashes);
+    free(job.results);
+    free(job.textureFormats);
+    free(layers);
+    
+    return result;
+}
+
+/*
+ Returns the name of the context's flipbook texture array, or 0 if it has none
+ */
+GLuint GetFlipbookTexture(HapMovieTextureContext *context) {
+    return context != NULL ? context->flipbookTexture : 0;
+}
+
+/*
+ Fills layers with the array layer of each frame, up to count frames, and returns the number of frames in the
+ flipbook, or 0 if the context has none
+ */
+int GetFlipbookLayers(HapMovieTextureContext *context, int *layers, int count) {
+    if (context == NULL || context->flipbookLayers == NULL) {
+        return 0;
+    }
+    
+    int frameCount = context->track->frameCount;
+    if (layers != NULL && count > 0) {
+        memcpy(layers, context->flipbookLayers, (count < frameCount ? count : frameCount) * sizeof(int));
+    }
+    
+    return frameCount;
+}
+
+/*
+ Plays a flipbook in place of UpdateTexture, advancing a frame and returning the layer of the array the
+ material should show, or -1 if the context has no flipbook
+ */
+int UpdateFlipbook(HapMovieTextureContext *context) {
+    if (context == NULL || context->flipbookLayers == NULL) {
+        return -1;
+    }
+    
+    int frame = context->currentFrame;
+    context->currentFrame = NextFrame(context, frame);
+    
+    return context->flipbookLayers[frame];
+}
+
+/*
+ Limits each UpdateTexture to about budget microseconds of decoding on the calling thread, spreading larger
+ frames over several updates, or restores threaded decoding of a whole frame per update if budget is 0. A
+ chunk is never split, so frames should be encoded with several chunks for the budget to be kept.
+ */
+void SetDecodeBudget(HapMovieTextureContext *context, int budget) {
+    if (context == NULL) {
+        return;
+    }
+    
+    if (budget <= 0) {
+        AbandonDecode(context);
+    }
+    
+    context->decodeBudget = budget > 0 ? budget : 0;
+}
+
+/*
+ Decodes each next frame in the background while the current one is shown, so that UpdateTexture usually
+ only uploads. Movies only; a decode budget takes precedence. Returns 0 or an errno value.
+ */
+int SetDecodeAhead(HapMovieTextureContext *context, bool enabled) {
+    if (context == NULL) {
+        return EINVAL;
+    }
+    if (context->stream != NULL) {
+        return ENOTSUP;
+    }
+    
+    DecodeAheadJob *job = &context->decodeAhead;
+    
+    if (enabled && !context->decodeAheadEnabled) {
+        uint32_t maxFrameSize = context->track->maxFrameSize;
+        if (context->proxyTrack != NULL && context->proxyTrack->maxFrameSize > maxFrameSize) {
+            maxFrameSize = context->proxyTrack->maxFrameSize;
+        }
+        
+        job->context = context;
+        job->frameBuffer = malloc(maxFrameSize);
+        job->textureBuffer = malloc(context->textureBufferSize);
+        if (job->frameBuffer == NULL || job->textureBuffer == NULL) {
+            free(job->frameBuffer);
+            free(job->textureBuffer);
+            memset(job, 0, sizeof(DecodeAheadJob));
+            return ENOMEM;
+        }
+        
+        context->decodeAheadEnabled = true;
+    } else if (!enabled && context->decodeAheadEnabled) {
+        CancelDecodeAhead(context, true);
+        context->decodeAheadEnabled = false;
+        
+        free(job->frameBuffer);
+        free(job->textureBuffer);
+        memset(job, 0, sizeof(DecodeAheadJob));
+    }
+    
+    return 0;
+}
+
+/*
+ Makes frame the next one UpdateTexture shows. Decoding already under way for the old position is cancelled,
+ so its remaining chunks do not compete with decoding the new frame.
+ */
+void SeekToFrame(HapMovieTextureContext *context, int frame) {
+    if (context == NULL || frame < 0 || frame >= context->track->frameCount) {
+        return;
+    }
+    
+    AbandonDecode(context);
+    CancelDecodeAhead(context, false);
+    
+    context->currentFrame = frame;
+}
+
+void DestroyContext(HapMovieTextureContext *context) {
+    if (context == NULL) {
+        return;
+    }
+    
+    AbandonDecode(context);
+    SetDecodeAhead(context, false);
+    SetUploadThread(context, false);
+    while (context->frameSinkCount > 0) {
+        RemoveFrameSink(context, context->frameSinks[0]);
+    }
+    DecodedFramePoolDestroy(context->framePool);
+    UnloadFlipbook(context);
+    
+    __sync_add_and_fetch(&readAheadBytesReserved, -context->readAheadBytes);
+    
+    DestroyPixelBuffers(context);
+    CloseMipmaps(context);
+    UnpinSampleData(context);
+    FrameReceiverDestroy(context->stream);
+    if (context->file != NULL) {
+        fclose(context->file);
+    }
+    MovieIndexFree(&context->index);
     
+    free(context->hapFrameBuffer);
     free(context->textureBuffer);
     free(context);
 }
@@ -0,0 +1,530 @@
+//
+//  Recorder.c
+//  HapMovieTexturePlugin
+//
+
+#include "Recorder.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <mach/mach_time.h>
+
+#include "hap.h"
+#include "DXT.h"
+#include "MovieWriter.h"
+#include "MovieTools.h"
+
+#define FourCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+// Frames beyond one per thread, to absorb jitter between stages before frames are dropped
+#define kRecorderSpareFrames 4
+
+typedef struct {
+    uint64_t sequence;
+    uint32_t droppedBefore;
+    uint8_t *rgba;
+    uint8_t *texture;
+    uint8_t *encoded;
+    unsigned long encodedSize;
+} RecorderFrame;
+
+/*
+ A queue of frames between stages. It closes once every producing thread has finished, after which popping
+ from it empty returns NULL.
+ */
+typedef struct {
+    bool initialized;
+    RecorderFrame **frames;
+    int capacity, head, count;
+    int producers;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} RecorderQueue;
+
+struct Recorder {
+    int width, height;
+    bool alpha;
+    size_t textureSize;
+    unsigned long rowBytes;
+    unsigned int chunkCount;
+    unsigned long encodedCapacity;
+    
+    MovieWriter *writer;
+    ReplayRing *ring;
+    int error;
+    
+    int frameCount;
+    RecorderFrame *frames;
+    RecorderQueue freeFrames, compressQueue, encodeQueue, writeQueue;
+    
+    uint64_t nextSequence;
+    uint32_t droppedSinceSubmit;
+    
+    int threadCount;
+    pthread_t *threads;
+    
+    uint64_t startTime;
+    uint64_t submitted, dropped, repeated;
+    RecorderStageMetrics stages[kRecorderStageCount];
+};
+
+static uint64_t Nanoseconds(void)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+
+static int QueueInit(RecorderQueue *queue, int capacity, int producers)
+{
+    queue->frames = calloc(capacity, sizeof(RecorderFrame *));
+    if (queue->frames == NULL) {
+        return ENOMEM;
+    }
+    
+    queue->capacity = capacity;
+    queue->head = queue->count = 0;
+    queue->producers = producers;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+    queue->initialized = true;
+    
+    return 0;
+}
+
+// Safe on a queue which was never initialized, as when creating a recorder fails part way
+static void QueueDestroy(RecorderQueue *queue)
+{
+    if (queue->initialized) {
+        free(queue->frames);
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->changed);
+        queue->initialized = false;
+    }
+}
+
+// Every queue can hold the whole pool, so pushing never waits
+static void QueuePush(RecorderQueue *queue, RecorderFrame *frame)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->frames[(queue->head + queue->count++) % queue->capacity] = frame;
+    pthread_cond_signal(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ Returns the next frame, waiting for one unless wait is false, or NULL if the queue is closed and empty or
+ wait is false and it is empty. Time spent waiting is added to waitNanoseconds.
+ */
+static RecorderFrame *QueuePop(RecorderQueue *queue, bool wait, uint64_t *waitNanoseconds)
+{
+    RecorderFrame *frame = NULL;
+    
+    pthread_mutex_lock(&queue->lock);
+    
+    if (queue->count == 0 && wait && queue->producers > 0) {
+        uint64_t start = Nanoseconds();
+        while (queue->count == 0 && queue->producers > 0) {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+        __sync_add_and_fetch(waitNanoseconds, Nanoseconds() - start);
+    }
+    
+    if (queue->count > 0) {
+        frame = queue->frames[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
+    
+    pthread_mutex_unlock(&queue->lock);
+    
+    return frame;
+}
+
+static void QueueProducerFinished(RecorderQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->producers--;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void SerialHapCallback(HapDecodeWorkFunction function, void *p, unsigned int count, void *info)
+{
+    unsigned int i;
+    for (i = 0; i < count; i++) {
+        function(p, i);
+    }
+}
+
+static void FailRecording(Recorder *recorder, int error)
+{
+    __sync_bool_compare_and_swap(&recorder->error, 0, error);
+}
+
+static void *CompressThread(void *p)
+{
+    Recorder *recorder = p;
+    RecorderStageMetrics *metrics = &recorder->stages[RecorderStageCompress];
+    RecorderFrame *frame;
+    
+    while ((frame = QueuePop(&recorder->compressQueue, true, &metrics->waitNanoseconds)) != NULL) {
+        uint64_t start = Nanoseconds();
+        
+        DXTEncode(frame->rgba, recorder->width, recorder->height, (size_t)recorder->width * 4, recorder->alpha, frame->texture);
+        
+        __sync_add_and_fetch(&metrics->busyNanoseconds, Nanoseconds() - start);
+        __sync_add_and_fetch(&metrics->frames, 1);
+        QueuePush(&recorder->encodeQueue, frame);
+    }
+    
+    QueueProducerFinished(&recorder->encodeQueue);
+    
+    return NULL;
+}
+
+// Frames are encoded in parallel with each other, so each frame's chunks are encoded serially
+static void *EncodeThread(void *p)
+{
+    Recorder *recorder = p;
+    RecorderStageMetrics *metrics = &recorder->stages[RecorderStageEncode];
+    unsigned int textureFormat = recorder->alpha ? HapTextureFormat_RGBA_DXT5 : HapTextureFormat_RGB_DXT1;
+    RecorderFrame *frame;
+    
+    while ((frame = QueuePop(&recorder->encodeQueue, true, &metrics->waitNanoseconds)) != NULL) {
+        uint64_t start = Nanoseconds();
+        
+        if (HapEncodeChunks(frame->texture, recorder->textureSize, textureFormat, HapCompressorSnappy, recorder->chunkCount, recorder->rowBytes,
+                            NULL, SerialHapCallback, NULL, frame->encoded, recorder->encodedCapacity, &frame->encodedSize) != HapResult_No_Error) {
+            FailRecording(recorder, EINVAL);
+            frame->encodedSize = 0;
+        }
+        
+        __sync_add_and_fetch(&metrics->busyNanoseconds, Nanoseconds() - start);
+        __sync_add_and_fetch(&metrics->frames, 1);
+        QueuePush(&recorder->writeQueue, frame);
+    }
+    
+    QueueProducerFinished(&recorder->writeQueue);
+    
+    return NULL;
+}
+
+static void WriteFrame(Recorder *recorder, const RecorderFrame *frame)
+{
+    if (recorder->error != 0) {
+        return;
+    }
+    if (recorder->writer != NULL && MovieWriterAppendFrame(recorder->writer, 0, frame->encoded, (uint32_t)frame->encodedSize) != 0) {
+        FailRecording(recorder, EIO);
+    }
+    if (recorder->ring != NULL) {
+        int error = ReplayRingAppend(recorder->ring, frame->encoded, (uint32_t)frame->encodedSize);
+        if (error != 0) {
+            FailRecording(recorder, error);
+        }
+    }
+}
+
+// Writes frame in place of count dropped frames
+static void WriteRepeats(Recorder *recorder, const RecorderFrame *frame, uint32_t count)
+{
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        WriteFrame(recorder, frame);
+    }
+    __sync_add_and_fetch(&recorder->repeated, count);
+}
+
+/*
+ Frames arrive from the encoders out of order, so they are held until the next in sequence arrives. The last
+ frame written is kept back from the pool so that it can be repeated for any frames dropped after it. Frames
+ dropped before the first one are filled with it instead.
+ */
+static void *WriteThread(void *p)
+{
+    Recorder *recorder = p;
+    RecorderStageMetrics *metrics = &recorder->stages[RecorderStageWrite];
+    RecorderFrame **pending = calloc(recorder->frameCount, sizeof(RecorderFrame *));
+    RecorderFrame *last = NULL;
+    uint64_t nextSequence = 0;
+    RecorderFrame *frame;
+    
+    if (pending == NULL) {
+        FailRecording(recorder, ENOMEM);
+    }
+    
+    while ((frame = QueuePop(&recorder->writeQueue, true, &metrics->waitNanoseconds)) != NULL) {
+        if (pending == NULL) {
+            QueuePush(&recorder->freeFrames, frame);
+            continue;
+        }
+        pending[frame->sequence % recorder->frameCount] = frame;
+        
+        while ((frame = pending[nextSequence % recorder->frameCount]) != NULL && frame->sequence == nextSequence) {
+            uint64_t start = Nanoseconds();
+            
+            pending[nextSequence % recorder->frameCount] = NULL;
+            nextSequence++;
+            
+            WriteRepeats(recorder, last != NULL ? last : frame, frame->droppedBefore);
+            WriteFrame(recorder, frame);
+            
+            if (last != NULL) {
+                QueuePush(&recorder->freeFrames, last);
+            }
+            last = frame;
+            
+            __sync_add_and_fetch(&metrics->busyNanoseconds, Nanoseconds() - start);
+            __sync_add_and_fetch(&metrics->frames, 1);
+        }
+    }
+    
+    // Every producer has finished, so droppedSinceSubmit counts the frames dropped after the last one
+    if (last != NULL) {
+        WriteRepeats(recorder, last, recorder->droppedSinceSubmit);
+        QueuePush(&recorder->freeFrames, last);
+    }
+    
+    free(pending);
+    
+    return NULL;
+}
+
+static void FreeRecorder(Recorder *recorder)
+{
+    int i;
+    
+    if (recorder->frames != NULL) {
+        for (i = 0; i < recorder->frameCount; i++) {
+            free(recorder->frames[i].rgba);
+            free(recorder->frames[i].texture);
+            free(recorder->frames[i].encoded);
+        }
+    }
+    free(recorder->frames);
+    free(recorder->threads);
+    
+    QueueDestroy(&recorder->freeFrames);
+    QueueDestroy(&recorder->compressQueue);
+    QueueDestroy(&recorder->encodeQueue);
+    QueueDestroy(&recorder->writeQueue);
+    
+    free(recorder);
+}
+
+Recorder *RecorderCreate(const char *path, int width, int height, bool alpha, uint32_t timescale, uint32_t frameDuration)
+{
+    if (width <= 0 || height <= 0) {
+        return NULL;
+    }
+    
+    Recorder *recorder = calloc(1, sizeof(Recorder));
+    if (recorder == NULL) {
+        return NULL;
+    }
+    
+    recorder->width = width;
+    recorder->height = height;
+    recorder->alpha = alpha;
+    recorder->rowBytes = (unsigned long)((width + 3) / 4) * (alpha ? kDXT5BlockBytes : kDXT1BlockBytes);
+    recorder->textureSize = recorder->rowBytes * ((height + 3) / 4);
+    recorder->chunkCount = PlanChunkCount(height, recorder->textureSize);
+    recorder->encodedCapacity = HapMaxEncodedLengthForChunks(recorder->textureSize, recorder->chunkCount);
+    
+    // DXT compression is by far the most expensive stage, so it gets every core but those for the other stages
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    recorder->stages[RecorderStageCompress].threads = cores > 3 ? (int)cores - 2 : 1;
+    recorder->stages[RecorderStageEncode].threads = cores > 7 ? 2 : 1;
+    recorder->stages[RecorderStageWrite].threads = 1;
+    
+    int workers = recorder->stages[RecorderStageCompress].threads + recorder->stages[RecorderStageEncode].threads;
+    recorder->frameCount = workers + kRecorderSpareFrames + 1;
+    recorder->frames = calloc(recorder->frameCount, sizeof(RecorderFrame));
+    recorder->threads = calloc(workers + 1, sizeof(pthread_t));
+    
+    bool ok = recorder->frames != NULL && recorder->threads != NULL
+        && QueueInit(&recorder->freeFrames, recorder->frameCount, 1) == 0
+        && QueueInit(&recorder->compressQueue, recorder->frameCount, 1) == 0
+        && QueueInit(&recorder->encodeQueue, recorder->frameCount, recorder->stages[RecorderStageCompress].threads) == 0
+        && QueueInit(&recorder->writeQueue, recorder->frameCount, recorder->stages[RecorderStageEncode].threads) == 0;
+    
+    int i;
+    for (i = 0; ok && i < recorder->frameCount; i++) {
+        RecorderFrame *frame = &recorder->frames[i];
+        frame->rgba = malloc((size_t)width * height * 4);
+        frame->texture = malloc(recorder->textureSize);
+        frame->encoded = malloc(recorder->encodedCapacity);
+        ok = frame->rgba != NULL && frame->texture != NULL && frame->encoded != NULL;
+        QueuePush(&recorder->freeFrames, frame);
+    }
+    
+    if (ok && path != NULL) {
+        recorder->writer = MovieWriterCreate(path);
+        ok = recorder->writer != NULL
+            && MovieWriterAddTrack(recorder->writer, alpha ? FourCC('H', 'a', 'p', '5') : FourCC('H', 'a', 'p', '1'), width, height, timescale, frameDuration) == 0;
+    }
+    
+    if (!ok) {
+        if (recorder->writer != NULL) {
+            MovieWriterCancel(recorder->writer);
+        }
+        FreeRecorder(recorder);
+        return NULL;
+    }
+    
+    recorder->startTime = Nanoseconds();
+    
+    void *(*entries[kRecorderStageCount])(void *) = { CompressThread, EncodeThread, WriteThread };
+    int started[kRecorderStageCount] = { 0 };
+    int stage;
+    for (stage = 0; ok && stage < kRecorderStageCount; stage++) {
+        for (i = 0; ok && i < recorder->stages[stage].threads; i++) {
+            ok = pthread_create(&recorder->threads[recorder->threadCount], NULL, entries[stage], recorder) == 0;
+            if (ok) {
+                recorder->threadCount++;
+                started[stage]++;
+            }
+        }
+    }
+    
+    /*
+     If a thread could not be started, finish on behalf of the producers which never ran so that every queue
+     closes, and wait for the threads which did
+     */
+    if (!ok) {
+        for (i = started[RecorderStageCompress]; i < recorder->stages[RecorderStageCompress].threads; i++) {
+            QueueProducerFinished(&recorder->encodeQueue);
+        }
+        for (i = started[RecorderStageEncode]; i < recorder->stages[RecorderStageEncode].threads; i++) {
+            QueueProducerFinished(&recorder->writeQueue);
+        }
+        QueueProducerFinished(&recorder->compressQueue);
+        
+        for (i = 0; i < recorder->threadCount; i++) {
+            pthread_join(recorder->threads[i], NULL);
+        }
+        if (recorder->writer != NULL) {
+            MovieWriterCancel(recorder->writer);
+        }
+        FreeRecorder(recorder);
+        return NULL;
+    }
+    
+    return recorder;
+}
+
+void RecorderSetReplayRing(Recorder *recorder, ReplayRing *ring)
+{
+    if (recorder != NULL) {
+        recorder->ring = ring;
+    }
+}
+
+int RecorderSubmitFrame(Recorder *recorder, const void *rgba, size_t rowBytes)
+{
+    if (recorder == NULL || rgba == NULL) {
+        return EINVAL;
+    }
+    if (recorder->error != 0) {
+        return recorder->error;
+    }
+    
+    __sync_add_and_fetch(&recorder->submitted, 1);
+    
+    uint64_t unused = 0;
+    RecorderFrame *frame = QueuePop(&recorder->freeFrames, false, &unused);
+    if (frame == NULL) {
+        recorder->droppedSinceSubmit++;
+        __sync_add_and_fetch(&recorder->dropped, 1);
+        return EAGAIN;
+    }
+    
+    int y;
+    for (y = 0; y < recorder->height; y++) {
+        memcpy(frame->rgba + (size_t)y * recorder->width * 4, (const uint8_t *)rgba + y * rowBytes, (size_t)recorder->width * 4);
+    }
+    
+    frame->sequence = recorder->nextSequence++;
+    frame->droppedBefore = recorder->droppedSinceSubmit;
+    recorder->droppedSinceSubmit = 0;
+    
+    QueuePush(&recorder->compressQueue, frame);
+    
+    return 0;
+}
+
+void RecorderGetMetrics(Recorder *recorder, RecorderMetrics *metrics)
+{
+    memset(metrics, 0, sizeof(RecorderMetrics));
+    if (recorder == NULL) {
+        return;
+    }
+    
+    metrics->submitted = __sync_add_and_fetch(&recorder->submitted, 0);
+    metrics->dropped = __sync_add_and_fetch(&recorder->dropped, 0);
+    metrics->repeated = __sync_add_and_fetch(&recorder->repeated, 0);
+    metrics->elapsedNanoseconds = Nanoseconds() - recorder->startTime;
+    
+    int i;
+    for (i = 0; i < kRecorderStageCount; i++) {
+        RecorderStageMetrics *stage = &recorder->stages[i];
+        metrics->stages[i].threads = stage->threads;
+        metrics->stages[i].frames = __sync_add_and_fetch(&stage->frames, 0);
+        metrics->stages[i].busyNanoseconds = __sync_add_and_fetch(&stage->busyNanoseconds, 0);
+        metrics->stages[i].waitNanoseconds = __sync_add_and_fetch(&stage->waitNanoseconds, 0);
+    }
+}
+
+int RecorderLimitingStage(const RecorderMetrics *metrics)
+{
+    int limiting = 0;
+    double highest = -1.0;
+    
+    int i;
+    for (i = 0; i < kRecorderStageCount; i++) {
+        const RecorderStageMetrics *stage = &metrics->stages[i];
+        double utilisation = stage->threads > 0 && metrics->elapsedNanoseconds > 0
+            ? (double)stage->busyNanoseconds / ((double)metrics->elapsedNanoseconds * stage->threads) : 0.0;
+        if (utilisation > highest) {
+            highest = utilisation;
+            limiting = i;
+        }
+    }
+    
+    return limiting;
+}
+
+int RecorderFinish(Recorder *recorder)
+{
+    if (recorder == NULL) {
+        return EINVAL;
+    }
+    
+    QueueProducerFinished(&recorder->compressQueue);
+    
+    int i;
+    for (i = 0; i < recorder->threadCount; i++) {
+        pthread_join(recorder->threads[i], NULL);
+    }
+    
+    int result = recorder->error;
+    if (recorder->writer != NULL) {
+        if (result == 0) {
+            result = MovieWriterFinish(recorder->writer) == 0 ? 0 : EIO;
+        } else {
+            MovieWriterCancel(recorder->writer);
+        }
+    }
+    
+    FreeRecorder(recorder);
+    
+    return result;
+}
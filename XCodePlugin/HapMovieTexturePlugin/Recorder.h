@@ -0,0 +1,82 @@
+//
+//  Recorder.h
+//  HapMovieTexturePlugin
+//
+//  Records live RGBA frames to a Hap movie in real time.
+//
+
+#ifndef HapMovieTexturePlugin_Recorder_h
+#define HapMovieTexturePlugin_Recorder_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ReplayRing.h"
+
+/*
+ Frames pass through three stages, each on its own threads: compression to DXT, chunked Snappy encoding with
+ HapEncodeChunks, and writing in order with MovieWriter. Frames are taken from a fixed pool, which bounds the
+ queues between stages; when every frame is in use a stage has fallen behind, and submitted frames are dropped
+ rather than making the caller wait. A dropped frame is written as a repeat of the frame before it, or of
+ the first frame if none came before, so the movie keeps time with the source.
+ */
+typedef struct Recorder Recorder;
+
+typedef enum {
+    RecorderStageCompress,
+    RecorderStageEncode,
+    RecorderStageWrite,
+    kRecorderStageCount
+} RecorderStage;
+
+typedef struct {
+    int threads;
+    uint64_t frames;
+    uint64_t busyNanoseconds;
+    uint64_t waitNanoseconds;
+} RecorderStageMetrics;
+
+typedef struct {
+    uint64_t submitted;
+    uint64_t dropped;
+    uint64_t repeated;  // Frames written as repeats in place of dropped ones
+    uint64_t elapsedNanoseconds;
+    RecorderStageMetrics stages[kRecorderStageCount];
+} RecorderMetrics;
+
+/*
+ Starts recording frames of width by height texels, each lasting frameDuration units of timescale, to path.
+ The movie is Hap Alpha if alpha is true and Hap otherwise. path may be NULL to only record to a replay ring.
+ Returns NULL on failure.
+ */
+Recorder *RecorderCreate(const char *path, int width, int height, bool alpha, uint32_t timescale, uint32_t frameDuration);
+
+/*
+ Also appends every frame recorded, including repeats of dropped frames, to ring, which must have been created
+ with the same codec and dimensions. Must be called before the first frame is submitted. ring must not be
+ destroyed until the recorder has finished.
+ */
+void RecorderSetReplayRing(Recorder *recorder, ReplayRing *ring);
+
+/*
+ Copies a frame of RGBA texels whose rows are rowBytes apart into the pipeline. Must only be called from one
+ thread at a time. Returns 0, EAGAIN if the frame was dropped, or an errno value if recording has failed.
+ */
+int RecorderSubmitFrame(Recorder *recorder, const void *rgba, size_t rowBytes);
+
+void RecorderGetMetrics(Recorder *recorder, RecorderMetrics *metrics);
+
+/*
+ Returns the RecorderStage which was busy for the greatest share of its threads' time, which is the one
+ limiting throughput
+ */
+int RecorderLimitingStage(const RecorderMetrics *metrics);
+
+/*
+ Writes every submitted frame, finishes the movie and frees recorder. Returns 0 or an errno value, in which
+ case the partial movie is removed.
+ */
+int RecorderFinish(Recorder *recorder);
+
+#endif
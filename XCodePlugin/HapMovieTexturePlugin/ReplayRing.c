@@ -0,0 +1,297 @@
+//
+//  ReplayRing.c
+//  HapMovieTexturePlugin
+//
+
+#include "ReplayRing.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "MovieWriter.h"
+
+typedef struct {
+    size_t offset;
+    uint32_t size;
+} ReplayFrame;
+
+/*
+ Frames occupy the arena in sequence order, each starting where the last ended and wrapping to the start of the
+ arena when one would not fit before its end. frames is a circular list of the held frames, oldest first.
+ */
+struct ReplayRing {
+    uint8_t *arena;
+    size_t arenaBytes;
+    
+    ReplayFrame *frames;
+    int capacity;
+    int head, count;
+    uint64_t firstSequence;
+    uint32_t maxFrameSize;
+    
+    uint32_t codec;
+    int width, height;
+    uint32_t timescale, frameDuration;
+    
+    pthread_mutex_t lock;
+};
+
+struct ReplayExport {
+    ReplayRing *ring;
+    uint64_t first, count;
+    MovieWriter *writer;
+    int result;
+    // Set with a full barrier once result is final
+    int done;
+    pthread_t thread;
+};
+
+ReplayRing *ReplayRingCreate(double seconds, size_t arenaBytes, uint32_t codec, int width, int height, uint32_t timescale, uint32_t frameDuration)
+{
+    if (seconds <= 0.0 || arenaBytes == 0 || timescale == 0 || frameDuration == 0) {
+        return NULL;
+    }
+    
+    ReplayRing *ring = calloc(1, sizeof(ReplayRing));
+    if (ring == NULL) {
+        return NULL;
+    }
+    
+    ring->capacity = (int)(seconds * timescale / frameDuration);
+    if (ring->capacity < 1) {
+        ring->capacity = 1;
+    }
+    
+    ring->arena = malloc(arenaBytes);
+    ring->frames = calloc(ring->capacity, sizeof(ReplayFrame));
+    if (ring->arena == NULL || ring->frames == NULL) {
+        free(ring->arena);
+        free(ring->frames);
+        free(ring);
+        return NULL;
+    }
+    
+    // Fault in the arena now rather than while recording
+    memset(ring->arena, 0, arenaBytes);
+    
+    ring->arenaBytes = arenaBytes;
+    ring->codec = codec;
+    ring->width = width;
+    ring->height = height;
+    ring->timescale = timescale;
+    ring->frameDuration = frameDuration;
+    pthread_mutex_init(&ring->lock, NULL);
+    
+    return ring;
+}
+
+void ReplayRingDestroy(ReplayRing *ring)
+{
+    if (ring != NULL) {
+        pthread_mutex_destroy(&ring->lock);
+        free(ring->arena);
+        free(ring->frames);
+        free(ring);
+    }
+}
+
+static void EvictOldest(ReplayRing *ring)
+{
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->count--;
+    ring->firstSequence++;
+}
+
+// Returns true if bytes from offset to offset + size overlap the oldest frame
+static bool OverlapsOldest(const ReplayRing *ring, size_t offset, uint32_t size)
+{
+    const ReplayFrame *oldest = &ring->frames[ring->head];
+    return ring->count > 0 && offset < oldest->offset + oldest->size && oldest->offset < offset + size;
+}
+
+int ReplayRingAppend(ReplayRing *ring, const void *frame, uint32_t size)
+{
+    if (ring == NULL || frame == NULL) {
+        return EINVAL;
+    }
+    if (size > ring->arenaBytes) {
+        return E2BIG;
+    }
+    
+    pthread_mutex_lock(&ring->lock);
+    
+    size_t offset = 0;
+    if (ring->count > 0) {
+        const ReplayFrame *newest = &ring->frames[(ring->head + ring->count - 1) % ring->capacity];
+        offset = newest->offset + newest->size;
+        if (offset + size > ring->arenaBytes) {
+            // Any frames after the newest are the oldest, and wrapping skips over them
+            while (ring->count > 0 && ring->frames[ring->head].offset >= offset) {
+                EvictOldest(ring);
+            }
+            offset = 0;
+        }
+    }
+    
+    if (ring->count == ring->capacity) {
+        EvictOldest(ring);
+    }
+    while (OverlapsOldest(ring, offset, size)) {
+        EvictOldest(ring);
+    }
+    
+    ReplayFrame *entry = &ring->frames[(ring->head + ring->count) % ring->capacity];
+    entry->offset = offset;
+    entry->size = size;
+    ring->count++;
+    if (size > ring->maxFrameSize) {
+        ring->maxFrameSize = size;
+    }
+    
+    // Frames are only read under the lock, so the copy must be made under it too
+    memcpy(ring->arena + offset, frame, size);
+    
+    pthread_mutex_unlock(&ring->lock);
+    
+    return 0;
+}
+
+void ReplayRingGetRange(ReplayRing *ring, uint64_t *first, uint64_t *count)
+{
+    pthread_mutex_lock(&ring->lock);
+    *first = ring->firstSequence;
+    *count = ring->count;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+uint32_t ReplayRingMaxFrameSize(ReplayRing *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    uint32_t size = ring->maxFrameSize;
+    pthread_mutex_unlock(&ring->lock);
+    
+    return size;
+}
+
+int ReplayRingReadFrame(ReplayRing *ring, uint64_t sequence, void *destination, size_t destinationBytes, uint32_t *size)
+{
+    int result = 0;
+    
+    pthread_mutex_lock(&ring->lock);
+    
+    if (sequence < ring->firstSequence || sequence >= ring->firstSequence + ring->count) {
+        result = ESTALE;
+    } else {
+        const ReplayFrame *frame = &ring->frames[(ring->head + (sequence - ring->firstSequence)) % ring->capacity];
+        *size = frame->size;
+        if (frame->size > destinationBytes) {
+            result = ENOBUFS;
+        } else {
+            memcpy(destination, ring->arena + frame->offset, frame->size);
+        }
+    }
+    
+    pthread_mutex_unlock(&ring->lock);
+    
+    return result;
+}
+
+/*
+ The recording carries on while exporting, so a frame larger than any seen when the export started may be
+ appended and reached; the buffer grows to fit it
+ */
+static void *ExportThread(void *p)
+{
+    ReplayExport *export = p;
+    uint32_t capacity = ReplayRingMaxFrameSize(export->ring);
+    void *buffer = malloc(capacity > 0 ? capacity : 1);
+    
+    if (buffer == NULL) {
+        export->result = ENOMEM;
+    }
+    
+    uint64_t i;
+    for (i = 0; i < export->count && export->result == 0; i++) {
+        uint32_t size;
+        export->result = ReplayRingReadFrame(export->ring, export->first + i, buffer, capacity, &size);
+        if (export->result == ENOBUFS) {
+            void *grown = realloc(buffer, size);
+            if (grown == NULL) {
+                export->result = ENOMEM;
+                break;
+            }
+            buffer = grown;
+            capacity = size;
+            export->result = ReplayRingReadFrame(export->ring, export->first + i, buffer, capacity, &size);
+        }
+        if (export->result == 0 && MovieWriterAppendFrame(export->writer, 0, buffer, size) != 0) {
+            export->result = EIO;
+        }
+    }
+    
+    free(buffer);
+    
+    if (export->result == 0) {
+        export->result = MovieWriterFinish(export->writer) == 0 ? 0 : EIO;
+    } else {
+        MovieWriterCancel(export->writer);
+    }
+    
+    __sync_bool_compare_and_swap(&export->done, 0, 1);
+    
+    return NULL;
+}
+
+ReplayExport *ReplayRingExport(ReplayRing *ring, uint64_t first, uint64_t count, const char *path)
+{
+    if (ring == NULL || count == 0 || path == NULL) {
+        return NULL;
+    }
+    
+    ReplayExport *export = calloc(1, sizeof(ReplayExport));
+    if (export == NULL) {
+        return NULL;
+    }
+    
+    export->ring = ring;
+    export->first = first;
+    export->count = count;
+    export->writer = MovieWriterCreate(path);
+    
+    if (export->writer == NULL
+        || MovieWriterAddTrack(export->writer, ring->codec, ring->width, ring->height, ring->timescale, ring->frameDuration) != 0) {
+        if (export->writer != NULL) {
+            MovieWriterCancel(export->writer);
+        }
+        free(export);
+        return NULL;
+    }
+    
+    if (pthread_create(&export->thread, NULL, ExportThread, export) != 0) {
+        MovieWriterCancel(export->writer);
+        free(export);
+        return NULL;
+    }
+    
+    return export;
+}
+
+bool ReplayExportIsDone(ReplayExport *export)
+{
+    return __sync_add_and_fetch(&export->done, 0) != 0;
+}
+
+int ReplayExportFinish(ReplayExport *export)
+{
+    if (export == NULL) {
+        return EINVAL;
+    }
+    
+    pthread_join(export->thread, NULL);
+    int result = export->result;
+    free(export);
+    
+    return result;
+}
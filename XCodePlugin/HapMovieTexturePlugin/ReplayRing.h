@@ -0,0 +1,75 @@
+//
+//  ReplayRing.h
+//  HapMovieTexturePlugin
+//
+//  Holds the most recent encoded frames of a recording in memory for instant replay.
+//
+
+#ifndef HapMovieTexturePlugin_ReplayRing_h
+#define HapMovieTexturePlugin_ReplayRing_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ Encoded Hap frames are stored end to end in a single arena allocated when the ring is created, so memory use
+ stays fixed however long a session runs. Appending a frame evicts the oldest frames until it fits and the ring
+ spans no more than its duration. Frames are identified by a sequence number which counts every frame ever
+ appended.
+ */
+typedef struct ReplayRing ReplayRing;
+
+typedef struct ReplayExport ReplayExport;
+
+/*
+ Creates a ring holding up to seconds of frames in arenaBytes of memory. The remaining arguments describe the
+ frames as for MovieWriterAddTrack, and are used when exporting. Returns NULL on failure.
+ */
+ReplayRing *ReplayRingCreate(double seconds, size_t arenaBytes, uint32_t codec, int width, int height, uint32_t timescale, uint32_t frameDuration);
+
+/*
+ Every export of ring must have finished.
+ */
+void ReplayRingDestroy(ReplayRing *ring);
+
+/*
+ Copies a frame into the ring. Returns 0, or E2BIG if the frame is larger than the arena.
+ */
+int ReplayRingAppend(ReplayRing *ring, const void *frame, uint32_t size);
+
+/*
+ Sets first and count to the range of sequence numbers currently held.
+ */
+void ReplayRingGetRange(ReplayRing *ring, uint64_t *first, uint64_t *count);
+
+/*
+ Copies the frame with sequence number sequence into destination, which is destinationBytes long, and sets size
+ to its length. Returns 0, ESTALE if the frame has been evicted or not yet appended, or ENOBUFS if destination is
+ too small, in which case size is still set.
+ */
+int ReplayRingReadFrame(ReplayRing *ring, uint64_t sequence, void *destination, size_t destinationBytes, uint32_t *size);
+
+/*
+ Returns the size of the largest frame appended so far, which is enough for any frame ReplayRingReadFrame returns.
+ */
+uint32_t ReplayRingMaxFrameSize(ReplayRing *ring);
+
+/*
+ Starts writing count frames from sequence number first to a movie at path on a background thread. Frames are
+ read from the ring as they are written, so an export which the recording overtakes fails with ESTALE. Returns
+ NULL if the export could not be started.
+ */
+ReplayExport *ReplayRingExport(ReplayRing *ring, uint64_t first, uint64_t count, const char *path);
+
+/*
+ Returns true once export has finished, without waiting.
+ */
+bool ReplayExportIsDone(ReplayExport *export);
+
+/*
+ Waits for export to finish and frees it. Returns 0 or an errno value, in which case the partial movie is removed.
+ */
+int ReplayExportFinish(ReplayExport *export);
+
+#endif
@@ -0,0 +1,376 @@
+//
+//  Uploader.c
+//  HapMovieTexturePlugin
+//
+
+#include "Uploader.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#if defined(__APPLE__)
+#include <OpenGL/OpenGL.h>
+#else
+#include <EGL/egl.h>
+#endif
+
+// One texture being sampled, one waiting to be, and one being uploaded to
+#define kUploadSlotCount 3
+
+typedef enum {
+    UploadSlotFree,
+    UploadSlotFilling,
+    UploadSlotQueued,
+    UploadSlotReady,
+    UploadSlotCurrent
+} UploadSlotState;
+
+typedef struct UploadSlot {
+    UploadSlotState state;
+    uint64_t sequence;
+    struct UploadSlot *next;
+    
+    GLuint texture;
+    GLenum allocatedFormat;
+    int allocatedWidth, allocatedHeight;
+    
+    void *buffer;
+    GLenum textureFormat;
+    int width, height;
+    size_t size;
+    
+    GLsync uploaded;
+    GLsync released;
+} UploadSlot;
+
+struct UploadStream {
+    UploadSlot slots[kUploadSlotCount];
+    UploadSlot *filling;
+    uint64_t nextSequence;
+};
+
+/*
+ The upload thread and its queue of slots to upload, protected by lock. changed is signalled both when a slot
+ is queued and when one has been uploaded.
+ */
+typedef struct {
+#if defined(__APPLE__)
+    CGLContextObj context;
+#else
+    EGLDisplay display;
+    EGLContext context;
+#endif
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    UploadSlot *head, *tail;
+} Uploader;
+
+static Uploader *sharedUploader;
+
+static bool CreateSharedContext(Uploader *uploader)
+{
+#if defined(__APPLE__)
+    CGLContextObj share = CGLGetCurrentContext();
+    
+    return share != NULL && CGLCreateContext(CGLGetPixelFormat(share), share, &uploader->context) == kCGLNoError;
+#else
+    EGLDisplay display = eglGetCurrentDisplay();
+    EGLContext share = eglGetCurrentContext();
+    EGLint configID = 0, configCount;
+    EGLConfig config = NULL;
+    
+    if (display == EGL_NO_DISPLAY || share == EGL_NO_CONTEXT) {
+        return false;
+    }
+    
+    // A context created without a config, as EGL_KHR_no_config_context allows, reports a config ID of 0
+    eglQueryContext(display, share, EGL_CONFIG_ID, &configID);
+    if (configID != 0) {
+        EGLint attributes[] = { EGL_CONFIG_ID, configID, EGL_NONE };
+        if (!eglChooseConfig(display, attributes, &config, 1, &configCount) || configCount != 1) {
+            return false;
+        }
+    }
+    
+    uploader->display = display;
+    uploader->context = eglCreateContext(display, config, share, NULL);
+    
+    return uploader->context != EGL_NO_CONTEXT;
+#endif
+}
+
+static void MakeSharedContextCurrent(Uploader *uploader)
+{
+#if defined(__APPLE__)
+    CGLSetCurrentContext(uploader->context);
+#else
+    eglMakeCurrent(uploader->display, EGL_NO_SURFACE, EGL_NO_SURFACE, uploader->context);
+#endif
+}
+
+static void UploadSlotTexture(UploadSlot *slot)
+{
+    // Wait for the render thread's last draws from this texture, without blocking this thread
+    if (slot->released != NULL) {
+        glWaitSync(slot->released, 0, GL_TIMEOUT_IGNORED);
+        glDeleteSync(slot->released);
+        slot->released = NULL;
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, slot->texture);
+    
+    if (slot->allocatedFormat == slot->textureFormat && slot->allocatedWidth == slot->width && slot->allocatedHeight == slot->height) {
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, slot->width, slot->height, slot->textureFormat, (GLsizei)slot->size, slot->buffer);
+    } else {
+        glCompressedTexImage2D(GL_TEXTURE_2D, 0, slot->textureFormat, slot->width, slot->height, 0, (GLsizei)slot->size, slot->buffer);
+        slot->allocatedFormat = slot->textureFormat;
+        slot->allocatedWidth = slot->width;
+        slot->allocatedHeight = slot->height;
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+static void *UploadThread(void *p)
+{
+    Uploader *uploader = p;
+    
+    MakeSharedContextCurrent(uploader);
+    
+    pthread_mutex_lock(&uploader->lock);
+    
+    for (;;) {
+        while (uploader->head == NULL) {
+            pthread_cond_wait(&uploader->changed, &uploader->lock);
+        }
+        
+        UploadSlot *slot = uploader->head;
+        uploader->head = slot->next;
+        if (uploader->head == NULL) {
+            uploader->tail = NULL;
+        }
+        
+        pthread_mutex_unlock(&uploader->lock);
+        
+        UploadSlotTexture(slot);
+        
+        // The flush makes sure the fence will be reached, so the render thread can wait for it
+        GLsync uploaded = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
+        
+        pthread_mutex_lock(&uploader->lock);
+        slot->uploaded = uploaded;
+        slot->state = UploadSlotReady;
+        pthread_cond_broadcast(&uploader->changed);
+    }
+    
+    return NULL;
+}
+
+/*
+ The upload thread lives for the rest of the process, as the share group it belongs to normally does
+ */
+static Uploader *SharedUploader(void)
+{
+    if (sharedUploader != NULL) {
+        return sharedUploader;
+    }
+    
+    Uploader *uploader = calloc(1, sizeof(Uploader));
+    if (uploader == NULL) {
+        return NULL;
+    }
+    
+    pthread_mutex_init(&uploader->lock, NULL);
+    pthread_cond_init(&uploader->changed, NULL);
+    
+    if (!CreateSharedContext(uploader) || pthread_create(&uploader->thread, NULL, UploadThread, uploader) != 0) {
+        pthread_mutex_destroy(&uploader->lock);
+        pthread_cond_destroy(&uploader->changed);
+        free(uploader);
+        return NULL;
+    }
+    
+    sharedUploader = uploader;
+    
+    return uploader;
+}
+
+UploadStream *UploadStreamCreate(size_t bufferSize)
+{
+    if (SharedUploader() == NULL) {
+        return NULL;
+    }
+    
+    UploadStream *stream = calloc(1, sizeof(UploadStream));
+    if (stream == NULL) {
+        return NULL;
+    }
+    
+    int i;
+    for (i = 0; i < kUploadSlotCount; i++) {
+        UploadSlot *slot = &stream->slots[i];
+        slot->buffer = malloc(bufferSize);
+        if (slot->buffer == NULL) {
+            UploadStreamDestroy(stream);
+            return NULL;
+        }
+        
+        // Only level 0 is ever uploaded, so the texture must not expect mipmaps
+        glGenTextures(1, &slot->texture);
+        glBindTexture(GL_TEXTURE_2D, slot->texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    
+    // The upload thread must see the textures' parameters
+    glFlush();
+    
+    return stream;
+}
+
+void *UploadStreamBuffer(UploadStream *stream)
+{
+    Uploader *uploader = sharedUploader;
+    
+    pthread_mutex_lock(&uploader->lock);
+    
+    stream->filling = NULL;
+    int i;
+    for (i = 0; i < kUploadSlotCount && stream->filling == NULL; i++) {
+        if (stream->slots[i].state == UploadSlotFree) {
+            stream->filling = &stream->slots[i];
+            stream->filling->state = UploadSlotFilling;
+        }
+    }
+    
+    pthread_mutex_unlock(&uploader->lock);
+    
+    return stream->filling != NULL ? stream->filling->buffer : NULL;
+}
+
+void UploadStreamSubmit(UploadStream *stream, GLenum textureFormat, int width, int height, size_t size)
+{
+    Uploader *uploader = sharedUploader;
+    UploadSlot *slot = stream->filling;
+    
+    if (slot == NULL) {
+        return;
+    }
+    
+    slot->textureFormat = textureFormat;
+    slot->width = width;
+    slot->height = height;
+    slot->size = size;
+    slot->sequence = stream->nextSequence++;
+    slot->next = NULL;
+    stream->filling = NULL;
+    
+    pthread_mutex_lock(&uploader->lock);
+    
+    slot->state = UploadSlotQueued;
+    if (uploader->tail != NULL) {
+        uploader->tail->next = slot;
+    } else {
+        uploader->head = slot;
+    }
+    uploader->tail = slot;
+    pthread_cond_broadcast(&uploader->changed);
+    
+    pthread_mutex_unlock(&uploader->lock);
+}
+
+void UploadStreamCancel(UploadStream *stream)
+{
+    Uploader *uploader = sharedUploader;
+    
+    if (stream->filling != NULL) {
+        pthread_mutex_lock(&uploader->lock);
+        stream->filling->state = UploadSlotFree;
+        stream->filling = NULL;
+        pthread_mutex_unlock(&uploader->lock);
+    }
+}
+
+GLuint UploadStreamTexture(UploadStream *stream)
+{
+    Uploader *uploader = sharedUploader;
+    UploadSlot *current = NULL, *newest = NULL;
+    int i;
+    
+    pthread_mutex_lock(&uploader->lock);
+    
+    for (i = 0; i < kUploadSlotCount; i++) {
+        UploadSlot *slot = &stream->slots[i];
+        if (slot->state == UploadSlotCurrent) {
+            current = slot;
+        } else if (slot->state == UploadSlotReady && (newest == NULL || slot->sequence > newest->sequence)) {
+            newest = slot;
+        }
+    }
+    
+    // Older frames which were uploaded but never shown are skipped, and need no release fence
+    for (i = 0; i < kUploadSlotCount; i++) {
+        UploadSlot *slot = &stream->slots[i];
+        if (slot->state == UploadSlotReady && slot != newest) {
+            glDeleteSync(slot->uploaded);
+            slot->uploaded = NULL;
+            slot->state = UploadSlotFree;
+        }
+    }
+    
+    if (newest != NULL) {
+        if (current != NULL) {
+            current->released = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            current->state = UploadSlotFree;
+        }
+        
+        glWaitSync(newest->uploaded, 0, GL_TIMEOUT_IGNORED);
+        glDeleteSync(newest->uploaded);
+        newest->uploaded = NULL;
+        newest->state = UploadSlotCurrent;
+        current = newest;
+        
+        glFlush();
+    }
+    
+    pthread_mutex_unlock(&uploader->lock);
+    
+    return current != NULL ? current->texture : 0;
+}
+
+void UploadStreamDestroy(UploadStream *stream)
+{
+    Uploader *uploader = sharedUploader;
+    int i;
+    
+    pthread_mutex_lock(&uploader->lock);
+    
+    for (i = 0; i < kUploadSlotCount; i++) {
+        while (stream->slots[i].state == UploadSlotQueued) {
+            pthread_cond_wait(&uploader->changed, &uploader->lock);
+        }
+    }
+    
+    pthread_mutex_unlock(&uploader->lock);
+    
+    for (i = 0; i < kUploadSlotCount; i++) {
+        UploadSlot *slot = &stream->slots[i];
+        if (slot->uploaded != NULL) {
+            glDeleteSync(slot->uploaded);
+        }
+        if (slot->released != NULL) {
+            glDeleteSync(slot->released);
+        }
+        if (slot->texture != 0) {
+            glDeleteTextures(1, &slot->texture);
+        }
+        free(slot->buffer);
+    }
+    
+    free(stream);
+}
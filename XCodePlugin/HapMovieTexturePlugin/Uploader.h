@@ -0,0 +1,65 @@
+//
+//  Uploader.h
+//  HapMovieTexturePlugin
+//
+//  Uploads decoded frames to textures from a thread with its own GL context.
+//
+
+#ifndef HapMovieTexturePlugin_Uploader_h
+#define HapMovieTexturePlugin_Uploader_h
+
+#include <stddef.h>
+
+#if defined(__APPLE__)
+#include <OpenGL/gl.h>
+#include <OpenGL/glext.h>
+#else
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES 1
+#endif
+#include <GL/gl.h>
+#include <GL/glext.h>
+#endif
+
+/*
+ One thread serves every stream, through a GL context in the share group of the context that was current
+ when the first stream was created. Each stream uploads into a small ring of textures of its own, so the
+ texture being sampled is never the one being uploaded to. A fence placed after each upload is waited on by
+ the render thread before it samples the texture, and a fence placed when the render thread moves on from a
+ texture is waited on by the upload thread before it uploads to it again; both waits are on the GPU.
+ */
+typedef struct UploadStream UploadStream;
+
+/*
+ Creates a stream for frames of up to bufferSize bytes. Must be called on the render thread with its context
+ current. Returns NULL if the upload thread or its context could not be created.
+ */
+UploadStream *UploadStreamCreate(size_t bufferSize);
+
+/*
+ Returns a buffer to decode the next frame into, or NULL if every texture is in use because uploads are
+ falling behind, in which case the frame should be dropped. Each buffer returned must be passed back with
+ UploadStreamSubmit or UploadStreamCancel before the next is asked for.
+ */
+void *UploadStreamBuffer(UploadStream *stream);
+
+/*
+ Queues the frame in the buffer last returned for upload as a texture of the given format and dimensions
+ */
+void UploadStreamSubmit(UploadStream *stream, GLenum textureFormat, int width, int height, size_t size);
+
+void UploadStreamCancel(UploadStream *stream);
+
+/*
+ Moves on to the newest uploaded frame, if there is one which is newer, and returns the texture holding the
+ frame to sample, or 0 if none has been uploaded yet. Must be called on the render thread, before each frame
+ is drawn.
+ */
+GLuint UploadStreamTexture(UploadStream *stream);
+
+/*
+ Waits for the stream's queued uploads and deletes its textures. Must be called on the render thread.
+ */
+void UploadStreamDestroy(UploadStream *stream);
+
+#endif
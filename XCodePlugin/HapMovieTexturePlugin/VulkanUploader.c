@@ -0,0 +1,392 @@
+//
+//  VulkanUploader.c
+//  HapMovieTexturePlugin
+//
+
+#include "VulkanUploader.h"
+
+#if defined(HAP_VULKAN)
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "hap.h"
+
+/*
+ Each submission has a command buffer of its own, reused once the semaphore passes the value it signalled,
+ so at most kVulkanUploadSlotCount copies are in flight
+ */
+#define kVulkanUploadSlotCount 8
+#define kVulkanUploadTimeout (100 * 1000 * 1000ULL)
+
+// Copies from a buffer into a block-compressed image must start on a block
+#define kVulkanUploadAlignment 16
+
+typedef struct {
+    VkCommandBuffer commandBuffer;
+    uint64_t value;
+    VkDeviceSize offset, size;
+} VulkanUploadSlot;
+
+struct VulkanUploader {
+    VulkanUploaderDevice device;
+    
+    VkBuffer staging;
+    VkDeviceMemory stagingMemory;
+    uint8_t *mapped;
+    VkDeviceSize stagingBytes;
+    VkDeviceSize head;
+    
+    VkCommandPool commandPool;
+    VulkanUploadSlot slots[kVulkanUploadSlotCount];
+    int nextSlot;
+    
+    VkSemaphore timeline;
+    uint64_t submittedValue;
+    uint64_t completedValue;
+    
+    bool reserved;
+    VkDeviceSize reservedOffset, reservedSize;
+};
+
+static int FindMemoryType(const VulkanUploaderDevice *device, uint32_t typeBits, VkMemoryPropertyFlags flags)
+{
+    VkPhysicalDeviceMemoryProperties properties;
+    vkGetPhysicalDeviceMemoryProperties(device->physicalDevice, &properties);
+    
+    uint32_t i;
+    for (i = 0; i < properties.memoryTypeCount; i++) {
+        if ((typeBits & (1u << i)) != 0 && (properties.memoryTypes[i].propertyFlags & flags) == flags) {
+            return (int)i;
+        }
+    }
+    
+    return -1;
+}
+
+static bool CreateStaging(VulkanUploader *uploader)
+{
+    VkDevice device = uploader->device.device;
+    
+    VkBufferCreateInfo bufferInfo = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = uploader->stagingBytes,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+    };
+    if (vkCreateBuffer(device, &bufferInfo, NULL, &uploader->staging) != VK_SUCCESS) {
+        return false;
+    }
+    
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device, uploader->staging, &requirements);
+    
+    // Coherent memory needs no flushing, and is usually write-combined, which HapDecodeStaged is suited to
+    int memoryType = FindMemoryType(&uploader->device, requirements.memoryTypeBits,
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    if (memoryType < 0) {
+        return false;
+    }
+    
+    VkMemoryAllocateInfo allocateInfo = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = requirements.size,
+        .memoryTypeIndex = (uint32_t)memoryType
+    };
+    if (vkAllocateMemory(device, &allocateInfo, NULL, &uploader->stagingMemory) != VK_SUCCESS) {
+        return false;
+    }
+    
+    void *mapped;
+    if (vkBindBufferMemory(device, uploader->staging, uploader->stagingMemory, 0) != VK_SUCCESS
+        || vkMapMemory(device, uploader->stagingMemory, 0, VK_WHOLE_SIZE, 0, &mapped) != VK_SUCCESS) {
+        return false;
+    }
+    uploader->mapped = mapped;
+    
+    return true;
+}
+
+static bool CreateCommandBuffers(VulkanUploader *uploader)
+{
+    VkDevice device = uploader->device.device;
+    
+    VkCommandPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = uploader->device.transferQueueFamily
+    };
+    if (vkCreateCommandPool(device, &poolInfo, NULL, &uploader->commandPool) != VK_SUCCESS) {
+        return false;
+    }
+    
+    VkCommandBuffer commandBuffers[kVulkanUploadSlotCount];
+    VkCommandBufferAllocateInfo allocateInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = uploader->commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = kVulkanUploadSlotCount
+    };
+    if (vkAllocateCommandBuffers(device, &allocateInfo, commandBuffers) != VK_SUCCESS) {
+        return false;
+    }
+    
+    int i;
+    for (i = 0; i < kVulkanUploadSlotCount; i++) {
+        uploader->slots[i].commandBuffer = commandBuffers[i];
+    }
+    
+    VkSemaphoreTypeCreateInfo typeInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = 0
+    };
+    VkSemaphoreCreateInfo semaphoreInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &typeInfo
+    };
+    
+    return vkCreateSemaphore(device, &semaphoreInfo, NULL, &uploader->timeline) == VK_SUCCESS;
+}
+
+VulkanUploader *VulkanUploaderCreate(const VulkanUploaderDevice *device, size_t stagingBytes)
+{
+    if (device == NULL || stagingBytes < kVulkanUploadAlignment) {
+        return NULL;
+    }
+    
+    VulkanUploader *uploader = calloc(1, sizeof(VulkanUploader));
+    if (uploader == NULL) {
+        return NULL;
+    }
+    
+    uploader->device = *device;
+    uploader->stagingBytes = stagingBytes;
+    
+    if (!CreateStaging(uploader) || !CreateCommandBuffers(uploader)) {
+        VulkanUploaderDestroy(uploader);
+        return NULL;
+    }
+    
+    return uploader;
+}
+
+VkFormat VulkanUploaderFormat(unsigned int textureFormat)
+{
+    switch (textureFormat) {
+        case HapTextureFormat_RGB_DXT1:
+            return VK_FORMAT_BC1_RGB_UNORM_BLOCK;
+        case HapTextureFormat_RGBA_DXT5:
+        case HapTextureFormat_YCoCg_DXT5:
+            return VK_FORMAT_BC3_UNORM_BLOCK;
+        default:
+            return VK_FORMAT_UNDEFINED;
+    }
+}
+
+/*
+ Waits until the semaphore reaches value, only asking the device when the last value seen is behind it
+ */
+static bool WaitForValue(VulkanUploader *uploader, uint64_t value)
+{
+    if (value <= uploader->completedValue) {
+        return true;
+    }
+    
+    VkSemaphoreWaitInfo waitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = 1,
+        .pSemaphores = &uploader->timeline,
+        .pValues = &value
+    };
+    if (vkWaitSemaphores(uploader->device.device, &waitInfo, kVulkanUploadTimeout) != VK_SUCCESS) {
+        return false;
+    }
+    
+    vkGetSemaphoreCounterValue(uploader->device.device, uploader->timeline, &uploader->completedValue);
+    
+    return true;
+}
+
+void *VulkanUploaderReserve(VulkanUploader *uploader, size_t size)
+{
+    VkDeviceSize alignedSize = (size + kVulkanUploadAlignment - 1) & ~(VkDeviceSize)(kVulkanUploadAlignment - 1);
+    
+    if (uploader == NULL || alignedSize > uploader->stagingBytes) {
+        return NULL;
+    }
+    
+    VkDeviceSize offset = uploader->head;
+    if (offset + alignedSize > uploader->stagingBytes) {
+        offset = 0;
+    }
+    
+    // The slot about to be reused, and any copy still reading from the space, must have finished
+    if (!WaitForValue(uploader, uploader->slots[uploader->nextSlot].value)) {
+        return NULL;
+    }
+    
+    int i;
+    for (i = 0; i < kVulkanUploadSlotCount; i++) {
+        VulkanUploadSlot *slot = &uploader->slots[i];
+        
+        if (slot->value > uploader->completedValue && slot->offset < offset + alignedSize
+            && offset < slot->offset + slot->size && !WaitForValue(uploader, slot->value)) {
+            return NULL;
+        }
+    }
+    
+    uploader->reserved = true;
+    uploader->reservedOffset = offset;
+    uploader->reservedSize = alignedSize;
+    
+    return uploader->mapped + offset;
+}
+
+static void RecordCopy(VulkanUploader *uploader, VkCommandBuffer commandBuffer, VkImage image, int width, int height)
+{
+    bool transferOwnership = uploader->device.transferQueueFamily != uploader->device.graphicsQueueFamily;
+    
+    VkImageSubresourceRange range = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .levelCount = 1,
+        .layerCount = 1
+    };
+    
+    VkImageMemoryBarrier toTransfer = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = 0,
+        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = image,
+        .subresourceRange = range
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 0, NULL, 0, NULL, 1, &toTransfer);
+    
+    VkBufferImageCopy region = {
+        .bufferOffset = uploader->reservedOffset,
+        .imageSubresource = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .mipLevel = 0, .baseArrayLayer = 0, .layerCount = 1 },
+        .imageExtent = { (uint32_t)width, (uint32_t)height, 1 }
+    };
+    vkCmdCopyBufferToImage(commandBuffer, uploader->staging, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    
+    // The semaphore makes the copy visible to the graphics queue, so the barrier only changes layout and owner
+    VkImageMemoryBarrier toShader = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = 0,
+        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        .srcQueueFamilyIndex = transferOwnership ? uploader->device.transferQueueFamily : VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = transferOwnership ? uploader->device.graphicsQueueFamily : VK_QUEUE_FAMILY_IGNORED,
+        .image = image,
+        .subresourceRange = range
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                         0, 0, NULL, 0, NULL, 1, &toShader);
+}
+
+uint64_t VulkanUploaderSubmit(VulkanUploader *uploader, VkImage image, int width, int height)
+{
+    if (uploader == NULL || !uploader->reserved) {
+        return 0;
+    }
+    
+    uploader->reserved = false;
+    
+    VulkanUploadSlot *slot = &uploader->slots[uploader->nextSlot];
+    VkCommandBuffer commandBuffer = slot->commandBuffer;
+    
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+    };
+    if (vkResetCommandBuffer(commandBuffer, 0) != VK_SUCCESS || vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        return 0;
+    }
+    
+    RecordCopy(uploader, commandBuffer, image, width, height);
+    
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        return 0;
+    }
+    
+    uint64_t value = uploader->submittedValue + 1;
+    
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .signalSemaphoreValueCount = 1,
+        .pSignalSemaphoreValues = &value
+    };
+    VkSubmitInfo submitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .pNext = &timelineInfo,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &commandBuffer,
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &uploader->timeline
+    };
+    if (vkQueueSubmit(uploader->device.transferQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+        return 0;
+    }
+    
+    uploader->submittedValue = value;
+    slot->value = value;
+    slot->offset = uploader->reservedOffset;
+    slot->size = uploader->reservedSize;
+    
+    uploader->head = uploader->reservedOffset + uploader->reservedSize;
+    uploader->nextSlot = (uploader->nextSlot + 1) % kVulkanUploadSlotCount;
+    
+    return value;
+}
+
+void VulkanUploaderCancel(VulkanUploader *uploader)
+{
+    if (uploader != NULL) {
+        uploader->reserved = false;
+    }
+}
+
+VkSemaphore VulkanUploaderSemaphore(VulkanUploader *uploader)
+{
+    return uploader != NULL ? uploader->timeline : VK_NULL_HANDLE;
+}
+
+void VulkanUploaderDestroy(VulkanUploader *uploader)
+{
+    if (uploader == NULL) {
+        return;
+    }
+    
+    VkDevice device = uploader->device.device;
+    
+    if (uploader->timeline != VK_NULL_HANDLE) {
+        // Wait without a timeout, as the command buffers and staging memory can not be freed while in use
+        VkSemaphoreWaitInfo waitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+            .semaphoreCount = 1,
+            .pSemaphores = &uploader->timeline,
+            .pValues = &uploader->submittedValue
+        };
+        vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+        vkDestroySemaphore(device, uploader->timeline, NULL);
+    }
+    if (uploader->commandPool != VK_NULL_HANDLE) {
+        vkDestroyCommandPool(device, uploader->commandPool, NULL);
+    }
+    if (uploader->staging != VK_NULL_HANDLE) {
+        vkDestroyBuffer(device, uploader->staging, NULL);
+    }
+    if (uploader->stagingMemory != VK_NULL_HANDLE) {
+        vkFreeMemory(device, uploader->stagingMemory, NULL);
+    }
+    
+    free(uploader);
+}
+
+#endif
@@ -0,0 +1,86 @@
+//
+//  VulkanUploader.h
+//  HapMovieTexturePlugin
+//
+//  Uploads decoded frames to Vulkan images on a transfer queue. Only built with HAP_VULKAN defined, which
+//  needs the Vulkan headers and a loader to link against, such as MoltenVK's.
+//
+
+#ifndef HapMovieTexturePlugin_VulkanUploader_h
+#define HapMovieTexturePlugin_VulkanUploader_h
+
+#if defined(HAP_VULKAN)
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vulkan/vulkan.h>
+
+/*
+ The host's device and the queues the uploader works between. transferQueue is used by the uploader alone,
+ and is ideally from a family without graphics, so that copies run beside rendering. The device must have
+ been created with the timelineSemaphore feature enabled, which is core in Vulkan 1.2.
+ */
+typedef struct {
+    VkPhysicalDevice physicalDevice;
+    VkDevice device;
+    VkQueue transferQueue;
+    uint32_t transferQueueFamily;
+    uint32_t graphicsQueueFamily;
+} VulkanUploaderDevice;
+
+/*
+ Frames are decoded straight into a persistently mapped staging buffer, used as a ring, and copied into the
+ host's images by command buffers submitted to the transfer queue. Each submission signals the next value of
+ a timeline semaphore, which the host's graphics submissions wait on before sampling the image, so neither
+ side waits on the CPU for the other. Staging space is only reused once the semaphore shows the copy out of
+ it has finished.
+ */
+typedef struct VulkanUploader VulkanUploader;
+
+/*
+ Creates an uploader with stagingBytes of staging memory, which should hold at least two of the largest
+ frames for uploads to overlap decoding. Returns NULL if any Vulkan object could not be created.
+ */
+VulkanUploader *VulkanUploaderCreate(const VulkanUploaderDevice *device, size_t stagingBytes);
+
+/*
+ Returns the format of image to create for frames of textureFormat, a HapTextureFormat constant. YCoCg frames
+ use BC3 and are converted back to RGB by the material's shader.
+ */
+VkFormat VulkanUploaderFormat(unsigned int textureFormat);
+
+/*
+ Returns size bytes of staging memory to decode the next frame into, or NULL if the frame is larger than the
+ ring or the copies out of the space it needs did not finish in time. The memory may be write-combined, so
+ should be written with HapDecodeStaged. Each buffer returned must be passed back with VulkanUploaderSubmit
+ or VulkanUploaderCancel before the next is asked for.
+ */
+void *VulkanUploaderReserve(VulkanUploader *uploader, size_t size);
+
+/*
+ Copies the frame in the space last reserved into level 0 of image, a BC1 or BC3 image of width by height
+ created with VK_IMAGE_USAGE_TRANSFER_DST_BIT, and leaves it in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.
+ The image's previous contents are discarded, so the host must not be sampling it. When the queue families
+ differ, ownership of the image is released to the graphics family, and the host must record the matching
+ acquire barrier before sampling it.
+ Returns the value the timeline semaphore reaches once the copy has finished, or 0 if it could not be
+ submitted.
+ */
+uint64_t VulkanUploaderSubmit(VulkanUploader *uploader, VkImage image, int width, int height);
+
+void VulkanUploaderCancel(VulkanUploader *uploader);
+
+/*
+ The timeline semaphore signalled by each submission, for the host to wait on with the value it returned
+ */
+VkSemaphore VulkanUploaderSemaphore(VulkanUploader *uploader);
+
+/*
+ Waits for every submitted copy and destroys the uploader's Vulkan objects
+ */
+void VulkanUploaderDestroy(VulkanUploader *uploader);
+
+#endif
+
+#endif
@@ -0,0 +1,66 @@
+//
+//  GLTiming.h
+//  HapUploadBenchmark
+//
+//  Prefix header for the benchmark target. Wraps each GL function the plugin calls so the time spent in
+//  the driver is counted apart from decoding.
+//
+
+#ifndef HapUploadBenchmark_GLTiming_h
+#define HapUploadBenchmark_GLTiming_h
+
+#include <stdint.h>
+
+#if defined(__APPLE__)
+#include <OpenGL/gl.h>
+#include <OpenGL/glext.h>
+#else
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES 1
+#endif
+#include <GL/gl.h>
+#include <GL/glext.h>
+#endif
+
+/*
+ Totals for every timed call so far: wall time, which includes waiting on fences, and the calling thread's
+ CPU time, which does not
+ */
+typedef struct {
+    uint64_t calls;
+    uint64_t nanoseconds;
+    uint64_t cpuNanoseconds;
+} GLTimingTotals;
+
+extern GLTimingTotals glTimingTotals;
+
+typedef struct {
+    uint64_t start;
+    uint64_t cpuStart;
+} GLTimingStart;
+
+GLTimingStart GLTimingBegin(void);
+void GLTimingEnd(GLTimingStart start);
+
+#define GLTimedVoid(call) ({ GLTimingStart glTimingStart = GLTimingBegin(); call; GLTimingEnd(glTimingStart); })
+#define GLTimed(call) ({ GLTimingStart glTimingStart = GLTimingBegin(); __typeof__(call) glTimingResult = call; GLTimingEnd(glTimingStart); glTimingResult; })
+
+#define glBindBuffer(...) GLTimedVoid(glBindBuffer(__VA_ARGS__))
+#define glBindTexture(...) GLTimedVoid(glBindTexture(__VA_ARGS__))
+#define glBufferData(...) GLTimedVoid(glBufferData(__VA_ARGS__))
+#define glCompressedTexImage2D(...) GLTimedVoid(glCompressedTexImage2D(__VA_ARGS__))
+#define glCompressedTexImage3D(...) GLTimedVoid(glCompressedTexImage3D(__VA_ARGS__))
+#define glCompressedTexSubImage2D(...) GLTimedVoid(glCompressedTexSubImage2D(__VA_ARGS__))
+#define glDeleteBuffers(...) GLTimedVoid(glDeleteBuffers(__VA_ARGS__))
+#define glDeleteSync(...) GLTimedVoid(glDeleteSync(__VA_ARGS__))
+#define glDeleteTextures(...) GLTimedVoid(glDeleteTextures(__VA_ARGS__))
+#define glGenBuffers(...) GLTimedVoid(glGenBuffers(__VA_ARGS__))
+#define glGenTextures(...) GLTimedVoid(glGenTextures(__VA_ARGS__))
+#define glGetIntegerv(...) GLTimedVoid(glGetIntegerv(__VA_ARGS__))
+#define glTexParameteri(...) GLTimedVoid(glTexParameteri(__VA_ARGS__))
+#define glClientWaitSync(...) GLTimed(glClientWaitSync(__VA_ARGS__))
+#define glFenceSync(...) GLTimed(glFenceSync(__VA_ARGS__))
+#define glMapBuffer(...) GLTimed(glMapBuffer(__VA_ARGS__))
+#define glUnmapBuffer(...) GLTimed(glUnmapBuffer(__VA_ARGS__))
+
+#endif
@@ -0,0 +1,261 @@
+//
+//  main.c
+//  HapUploadBenchmark
+//
+//  Runs the plugin's own UpdateTexture against a software GL driver, so that the upload path can be measured
+//  without a GPU: Apple's software renderer, or Mesa's llvmpipe through a surfaceless EGL display elsewhere.
+//  Reports the time each frame spends in GL calls for several resolutions and numbers of streams.
+//
+//  usage: HapUploadBenchmark [frames]
+//
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "GLTiming.h"
+
+#if defined(__APPLE__)
+#include <OpenGL/OpenGL.h>
+#else
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include "hap.h"
+#include "MovieWriter.h"
+#include "Parallel.h"
+
+#define FourCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+#define kMovieFrameCount 16
+#define kMovieChunkCount 8
+#define kMaxStreams 16
+
+static const int resolutions[][2] = { { 640, 360 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+static const int streamCounts[] = { 1, 4, kMaxStreams };
+
+// The plugin's entry points, as Unity imports them
+typedef struct HapMovieTextureContext HapMovieTextureContext;
+
+HapMovieTextureContext *CreateContext(const char *path);
+void Preroll(HapMovieTextureContext *context, GLuint textureHandle, int frames);
+void UpdateTexture(HapMovieTextureContext *context, GLuint textureHandle);
+void DestroyContext(HapMovieTextureContext *context);
+
+GLTimingTotals glTimingTotals;
+
+static uint64_t ClockNanoseconds(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+GLTimingStart GLTimingBegin(void)
+{
+    GLTimingStart start = { ClockNanoseconds(CLOCK_MONOTONIC), ClockNanoseconds(CLOCK_THREAD_CPUTIME_ID) };
+    
+    return start;
+}
+
+void GLTimingEnd(GLTimingStart start)
+{
+    glTimingTotals.calls++;
+    glTimingTotals.nanoseconds += ClockNanoseconds(CLOCK_MONOTONIC) - start.start;
+    glTimingTotals.cpuNanoseconds += ClockNanoseconds(CLOCK_THREAD_CPUTIME_ID) - start.cpuStart;
+}
+
+static bool CreateSoftwareContext(void)
+{
+#if defined(__APPLE__)
+    CGLPixelFormatAttribute attributes[] = { kCGLPFARendererID, kCGLRendererGenericFloatID, 0 };
+    CGLPixelFormatObj pixelFormat;
+    CGLContextObj context = NULL;
+    GLint count;
+    
+    if (CGLChoosePixelFormat(attributes, &pixelFormat, &count) != kCGLNoError || pixelFormat == NULL) {
+        return false;
+    }
+    
+    CGLCreateContext(pixelFormat, NULL, &context);
+    CGLDestroyPixelFormat(pixelFormat);
+    
+    return context != NULL && CGLSetCurrentContext(context) == kCGLNoError;
+#else
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay == NULL) {
+        return false;
+    }
+    
+    EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) || !eglBindAPI(EGL_OPENGL_API)) {
+        return false;
+    }
+    
+    // Nothing is drawn, so the context needs no config where EGL_KHR_no_config_context allows it
+    EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config = NULL;
+    EGLint count = 0;
+    eglChooseConfig(display, configAttributes, &config, 1, &count);
+    
+    EGLContext context = eglCreateContext(display, count > 0 ? config : NULL, EGL_NO_CONTEXT, NULL);
+    
+    return context != EGL_NO_CONTEXT && eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+#endif
+}
+
+/*
+ Writes a DXT1 movie of width by height, encoded in chunks as the offline tools would, whose blocks change
+ from frame to frame
+ */
+static int WriteTestMovie(const char *path, int width, int height)
+{
+    unsigned long blockRowBytes = (unsigned long)((width + 3) / 4) * 8;
+    unsigned long size = blockRowBytes * ((height + 3) / 4);
+    unsigned long maxEncodedSize = HapMaxEncodedLengthForChunks(size, kMovieChunkCount);
+    uint8_t *blocks = malloc(size);
+    uint8_t *encoded = malloc(maxEncodedSize);
+    MovieWriter *writer = MovieWriterCreate(path);
+    int result = -1;
+    
+    if (blocks == NULL || encoded == NULL || writer == NULL) {
+        goto done;
+    }
+    
+    int track = MovieWriterAddTrack(writer, FourCC('H', 'a', 'p', '1'), width, height, 600, 20);
+    
+    int frame;
+    for (frame = 0; track >= 0 && frame < kMovieFrameCount; frame++) {
+        unsigned long i;
+        for (i = 0; i < size; i += 8) {
+            unsigned long block = i / 8;
+            uint16_t color0 = (uint16_t)((((block + frame) & 31) << 11) | (((i / blockRowBytes) & 63) << 5));
+            uint16_t color1 = (uint16_t)(color0 ^ 0x1F);
+            
+            blocks[i] = color0 & 0xFF; blocks[i + 1] = color0 >> 8;
+            blocks[i + 2] = color1 & 0xFF; blocks[i + 3] = color1 >> 8;
+            memset(blocks + i + 4, 0xE4, 4);
+        }
+        
+        unsigned long encodedSize;
+        if (HapEncodeChunks(blocks, size, HapTextureFormat_RGB_DXT1, HapCompressorSnappy, kMovieChunkCount, blockRowBytes, NULL,
+                            ParallelHapCallback, NULL, encoded, maxEncodedSize, &encodedSize) != HapResult_No_Error
+            || MovieWriterAppendFrame(writer, track, encoded, (uint32_t)encodedSize) != 0) {
+            break;
+        }
+    }
+    
+    if (frame == kMovieFrameCount) {
+        result = MovieWriterFinish(writer);
+        writer = NULL;
+    }
+
+done:
+    if (writer != NULL) {
+        MovieWriterCancel(writer);
+    }
+    free(blocks);
+    free(encoded);
+    
+    return result;
+}
+
+/*
+ Plays frames of the movie on streams contexts at once, each into a texture of its own, after prerolling so
+ that allocation is not measured. Only the plugin's calls are timed; glFlush stands in for the end of a frame.
+ */
+static void BenchmarkUpload(const char *path, int width, int height, int streams, int frames)
+{
+    HapMovieTextureContext *contexts[kMaxStreams];
+    GLuint textures[kMaxStreams];
+    
+    glGenTextures(streams, textures);
+    
+    int i;
+    for (i = 0; i < streams; i++) {
+        contexts[i] = CreateContext(path);
+        if (contexts[i] == NULL) {
+            printf("  %s could not be opened\n", path);
+            break;
+        }
+        Preroll(contexts[i], textures[i], 2);
+    }
+    
+    if (i == streams) {
+        GLTimingTotals before = glTimingTotals;
+        uint64_t updating = 0;
+        
+        int frame;
+        for (frame = 0; frame < frames; frame++) {
+            uint64_t start = ClockNanoseconds(CLOCK_MONOTONIC);
+            for (i = 0; i < streams; i++) {
+                UpdateTexture(contexts[i], textures[i]);
+            }
+            updating += ClockNanoseconds(CLOCK_MONOTONIC) - start;
+            
+            glFlush();
+        }
+        glFinish();
+        
+        printf("  %4dx%-4d %2d streams %8.3f ms in GL %8.3f ms GL CPU %6.1f calls %8.3f ms updating per frame\n",
+               width, height, streams,
+               (glTimingTotals.nanoseconds - before.nanoseconds) / 1e6 / frames,
+               (glTimingTotals.cpuNanoseconds - before.cpuNanoseconds) / 1e6 / frames,
+               (double)(glTimingTotals.calls - before.calls) / frames,
+               updating / 1e6 / frames);
+    }
+    
+    while (i-- > 0) {
+        DestroyContext(contexts[i]);
+    }
+    glDeleteTextures(streams, textures);
+}
+
+int main(int argc, const char *argv[])
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 60;
+    
+    if (frames <= 0) {
+        fprintf(stderr, "usage: %s [frames]\n", argv[0]);
+        return 1;
+    }
+    
+    if (!CreateSoftwareContext()) {
+        fprintf(stderr, "Could not create a software OpenGL context\n");
+        return 1;
+    }
+    
+    printf("Upload on %s, %d frames\n", (const char *)glGetString(GL_RENDERER), frames);
+    
+    size_t r, s;
+    for (r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]); r++) {
+        char path[] = "/tmp/HapUploadBenchmark.XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0) {
+            fprintf(stderr, "Could not create a test movie\n");
+            return 1;
+        }
+        close(fd);
+        
+        int width = resolutions[r][0], height = resolutions[r][1];
+        
+        if (WriteTestMovie(path, width, height) != 0) {
+            fprintf(stderr, "Could not write a %dx%d test movie\n", width, height);
+            unlink(path);
+            return 1;
+        }
+        
+        for (s = 0; s < sizeof(streamCounts) / sizeof(streamCounts[0]); s++) {
+            BenchmarkUpload(path, width, height, streamCounts[s], frames);
+        }
+        
+        unlink(path);
+    }
+    
+    return 0;
+}
@@ -0,0 +1,203 @@
+//
+//  Compat.c
+//  HapMovieTexturePlugin
+//
+//  Darwin functions the plugin uses which Linux lacks
+//
+
+#include "Compat.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <dispatch/dispatch.h>
+
+size_t strlcat(char *destination, const char *source, size_t size)
+{
+    size_t length = strnlen(destination, size);
+    size_t sourceLength = strlen(source);
+    
+    if (length < size) {
+        size_t copy = sourceLength < size - length - 1 ? sourceLength : size - length - 1;
+        memcpy(destination + length, source, copy);
+        destination[length + copy] = '\0';
+    }
+    
+    return length + sourceLength;
+}
+
+/*
+ Every queue is the same one, as work is never run in order
+ */
+static struct dispatch_queue_s {
+    int unused;
+} globalQueue;
+
+dispatch_queue_t dispatch_get_global_queue(long priority, unsigned long flags)
+{
+    return &globalQueue;
+}
+
+typedef struct {
+    void *context;
+    void (*work)(void *context, size_t index);
+    size_t iterations;
+    size_t next;
+} ApplyJob;
+
+static void *ApplyThread(void *p)
+{
+    ApplyJob *job = p;
+    size_t index;
+    
+    while ((index = __sync_fetch_and_add(&job->next, 1)) < job->iterations) {
+        job->work(job->context, index);
+    }
+    
+    return NULL;
+}
+
+void dispatch_apply_f(size_t iterations, dispatch_queue_t queue, void *context, void (*work)(void *context, size_t index))
+{
+    ApplyJob job = { context, work, iterations, 0 };
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threadCount = processors > 1 ? (size_t)processors - 1 : 0;
+    
+    if (threadCount > iterations - 1) {
+        threadCount = iterations > 0 ? iterations - 1 : 0;
+    }
+    
+    pthread_t *threads = threadCount > 0 ? malloc(sizeof(pthread_t) * threadCount) : NULL;
+    size_t started = 0;
+    
+    while (threads != NULL && started < threadCount && pthread_create(&threads[started], NULL, ApplyThread, &job) == 0) {
+        started++;
+    }
+    
+    // The calling thread takes part, so the work finishes even if no thread could be started
+    ApplyThread(&job);
+    
+    while (started > 0) {
+        pthread_join(threads[--started], NULL);
+    }
+    free(threads);
+}
+
+/*
+ pending counts work submitted and not yet finished, and released is set once the group's owner has let go
+ of it, so that whichever of the two comes last frees it
+ */
+struct dispatch_group_s {
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    int pending;
+    bool released;
+};
+
+typedef struct {
+    dispatch_group_t group;
+    void *context;
+    dispatch_function_t work;
+} GroupWork;
+
+static void GroupFree(dispatch_group_t group)
+{
+    pthread_cond_destroy(&group->finished);
+    pthread_mutex_destroy(&group->lock);
+    free(group);
+}
+
+static void GroupLeave(dispatch_group_t group)
+{
+    pthread_mutex_lock(&group->lock);
+    bool last = --group->pending == 0 && group->released;
+    pthread_cond_broadcast(&group->finished);
+    pthread_mutex_unlock(&group->lock);
+    
+    if (last) {
+        GroupFree(group);
+    }
+}
+
+static void *GroupThread(void *p)
+{
+    GroupWork *work = p;
+    dispatch_group_t group = work->group;
+    
+    work->work(work->context);
+    free(work);
+    
+    GroupLeave(group);
+    
+    return NULL;
+}
+
+dispatch_group_t dispatch_group_create(void)
+{
+    dispatch_group_t group = calloc(1, sizeof(struct dispatch_group_s));
+    if (group != NULL) {
+        pthread_mutex_init(&group->lock, NULL);
+        pthread_cond_init(&group->finished, NULL);
+    }
+    
+    return group;
+}
+
+void dispatch_group_async_f(dispatch_group_t group, dispatch_queue_t queue, void *context, dispatch_function_t work)
+{
+    GroupWork *groupWork = malloc(sizeof(GroupWork));
+    pthread_attr_t attributes;
+    pthread_t thread;
+    
+    pthread_mutex_lock(&group->lock);
+    group->pending++;
+    pthread_mutex_unlock(&group->lock);
+    
+    if (groupWork != NULL) {
+        groupWork->group = group;
+        groupWork->context = context;
+        groupWork->work = work;
+        
+        pthread_attr_init(&attributes);
+        pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+        bool started = pthread_create(&thread, &attributes, GroupThread, groupWork) == 0;
+        pthread_attr_destroy(&attributes);
+        
+        if (started) {
+            return;
+        }
+        free(groupWork);
+    }
+    
+    // Without a thread the work is run before returning, as the caller has nowhere else to put it
+    work(context);
+    GroupLeave(group);
+}
+
+long dispatch_group_wait(dispatch_group_t group, dispatch_time_t timeout)
+{
+    pthread_mutex_lock(&group->lock);
+    while (group->pending > 0) {
+        pthread_cond_wait(&group->finished, &group->lock);
+    }
+    pthread_mutex_unlock(&group->lock);
+    
+    return 0;
+}
+
+void dispatch_release(void *object)
+{
+    dispatch_group_t group = object;
+    
+    pthread_mutex_lock(&group->lock);
+    group->released = true;
+    bool last = group->pending == 0;
+    pthread_mutex_unlock(&group->lock);
+    
+    if (last) {
+        GroupFree(group);
+    }
+}
@@ -0,0 +1,22 @@
+//
+//  Compat.h
+//  HapMovieTexturePlugin
+//
+//  Prefix header for building on Linux, where the headers under include stand in for the Darwin ones the
+//  plugin uses. Only what the Makefile builds is covered.
+//
+
+#ifndef HapMovieTexturePlugin_Compat_h
+#define HapMovieTexturePlugin_Compat_h
+
+#include <errno.h>
+#include <stddef.h>
+
+// Darwin's "inappropriate file type or format"
+#ifndef EFTYPE
+#define EFTYPE ENOEXEC
+#endif
+
+size_t strlcat(char *destination, const char *source, size_t size);
+
+#endif
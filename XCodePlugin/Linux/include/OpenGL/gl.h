@@ -0,0 +1,17 @@
+//
+//  gl.h
+//  HapMovieTexturePlugin
+//
+//  Maps Darwin's OpenGL framework headers onto Mesa's, with prototypes for the extension functions
+//
+
+#ifndef HapMovieTexturePlugin_OpenGL_gl_h
+#define HapMovieTexturePlugin_OpenGL_gl_h
+
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES 1
+#endif
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#endif
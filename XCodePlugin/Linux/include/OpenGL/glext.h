@@ -0,0 +1,6 @@
+//
+//  glext.h
+//  HapMovieTexturePlugin
+//
+
+#include <OpenGL/gl.h>
@@ -0,0 +1,41 @@
+//
+//  dispatch.h
+//  HapMovieTexturePlugin
+//
+//  The part of libdispatch which Parallel.c uses, implemented on pthreads in Compat.c. There is one global
+//  queue, and work is run on threads started for it rather than on a pool.
+//
+
+#ifndef HapMovieTexturePlugin_dispatch_h
+#define HapMovieTexturePlugin_dispatch_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct dispatch_queue_s *dispatch_queue_t;
+typedef struct dispatch_group_s *dispatch_group_t;
+typedef uint64_t dispatch_time_t;
+typedef void (*dispatch_function_t)(void *context);
+
+#define DISPATCH_QUEUE_PRIORITY_HIGH 2
+#define DISPATCH_QUEUE_PRIORITY_DEFAULT 0
+#define DISPATCH_TIME_FOREVER (~0ULL)
+
+dispatch_queue_t dispatch_get_global_queue(long priority, unsigned long flags);
+
+/*
+ Calls work(context, index) for every index below iterations across as many threads as there are processors,
+ returning when all have finished
+ */
+void dispatch_apply_f(size_t iterations, dispatch_queue_t queue, void *context, void (*work)(void *context, size_t index));
+
+dispatch_group_t dispatch_group_create(void);
+void dispatch_group_async_f(dispatch_group_t group, dispatch_queue_t queue, void *context, dispatch_function_t work);
+
+// Only DISPATCH_TIME_FOREVER is supported
+long dispatch_group_wait(dispatch_group_t group, dispatch_time_t timeout);
+
+// Only groups are counted; releasing one frees it once its work has finished
+void dispatch_release(void *object);
+
+#endif
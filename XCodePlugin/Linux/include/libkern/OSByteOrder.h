@@ -0,0 +1,54 @@
+//
+//  OSByteOrder.h
+//  HapMovieTexturePlugin
+//
+//  The big-endian accessors from Darwin's libkern/OSByteOrder.h which the plugin uses
+//
+
+#ifndef HapMovieTexturePlugin_OSByteOrder_h
+#define HapMovieTexturePlugin_OSByteOrder_h
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+static inline uint16_t OSReadBigInt16(const volatile void *base, uintptr_t offset)
+{
+    uint16_t value;
+    memcpy(&value, (const char *)base + offset, sizeof(value));
+    return be16toh(value);
+}
+
+static inline uint32_t OSReadBigInt32(const volatile void *base, uintptr_t offset)
+{
+    uint32_t value;
+    memcpy(&value, (const char *)base + offset, sizeof(value));
+    return be32toh(value);
+}
+
+static inline uint64_t OSReadBigInt64(const volatile void *base, uintptr_t offset)
+{
+    uint64_t value;
+    memcpy(&value, (const char *)base + offset, sizeof(value));
+    return be64toh(value);
+}
+
+static inline void OSWriteBigInt16(volatile void *base, uintptr_t offset, uint16_t value)
+{
+    value = htobe16(value);
+    memcpy((char *)base + offset, &value, sizeof(value));
+}
+
+static inline void OSWriteBigInt32(volatile void *base, uintptr_t offset, uint32_t value)
+{
+    value = htobe32(value);
+    memcpy((char *)base + offset, &value, sizeof(value));
+}
+
+static inline void OSWriteBigInt64(volatile void *base, uintptr_t offset, uint64_t value)
+{
+    value = htobe64(value);
+    memcpy((char *)base + offset, &value, sizeof(value));
+}
+
+#endif
@@ -0,0 +1,35 @@
+//
+//  mach_time.h
+//  HapMovieTexturePlugin
+//
+//  mach_absolute_time on the monotonic clock, counting nanoseconds
+//
+
+#ifndef HapMovieTexturePlugin_mach_time_h
+#define HapMovieTexturePlugin_mach_time_h
+
+#include <stdint.h>
+#include <time.h>
+
+typedef struct {
+    uint32_t numer;
+    uint32_t denom;
+} mach_timebase_info_data_t;
+
+static inline uint64_t mach_absolute_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static inline int mach_timebase_info(mach_timebase_info_data_t *info)
+{
+    info->numer = 1;
+    info->denom = 1;
+    
+    return 0;
+}
+
+#endif
@@ -0,0 +1,36 @@
+//
+//  sysctl.h
+//  HapMovieTexturePlugin
+//
+//  sysctlbyname for the names the plugin asks for, answered from sysconf
+//
+
+#ifndef HapMovieTexturePlugin_sysctl_h
+#define HapMovieTexturePlugin_sysctl_h
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+static inline int sysctlbyname(const char *name, void *value, size_t *length, void *newValue, size_t newLength)
+{
+    long result = -1;
+    
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+    if (strcmp(name, "hw.l2cachesize") == 0) {
+        result = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+#endif
+    
+    if (result < 0 || newValue != NULL || *length != sizeof(uint64_t)) {
+        errno = ENOENT;
+        return -1;
+    }
+    
+    *(uint64_t *)value = (uint64_t)result;
+    
+    return 0;
+}
+
+#endif
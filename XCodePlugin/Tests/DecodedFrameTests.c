@@ -0,0 +1,223 @@
+//
+//  DecodedFrameTests.c
+//  HapMovieTexturePlugin
+//
+//  Takes, retains, releases and recycles frames of a DecodedFramePool, alone and through frame sinks on other
+//  threads, and destroys pools with frames still referenced. Built with AddressSanitizer, which fails the test
+//  on a frame used after it was freed or one never freed.
+//
+//  usage: DecodedFrameTests
+//
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "DecodedFrame.h"
+
+#define kBufferSize 4096
+#define kMaxFrames 3
+
+#define kSinkCount 2
+#define kPublishCount 20000
+
+static int failures = 0;
+
+#define Check(condition, ...) do { \
+    if (!(condition)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static void TestTakeAndRecycle(void)
+{
+    DecodedFramePool *pool = DecodedFramePoolCreate(kBufferSize, kMaxFrames);
+    DecodedFrame *frames[kMaxFrames];
+    int i;
+    
+    for (i = 0; i < kMaxFrames; i++) {
+        frames[i] = DecodedFramePoolTake(pool);
+        Check(frames[i] != NULL, "take %d: no frame", i);
+        Check(frames[i]->references == 1, "take %d: %d references", i, frames[i]->references);
+        memset(frames[i]->data, i, kBufferSize);
+    }
+    Check(DecodedFramePoolTake(pool) == NULL, "took a frame past the pool's limit");
+    
+    // A frame goes back to the pool only when its last reference is released
+    DecodedFrameRetain(frames[1]);
+    DecodedFrameRelease(frames[1]);
+    Check(DecodedFramePoolTake(pool) == NULL, "took a frame still referenced");
+    
+    DecodedFrameRelease(frames[1]);
+    DecodedFrame *recycled = DecodedFramePoolTake(pool);
+    Check(recycled == frames[1], "released frame was not recycled");
+    Check(recycled != NULL && recycled->references == 1, "recycled frame has the wrong references");
+    
+    for (i = 0; i < kMaxFrames; i++) {
+        DecodedFrameRelease(frames[i]);
+    }
+    DecodedFramePoolDestroy(pool);
+}
+
+static void TestDestroyWhileReferenced(void)
+{
+    DecodedFramePool *pool = DecodedFramePoolCreate(kBufferSize, kMaxFrames);
+    DecodedFrame *held = DecodedFramePoolTake(pool);
+    DecodedFrame *released = DecodedFramePoolTake(pool);
+    
+    DecodedFrameRelease(released);
+    DecodedFrameRetain(held);
+    DecodedFramePoolDestroy(pool);
+    
+    // The held frame and the pool stay valid until the last release
+    memset(held->data, 0xFF, kBufferSize);
+    DecodedFrameRelease(held);
+    Check(held->pool == pool, "held frame lost its pool");
+    DecodedFrameRelease(held);
+}
+
+static void TestSinkSkipsAndReleases(void)
+{
+    DecodedFramePool *pool = DecodedFramePoolCreate(kBufferSize, kMaxFrames);
+    FrameSink *sink = FrameSinkCreate();
+    DecodedFrame *first = DecodedFramePoolTake(pool);
+    DecodedFrame *second = DecodedFramePoolTake(pool);
+    FrameSinkStatistics statistics;
+    
+    first->frame = 1;
+    second->frame = 2;
+    
+    // Each delivery holds its own reference, so the decoder can release its one straight away
+    FrameSinkDeliver(sink, first);
+    DecodedFrameRelease(first);
+    FrameSinkDeliver(sink, second);
+    DecodedFrameRelease(second);
+    
+    Check(DecodedFramePoolTake(pool) == first, "skipped frame was not recycled");
+    
+    DecodedFrame *acquired = FrameSinkAcquire(sink);
+    Check(acquired == second, "acquired the wrong frame");
+    Check(FrameSinkAcquire(sink) == NULL, "acquired a frame twice");
+    
+    FrameSinkGetStatistics(sink, &statistics);
+    Check(statistics.delivered == 2, "delivered %llu", (unsigned long long)statistics.delivered);
+    Check(statistics.skipped == 1, "skipped %llu", (unsigned long long)statistics.skipped);
+    Check(statistics.completed == 1 && statistics.completedFrame == 2, "completed %llu, last %d",
+          (unsigned long long)statistics.completed, statistics.completedFrame);
+    
+    Check(DecodedFramePoolTake(pool) == second, "completed frame was not recycled");
+    
+    DecodedFrameRelease(first);
+    DecodedFrameRelease(second);
+    FrameSinkDestroy(sink);
+    DecodedFramePoolDestroy(pool);
+}
+
+typedef struct {
+    FrameSink *sink;
+    volatile bool *stop;
+    int lastFrame;
+    int outOfOrder;
+    int corrupt;
+} Consumer;
+
+static void *ConsumerThread(void *p)
+{
+    Consumer *consumer = p;
+    
+    while (!*consumer->stop) {
+        DecodedFrame *frame = FrameSinkAcquire(consumer->sink);
+        if (frame == NULL) {
+            continue;
+        }
+        
+        if (frame->frame <= consumer->lastFrame) {
+            consumer->outOfOrder++;
+        }
+        consumer->lastFrame = frame->frame;
+        
+        const uint8_t *data = frame->data;
+        if (data[0] != (uint8_t)frame->frame || data[kBufferSize - 1] != (uint8_t)frame->frame) {
+            consumer->corrupt++;
+        }
+    }
+    
+    // The last frame taken is left for FrameSinkDestroy to release
+    return NULL;
+}
+
+/*
+ One thread decodes into frames of the pool and delivers them to sinks which other threads take them from.
+ A frame recycled while a consumer still had it would show up as corrupt or, freed, to AddressSanitizer.
+ */
+static void TestSinksAcrossThreads(void)
+{
+    DecodedFramePool *pool = DecodedFramePoolCreate(kBufferSize, kSinkCount * 2 + 1);
+    Consumer consumers[kSinkCount];
+    pthread_t threads[kSinkCount];
+    volatile bool stop = false;
+    int published = 0, dropped = 0;
+    int i, frame;
+    
+    for (i = 0; i < kSinkCount; i++) {
+        memset(&consumers[i], 0, sizeof(Consumer));
+        consumers[i].sink = FrameSinkCreate();
+        consumers[i].stop = &stop;
+        consumers[i].lastFrame = -1;
+        pthread_create(&threads[i], NULL, ConsumerThread, &consumers[i]);
+    }
+    
+    for (frame = 0; frame < kPublishCount; frame++) {
+        DecodedFrame *decoded = DecodedFramePoolTake(pool);
+        if (decoded == NULL) {
+            dropped++;
+            continue;
+        }
+        
+        decoded->frame = frame;
+        memset(decoded->data, (uint8_t)frame, kBufferSize);
+        
+        for (i = 0; i < kSinkCount; i++) {
+            FrameSinkDeliver(consumers[i].sink, decoded);
+        }
+        DecodedFrameRelease(decoded);
+        published++;
+    }
+    
+    stop = true;
+    
+    // The pool goes first, so the frames the sinks still hold free it as they are released
+    DecodedFramePoolDestroy(pool);
+    
+    for (i = 0; i < kSinkCount; i++) {
+        pthread_join(threads[i], NULL);
+        
+        FrameSinkStatistics statistics;
+        FrameSinkGetStatistics(consumers[i].sink, &statistics);
+        Check(statistics.delivered == published, "sink %d: %llu of %d frames delivered", i,
+              (unsigned long long)statistics.delivered, published);
+        Check(consumers[i].outOfOrder == 0, "sink %d: %d frames out of order", i, consumers[i].outOfOrder);
+        Check(consumers[i].corrupt == 0, "sink %d: %d frames changed while held", i, consumers[i].corrupt);
+        
+        FrameSinkDestroy(consumers[i].sink);
+    }
+    
+    Check(published > 0, "no frames published, %d dropped", dropped);
+}
+
+int main(int argc, const char *argv[])
+{
+    TestTakeAndRecycle();
+    TestDestroyWhileReferenced();
+    TestSinkSkipsAndReleases();
+    TestSinksAcrossThreads();
+    
+    printf("%s: %s\n", argv[0], failures == 0 ? "passed" : "FAILED");
+    
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,286 @@
+//
+//  ETCTests.c
+//  HapMovieTexturePlugin
+//
+//  Transcodes a few DXT blocks which between them reach every ETC2 mode the transcoder writes, and checks the
+//  output against stored blocks. The output is also decoded here, following the ETC2 and EAC definitions in
+//  the OpenGL ES 3.0 specification, and compared with the DXT texels, so the stored blocks and their errors
+//  can be checked by hand against any other decoder.
+//
+//  usage: ETCTests
+//
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ETC.h"
+#include "DXT.h"
+
+typedef struct {
+    const char *name;
+    bool dxt5;
+    uint8_t dxt[16];
+    uint8_t etc[16];
+    // The sum of squared differences between the decoded blocks, over every channel the ETC format stores
+    int error;
+} GoldenBlock;
+
+static const GoldenBlock goldenBlocks[] = {
+    {
+        "solid red, differential", false,
+        { 0x00, 0xF8, 0x00, 0xF8, 0x00, 0x00, 0x00, 0x00 },
+        { 0xF8, 0x00, 0x00, 0x02, 0xFF, 0xFF, 0x00, 0x00 },
+        64
+    },
+    {
+        "grey ramp, differential", false,
+        { 0xFF, 0xFF, 0x00, 0x00, 0xE4, 0xE4, 0xE4, 0xE4 },
+        { 0x80, 0x80, 0x80, 0xEE, 0xF0, 0xF0, 0xFF, 0xFF },
+        492
+    },
+    {
+        "black and white halves, individual", false,
+        { 0xFF, 0xFF, 0x00, 0x00, 0x05, 0x05, 0x05, 0x05 },
+        { 0x0F, 0x0F, 0x0F, 0x00, 0x00, 0xFF, 0x00, 0x00 },
+        0
+    },
+    {
+        "red and blue, T mode", false,
+        { 0x00, 0xF8, 0x1F, 0x00, 0x44, 0x44, 0x44, 0x44 },
+        { 0x04, 0x0F, 0xF0, 0x02, 0x0F, 0x0F, 0x00, 0x00 },
+        0
+    },
+    {
+        "four colours off the grey axis, T mode", false,
+        { 0xE0, 0x07, 0x1F, 0xF8, 0x1B, 0x1B, 0x1B, 0x1B },
+        { 0xFB, 0x0F, 0x27, 0x2F, 0xF0, 0x0F, 0x00, 0xFF },
+        114604
+    },
+    {
+        "three colours and transparent, T mode", false,
+        { 0x1F, 0x00, 0xE0, 0x07, 0x24, 0x9C, 0x24, 0x9C },
+        { 0x04, 0x0F, 0x09, 0x3F, 0xAF, 0xF0, 0x00, 0xA0 },
+        93670
+    },
+    {
+        "opaque solid red with alpha", true,
+        { 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xF8, 0x00, 0xF8, 0x00, 0x00, 0x00, 0x00 },
+        { 0xFF, 0x1D, 0x92, 0x49, 0x24, 0x92, 0x49, 0x24, 0xF8, 0x00, 0x00, 0x02, 0xFF, 0xFF, 0x00, 0x00 },
+        64
+    },
+    {
+        "alpha ramp, H mode", true,
+        { 0xFF, 0x00, 0x88, 0x46, 0x24, 0x92, 0x49, 0x24, 0xE0, 0x07, 0x1F, 0xF8, 0x1B, 0x4E, 0xB1, 0xE4 },
+        { 0x80, 0xD7, 0xF3, 0x47, 0xF7, 0xCC, 0xBA, 0xE3, 0x69, 0xFA, 0x9E, 0x9B, 0x5A, 0x5A, 0x96, 0x69 },
+        81027
+    }
+};
+
+static const int ETCModifierTables[8][2] = {
+    { 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 }, { 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 }
+};
+
+static const int ETCDistances[8] = { 3, 6, 11, 16, 23, 32, 41, 64 };
+
+static const int EACModifierTables[16][8] = {
+    { -3, -6, -9, -15, 2, 5, 8, 14 },
+    { -3, -7, -10, -13, 2, 6, 9, 12 },
+    { -2, -5, -8, -13, 1, 4, 7, 12 },
+    { -2, -4, -6, -13, 1, 3, 5, 12 },
+    { -3, -6, -8, -12, 2, 5, 7, 11 },
+    { -3, -7, -9, -11, 2, 6, 8, 10 },
+    { -4, -7, -8, -11, 3, 6, 7, 10 },
+    { -3, -5, -8, -11, 2, 4, 7, 10 },
+    { -2, -6, -8, -10, 1, 5, 7, 9 },
+    { -2, -5, -8, -10, 1, 4, 7, 9 },
+    { -2, -4, -8, -10, 1, 3, 7, 9 },
+    { -2, -5, -7, -10, 1, 4, 6, 9 },
+    { -3, -4, -7, -10, 2, 3, 6, 9 },
+    { -1, -2, -3, -10, 0, 1, 2, 9 },
+    { -4, -6, -8, -9, 3, 5, 7, 8 },
+    { -3, -5, -7, -9, 2, 4, 6, 8 }
+};
+
+static int Clamp255(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static uint32_t ReadBig32(const uint8_t *bytes)
+{
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+static int Extend4(int value)
+{
+    return value * 17;
+}
+
+static int Extend5(int value)
+{
+    return (value << 3) | (value >> 2);
+}
+
+/*
+ Decodes an ETC2 RGB8 block to texels in row order. Returns false for planar blocks, which the transcoder
+ never writes.
+ */
+static bool DecodeETC2(const uint8_t *block, uint8_t rgb[16][3])
+{
+    uint32_t high = ReadBig32(block), low = ReadBig32(block + 4);
+    int colours[2][3], paints[4][3];
+    bool individual = (high & 2) == 0, flip = high & 1;
+    int x, y, k;
+    
+    int red = high >> 27 & 31, redDifference = (int)(high >> 24 & 7) - ((high >> 24 & 4) ? 8 : 0);
+    int green = high >> 19 & 31, greenDifference = (int)(high >> 16 & 7) - ((high >> 16 & 4) ? 8 : 0);
+    int blue = high >> 11 & 31, blueDifference = (int)(high >> 8 & 7) - ((high >> 8 & 4) ? 8 : 0);
+    
+    if (!individual && (red + redDifference < 0 || red + redDifference > 31)) {
+        // T mode
+        int base0[3] = { (int)((high >> 27 & 3) << 2 | (high >> 24 & 3)), (int)(high >> 20 & 15), (int)(high >> 16 & 15) };
+        int base1[3] = { (int)(high >> 12 & 15), (int)(high >> 8 & 15), (int)(high >> 4 & 15) };
+        int distance = ETCDistances[(high >> 2 & 3) << 1 | (high & 1)];
+        for (k = 0; k < 3; k++) {
+            paints[0][k] = Extend4(base0[k]);
+            paints[1][k] = Clamp255(Extend4(base1[k]) + distance);
+            paints[2][k] = Extend4(base1[k]);
+            paints[3][k] = Clamp255(Extend4(base1[k]) - distance);
+        }
+    } else if (!individual && (green + greenDifference < 0 || green + greenDifference > 31)) {
+        // H mode, where the order of the bases gives the lowest bit of the distance index
+        int base0[3] = { (int)(high >> 27 & 15), (int)((high >> 24 & 7) << 1 | (high >> 20 & 1)), (int)((high >> 19 & 1) << 3 | (high >> 15 & 7)) };
+        int base1[3] = { (int)(high >> 11 & 15), (int)(high >> 7 & 15), (int)(high >> 3 & 15) };
+        int order = ((base0[0] << 8) | (base0[1] << 4) | base0[2]) >= ((base1[0] << 8) | (base1[1] << 4) | base1[2]);
+        int distance = ETCDistances[(high >> 2 & 1) << 2 | (high & 1) << 1 | order];
+        for (k = 0; k < 3; k++) {
+            paints[0][k] = Clamp255(Extend4(base0[k]) + distance);
+            paints[1][k] = Clamp255(Extend4(base0[k]) - distance);
+            paints[2][k] = Clamp255(Extend4(base1[k]) + distance);
+            paints[3][k] = Clamp255(Extend4(base1[k]) - distance);
+        }
+    } else if (!individual && (blue + blueDifference < 0 || blue + blueDifference > 31)) {
+        return false;
+    } else {
+        if (individual) {
+            for (k = 0; k < 3; k++) {
+                colours[0][k] = Extend4(high >> (28 - 8 * k) & 15);
+                colours[1][k] = Extend4(high >> (24 - 8 * k) & 15);
+            }
+        } else {
+            int bases[3] = { red, green, blue }, differences[3] = { redDifference, greenDifference, blueDifference };
+            for (k = 0; k < 3; k++) {
+                colours[0][k] = Extend5(bases[k]);
+                colours[1][k] = Extend5(bases[k] + differences[k]);
+            }
+        }
+        
+        int tables[2] = { high >> 5 & 7, high >> 2 & 7 };
+        for (y = 0; y < 4; y++) {
+            for (x = 0; x < 4; x++) {
+                int pixel = x * 4 + y;
+                int index = (low >> (16 + pixel) & 1) << 1 | (low >> pixel & 1);
+                int subblock = flip ? y >= 2 : x >= 2;
+                int modifier = ETCModifierTables[tables[subblock]][index & 1];
+                if (index & 2) {
+                    modifier = -modifier;
+                }
+                for (k = 0; k < 3; k++) {
+                    rgb[y * 4 + x][k] = (uint8_t)Clamp255(colours[subblock][k] + modifier);
+                }
+            }
+        }
+        return true;
+    }
+    
+    for (y = 0; y < 4; y++) {
+        for (x = 0; x < 4; x++) {
+            int pixel = x * 4 + y;
+            int index = (low >> (16 + pixel) & 1) << 1 | (low >> pixel & 1);
+            for (k = 0; k < 3; k++) {
+                rgb[y * 4 + x][k] = (uint8_t)paints[index][k];
+            }
+        }
+    }
+    return true;
+}
+
+static void DecodeEAC(const uint8_t *block, uint8_t alpha[16])
+{
+    int base = block[0], multiplier = block[1] >> 4;
+    const int *modifiers = EACModifierTables[block[1] & 15];
+    uint64_t bits = 0;
+    int i, x, y;
+    
+    for (i = 2; i < 8; i++) {
+        bits = bits << 8 | block[i];
+    }
+    for (x = 0; x < 4; x++) {
+        for (y = 0; y < 4; y++) {
+            int pixel = x * 4 + y;
+            alpha[y * 4 + x] = (uint8_t)Clamp255(base + modifiers[bits >> (45 - 3 * pixel) & 7] * multiplier);
+        }
+    }
+}
+
+static void SerialCallback(HapDecodeWorkFunction function, void *p, unsigned int count, void *info)
+{
+    unsigned int i;
+    for (i = 0; i < count; i++) {
+        function(p, i);
+    }
+}
+
+int main(int argc, const char *argv[])
+{
+    int failures = 0;
+    size_t i;
+    
+    for (i = 0; i < sizeof(goldenBlocks) / sizeof(goldenBlocks[0]); i++) {
+        const GoldenBlock *golden = &goldenBlocks[i];
+        size_t bytes = golden->dxt5 ? kDXT5BlockBytes : kDXT1BlockBytes;
+        const uint8_t *colour = golden->dxt5 ? golden->etc + 8 : golden->etc;
+        uint8_t etc[16], texels[16][4], rgb[16][3], alpha[16];
+        int error = 0;
+        int t, k;
+        
+        ETCTranscode(golden->dxt, 4, 4, golden->dxt5, etc, SerialCallback, NULL);
+        if (memcmp(etc, golden->etc, bytes) != 0) {
+            printf("FAIL %s: transcoded to", golden->name);
+            for (k = 0; k < (int)bytes; k++) {
+                printf(" %02X", etc[k]);
+            }
+            printf("\n");
+            failures++;
+        }
+        
+        DXTDecodeBlock(golden->dxt, golden->dxt5, texels);
+        if (!DecodeETC2(colour, rgb)) {
+            printf("FAIL %s: stored block is planar\n", golden->name);
+            failures++;
+            continue;
+        }
+        if (golden->dxt5) {
+            DecodeEAC(golden->etc, alpha);
+        }
+        
+        for (t = 0; t < 16; t++) {
+            for (k = 0; k < 3; k++) {
+                error += (rgb[t][k] - texels[t][k]) * (rgb[t][k] - texels[t][k]);
+            }
+            if (golden->dxt5) {
+                error += (alpha[t] - texels[t][3]) * (alpha[t] - texels[t][3]);
+            }
+        }
+        if (error != golden->error) {
+            printf("FAIL %s: decoded error %d, expected %d\n", golden->name, error, golden->error);
+            failures++;
+        }
+    }
+    
+    printf("%s: %s\n", argv[0], failures == 0 ? "passed" : "FAILED");
+    
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,252 @@
+//
+//  FlipbookTests.c
+//  HapMovieTexturePlugin
+//
+//  Writes short movies with repeated frames, loads them as flipbooks from a headless EGL context, and checks
+//  the layer each frame is given and the texture array's contents, and that a clip with more distinct frames
+//  than the array can hold is refused without leaving a texture.
+//
+//  usage: FlipbookTests
+//
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#if defined(__APPLE__)
+#include <OpenGL/gl.h>
+#include <OpenGL/glext.h>
+#else
+#define GL_GLEXT_PROTOTYPES 1
+#include <GL/gl.h>
+#include <GL/glext.h>
+#endif
+
+#include "hap.h"
+#include "MovieWriter.h"
+
+#define FourCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+#define kBlockBytes 8
+
+// The repeating clip is 8 by 8 pixels, four blocks a frame
+#define kWidth 8
+#define kHeight 8
+#define kFrameBytes (kWidth * kHeight / 2)
+
+// Only the plugin's exported functions, which have no header of their own
+typedef struct HapMovieTextureContext HapMovieTextureContext;
+HapMovieTextureContext *CreateContext(const char *path);
+void DestroyContext(HapMovieTextureContext *context);
+int LoadFlipbook(HapMovieTextureContext *context);
+GLuint GetFlipbookTexture(HapMovieTextureContext *context);
+int GetFlipbookLayers(HapMovieTextureContext *context, int *layers, int count);
+int UpdateFlipbook(HapMovieTextureContext *context);
+
+static int failures = 0;
+
+#define Check(condition, ...) do { \
+    if (!(condition)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static bool CreateHeadlessContext(void)
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay == NULL) {
+        return false;
+    }
+    
+    EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) || !eglBindAPI(EGL_OPENGL_API)) {
+        return false;
+    }
+    
+    EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config = NULL;
+    EGLint count = 0;
+    eglChooseConfig(display, configAttributes, &config, 1, &count);
+    
+    EGLContext context = eglCreateContext(display, count > 0 ? config : NULL, EGL_NO_CONTEXT, NULL);
+    
+    return context != EGL_NO_CONTEXT && eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+
+// Every block of a frame differs from those of a frame with another number
+static void FillFrame(uint8_t *blocks, size_t size, int number)
+{
+    size_t i;
+    for (i = 0; i < size; i++) {
+        blocks[i] = (uint8_t)(number * 31 + i);
+    }
+    blocks[0] = number & 0xFF;
+    blocks[1] = (number >> 8) & 0xFF;
+}
+
+/*
+ Writes a DXT1 movie to path of width by height pixels whose frames are filled as FillFrame does for each of
+ numbers in turn
+ */
+static bool WriteMovie(const char *path, int width, int height, const int *numbers, int count)
+{
+    size_t size = (size_t)((width + 3) / 4) * ((height + 3) / 4) * kBlockBytes;
+    unsigned long encodedMax = HapMaxEncodedLength(size);
+    uint8_t *blocks = malloc(size), *encoded = malloc(encodedMax);
+    MovieWriter *writer = MovieWriterCreate(path);
+    int track = writer != NULL ? MovieWriterAddTrack(writer, FourCC('H', 'a', 'p', '1'), width, height, 600, 20) : -1;
+    bool ok = blocks != NULL && encoded != NULL && track >= 0;
+    
+    int i;
+    for (i = 0; i < count && ok; i++) {
+        unsigned long encodedSize;
+        FillFrame(blocks, size, numbers[i]);
+        ok = HapEncode(blocks, size, HapTextureFormat_RGB_DXT1, HapCompressorNone, encoded, encodedMax, &encodedSize) == HapResult_No_Error
+            && MovieWriterAppendFrame(writer, track, encoded, (uint32_t)encodedSize) == 0;
+    }
+    
+    if (writer != NULL) {
+        if (ok) {
+            ok = MovieWriterFinish(writer) == 0;
+        } else {
+            MovieWriterCancel(writer);
+        }
+    }
+    free(blocks);
+    free(encoded);
+    
+    return ok;
+}
+
+// Repeated frames share the layer of their first showing, and the layers hold the distinct frames in order
+static void TestRepeatedFrames(const char *path)
+{
+    static const int numbers[] = { 1, 2, 1, 3, 2, 1 };
+    static const int expectedLayers[] = { 0, 1, 0, 2, 1, 0 };
+    static const int distinct[] = { 1, 2, 3 };
+    const int frameCount = sizeof(numbers) / sizeof(numbers[0]);
+    const int layerCount = sizeof(distinct) / sizeof(distinct[0]);
+    
+    if (!WriteMovie(path, kWidth, kHeight, numbers, frameCount)) {
+        printf("FAIL could not write %s\n", path);
+        failures++;
+        return;
+    }
+    
+    HapMovieTextureContext *context = CreateContext(path);
+    Check(context != NULL, "repeated: could not open %s", path);
+    if (context == NULL) {
+        return;
+    }
+    
+    int result = LoadFlipbook(context);
+    Check(result == 0, "repeated: LoadFlipbook returned %d", result);
+    
+    int layers[sizeof(numbers) / sizeof(numbers[0])];
+    int count = GetFlipbookLayers(context, layers, frameCount);
+    Check(count == frameCount, "repeated: %d frames in the flipbook", count);
+    Check(count != frameCount || memcmp(layers, expectedLayers, sizeof(layers)) == 0,
+          "repeated: layers %d %d %d %d %d %d", layers[0], layers[1], layers[2], layers[3], layers[4], layers[5]);
+    
+    int frame;
+    for (frame = 0; frame < frameCount; frame++) {
+        int layer = UpdateFlipbook(context);
+        Check(layer == expectedLayers[frame], "repeated: frame %d played as layer %d", frame, layer);
+    }
+    
+    GLuint texture = GetFlipbookTexture(context);
+    Check(texture != 0, "repeated: no texture");
+    if (texture != 0) {
+        uint8_t contents[kFrameBytes * 3], expected[kFrameBytes * 3];
+        GLint depth = 0;
+        
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, 0, GL_TEXTURE_DEPTH, &depth);
+        Check(depth == layerCount, "repeated: %d layers in the array", depth);
+        
+        if (depth == layerCount) {
+            int layer;
+            for (layer = 0; layer < layerCount; layer++) {
+                FillFrame(expected + layer * kFrameBytes, kFrameBytes, distinct[layer]);
+            }
+            glGetCompressedTexImage(GL_TEXTURE_2D_ARRAY, 0, contents);
+            Check(memcmp(contents, expected, sizeof(contents)) == 0, "repeated: array contents differ");
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+    
+    DestroyContext(context);
+}
+
+// A clip of one more distinct frame than the array can hold is refused, leaving the context without a flipbook
+static void TestTooManyLayers(const char *path)
+{
+    GLint maxLayers = 0;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+    
+    int frameCount = maxLayers + 1;
+    int *numbers = malloc(frameCount * sizeof(int));
+    int i;
+    for (i = 0; numbers != NULL && i < frameCount; i++) {
+        numbers[i] = i;
+    }
+    
+    if (numbers == NULL || !WriteMovie(path, 4, 4, numbers, frameCount)) {
+        printf("FAIL could not write %s\n", path);
+        failures++;
+        free(numbers);
+        return;
+    }
+    free(numbers);
+    
+    HapMovieTextureContext *context = CreateContext(path);
+    Check(context != NULL, "too many layers: could not open %s", path);
+    if (context == NULL) {
+        return;
+    }
+    
+    int result = LoadFlipbook(context);
+    Check(result == EFBIG, "too many layers: LoadFlipbook returned %d", result);
+    Check(GetFlipbookTexture(context) == 0, "too many layers: texture left behind");
+    Check(GetFlipbookLayers(context, NULL, 0) == 0, "too many layers: layers left behind");
+    Check(UpdateFlipbook(context) == -1, "too many layers: flipbook played");
+    
+    DestroyContext(context);
+}
+
+int main(int argc, const char *argv[])
+{
+    if (!CreateHeadlessContext()) {
+        printf("FAIL could not create an OpenGL context\n");
+        return 1;
+    }
+    
+    char path[] = "/tmp/FlipbookTests.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("FAIL could not create a temporary file\n");
+        return 1;
+    }
+    close(fd);
+    
+    TestRepeatedFrames(path);
+    TestTooManyLayers(path);
+    
+    GLenum error = glGetError();
+    Check(error == GL_NO_ERROR, "GL error 0x%x", error);
+    
+    unlink(path);
+    
+    printf("%s: %s\n", argv[0], failures == 0 ? "passed" : "FAILED");
+    
+    return failures == 0 ? 0 : 1;
+}
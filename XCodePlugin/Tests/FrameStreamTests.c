@@ -0,0 +1,269 @@
+//
+//  FrameStreamTests.c
+//  HapMovieTexturePlugin
+//
+//  Sends UDP fragments to a FrameReceiver over loopback out of order, duplicated and with some missing, and
+//  checks which frames come out whole, then checks that senders which restart over UDP or reconnect over TCP
+//  are shown from their first frame.
+//
+//  usage: FrameStreamTests
+//
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <libkern/OSByteOrder.h>
+#include <mach/mach_time.h>
+
+#include "FrameStream.h"
+
+#define FourCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+// The wire format, as FrameStream.c writes it
+#define kHeaderBytes 32
+#define kFragmentBytes (1400 - kHeaderBytes)
+
+#define kFrameSize (3 * kFragmentBytes + 100)
+#define kWidthBase 16
+#define kFragmentCount 4
+
+// A sender restarting from 0 after this frame is far enough back to be told from reordering
+#define kRestartSequence 200
+
+// The clock of a reconnected sender, behind the first one's by more than the test waits for a frame
+#define kSenderClockOffset 10000000
+
+// How long to wait for the receiving thread to hand a frame over, and for it to have seen every datagram
+#define kWaitMicroseconds 2000000
+#define kSettleMicroseconds 300000
+
+static int failures = 0;
+
+#define Check(condition, ...) do { \
+    if (!(condition)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static uint64_t Microseconds(void)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+}
+
+static void FillFrame(uint8_t *frame, uint32_t sequence)
+{
+    int i;
+    for (i = 0; i < kFrameSize; i++) {
+        frame[i] = (uint8_t)(i * 7 + sequence * 13);
+    }
+}
+
+static void SendFragment(int fd, uint32_t sequence, uint64_t timestamp, const uint8_t *frame, int index)
+{
+    uint8_t datagram[kHeaderBytes + kFragmentBytes];
+    uint32_t offset = index * kFragmentBytes;
+    uint32_t size = kFrameSize - offset < kFragmentBytes ? kFrameSize - offset : kFragmentBytes;
+    
+    OSWriteBigInt32(datagram, 0, FourCC('H', 'a', 'p', 'S'));
+    OSWriteBigInt32(datagram, 4, sequence);
+    OSWriteBigInt64(datagram, 8, timestamp);
+    // The width carries the sequence, which FrameReceiverNextFrame doesn't return
+    OSWriteBigInt16(datagram, 16, kWidthBase + sequence);
+    OSWriteBigInt16(datagram, 18, 64);
+    OSWriteBigInt32(datagram, 20, kFrameSize);
+    OSWriteBigInt32(datagram, 24, offset);
+    OSWriteBigInt32(datagram, 28, size);
+    memcpy(datagram + kHeaderBytes, frame + offset, size);
+    
+    send(fd, datagram, kHeaderBytes + size, 0);
+}
+
+// Sends the fragments of frame sequence in the order given by indices
+static void SendFrame(int fd, uint32_t sequence, const int *indices, int count)
+{
+    uint8_t frame[kFrameSize];
+    uint64_t timestamp = Microseconds();
+    
+    FillFrame(frame, sequence);
+    
+    int i;
+    for (i = 0; i < count; i++) {
+        SendFragment(fd, sequence, timestamp, frame, indices[i]);
+    }
+}
+
+/*
+ Waits for the next frame, returning its sequence, -1 if none arrived whole, or -2 if one arrived with the
+ wrong contents
+ */
+static int NextFrame(FrameReceiver *receiver, uint64_t waitMicroseconds)
+{
+    uint8_t frame[kFrameSize], expected[kFrameSize];
+    uint64_t start = Microseconds();
+    
+    do {
+        uint32_t size;
+        int width, height;
+        
+        if (FrameReceiverNextFrame(receiver, frame, sizeof(frame), &size, &width, &height) == 0) {
+            int sequence = width - kWidthBase;
+            FillFrame(expected, sequence);
+            
+            return size == kFrameSize && memcmp(frame, expected, kFrameSize) == 0 ? sequence : -2;
+        }
+        usleep(1000);
+    } while (Microseconds() - start < waitMicroseconds);
+    
+    return -1;
+}
+
+static int ConnectSender(uint16_t port)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    
+    return fd;
+}
+
+/*
+ Sends frames numbered first to last over a new TCP connection, whose timestamps are offset microseconds
+ behind ours, and waits for each to be shown. Returns the number shown.
+ */
+static int SendOverTCP(FrameReceiver *receiver, int first, int last, uint64_t offset)
+{
+    FrameSender *sender = FrameSenderCreate(FrameStreamTCP, "localhost", FrameReceiverPort(receiver));
+    if (sender == NULL) {
+        return 0;
+    }
+    
+    uint8_t frame[kFrameSize];
+    int shown = 0;
+    int sequence;
+    for (sequence = first; sequence <= last; sequence++) {
+        FillFrame(frame, sequence);
+        FrameSenderSend(sender, frame, kFrameSize, kWidthBase + sequence, 64, Microseconds() - offset);
+        if (NextFrame(receiver, kWaitMicroseconds) == sequence) {
+            shown++;
+        }
+    }
+    
+    FrameSenderDestroy(sender);
+    
+    return shown;
+}
+
+// A sender that disconnects and a new one that connects count from sequence 0 again, on a clock of its own
+static void TestReconnect(void)
+{
+    FrameReceiver *receiver = FrameReceiverCreate(FrameStreamTCP, 0, kFrameSize, 0);
+    if (receiver == NULL) {
+        printf("FAIL could not create a TCP receiver\n");
+        failures++;
+        return;
+    }
+    
+    int shown = SendOverTCP(receiver, 0, 4, 0);
+    Check(shown == 5, "first sender: %d of 5 frames shown", shown);
+    
+    shown = SendOverTCP(receiver, 0, 2, kSenderClockOffset);
+    Check(shown == 3, "reconnected sender: %d of 3 frames shown", shown);
+    
+    FrameReceiverStatistics statistics;
+    FrameReceiverGetStatistics(receiver, &statistics);
+    Check(statistics.late == 0, "reconnected sender: %llu frames late", (unsigned long long)statistics.late);
+    
+    FrameReceiverDestroy(receiver);
+}
+
+int main(int argc, const char *argv[])
+{
+    FrameReceiver *receiver = FrameReceiverCreate(FrameStreamUDP, 0, kFrameSize, 0);
+    if (receiver == NULL) {
+        printf("FAIL could not create a receiver\n");
+        return 1;
+    }
+    
+    int fd = ConnectSender(FrameReceiverPort(receiver));
+    if (fd < 0) {
+        printf("FAIL could not connect to port %u\n", FrameReceiverPort(receiver));
+        FrameReceiverDestroy(receiver);
+        return 1;
+    }
+    
+    static const int inOrder[] = { 0, 1, 2, 3 };
+    static const int reversed[] = { 3, 2, 1, 0 };
+    static const int duplicated[] = { 0, 1, 1, 0, 2, 2 };
+    static const int last[] = { 3 };
+    static const int lost[] = { 0, 2, 3 };
+    
+    SendFrame(fd, 0, inOrder, kFragmentCount);
+    int sequence = NextFrame(receiver, kWaitMicroseconds);
+    Check(sequence == 0, "in order: got frame %d", sequence);
+    
+    SendFrame(fd, 1, reversed, kFragmentCount);
+    sequence = NextFrame(receiver, kWaitMicroseconds);
+    Check(sequence == 1, "reordered: got frame %d", sequence);
+    
+    // Repeated fragments must not stand in for the one that hasn't come
+    SendFrame(fd, 2, duplicated, sizeof(duplicated) / sizeof(duplicated[0]));
+    sequence = NextFrame(receiver, kSettleMicroseconds);
+    Check(sequence == -1, "duplicated: frame %d completed with fragment 3 missing", sequence);
+    
+    SendFrame(fd, 2, last, 1);
+    sequence = NextFrame(receiver, kWaitMicroseconds);
+    Check(sequence == 2, "duplicated: got frame %d once complete", sequence);
+    
+    SendFrame(fd, 3, lost, sizeof(lost) / sizeof(lost[0]));
+    SendFrame(fd, 4, inOrder, kFragmentCount);
+    sequence = NextFrame(receiver, kWaitMicroseconds);
+    Check(sequence == 4, "lost: got frame %d", sequence);
+    sequence = NextFrame(receiver, kSettleMicroseconds);
+    Check(sequence == -1, "lost: frame %d completed with fragment 1 missing", sequence);
+    
+    FrameReceiverStatistics statistics;
+    FrameReceiverGetStatistics(receiver, &statistics);
+    Check(statistics.received == 4, "received %llu frames", (unsigned long long)statistics.received);
+    Check(statistics.displayed == 4, "displayed %llu frames", (unsigned long long)statistics.displayed);
+    Check(statistics.missing == 1, "missing %llu frames", (unsigned long long)statistics.missing);
+    
+    // A sender restarted over UDP starts from 0 again, far behind the last frame shown
+    SendFrame(fd, kRestartSequence, inOrder, kFragmentCount);
+    sequence = NextFrame(receiver, kWaitMicroseconds);
+    Check(sequence == kRestartSequence, "restart: got frame %d before restarting", sequence);
+    SendFrame(fd, 0, inOrder, kFragmentCount);
+    sequence = NextFrame(receiver, kWaitMicroseconds);
+    Check(sequence == 0, "restart: got frame %d after restarting", sequence);
+    
+    close(fd);
+    FrameReceiverDestroy(receiver);
+    
+    TestReconnect();
+    
+    printf("%s: %s\n", argv[0], failures == 0 ? "passed" : "FAILED");
+    
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,243 @@
+//
+//  HapDecodeTests.c
+//  HapMovieTexturePlugin
+//
+//  Decodes chunked DXT1 frames into neighbouring rectangles of one atlas buffer, including frames whose size
+//  doesn't match the rectangle, and checks that nothing outside a frame's own rectangle is written. Decodes a
+//  frame of many chunks incrementally, one chunk a call, and checks the result matches HapDecode's and that
+//  ending part way reports the frame unfinished.
+//
+//  usage: HapDecodeTests
+//
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hap.h"
+
+#define kBlockBytes 8
+#define kChunkCount 2
+
+// The atlas is 6 by 4 blocks, holding 2 by 2 block frames side by side and one below the other
+#define kAtlasBlocksWide 6
+#define kAtlasBlocksHigh 4
+#define kAtlasRowBytes (kAtlasBlocksWide * kBlockBytes)
+#define kAtlasBytes (kAtlasRowBytes * kAtlasBlocksHigh)
+#define kUnwritten 0xEE
+
+#define kMaxFrameBytes (kAtlasBytes * 2)
+
+// The incrementally decoded frame is 8 by 16 blocks, one row of blocks a chunk
+#define kIncrementalBlocksWide 8
+#define kIncrementalBlocksHigh 16
+#define kIncrementalRowBytes (kIncrementalBlocksWide * kBlockBytes)
+#define kIncrementalBytes (kIncrementalRowBytes * kIncrementalBlocksHigh)
+#define kIncrementalChunkCount kIncrementalBlocksHigh
+#define kIncrementalStopChunk 3
+
+static int failures = 0;
+
+#define Check(condition, ...) do { \
+    if (!(condition)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+typedef struct {
+    int blocksWide, blocksHigh;
+    uint8_t blocks[kAtlasBytes];
+    uint8_t encoded[kMaxFrameBytes];
+    unsigned long encodedSize;
+} TestFrame;
+
+static void SerialCallback(HapDecodeWorkFunction function, void *p, unsigned int count, void *info)
+{
+    unsigned int i;
+    for (i = 0; i < count; i++) {
+        function(p, i);
+    }
+}
+
+// Every byte of a frame is different from the same byte of another frame made with a different seed
+static bool MakeFrame(TestFrame *frame, int blocksWide, int blocksHigh, int seed)
+{
+    size_t size = (size_t)blocksWide * blocksHigh * kBlockBytes;
+    size_t i;
+    
+    frame->blocksWide = blocksWide;
+    frame->blocksHigh = blocksHigh;
+    for (i = 0; i < size; i++) {
+        frame->blocks[i] = (uint8_t)(seed * 37 + i);
+    }
+    
+    return HapEncodeChunks(frame->blocks, size, HapTextureFormat_RGB_DXT1, HapCompressorNone, kChunkCount,
+                           blocksWide * kBlockBytes, NULL, SerialCallback, NULL, frame->encoded, sizeof(frame->encoded),
+                           &frame->encodedSize) == HapResult_No_Error;
+}
+
+static unsigned int DecodeInto(uint8_t *atlas, const TestFrame *frame, int width, int height, int blockX, int blockY)
+{
+    unsigned int textureFormat;
+    
+    return HapDecodeRegion(frame->encoded, frame->encodedSize, SerialCallback, NULL, width, height,
+                           atlas, kAtlasBytes, kAtlasRowBytes, blockX, blockY, &textureFormat);
+}
+
+// Writes frame's blocks into expected as if it had been decoded at blockX, blockY
+static void Place(uint8_t *expected, const TestFrame *frame, int blockX, int blockY)
+{
+    int row;
+    for (row = 0; row < frame->blocksHigh; row++) {
+        memcpy(expected + (blockY + row) * kAtlasRowBytes + blockX * kBlockBytes,
+               frame->blocks + row * frame->blocksWide * kBlockBytes, frame->blocksWide * kBlockBytes);
+    }
+}
+
+static void TestNeighbouringRegions(void)
+{
+    TestFrame *left = malloc(sizeof(TestFrame)), *right = malloc(sizeof(TestFrame));
+    TestFrame *tall = malloc(sizeof(TestFrame)), *wide = malloc(sizeof(TestFrame));
+    uint8_t atlas[kAtlasBytes], expected[kAtlasBytes];
+    
+    if (!MakeFrame(left, 2, 2, 1) || !MakeFrame(right, 2, 2, 2) || !MakeFrame(tall, 2, 3, 3) || !MakeFrame(wide, 3, 2, 4)) {
+        printf("FAIL could not encode the test frames\n");
+        failures++;
+        return;
+    }
+    
+    memset(atlas, kUnwritten, kAtlasBytes);
+    memset(expected, kUnwritten, kAtlasBytes);
+    
+    unsigned int result = DecodeInto(atlas, left, 8, 8, 0, 0);
+    Check(result == HapResult_No_Error, "left: result %u", result);
+    Place(expected, left, 0, 0);
+    
+    // A height which isn't a whole number of blocks is rounded up
+    result = DecodeInto(atlas, right, 8, 6, 2, 0);
+    Check(result == HapResult_No_Error, "right: result %u", result);
+    Place(expected, right, 2, 0);
+    
+    Check(memcmp(atlas, expected, kAtlasBytes) == 0, "neighbours: blocks outside the two rectangles written");
+    
+    // Frames larger than their rectangle would reach the one below or beside it
+    result = DecodeInto(atlas, tall, 8, 8, 0, 0);
+    Check(result == HapResult_Bad_Arguments, "taller frame: result %u", result);
+    
+    result = DecodeInto(atlas, wide, 8, 8, 0, 0);
+    Check(result == HapResult_Bad_Arguments, "wider frame: result %u", result);
+    
+    result = DecodeInto(atlas, left, 8, 12, 2, 0);
+    Check(result == HapResult_Bad_Arguments, "shorter frame: result %u", result);
+    
+    result = DecodeInto(atlas, left, 8, 8, 5, 0);
+    Check(result == HapResult_Bad_Arguments, "past the right edge: result %u", result);
+    
+    result = DecodeInto(atlas, left, 8, 8, 0, 3);
+    Check(result == HapResult_Buffer_Too_Small, "past the bottom edge: result %u", result);
+    
+    Check(memcmp(atlas, expected, kAtlasBytes) == 0, "rejected frames: atlas written");
+    
+    free(left);
+    free(right);
+    free(tall);
+    free(wide);
+}
+
+/*
+ A budget of nothing still decodes one chunk a call, so a frame of many chunks takes as many calls, and the
+ result is the same as decoding it in one go
+ */
+static void TestIncrementalDecode(void)
+{
+    uint8_t *blocks = malloc(kIncrementalBytes), *whole = malloc(kIncrementalBytes), *incremental = malloc(kIncrementalBytes);
+    unsigned long encodedMax = HapMaxEncodedLengthForChunks(kIncrementalBytes, kIncrementalChunkCount);
+    uint8_t *encoded = malloc(encodedMax);
+    unsigned long encodedSize, bytesUsed;
+    unsigned int textureFormat, result;
+    HapDecodeProgress *progress;
+    int i;
+    
+    for (i = 0; i < kIncrementalBytes; i++) {
+        blocks[i] = (uint8_t)(i * 7 + i / kIncrementalRowBytes);
+    }
+    
+    if (HapEncodeChunks(blocks, kIncrementalBytes, HapTextureFormat_RGB_DXT1, HapCompressorNone, kIncrementalChunkCount,
+                        kIncrementalRowBytes, NULL, SerialCallback, NULL, encoded, encodedMax, &encodedSize) != HapResult_No_Error) {
+        printf("FAIL could not encode the incremental frame\n");
+        failures++;
+        return;
+    }
+    
+    result = HapDecode(encoded, encodedSize, SerialCallback, NULL, whole, kIncrementalBytes, &bytesUsed, &textureFormat);
+    Check(result == HapResult_No_Error && bytesUsed == kIncrementalBytes, "whole: result %u, %lu bytes", result, bytesUsed);
+    Check(memcmp(whole, blocks, kIncrementalBytes) == 0, "whole: frame differs from the one encoded");
+    
+    memset(incremental, kUnwritten, kIncrementalBytes);
+    result = HapDecodeBegin(encoded, encodedSize, incremental, kIncrementalBytes, &textureFormat, &progress);
+    Check(result == HapResult_No_Error, "incremental: begin result %u", result);
+    if (result == HapResult_No_Error) {
+        int calls = 0;
+        bool finished = false;
+        while (!finished && calls <= kIncrementalChunkCount) {
+            finished = HapDecodeContinue(progress, 0);
+            calls++;
+        }
+        Check(finished, "incremental: not finished after %d calls", calls);
+        Check(calls == kIncrementalChunkCount, "incremental: %d calls for %d chunks", calls, kIncrementalChunkCount);
+        
+        bytesUsed = 0;
+        result = HapDecodeEnd(progress, &bytesUsed);
+        Check(result == HapResult_No_Error && bytesUsed == kIncrementalBytes, "incremental: result %u, %lu bytes", result, bytesUsed);
+        Check(textureFormat == HapTextureFormat_RGB_DXT1, "incremental: texture format 0x%x", textureFormat);
+        Check(memcmp(incremental, whole, kIncrementalBytes) == 0, "incremental: frame differs from HapDecode's");
+    }
+    
+    // A generous budget finishes in one call
+    result = HapDecodeBegin(encoded, encodedSize, incremental, kIncrementalBytes, &textureFormat, &progress);
+    if (result == HapResult_No_Error) {
+        Check(HapDecodeContinue(progress, 1000000), "generous budget: not finished in one call");
+        result = HapDecodeEnd(progress, NULL);
+    }
+    Check(result == HapResult_No_Error, "generous budget: result %u", result);
+    
+    // Ending part way reports the frame unfinished, and leaves the chunks not yet decoded unwritten
+    memset(incremental, kUnwritten, kIncrementalBytes);
+    result = HapDecodeBegin(encoded, encodedSize, incremental, kIncrementalBytes, &textureFormat, &progress);
+    Check(result == HapResult_No_Error, "part way: begin result %u", result);
+    if (result == HapResult_No_Error) {
+        for (i = 0; i < kIncrementalStopChunk; i++) {
+            Check(!HapDecodeContinue(progress, 0), "part way: finished after %d calls", i + 1);
+        }
+        bytesUsed = 0;
+        result = HapDecodeEnd(progress, &bytesUsed);
+        Check(result == HapResult_Internal_Error, "part way: result %u", result);
+        Check(bytesUsed == 0, "part way: %lu bytes reported", bytesUsed);
+        
+        size_t decodedBytes = kIncrementalStopChunk * kIncrementalRowBytes;
+        Check(memcmp(incremental, whole, decodedBytes) == 0, "part way: decoded chunks differ from HapDecode's");
+        for (i = (int)decodedBytes; i < kIncrementalBytes && incremental[i] == kUnwritten; i++) {
+        }
+        Check(i == kIncrementalBytes, "part way: byte %d written past the chunks decoded", i);
+    }
+    
+    free(blocks);
+    free(whole);
+    free(incremental);
+    free(encoded);
+}
+
+int main(int argc, const char *argv[])
+{
+    TestNeighbouringRegions();
+    TestIncrementalDecode();
+    
+    printf("%s: %s\n", argv[0], failures == 0 ? "passed" : "FAILED");
+    
+    return failures == 0 ? 0 : 1;
+}
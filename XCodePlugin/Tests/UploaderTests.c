@@ -0,0 +1,185 @@
+//
+//  UploaderTests.c
+//  HapMovieTexturePlugin
+//
+//  Submits numbered frames to several upload streams from a headless EGL context, and checks that every
+//  texture the render thread is given holds one whole frame of its own stream, in order, ending with the last.
+//
+//  usage: UploaderTests
+//
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <mach/mach_time.h>
+
+#include "Uploader.h"
+
+#define kStreamCount 4
+#define kFrameCount 200
+#define kWidth 256
+#define kHeight 128
+#define kFrameSize (kWidth * kHeight / 2)
+#define kBlockBytes 8
+
+// How long to wait for the last frame submitted to each stream to be uploaded
+#define kWaitMicroseconds 2000000
+
+static int failures = 0;
+
+#define Check(condition, ...) do { \
+    if (!(condition)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static uint64_t Microseconds(void)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+}
+
+static bool CreateHeadlessContext(void)
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay == NULL) {
+        return false;
+    }
+    
+    EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) || !eglBindAPI(EGL_OPENGL_API)) {
+        return false;
+    }
+    
+    EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config = NULL;
+    EGLint count = 0;
+    eglChooseConfig(display, configAttributes, &config, 1, &count);
+    
+    EGLContext context = eglCreateContext(display, count > 0 ? config : NULL, EGL_NO_CONTEXT, NULL);
+    
+    return context != EGL_NO_CONTEXT && eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+
+// Every DXT1 block of a frame is the same, its first colour holding the frame number and its second the stream
+static void FillFrame(uint8_t *frame, int stream, int number)
+{
+    int i;
+    for (i = 0; i < kFrameSize; i += kBlockBytes) {
+        memset(frame + i, 0, kBlockBytes);
+        frame[i] = number & 0xFF;
+        frame[i + 1] = number >> 8;
+        frame[i + 2] = stream;
+    }
+}
+
+/*
+ Returns the number of the frame in texture, -1 if it holds no texture, or -2 if it doesn't hold one whole
+ frame of stream
+ */
+static int TextureFrame(GLuint texture, int stream, uint8_t *readback)
+{
+    if (texture == 0) {
+        return -1;
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glGetCompressedTexImage(GL_TEXTURE_2D, 0, readback);
+    
+    int number = readback[0] | readback[1] << 8;
+    int i;
+    for (i = 0; i < kFrameSize; i += kBlockBytes) {
+        if ((readback[i] | readback[i + 1] << 8) != number || readback[i + 2] != stream) {
+            return -2;
+        }
+    }
+    
+    return number;
+}
+
+int main(int argc, const char *argv[])
+{
+    if (!CreateHeadlessContext()) {
+        printf("FAIL could not create an OpenGL context\n");
+        return 1;
+    }
+    
+    UploadStream *streams[kStreamCount];
+    int shown[kStreamCount], changes[kStreamCount], submitted[kStreamCount];
+    uint8_t *readback = malloc(kFrameSize);
+    int stream, number;
+    
+    for (stream = 0; stream < kStreamCount; stream++) {
+        streams[stream] = UploadStreamCreate(kFrameSize);
+        if (streams[stream] == NULL) {
+            printf("FAIL could not create upload stream %d\n", stream);
+            return 1;
+        }
+        shown[stream] = -1;
+        changes[stream] = 0;
+        submitted[stream] = -1;
+    }
+    
+    // A cancelled buffer is given back, so the next frame still has one
+    Check(UploadStreamBuffer(streams[0]) != NULL, "no buffer for the first frame");
+    UploadStreamCancel(streams[0]);
+    
+    for (number = 0; number < kFrameCount; number++) {
+        for (stream = 0; stream < kStreamCount; stream++) {
+            int frame = TextureFrame(UploadStreamTexture(streams[stream]), stream, readback);
+            Check(frame != -2, "stream %d: texture doesn't hold one whole frame", stream);
+            Check(frame >= shown[stream], "stream %d: frame %d shown after %d", stream, frame, shown[stream]);
+            if (frame != shown[stream]) {
+                changes[stream]++;
+            }
+            shown[stream] = frame;
+            
+            // Uploads falling behind drop the frame
+            uint8_t *buffer = UploadStreamBuffer(streams[stream]);
+            if (buffer != NULL) {
+                FillFrame(buffer, stream, number);
+                UploadStreamSubmit(streams[stream], GL_COMPRESSED_RGB_S3TC_DXT1_EXT, kWidth, kHeight, kFrameSize);
+                submitted[stream] = number;
+            }
+        }
+        usleep(1000);
+    }
+    
+    for (stream = 0; stream < kStreamCount; stream++) {
+        uint64_t start = Microseconds();
+        int frame = shown[stream];
+        
+        while (frame != submitted[stream] && Microseconds() - start < kWaitMicroseconds) {
+            frame = TextureFrame(UploadStreamTexture(streams[stream]), stream, readback);
+            usleep(1000);
+        }
+        
+        Check(changes[stream] > 1, "stream %d: only %d frames shown", stream, changes[stream]);
+        Check(frame == submitted[stream], "stream %d: last frame shown %d, last submitted %d", stream, frame, submitted[stream]);
+    }
+    
+    GLenum error = glGetError();
+    Check(error == GL_NO_ERROR, "GL error 0x%x", error);
+    
+    for (stream = 0; stream < kStreamCount; stream++) {
+        UploadStreamDestroy(streams[stream]);
+    }
+    free(readback);
+    
+    printf("%s: %s\n", argv[0], failures == 0 ? "passed" : "FAILED");
+    
+    return failures == 0 ? 0 : 1;
+}
@@ -28,7 +28,20 @@
 #include "hap.h"
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h> // For ULONG_MAX
 #include <string.h> // For memcpy for uncompressed frames
+#include <pthread.h> // For per-thread staging buffers
+#if defined(__APPLE__)
+#include <mach/mach_time.h> // For timing incremental decodes
+#else
+#include <time.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 #include "snappy-c.h"
 
 #define kHapUInt24Max 0x00FFFFFF
@@ -71,15 +84,29 @@
 #define kHapSectionChunkOffsetTable 0x04
 
 /*
- To decode we use a struct to store details of each chunk
+ Where a frame is decoded into a region of a larger buffer, each row of frame_row_bytes is written
+ output_row_bytes after the last, starting at destination
+ */
+typedef struct HapDecodeRegionInfo {
+    char *destination;
+    size_t frame_row_bytes;
+    size_t output_row_bytes;
+} HapDecodeRegionInfo;
+
+/*
+ To decode we use a struct to store details of each chunk. uncompressed_chunk_offset is the chunk's position in
+ the frame as if it were decoded tightly packed, and is used in place of uncompressed_chunk_data if region is not NULL.
  */
 typedef struct HapChunkDecodeInfo {
     unsigned int result;
     unsigned int compressor;
+    unsigned int staged;
     const char *compressed_chunk_data;
     size_t compressed_chunk_size;
     char *uncompressed_chunk_data;
     size_t uncompressed_chunk_size;
+    size_t uncompressed_chunk_offset;
+    const HapDecodeRegionInfo *region;
 } HapChunkDecodeInfo;
 
 // TODO: rename the defines we use for codes used in stored frames
@@ -338,16 +365,444 @@ unsigned int HapEncode(const void *inputBuffer, unsigned long inputBufferBytes,
     return HapResult_No_Error;
 }
 
+/*
+ To encode a chunked frame we use a struct to store details of each chunk
+ */
+typedef struct HapChunkEncodeInfo {
+    unsigned int result;
+    unsigned int compressor;
+    const char *uncompressed_chunk_data;
+    size_t uncompressed_chunk_size;
+    char *compressed_chunk_data;
+    size_t compressed_chunk_size;
+    const HapCompressionModel *model;
+} HapChunkEncodeInfo;
+
+static size_t hap_max_compressed_chunk_length(size_t inputBytes)
+{
+    size_t length = snappy_max_compressed_length(inputBytes);
+    return length < inputBytes ? inputBytes : length;
+}
+
+unsigned long HapMaxEncodedLengthForChunks(unsigned long inputBytes, unsigned int chunkCount)
+{
+    /*
+     Worst case: an eight-byte top-level header, the Decode Instructions Container with a compressor and size
+     table, and every chunk at snappy's maximum length (which is linear in input size plus a constant per chunk)
+     */
+    if (chunkCount == 0) chunkCount = 1;
+    return 8U + 4U + (4U + chunkCount) + (4U + 4U * chunkCount)
+        + hap_max_compressed_chunk_length(inputBytes) + (unsigned long)chunkCount * hap_max_compressed_chunk_length(0);
+}
+
+/*
+ Returns 1 if the model predicts that reading and decompressing compressedBytes is quicker than reading and
+ copying uncompressedBytes
+ */
+static int hap_model_prefers_compressed(const HapCompressionModel *model, size_t uncompressedBytes, size_t compressedBytes)
+{
+    double compressedTime;
+    double uncompressedTime;
+
+    if (model->storageBytesPerSecond <= 0.0 || model->decompressBytesPerSecond <= 0.0)
+    {
+        return 1;
+    }
+
+    compressedTime = compressedBytes / model->storageBytesPerSecond + uncompressedBytes / model->decompressBytesPerSecond;
+    uncompressedTime = uncompressedBytes / model->storageBytesPerSecond;
+    if (model->copyBytesPerSecond > 0.0)
+    {
+        uncompressedTime += uncompressedBytes / model->copyBytesPerSecond;
+    }
+
+    return compressedTime < uncompressedTime;
+}
+
+static void hap_encode_chunk(HapChunkEncodeInfo chunks[], unsigned int index)
+{
+    if (chunks)
+    {
+        HapChunkEncodeInfo *chunk = &chunks[index];
+        chunk->result = HapResult_No_Error;
+
+        if (chunk->compressor == kHapCompressorSnappy)
+        {
+            chunk->compressed_chunk_size = hap_max_compressed_chunk_length(chunk->uncompressed_chunk_size);
+            if (snappy_compress(chunk->uncompressed_chunk_data, chunk->uncompressed_chunk_size,
+                                chunk->compressed_chunk_data, &chunk->compressed_chunk_size) != SNAPPY_OK)
+            {
+                chunk->result = HapResult_Internal_Error;
+                return;
+            }
+        }
+
+        /*
+         If our "compressed" chunk is no smaller than our input chunk, or the model predicts it will be slower to
+         decode, then store the input uncompressed.
+         */
+        if (chunk->compressor == kHapCompressorNone
+            || chunk->compressed_chunk_size >= chunk->uncompressed_chunk_size
+            || (chunk->model != NULL
+                && !hap_model_prefers_compressed(chunk->model, chunk->uncompressed_chunk_size, chunk->compressed_chunk_size)))
+        {
+            memcpy(chunk->compressed_chunk_data, chunk->uncompressed_chunk_data, chunk->uncompressed_chunk_size);
+            chunk->compressed_chunk_size = chunk->uncompressed_chunk_size;
+            chunk->compressor = kHapCompressorNone;
+        }
+    }
+}
+
+unsigned int HapEncodeChunks(const void *inputBuffer, unsigned long inputBufferBytes, unsigned int textureFormat,
+                             unsigned int compressor, unsigned int chunkCount, unsigned long chunkAlignment,
+                             const HapCompressionModel *model,
+                             HapDecodeCallback callback, void *info,
+                             void *outputBuffer, unsigned long outputBufferBytes,
+                             unsigned long *outputBufferBytesUsed)
+{
+    HapChunkEncodeInfo *chunk_info;
+    size_t topHeaderLength;
+    size_t tablesLength;
+    size_t dataStart;
+    size_t scratchLength = 0;
+    size_t units;
+    size_t storedLength = 0;
+    unsigned int result = HapResult_No_Error;
+    unsigned int i;
+    uint8_t *out = (uint8_t *)outputBuffer;
+
+    /*
+     Check arguments
+     */
+    if (inputBuffer == NULL
+        || inputBufferBytes == 0
+        || callback == NULL
+        || chunkCount == 0
+        || (textureFormat != HapTextureFormat_RGB_DXT1
+            && textureFormat != HapTextureFormat_RGBA_DXT5
+            && textureFormat != HapTextureFormat_YCoCg_DXT5
+            )
+        || (compressor != HapCompressorNone
+            && compressor != HapCompressorSnappy
+            )
+        )
+    {
+        return HapResult_Bad_Arguments;
+    }
+
+    /*
+     Chunks are split on multiples of chunkAlignment bytes, by default the size of one S3TC block, so no block
+     straddles two chunks
+     */
+    if (chunkAlignment == 0)
+    {
+        chunkAlignment = textureFormat == HapTextureFormat_RGB_DXT1 ? 8U : 16U;
+    }
+    units = inputBufferBytes / chunkAlignment;
+    if (units == 0)
+    {
+        units = 1;
+        chunkAlignment = inputBufferBytes;
+    }
+    if (chunkCount > units)
+    {
+        chunkCount = (unsigned int)units;
+    }
+
+    if (outputBuffer == NULL || outputBufferBytes < HapMaxEncodedLengthForChunks(inputBufferBytes, chunkCount))
+    {
+        return HapResult_Buffer_Too_Small;
+    }
+
+    chunk_info = (HapChunkEncodeInfo *)malloc(sizeof(HapChunkEncodeInfo) * chunkCount);
+    if (chunk_info == NULL)
+    {
+        return HapResult_Internal_Error;
+    }
+
+    /*
+     The top-level section header must be able to express the worst-case length of the frame
+     */
+    tablesLength = 4U + (4U + chunkCount) + (4U + 4U * chunkCount);
+    topHeaderLength = HapMaxEncodedLengthForChunks(inputBufferBytes, chunkCount) - 8U > kHapUInt24Max ? 8U : 4U;
+    dataStart = topHeaderLength + tablesLength;
+
+    /*
+     Each chunk is compressed into its own worst-case sized region of the output buffer, so that chunks can be
+     compressed in parallel, and then moved down to follow the previous chunk
+     */
+    for (i = 0; i < chunkCount; i++)
+    {
+        size_t start = (units * i / chunkCount) * chunkAlignment;
+        size_t end = i == chunkCount - 1 ? inputBufferBytes : (units * (i + 1) / chunkCount) * chunkAlignment;
+
+        chunk_info[i].compressor = compressor == HapCompressorSnappy ? kHapCompressorSnappy : kHapCompressorNone;
+        chunk_info[i].uncompressed_chunk_data = ((const char *)inputBuffer) + start;
+        chunk_info[i].uncompressed_chunk_size = end - start;
+        chunk_info[i].compressed_chunk_data = (char *)out + dataStart + scratchLength;
+        chunk_info[i].compressed_chunk_size = 0;
+        chunk_info[i].model = model;
+
+        scratchLength += hap_max_compressed_chunk_length(end - start);
+    }
+
+    callback((HapDecodeWorkFunction)hap_encode_chunk, chunk_info, chunkCount, info);
+
+    for (i = 0; i < chunkCount; i++)
+    {
+        if (chunk_info[i].result != HapResult_No_Error)
+        {
+            result = chunk_info[i].result;
+            break;
+        }
+        memmove(out + dataStart + storedLength, chunk_info[i].compressed_chunk_data, chunk_info[i].compressed_chunk_size);
+        storedLength += chunk_info[i].compressed_chunk_size;
+    }
+
+    if (result == HapResult_No_Error)
+    {
+        uint8_t *section = out + topHeaderLength;
+
+        hap_write_section_header(out, topHeaderLength, (uint32_t)(tablesLength + storedLength),
+                                 hap_4_bit_packed_byte(kHapCompressorComplex, hap_texture_format_identifier_for_format_constant(textureFormat)));
+
+        hap_write_section_header(section, 4U, (uint32_t)(tablesLength - 4U), kHapSectionDecodeInstructionsContainer);
+        section += 4U;
+
+        hap_write_section_header(section, 4U, chunkCount, kHapSectionChunkSecondStageCompressorTable);
+        section += 4U;
+        for (i = 0; i < chunkCount; i++)
+        {
+            *section++ = (uint8_t)chunk_info[i].compressor;
+        }
+
+        hap_write_section_header(section, 4U, chunkCount * 4U, kHapSectionChunkSizeTable);
+        section += 4U;
+        for (i = 0; i < chunkCount; i++)
+        {
+            hap_write_4_byte_uint(section, (unsigned int)chunk_info[i].compressed_chunk_size);
+            section += 4U;
+        }
+
+        if (outputBufferBytesUsed != NULL)
+        {
+            *outputBufferBytesUsed = dataStart + storedLength;
+        }
+    }
+
+    free(chunk_info);
+
+    return result;
+}
+
+/*
+ Staged decoding
+ 
+ Output buffers mapped from the GPU are frequently write-combined, which makes reading them back extremely slow.
+ Snappy copies from earlier in its output to resolve back-references, so decompressing straight into such a buffer
+ is slow too. In staged mode each chunk is decompressed into a buffer private to the decoding thread, which stays
+ in cache, and is then streamed to the output with non-temporal stores which never read the destination.
+ */
+#define kHapStagingBufferMinimumBytes (256U * 1024U)
+
+typedef struct HapStagingBuffer {
+    size_t length;
+    char data[1];
+} HapStagingBuffer;
+
+static pthread_key_t hap_staging_key;
+static pthread_once_t hap_staging_once = PTHREAD_ONCE_INIT;
+
+static void hap_staging_key_create(void)
+{
+    pthread_key_create(&hap_staging_key, free);
+}
+
+// Returns a buffer of at least length bytes owned by the calling thread, or NULL
+static char *hap_staging_buffer(size_t length)
+{
+    HapStagingBuffer *buffer;
+
+    pthread_once(&hap_staging_once, hap_staging_key_create);
+
+    buffer = (HapStagingBuffer *)pthread_getspecific(hap_staging_key);
+    if (buffer == NULL || buffer->length < length)
+    {
+        size_t allocate = length < kHapStagingBufferMinimumBytes ? kHapStagingBufferMinimumBytes : length;
+        free(buffer);
+        buffer = (HapStagingBuffer *)malloc(sizeof(HapStagingBuffer) + allocate);
+        if (buffer != NULL)
+        {
+            buffer->length = allocate;
+        }
+        pthread_setspecific(hap_staging_key, buffer);
+    }
+    return buffer ? buffer->data : NULL;
+}
+
+/*
+ Copies length bytes to destination using non-temporal stores where the platform has them
+ */
+static void hap_stream_copy(void *destination, const void *source, size_t length)
+{
+#if defined(__SSE2__)
+    uint8_t *dst = (uint8_t *)destination;
+    const uint8_t *src = (const uint8_t *)source;
+    size_t head = (16U - ((uintptr_t)dst & 15U)) & 15U;
+
+    if (length < 64U)
+    {
+        memcpy(dst, src, length);
+        return;
+    }
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    length -= head;
+
+#if defined(__AVX__)
+    if (((uintptr_t)dst & 31U) == 16U && length >= 16U)
+    {
+        _mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+        dst += 16;
+        src += 16;
+        length -= 16;
+    }
+    while (length >= 32U)
+    {
+        _mm256_stream_si256((__m256i *)dst, _mm256_loadu_si256((const __m256i *)src));
+        dst += 32;
+        src += 32;
+        length -= 32;
+    }
+#endif
+    while (length >= 16U)
+    {
+        _mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+        dst += 16;
+        src += 16;
+        length -= 16;
+    }
+    _mm_sfence();
+
+    memcpy(dst, src, length);
+#else
+    memcpy(destination, source, length);
+#endif
+}
+
+static snappy_status hap_snappy_uncompress(const char *compressed, size_t compressed_length, char *uncompressed, size_t *uncompressed_length, unsigned int staged)
+{
+    char *staging = staged ? hap_staging_buffer(*uncompressed_length) : NULL;
+    snappy_status result;
+
+    if (staging == NULL)
+    {
+        return snappy_uncompress(compressed, compressed_length, uncompressed, uncompressed_length);
+    }
+
+    result = snappy_uncompress(compressed, compressed_length, staging, uncompressed_length);
+    if (result == SNAPPY_OK)
+    {
+        hap_stream_copy(uncompressed, staging, *uncompressed_length);
+    }
+    return result;
+}
+
+/*
+ Copies length bytes which begin offset bytes into a tightly packed frame to their place in region
+ */
+static void hap_region_copy(const HapDecodeRegionInfo *region, size_t offset, const char *source, size_t length)
+{
+    if (region->output_row_bytes == region->frame_row_bytes)
+    {
+        hap_stream_copy(region->destination + offset, source, length);
+        return;
+    }
+
+    while (length > 0)
+    {
+        size_t row = offset / region->frame_row_bytes;
+        size_t column = offset % region->frame_row_bytes;
+        size_t span = region->frame_row_bytes - column;
+
+        if (span > length)
+        {
+            span = length;
+        }
+
+        hap_stream_copy(region->destination + (row * region->output_row_bytes) + column, source, span);
+
+        offset += span;
+        source += span;
+        length -= span;
+    }
+}
+
+/*
+ A chunk decoded into a region is decompressed whole into the thread's staging buffer and copied out row by row
+ */
+static void hap_decode_chunk_region(HapChunkDecodeInfo *chunk)
+{
+    if (chunk->compressor == kHapCompressorSnappy)
+    {
+        size_t length = chunk->uncompressed_chunk_size;
+        char *staging = hap_staging_buffer(length);
+        snappy_status snappy_result;
+
+        if (staging == NULL)
+        {
+            chunk->result = HapResult_Internal_Error;
+            return;
+        }
+
+        snappy_result = snappy_uncompress(chunk->compressed_chunk_data, chunk->compressed_chunk_size, staging, &length);
+        if (snappy_result == SNAPPY_OK && length != chunk->uncompressed_chunk_size)
+        {
+            snappy_result = SNAPPY_INVALID_INPUT;
+        }
+
+        switch (snappy_result)
+        {
+            case SNAPPY_INVALID_INPUT:
+                chunk->result = HapResult_Bad_Frame;
+                break;
+            case SNAPPY_OK:
+                hap_region_copy(chunk->region, chunk->uncompressed_chunk_offset, staging, length);
+                chunk->result = HapResult_No_Error;
+                break;
+            default:
+                chunk->result = HapResult_Internal_Error;
+                break;
+        }
+    }
+    else if (chunk->compressor == kHapCompressorNone)
+    {
+        hap_region_copy(chunk->region, chunk->uncompressed_chunk_offset, chunk->compressed_chunk_data, chunk->compressed_chunk_size);
+        chunk->result = HapResult_No_Error;
+    }
+    else
+    {
+        chunk->result = HapResult_Bad_Frame;
+    }
+}
+
 static void hap_decode_chunk(HapChunkDecodeInfo chunks[], unsigned int index)
 {
     if (chunks)
     {
-        if (chunks[index].compressor == kHapCompressorSnappy)
+        if (chunks[index].region != NULL)
         {
-            snappy_status snappy_result = snappy_uncompress(chunks[index].compressed_chunk_data,
-                                                            chunks[index].compressed_chunk_size,
-                                                            chunks[index].uncompressed_chunk_data,
-                                                            &chunks[index].uncompressed_chunk_size);
+            hap_decode_chunk_region(&chunks[index]);
+        }
+        else if (chunks[index].compressor == kHapCompressorSnappy)
+        {
+            snappy_status snappy_result = hap_snappy_uncompress(chunks[index].compressed_chunk_data,
+                                                                chunks[index].compressed_chunk_size,
+                                                                chunks[index].uncompressed_chunk_data,
+                                                                &chunks[index].uncompressed_chunk_size,
+                                                                chunks[index].staged);
 
             switch (snappy_result)
             {
@@ -364,9 +819,18 @@ static void hap_decode_chunk(HapChunkDecodeInfo chunks[], unsigned int index)
         }
         else if (chunks[index].compressor == kHapCompressorNone)
         {
-            memcpy(chunks[index].uncompressed_chunk_data,
-                   chunks[index].compressed_chunk_data,
-                   chunks[index].compressed_chunk_size);
+            if (chunks[index].staged)
+            {
+                hap_stream_copy(chunks[index].uncompressed_chunk_data,
+                                chunks[index].compressed_chunk_data,
+                                chunks[index].compressed_chunk_size);
+            }
+            else
+            {
+                memcpy(chunks[index].uncompressed_chunk_data,
+                       chunks[index].compressed_chunk_data,
+                       chunks[index].compressed_chunk_size);
+            }
             chunks[index].result = HapResult_No_Error;
         }
         else
@@ -376,11 +840,19 @@ static void hap_decode_chunk(HapChunkDecodeInfo chunks[], unsigned int index)
     }
 }
 
-unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
-                       HapDecodeCallback callback, void *info,
-                       void *outputBuffer, unsigned long outputBufferBytes,
-                       unsigned long *outputBufferBytesUsed,
-                       unsigned int *outputBufferTextureFormat)
+/*
+ Reads a frame's headers and chunk tables and describes each chunk's decompression into outputBuffer, without
+ decompressing anything. A frame which is not chunked is described as one chunk in single; otherwise the chunks
+ are allocated and must be freed by the caller if they are not single.
+ */
+static unsigned int hap_decode_prepare(const void *inputBuffer, unsigned long inputBufferBytes,
+                                       void *outputBuffer, unsigned long outputBufferBytes,
+                                       unsigned int *outputBufferTextureFormat,
+                                       unsigned int staged,
+                                       HapChunkDecodeInfo *single,
+                                       HapChunkDecodeInfo **outChunks,
+                                       int *outChunkCount,
+                                       size_t *outBytesUsed)
 {
     int result = HapResult_No_Error;
     uint32_t sectionHeaderLength;
@@ -394,8 +866,10 @@ unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
     /*
      Check arguments
      */
+    *outChunks = NULL;
+    *outChunkCount = 0;
+
     if (inputBuffer == NULL
-        || callback == NULL
         || outputBuffer == NULL
         || outputBufferTextureFormat == NULL
         )
@@ -536,6 +1010,12 @@ unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
             for (i = 0; i < chunk_count; i++) {
 
                 chunk_info[i].compressor = *(((uint8_t *)compressors) + i);
+                chunk_info[i].staged = staged;
+
+                /*
+                 Replaced when the chunk is decoded, so a chunk the callback skips fails the frame
+                 */
+                chunk_info[i].result = HapResult_Internal_Error;
 
                 chunk_info[i].compressed_chunk_size = hap_read_4_byte_uint(((uint8_t *)chunk_sizes) + (i * 4));
 
@@ -576,6 +1056,8 @@ unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
                 }
 
                 chunk_info[i].uncompressed_chunk_data = (char *)(((uint8_t *)outputBuffer) + running_uncompressed_chunk_size);
+                chunk_info[i].uncompressed_chunk_offset = running_uncompressed_chunk_size;
+                chunk_info[i].region = NULL;
                 running_uncompressed_chunk_size += chunk_info[i].uncompressed_chunk_size;
             }
 
@@ -584,34 +1066,15 @@ unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
                 result = HapResult_Buffer_Too_Small;
             }
 
-            if (result == HapResult_No_Error)
-            {
-                /*
-                 Perform decompression
-                 */
-                bytesUsed = running_uncompressed_chunk_size;
-
-                callback((HapDecodeWorkFunction)hap_decode_chunk, chunk_info, chunk_count, info);
-
-                /*
-                 Check to see if we encountered any errors and report one of them
-                 */
-                for (i = 0; i < chunk_count; i++)
-                {
-                    if (chunk_info[i].result != HapResult_No_Error)
-                    {
-                        result = chunk_info[i].result;
-                        break;
-                    }
-                }
-            }
-
-            free(chunk_info);
-
             if (result != HapResult_No_Error)
             {
+                free(chunk_info);
                 return result;
             }
+
+            bytesUsed = running_uncompressed_chunk_size;
+            *outChunks = chunk_info;
+            *outChunkCount = chunk_count;
         }
     }
     else if (compressor == kHapCompressorSnappy)
@@ -628,11 +1091,6 @@ unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
         {
             return HapResult_Buffer_Too_Small;
         }
-        snappy_result = snappy_uncompress((const char *)sectionStart, sectionLength, (char *)outputBuffer, &bytesUsed);
-        if (snappy_result != SNAPPY_OK)
-        {
-            return HapResult_Internal_Error;
-        }
     }
     else if (compressor == kHapCompressorNone)
     {
@@ -644,12 +1102,103 @@ unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
         {
             return HapResult_Buffer_Too_Small;
         }
-        memcpy(outputBuffer, sectionStart, sectionLength);
     }
     else
     {
         return HapResult_Bad_Frame;
     }
+
+    if (compressor != kHapCompressorComplex)
+    {
+        single->compressor = compressor;
+        single->staged = staged;
+        single->compressed_chunk_data = (const char *)sectionStart;
+        single->compressed_chunk_size = sectionLength;
+        single->uncompressed_chunk_data = (char *)outputBuffer;
+        single->uncompressed_chunk_size = bytesUsed;
+        single->uncompressed_chunk_offset = 0;
+        single->region = NULL;
+        *outChunks = single;
+        *outChunkCount = 1;
+    }
+
+    *outBytesUsed = bytesUsed;
+
+    return HapResult_No_Error;
+}
+
+/*
+ Decodes the chunks described by hap_decode_prepare, only involving the callback if there is more than one,
+ and frees them
+ */
+static unsigned int hap_decode_chunks(HapDecodeCallback callback, void *info,
+                                      HapChunkDecodeInfo *single,
+                                      HapChunkDecodeInfo *chunks,
+                                      int chunk_count)
+{
+    unsigned int result = HapResult_No_Error;
+    int i;
+
+    if (chunks == single)
+    {
+        hap_decode_chunk(chunks, 0);
+    }
+    else if (chunk_count > 0)
+    {
+        callback((HapDecodeWorkFunction)hap_decode_chunk, chunks, chunk_count, info);
+    }
+
+    /*
+     Check to see if we encountered any errors and report one of them
+     */
+    for (i = 0; i < chunk_count; i++)
+    {
+        if (chunks[i].result != HapResult_No_Error)
+        {
+            result = chunks[i].result;
+            break;
+        }
+    }
+
+    if (chunks != single)
+    {
+        free(chunks);
+    }
+
+    return result;
+}
+
+static unsigned int hap_decode(const void *inputBuffer, unsigned long inputBufferBytes,
+                               HapDecodeCallback callback, void *info,
+                               void *outputBuffer, unsigned long outputBufferBytes,
+                               unsigned long *outputBufferBytesUsed,
+                               unsigned int *outputBufferTextureFormat,
+                               unsigned int staged)
+{
+    HapChunkDecodeInfo single;
+    HapChunkDecodeInfo *chunks;
+    int chunk_count;
+    size_t bytesUsed;
+    unsigned int result;
+
+    if (callback == NULL)
+    {
+        return HapResult_Bad_Arguments;
+    }
+
+    result = hap_decode_prepare(inputBuffer, inputBufferBytes, outputBuffer, outputBufferBytes, outputBufferTextureFormat,
+                                staged, &single, &chunks, &chunk_count, &bytesUsed);
+    if (result != HapResult_No_Error)
+    {
+        return result;
+    }
+
+    result = hap_decode_chunks(callback, info, &single, chunks, chunk_count);
+    if (result != HapResult_No_Error)
+    {
+        return result;
+    }
+
     /*
      Fill out the remaining return value
      */
@@ -661,6 +1210,251 @@ unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
     return HapResult_No_Error;
 }
 
+
+unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
+                       HapDecodeCallback callback, void *info,
+                       void *outputBuffer, unsigned long outputBufferBytes,
+                       unsigned long *outputBufferBytesUsed,
+                       unsigned int *outputBufferTextureFormat)
+{
+    return hap_decode(inputBuffer, inputBufferBytes, callback, info, outputBuffer, outputBufferBytes, outputBufferBytesUsed, outputBufferTextureFormat, 0);
+}
+
+unsigned int HapDecodeStaged(const void *inputBuffer, unsigned long inputBufferBytes,
+                             HapDecodeCallback callback, void *info,
+                             void *outputBuffer, unsigned long outputBufferBytes,
+                             unsigned long *outputBufferBytesUsed,
+                             unsigned int *outputBufferTextureFormat)
+{
+    return hap_decode(inputBuffer, inputBufferBytes, callback, info, outputBuffer, outputBufferBytes, outputBufferBytesUsed, outputBufferTextureFormat, 1);
+}
+
+unsigned int HapDecodeRegion(const void *inputBuffer, unsigned long inputBufferBytes,
+                             HapDecodeCallback callback, void *info,
+                             unsigned int frameWidth, unsigned int frameHeight,
+                             void *outputBuffer, unsigned long outputBufferBytes,
+                             unsigned long outputRowBytes,
+                             unsigned int blockX, unsigned int blockY,
+                             unsigned int *outputBufferTextureFormat)
+{
+    HapChunkDecodeInfo single;
+    HapChunkDecodeInfo *chunks;
+    HapDecodeRegionInfo region;
+    int chunk_count;
+    size_t bytesUsed;
+    size_t blockBytes;
+    size_t rows;
+    size_t offset;
+    unsigned int result;
+    int i;
+
+    if (callback == NULL || frameWidth == 0 || frameHeight == 0)
+    {
+        return HapResult_Bad_Arguments;
+    }
+
+    /*
+     The region is only checked against outputBufferBytes once the frame's texture format and size are known
+     */
+    result = hap_decode_prepare(inputBuffer, inputBufferBytes, outputBuffer, ULONG_MAX, outputBufferTextureFormat,
+                                1, &single, &chunks, &chunk_count, &bytesUsed);
+    if (result != HapResult_No_Error)
+    {
+        return result;
+    }
+
+    blockBytes = *outputBufferTextureFormat == HapTextureFormat_RGB_DXT1 ? 8U : 16U;
+    region.frame_row_bytes = ((frameWidth + 3U) / 4U) * blockBytes;
+    region.output_row_bytes = outputRowBytes;
+    rows = (frameHeight + 3U) / 4U;
+    offset = ((size_t)blockY * outputRowBytes) + ((size_t)blockX * blockBytes);
+
+    /*
+     A frame of any other size than the rectangle would write past it, into whatever is beside or below
+     */
+    if (bytesUsed != rows * region.frame_row_bytes
+        || ((size_t)blockX * blockBytes) + region.frame_row_bytes > outputRowBytes)
+    {
+        result = HapResult_Bad_Arguments;
+    }
+    else if (offset + ((rows - 1) * outputRowBytes) + region.frame_row_bytes > outputBufferBytes)
+    {
+        result = HapResult_Buffer_Too_Small;
+    }
+
+    if (result != HapResult_No_Error)
+    {
+        if (chunks != &single)
+        {
+            free(chunks);
+        }
+        return result;
+    }
+
+    region.destination = ((char *)outputBuffer) + offset;
+    for (i = 0; i < chunk_count; i++)
+    {
+        chunks[i].region = &region;
+    }
+
+    return hap_decode_chunks(callback, info, &single, chunks, chunk_count);
+}
+
+/*
+ Incremental decoding keeps the chunk descriptions between calls along with the time taken so far, from which
+ the time the next chunk will take is predicted
+ */
+struct HapDecodeProgress {
+    HapChunkDecodeInfo single;
+    HapChunkDecodeInfo *chunks;
+    int chunk_count;
+    int next_chunk;
+    int finished;
+    size_t bytes_used;
+    uint64_t decoded_nanoseconds;
+    size_t decoded_bytes;
+};
+
+static uint64_t hap_nanoseconds(void)
+{
+#if defined(__APPLE__)
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+    {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+unsigned int HapDecodeBegin(const void *inputBuffer, unsigned long inputBufferBytes,
+                            void *outputBuffer, unsigned long outputBufferBytes,
+                            unsigned int *outputBufferTextureFormat,
+                            HapDecodeProgress **outProgress)
+{
+    HapDecodeProgress *progress;
+    unsigned int result;
+
+    if (outProgress == NULL)
+    {
+        return HapResult_Bad_Arguments;
+    }
+    *outProgress = NULL;
+
+    progress = (HapDecodeProgress *)calloc(1, sizeof(HapDecodeProgress));
+    if (progress == NULL)
+    {
+        return HapResult_Internal_Error;
+    }
+
+    result = hap_decode_prepare(inputBuffer, inputBufferBytes, outputBuffer, outputBufferBytes, outputBufferTextureFormat,
+                                0, &progress->single, &progress->chunks, &progress->chunk_count, &progress->bytes_used);
+    if (result != HapResult_No_Error)
+    {
+        free(progress);
+        return result;
+    }
+
+    *outProgress = progress;
+    return HapResult_No_Error;
+}
+
+int HapDecodeContinue(HapDecodeProgress *progress, unsigned long budgetMicroseconds)
+{
+    uint64_t start;
+    uint64_t budget = (uint64_t)budgetMicroseconds * 1000;
+    int decoded = 0;
+
+    if (progress == NULL)
+    {
+        return 1;
+    }
+
+    start = hap_nanoseconds();
+
+    while (!progress->finished && progress->next_chunk < progress->chunk_count)
+    {
+        HapChunkDecodeInfo *chunk = &progress->chunks[progress->next_chunk];
+        uint64_t elapsed = hap_nanoseconds() - start;
+
+        /*
+         Stop before a chunk predicted to overrun the budget, but always make some progress
+         */
+        if (decoded > 0 && progress->decoded_bytes > 0)
+        {
+            uint64_t predicted = (uint64_t)((double)progress->decoded_nanoseconds * chunk->uncompressed_chunk_size / progress->decoded_bytes);
+            if (elapsed + predicted > budget)
+            {
+                break;
+            }
+        }
+
+        hap_decode_chunk(progress->chunks, progress->next_chunk);
+        progress->next_chunk++;
+        decoded++;
+
+        progress->decoded_bytes += chunk->uncompressed_chunk_size;
+        progress->decoded_nanoseconds += hap_nanoseconds() - start - elapsed;
+
+        /*
+         If the frame is bad there is no point decoding the rest of it
+         */
+        if (chunk->result != HapResult_No_Error)
+        {
+            progress->finished = 1;
+        }
+    }
+
+    if (progress->next_chunk == progress->chunk_count)
+    {
+        progress->finished = 1;
+    }
+
+    return progress->finished;
+}
+
+unsigned int HapDecodeEnd(HapDecodeProgress *progress, unsigned long *outputBufferBytesUsed)
+{
+    unsigned int result = HapResult_No_Error;
+    int i;
+
+    if (progress == NULL)
+    {
+        return HapResult_Bad_Arguments;
+    }
+
+    if (progress->next_chunk < progress->chunk_count)
+    {
+        result = HapResult_Internal_Error;
+    }
+
+    for (i = 0; i < progress->next_chunk; i++)
+    {
+        if (progress->chunks[i].result != HapResult_No_Error)
+        {
+            result = progress->chunks[i].result;
+            break;
+        }
+    }
+
+    if (result == HapResult_No_Error && outputBufferBytesUsed != NULL)
+    {
+        *outputBufferBytesUsed = progress->bytes_used;
+    }
+
+    if (progress->chunks != &progress->single)
+    {
+        free(progress->chunks);
+    }
+    free(progress);
+
+    return result;
+}
+
 unsigned int HapGetFrameTextureFormat(const void *inputBuffer, unsigned long inputBufferBytes, unsigned int *outputBufferTextureFormat)
 {
     unsigned int result = HapResult_No_Error;
@@ -76,6 +76,42 @@ unsigned int HapEncode(const void *inputBuffer, unsigned long inputBufferBytes,
                        unsigned int compressor, void *outputBuffer, unsigned long outputBufferBytes,
                        unsigned long *outputBufferBytesUsed);
 
+/*
+ Returns the maximum size of an output buffer for an input buffer of inputBytes length encoded as chunkCount chunks.
+ */
+unsigned long HapMaxEncodedLengthForChunks(unsigned long inputBytes, unsigned int chunkCount);
+
+/*
+ Describes the machine a file will be played on, so that HapEncodeChunks can store a chunk uncompressed when
+ reading the bytes compression saves would take less time than decompressing it.
+ storageBytesPerSecond is the read bandwidth of the storage the file will be played from.
+ decompressBytesPerSecond is the rate Snappy produces output on the decoding machine, across all decoding threads.
+ copyBytesPerSecond is the rate uncompressed chunks are copied to the output buffer, across all decoding threads,
+ or 0 to ignore the cost of copying.
+ A chunk is compressed if reading and decompressing it is expected to be quicker than reading and copying it.
+ */
+typedef struct HapCompressionModel {
+    double storageBytesPerSecond;
+    double decompressBytesPerSecond;
+    double copyBytesPerSecond;
+} HapCompressionModel;
+
+/*
+ As HapEncode, but splits inputBuffer into chunkCount chunks which are compressed independently, so that they can be
+ decoded in parallel. Chunks are split on multiples of chunkAlignment bytes, which should be the length of a row of
+ S3TC blocks to keep chunks row-aligned, or 0 to split on any block. The number of chunks may be reduced if there
+ are fewer units of chunkAlignment than chunkCount. Each chunk falls back to being stored uncompressed if compressing
+ it does not make it smaller, or if model is not NULL and it predicts the chunk will decode faster uncompressed.
+ callback and info are used as for HapDecode to spread compression of the chunks across threads.
+ Use HapMaxEncodedLengthForChunks() to discover the minimal value for outputBufferBytes.
+ */
+unsigned int HapEncodeChunks(const void *inputBuffer, unsigned long inputBufferBytes, unsigned int textureFormat,
+                             unsigned int compressor, unsigned int chunkCount, unsigned long chunkAlignment,
+                             const HapCompressionModel *model,
+                             HapDecodeCallback callback, void *info,
+                             void *outputBuffer, unsigned long outputBufferBytes,
+                             unsigned long *outputBufferBytesUsed);
+
 /*
  Decodes inputBuffer which is a Hap frame.
 
@@ -94,6 +130,7 @@ unsigned int HapEncode(const void *inputBuffer, unsigned long inputBufferBytes,
      }
  }
  info is an argument for your own use to pass context to the callback.
+ A callback may abandon a decode by not invoking the function for some indices, in which case an error is returned.
  If the frame does not permit multithreaded decoding, callback will not be called.
  If outputBufferBytesUsed is not NULL then it will be set to the decoded length of the output buffer.
  outputBufferTextureFormat must be non-NULL, and will be set to one of the HapTextureFormat constants.
@@ -104,6 +141,62 @@ unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
                        unsigned long *outputBufferBytesUsed,
                        unsigned int *outputBufferTextureFormat);
 
+/*
+ As HapDecode, but intended for outputBuffer in write-combined memory, such as a mapped pixel buffer object.
+ Each chunk is decompressed into a small buffer private to the decoding thread and then streamed into outputBuffer
+ with non-temporal stores, so outputBuffer is never read. Into ordinary cached memory this is usually slower
+ than HapDecode.
+ */
+unsigned int HapDecodeStaged(const void *inputBuffer, unsigned long inputBufferBytes,
+                             HapDecodeCallback callback, void *info,
+                             void *outputBuffer, unsigned long outputBufferBytes,
+                             unsigned long *outputBufferBytesUsed,
+                             unsigned int *outputBufferTextureFormat);
+
+/*
+ As HapDecodeStaged, but decodes the frame into a rectangle of a larger buffer of S3TC blocks in the frame's format,
+ such as the staging buffer for an atlas, rather than tightly packed. frameWidth and frameHeight are the dimensions of
+ the frame in pixels, which the frame itself does not record. Each row of blocks is written outputRowBytes after the
+ last, starting at block blockX of block row blockY, and blocks outside the frame's rectangle are left untouched.
+ Decodes of several frames into separate rectangles of one buffer may run at once.
+ Returns HapResult_Bad_Arguments if the frame's size is not that of frameWidth by frameHeight pixels or its rows do
+ not fit in outputRowBytes at blockX, and HapResult_Buffer_Too_Small if the rectangle extends beyond outputBufferBytes.
+ */
+unsigned int HapDecodeRegion(const void *inputBuffer, unsigned long inputBufferBytes,
+                             HapDecodeCallback callback, void *info,
+                             unsigned int frameWidth, unsigned int frameHeight,
+                             void *outputBuffer, unsigned long outputBufferBytes,
+                             unsigned long outputRowBytes,
+                             unsigned int blockX, unsigned int blockY,
+                             unsigned int *outputBufferTextureFormat);
+
+/*
+ Decodes a frame across several calls on the calling thread, for hosts which cannot use other threads and
+ cannot afford to decode a large frame in one go. HapDecodeBegin reads the frame's chunk tables, each call to
+ HapDecodeContinue then decodes whole chunks until the next is predicted to exceed budgetMicroseconds, and
+ HapDecodeEnd reports the result and frees progress. At least one chunk is decoded per call, so a frame which
+ is not chunked is decoded by a single call. inputBuffer and outputBuffer must remain valid until HapDecodeEnd,
+ which may be called early to abandon a decode.
+ */
+typedef struct HapDecodeProgress HapDecodeProgress;
+
+unsigned int HapDecodeBegin(const void *inputBuffer, unsigned long inputBufferBytes,
+                            void *outputBuffer, unsigned long outputBufferBytes,
+                            unsigned int *outputBufferTextureFormat,
+                            HapDecodeProgress **outProgress);
+
+/*
+ Returns 1 once decoding has finished, either because every chunk is decoded or one of them is bad, or 0 if
+ there is more to do.
+ */
+int HapDecodeContinue(HapDecodeProgress *progress, unsigned long budgetMicroseconds);
+
+/*
+ Returns HapResult_No_Error if every chunk was decoded successfully, in which case outputBufferBytesUsed is set
+ if it is not NULL.
+ */
+unsigned int HapDecodeEnd(HapDecodeProgress *progress, unsigned long *outputBufferBytesUsed);
+
 /*
  On return sets outputBufferTextureFormat to a HapTextureFormat constant describing the texture format of the frame.
  */